@@ -3,100 +3,742 @@
 #include <math.h>
 #include <complex.h>
 #include <string.h>
+#include <stddef.h>
+#include <stdint.h>
 #include <time.h>
+#include <pthread.h>
 #include <fftw3.h>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+#ifdef PHOTOMETRY_MPI
+#include <mpi.h>
+#include <fftw3-mpi.h>
+#endif
+#ifdef PHOTOMETRY_GPU
+#if defined(PHOTOMETRY_SINGLE) || defined(PHOTOMETRY_MPI)
+#error "the GPU backend is double precision and single node"
+#endif
+#include "occ_gpu.h"
+#endif
 
-// Function to calculate the E-field in the observers plane for an occultation
-void occ_lc(fftw_complex *ap, fftw_complex *result, int npts) {
-    int i, j;
-    int n2 = npts / 2;
+// Build with -DPHOTOMETRY_SINGLE (and -lfftw3f -lfftw3f_threads) for
+// single precision FFTs and grids, which halves the memory of a grid.
+// FFTW(name) picks the matching FFTW routine or type.
+#ifdef PHOTOMETRY_SINGLE
+#define FFTW(name) fftwf_ ## name
+#define OCC_CMPLX CMPLXF
+#define OCC_REAL float
+#else
+#define FFTW(name) fftw_ ## name
+#define OCC_CMPLX CMPLX
+#define OCC_REAL double
+#endif
+
+// FFTW wisdom is loaded from and saved to this file, so measured plans are
+// only paid for once per machine. Set PHOTOMETRY_WISDOM to use another file.
+// Build with -DPHOTOMETRY_MPI (make c-mpi) to split 2-D grids into slabs
+// of rows over MPI ranks with FFTW's MPI transforms. Only rank 0 prints
+// and writes files.
+static int occ_rank = 0;
+
+// Build with -DPHOTOMETRY_GPU and occ_gpu.cu (make c-gpu or c-hip) to run
+// the 2-D path on a GPU with cuFFT or rocFFT. FFTW stays the fallback when
+// there is no usable device, and --cpu selects it explicitly.
+static int occ_gpu_enabled = 1;
+
+// Projected diameter of the occulted star in km (--star), which do_run and
+// sweeps smooth their lightcurves by; 0 leaves them point-source.
+static double occ_star_km = 0.0;
+
+#ifdef PHOTOMETRY_SINGLE
+#define OCC_WISDOM_FILE "photometry_single.wisdom"
+#else
+#define OCC_WISDOM_FILE "photometry.wisdom"
+#endif
+
+// Wall-clock seconds spent in each phase of computing lightcurves, summed
+// over calls. clock() would add up the CPU time of every thread instead.
+typedef struct {
+    double aperture;
+    double modulate;
+    double fft;
+    double intensity;
+    double smooth;
+    double output;
+} OccTimers;
+
+// Seconds on a monotonic clock, for timing phases.
+static double wall_clock(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + 1e-9 * ts.tv_nsec;
+}
+
+// Persistent state for computing many lightcurves at one grid size: the
+// FFT plan and the buffer it transforms in place. A context made by
+// occ_context_create_1d only has the row buffer and plan, for apertures
+// that depend on x alone. A context made by occ_context_share has its own
+// buffers but borrows the plan and chirp tables of another one, and one
+// made by occ_context_create_inplace transforms the caller's aperture
+// buffer. One made by occ_context_create_mpi holds rows local_0_start to
+// local_0_start + local_n0 - 1 of the grid in M; every other 2-D context
+// holds all of them. Phase times are added to timers when it is set.
+typedef struct {
+    int npts;
+    ptrdiff_t local_n0;
+    ptrdiff_t local_0_start;
+    FFTW(complex) *M;
+    FFTW(plan) plan;
+    FFTW(complex) *row;
+    FFTW(plan) row_plan;
+    // exp(i*pi*u^2/npts) for u = k - npts/2, split into real and imaginary
+    // parts. The 2-D chirp is chirp(y) * chirp(x), so these replace a cexp
+    // per grid cell.
+    double *chirp_re;
+    double *chirp_im;
+    int borrowed;
+    int external_M;
+    OccTimers *timers;
+#ifdef PHOTOMETRY_MPI
+    MPI_Comm comm;
+    // First grid row of each rank, and npts at the end
+    ptrdiff_t *row_starts;
+#endif
+#ifdef PHOTOMETRY_GPU
+    // Set for a context from occ_context_create_gpu, which has no M or plan
+    OccGpu *gpu;
+#endif
+} OccContext;
+
+static const char *occ_wisdom_file(void) {
+    const char *path = getenv("PHOTOMETRY_WISDOM");
+    return path != NULL ? path : OCC_WISDOM_FILE;
+}
+
+// Allocates a context and fills its chirp tables. The phase is reduced
+// in integers first, since exp(i*pi*u^2/npts) repeats every 2*npts in u^2.
+static OccContext *occ_context_alloc(int npts) {
+    OccContext *ctx = malloc(sizeof(OccContext));
+    if (ctx == NULL) {
+        fprintf(stderr, "Out of memory creating occultation context\n");
+        exit(EXIT_FAILURE);
+    }
+    ctx->npts = npts;
+    ctx->local_n0 = npts;
+    ctx->local_0_start = 0;
+    ctx->M = NULL;
+    ctx->plan = NULL;
+    ctx->row = NULL;
+    ctx->row_plan = NULL;
+    ctx->borrowed = 0;
+    ctx->external_M = 0;
+    ctx->timers = NULL;
+#ifdef PHOTOMETRY_MPI
+    ctx->comm = MPI_COMM_NULL;
+    ctx->row_starts = NULL;
+#endif
+#ifdef PHOTOMETRY_GPU
+    ctx->gpu = NULL;
+#endif
+    ctx->chirp_re = malloc(npts * sizeof(double));
+    ctx->chirp_im = malloc(npts * sizeof(double));
+    if (ctx->chirp_re == NULL || ctx->chirp_im == NULL) {
+        fprintf(stderr, "Out of memory creating occultation context\n");
+        exit(EXIT_FAILURE);
+    }
     double pi = 3.14159265358979323846;
+    long long period = 2LL * npts;
+    for (int k = 0; k < npts; k++) {
+        long long u = k - npts / 2;
+        double phase = (pi / npts) * (double)((u * u) % period);
+        ctx->chirp_re[k] = cos(phase);
+        ctx->chirp_im[k] = sin(phase);
+    }
+    return ctx;
+}
+
+// Creates a context that transforms buf, an npts x npts array from
+// FFTW(malloc) that the caller owns. Passing the aperture itself as ap to
+// occ_lc_ctx or occ_lc_rows then modulates and transforms it in place, so
+// no second grid is needed; the aperture is lost. Planning with
+// FFTW_MEASURE overwrites buf, so fill it afterwards.
+OccContext *occ_context_create_inplace(int npts, FFTW(complex) *buf, unsigned flags) {
+    OccContext *ctx = occ_context_alloc(npts);
+    ctx->M = buf;
+    ctx->external_M = 1;
+
+    const char *wisdom = occ_wisdom_file();
+    FFTW(import_wisdom_from_filename)(wisdom);
+    ctx->plan = FFTW(plan_dft_2d)(npts, npts, ctx->M, ctx->M, FFTW_FORWARD, flags);
+    if (!(flags & FFTW_ESTIMATE) && !FFTW(export_wisdom_to_filename)(wisdom)) {
+        fprintf(stderr, "Could not save FFTW wisdom to %s\n", wisdom);
+    }
+    return ctx;
+}
+
+// Creates a context for npts x npts grids. flags is an FFTW planner flag
+// such as FFTW_MEASURE or FFTW_PATIENT; any wisdom on disk is used first
+// and the wisdom is saved again after planning. Call after setting up
+// FFTW's threads, and destroy before fftw_cleanup.
+OccContext *occ_context_create(int npts, unsigned flags) {
+    FFTW(complex) *M = FFTW(malloc)(sizeof(FFTW(complex)) * npts * npts);
+    if (M == NULL) {
+        fprintf(stderr, "Out of memory creating occultation context\n");
+        exit(EXIT_FAILURE);
+    }
+    OccContext *ctx = occ_context_create_inplace(npts, M, flags);
+    ctx->external_M = 0;
+    return ctx;
+}
+
+// Creates a context for occ_lc_separable only, which needs no npts x npts
+// buffer.
+OccContext *occ_context_create_1d(int npts, unsigned flags) {
+    OccContext *ctx = occ_context_alloc(npts);
+    ctx->row = FFTW(malloc)(sizeof(FFTW(complex)) * npts);
+    if (ctx->row == NULL) {
+        fprintf(stderr, "Out of memory creating occultation context\n");
+        exit(EXIT_FAILURE);
+    }
+
+    const char *wisdom = occ_wisdom_file();
+    FFTW(import_wisdom_from_filename)(wisdom);
+    ctx->row_plan = FFTW(plan_dft_1d)(npts, ctx->row, ctx->row, FFTW_FORWARD, flags);
+    if (!(flags & FFTW_ESTIMATE) && !FFTW(export_wisdom_to_filename)(wisdom)) {
+        fprintf(stderr, "Could not save FFTW wisdom to %s\n", wisdom);
+    }
+    return ctx;
+}
+
+#ifdef PHOTOMETRY_MPI
+// Creates a context for npts x npts grids split by rows over comm, with
+// the slab layout FFTW's MPI planner picks. Collective over comm. Wisdom
+// is read and saved by rank 0 and shared with the other ranks.
+OccContext *occ_context_create_mpi(int npts, MPI_Comm comm, unsigned flags) {
+    OccContext *ctx = occ_context_alloc(npts);
+    ptrdiff_t alloc_local = FFTW(mpi_local_size_2d)(npts, npts, comm, &ctx->local_n0,
+                                                    &ctx->local_0_start);
+    ctx->M = FFTW(malloc)(sizeof(FFTW(complex)) * alloc_local);
+    int rank, size;
+    MPI_Comm_rank(comm, &rank);
+    MPI_Comm_size(comm, &size);
+    ctx->row_starts = malloc((size + 1) * sizeof(ptrdiff_t));
+    if (ctx->M == NULL || ctx->row_starts == NULL) {
+        fprintf(stderr, "Out of memory creating occultation context\n");
+        exit(EXIT_FAILURE);
+    }
+    ctx->comm = comm;
+    long long start = ctx->local_0_start;
+    long long *starts = malloc(size * sizeof(long long));
+    MPI_Allgather(&start, 1, MPI_LONG_LONG, starts, 1, MPI_LONG_LONG, comm);
+    for (int r = 0; r < size; r++) {
+        ctx->row_starts[r] = starts[r];
+    }
+    ctx->row_starts[size] = npts;
+    free(starts);
     
-    // Create plan for FFTW
-    fftw_complex *M = fftw_malloc(sizeof(fftw_complex) * npts * npts);
-    fftw_plan plan = fftw_plan_dft_2d(npts, npts, M, result, FFTW_FORWARD, FFTW_ESTIMATE);
+    const char *wisdom = occ_wisdom_file();
+    if (rank == 0) {
+        FFTW(import_wisdom_from_filename)(wisdom);
+    }
+    FFTW(mpi_broadcast_wisdom)(comm);
+    ctx->plan = FFTW(mpi_plan_dft_2d)(npts, npts, ctx->M, ctx->M, comm, FFTW_FORWARD, flags);
+    FFTW(mpi_gather_wisdom)(comm);
+    if (rank == 0 && !(flags & FFTW_ESTIMATE) && !FFTW(export_wisdom_to_filename)(wisdom)) {
+        fprintf(stderr, "Could not save FFTW wisdom to %s\n", wisdom);
+    }
+    return ctx;
+}
+#endif
+
+// Creates a context with fresh buffers that executes base's plan, so
+// several threads can compute lightcurves at once without planning again.
+// FFTW allows concurrent execution of one plan on different arrays. base
+// must outlive the shared context.
+OccContext *occ_context_share(const OccContext *base) {
+    OccContext *ctx = malloc(sizeof(OccContext));
+    if (ctx == NULL) {
+        fprintf(stderr, "Out of memory creating occultation context\n");
+        exit(EXIT_FAILURE);
+    }
+    *ctx = *base;
+    ctx->borrowed = 1;
+    ctx->external_M = 0;
+    ctx->timers = NULL;
+    size_t size = base->plan != NULL ? (size_t)base->npts * base->npts : (size_t)base->npts;
+    FFTW(complex) *buf = FFTW(malloc)(sizeof(FFTW(complex)) * size);
+    if (buf == NULL) {
+        fprintf(stderr, "Out of memory creating occultation context\n");
+        exit(EXIT_FAILURE);
+    }
+    if (base->plan != NULL) {
+        ctx->M = buf;
+    } else {
+        ctx->row = buf;
+    }
+    return ctx;
+}
+
+void occ_context_destroy(OccContext *ctx) {
+    if (ctx->plan != NULL) {
+        if (!ctx->borrowed) {
+            FFTW(destroy_plan)(ctx->plan);
+        }
+        if (!ctx->external_M) {
+            FFTW(free)(ctx->M);
+        }
+    }
+    if (ctx->row_plan != NULL) {
+        if (!ctx->borrowed) {
+            FFTW(destroy_plan)(ctx->row_plan);
+        }
+        FFTW(free)(ctx->row);
+    }
+    if (!ctx->borrowed) {
+        free(ctx->chirp_re);
+        free(ctx->chirp_im);
+#ifdef PHOTOMETRY_MPI
+        free(ctx->row_starts);
+#endif
+#ifdef PHOTOMETRY_GPU
+        occ_gpu_destroy(ctx->gpu);
+#endif
+    }
+    free(ctx);
+}
+
+#ifdef PHOTOMETRY_GPU
+// Creates a context whose lightcurves the GPU backend computes, with its
+// grid and plan on the device. Returns NULL when there is no usable device
+// or --cpu was given, so the caller can fall back to FFTW.
+OccContext *occ_context_create_gpu(int npts) {
+    if (!occ_gpu_enabled) {
+        return NULL;
+    }
+    OccContext *ctx = occ_context_alloc(npts);
+    ctx->gpu = occ_gpu_create(npts, ctx->chirp_re, ctx->chirp_im);
+    if (ctx->gpu == NULL) {
+        printf("No usable GPU for npts = %d, using FFTW\n", npts);
+        occ_context_destroy(ctx);
+        return NULL;
+    }
+    return ctx;
+}
+#endif
+
+// Multiplies ap by the Fresnel chirp into the context buffer and
+// transforms it, leaving the E-field in the observer's plane in ctx->M.
+// ap and M hold the context's local rows.
+static void occ_field(OccContext *ctx, const FFTW(complex) *ap) {
+    int npts = ctx->npts;
+    const double *cre = ctx->chirp_re;
+    const double *cim = ctx->chirp_im;
     
     // Calculate modified aperture function: ap * exp((i*pi/npts) * (y^2 + x^2))
-    for (i = 0; i < npts; i++) {
-        for (j = 0; j < npts; j++) {
-            int idx = i * npts + j;
-            double y = (double)(i - n2);
-            double x = (double)(j - n2);
-            double complex eTerm = cexp(((pi * I) / npts) * (y * y + x * x));
-            M[idx] = ap[idx] * eTerm;
+    // as ap * chirp(y) * chirp(x). The products are written out in real
+    // arithmetic so the row loop vectorizes and skips the C99 complex
+    // multiply's inf/nan handling.
+    double start = wall_clock();
+    #pragma omp parallel for
+    for (int i = 0; i < ctx->local_n0; i++) {
+        double yr = cre[ctx->local_0_start + i];
+        double yi = cim[ctx->local_0_start + i];
+        const FFTW(complex) *src = ap + (size_t)i * npts;
+        FFTW(complex) *dst = ctx->M + (size_t)i * npts;
+        for (int j = 0; j < npts; j++) {
+            double er = yr * cre[j] - yi * cim[j];
+            double ei = yr * cim[j] + yi * cre[j];
+            double ar = creal(src[j]);
+            double ai = cimag(src[j]);
+            dst[j] = OCC_CMPLX(ar * er - ai * ei, ar * ei + ai * er);
         }
     }
     
-    // Execute FFT
-    fftw_execute(plan);
+    double mid = wall_clock();
     
-    // Calculate intensity: |E|^2
+    // Execute FFT, on this context's buffer in case the plan is shared
+#ifdef PHOTOMETRY_MPI
+    if (ctx->comm != MPI_COMM_NULL) {
+        FFTW(mpi_execute_dft)(ctx->plan, ctx->M, ctx->M);
+    } else
+#endif
+    FFTW(execute_dft)(ctx->plan, ctx->M, ctx->M);
+    if (ctx->timers != NULL) {
+        ctx->timers->modulate += mid - start;
+        ctx->timers->fft += wall_clock() - mid;
+    }
+}
+
+// Calculates the intensity in the observer's plane for an occultation by
+// the aperture ap, into result. The context can be reused for any number
+// of apertures of its grid size. Not for MPI contexts, whose ranks only
+// hold part of the field.
+void occ_lc_ctx(OccContext *ctx, const FFTW(complex) *ap, FFTW(complex) *result) {
+    int i, j;
+    int npts = ctx->npts;
+    int n2 = npts / 2;
+    FFTW(complex) *M = ctx->M;
+    
+    occ_field(ctx, ap);
+    double start = wall_clock();
+    
+    // Calculate intensity: |E|^2, rolled so the centre of the field lands
+    // in the middle of result
+    #pragma omp parallel for private(j)
     for (i = 0; i < npts; i++) {
         for (j = 0; j < npts; j++) {
             int idx = i * npts + j;
             int roll_idx = ((i + n2) % npts) * npts + ((j + n2) % npts);
-            double complex conj_val = conj(result[idx]);
-            result[roll_idx] = creal(result[idx] * conj_val);
+            double complex conj_val = conj(M[idx]);
+            result[roll_idx] = creal(M[idx] * conj_val);
         }
     }
-    
-    fftw_destroy_plan(plan);
-    fftw_free(M);
+    if (ctx->timers != NULL) {
+        ctx->timers->intensity += wall_clock() - start;
+    }
 }
 
-// Function to create an aperture with a vertical ring segment running through it
-void RingSeg_ap(double lam, double D, int npts, double wid, 
-                double *radial_pos, double *trans_values, int num_radial_points,
-                fftw_complex *ap, double *FOV, double *gridSz) {
-    int i, j;
+// Like occ_lc_ctx, but only computes the intensity along the scan rows
+// rows[0..nrows-1] of the rolled result. Row k goes to
+// out[k * npts .. (k + 1) * npts - 1], so the full grid is never squared
+// or written. With an MPI context this is collective, and the rows are
+// sent from the ranks that hold them to rank 0, the only one whose out is
+// filled.
+void occ_lc_rows(OccContext *ctx, const FFTW(complex) *ap, const int *rows,
+                 int nrows, double *out) {
+    int npts = ctx->npts;
+    int n2 = npts / 2;
     
-    double lam_km = lam * 1e-9; // Convert microns to km
-    *gridSz = sqrt(lam_km * D / npts);
-    *FOV = sqrt(lam_km * D * npts);
-    double FOV2 = 0.5 * (*FOV);
-    int npts2 = npts / 2;
-    double wid2 = 0.5 * wid; // Half the ring width
+    occ_field(ctx, ap);
+    double start = wall_clock();
     
-    // Initialize aperture with full transmission
-    for (i = 0; i < npts; i++) {
-        for (j = 0; j < npts; j++) {
-            ap[i * npts + j] = 1.0;
+    for (int k = 0; k < nrows; k++) {
+        // Rolled row r holds field row r + n2, and the same for columns
+        ptrdiff_t field_row = (rows[k] + n2) % npts;
+        double *dst = out + (size_t)k * npts;
+#ifdef PHOTOMETRY_MPI
+        int owner = 0, rank = 0;
+        if (ctx->comm != MPI_COMM_NULL) {
+            MPI_Comm_rank(ctx->comm, &rank);
+            while (ctx->row_starts[owner + 1] <= field_row) {
+                owner++;
+            }
+            if (rank != owner) {
+                if (rank == 0) {
+                    MPI_Recv(dst, npts, MPI_DOUBLE, owner, k, ctx->comm, MPI_STATUS_IGNORE);
+                }
+                continue;
+            }
         }
+#endif
+        const FFTW(complex) *src = ctx->M + (size_t)(field_row - ctx->local_0_start) * npts;
+        for (int j = 0; j < npts; j++) {
+            double complex e = src[(j + n2) % npts];
+            dst[j] = creal(e) * creal(e) + cimag(e) * cimag(e);
+        }
+#ifdef PHOTOMETRY_MPI
+        if (rank != 0) {
+            MPI_Send(dst, npts, MPI_DOUBLE, 0, k, ctx->comm);
+        }
+#endif
+    }
+    if (ctx->timers != NULL) {
+        ctx->timers->intensity += wall_clock() - start;
     }
+}
+
+// Lightcurve of an aperture whose transmission ap_x depends only on the
+// column, into out[0..npts-1]. The chirp exp(i*pi*(x^2 + y^2)/npts)
+// factors into x and y parts, so the 2-D transform is the product of the
+// 1-D transforms of ap_x * exp(i*pi*x^2/npts) and of the y chirp alone.
+// The y chirp is a quadratic Gauss sum whose transform has |C(k)|^2 = npts
+// at every k, so every row of the intensity is npts * |X(kx)|^2 and no
+// y transform is needed.
+void occ_lc_separable(OccContext *ctx, const FFTW(complex) *ap_x, double *out) {
+    int npts = ctx->npts;
+    int n2 = npts / 2;
+    FFTW(complex) *row = ctx->row;
+    double start = wall_clock();
     
-    // Create grid of x values centered on zero
-    double *xv = (double *)malloc(npts * sizeof(double));
-    for (i = 0; i < npts; i++) {
-        xv[i] = (i - npts2) * (*gridSz);
+    for (int j = 0; j < npts; j++) {
+        double ar = creal(ap_x[j]);
+        double ai = cimag(ap_x[j]);
+        row[j] = OCC_CMPLX(ar * ctx->chirp_re[j] - ai * ctx->chirp_im[j],
+                       ar * ctx->chirp_im[j] + ai * ctx->chirp_re[j]);
     }
     
-    // Replace in-aperture columns with their transmission functions
-    for (i = 0; i < npts; i++) {
-        for (j = 0; j < npts; j++) {
-            double x_val = xv[j];
-            if (fabs(x_val) <= wid2) {
-                // Interpolate to find transmission at this radial position
-                // Linear interpolation of transmission values
-                double trans = 1.0;
-                if (x_val <= radial_pos[0]) {
-                    trans = trans_values[0];
-                } else if (x_val >= radial_pos[num_radial_points-1]) {
-                    trans = trans_values[num_radial_points-1];
-                } else {
-                    for (int k = 0; k < num_radial_points-1; k++) {
-                        if (x_val >= radial_pos[k] && x_val <= radial_pos[k+1]) {
-                            double t = (x_val - radial_pos[k]) / (radial_pos[k+1] - radial_pos[k]);
-                            trans = trans_values[k] * (1-t) + trans_values[k+1] * t;
-                            break;
-                        }
-                    }
-                }
-                ap[i * npts + j] = trans;
+    double mid = wall_clock();
+    FFTW(execute_dft)(ctx->row_plan, row, row);
+    double fft_end = wall_clock();
+    
+    for (int j = 0; j < npts; j++) {
+        double complex e = row[(j + n2) % npts];
+        out[j] = npts * (creal(e) * creal(e) + cimag(e) * cimag(e));
+    }
+    if (ctx->timers != NULL) {
+        ctx->timers->modulate += mid - start;
+        ctx->timers->fft += fft_end - mid;
+        ctx->timers->intensity += wall_clock() - fft_end;
+    }
+}
+
+// One-off occ_lc_ctx that plans for a single call.
+void occ_lc(FFTW(complex) *ap, FFTW(complex) *result, int npts) {
+    OccContext *ctx = occ_context_create(npts, FFTW_ESTIMATE);
+    occ_lc_ctx(ctx, ap, result);
+    occ_context_destroy(ctx);
+}
+
+// Batched smoothing of lightcurves by the disk of the occulted star. A
+// star of finite size is a row of point sources, so the observed curve is
+// the point-source one convolved with the star's strip brightness, the
+// disk's chord length across the scan. Curves are convolved as flux - 1,
+// zero padded to nfft = 2 * npts, so the baseline continues past both ends
+// and nothing wraps round. The curves of a batch and their kernels go
+// through one r2c plan over cap transforms, and back through one c2r plan.
+typedef struct {
+    int npts;
+    int nfft;
+    int cap;
+    OCC_REAL *curves;
+    FFTW(complex) *spectra;
+    OCC_REAL *kernels;
+    FFTW(complex) *kernel_spectra;
+    FFTW(plan) forward;
+    FFTW(plan) inverse;
+    OccTimers *timers;
+} OccSmoother;
+
+// Creates a smoother for curves of npts samples, cap of them per batch.
+// Planning follows occ_context_create, through the same wisdom file.
+OccSmoother *occ_smoother_create(int npts, int cap, unsigned flags) {
+    OccSmoother *s = malloc(sizeof(OccSmoother));
+    if (s == NULL) {
+        fprintf(stderr, "Out of memory creating smoother\n");
+        exit(EXIT_FAILURE);
+    }
+    int nfft = 2 * npts;
+    int nspec = nfft / 2 + 1;
+    s->npts = npts;
+    s->nfft = nfft;
+    s->cap = cap;
+    s->timers = NULL;
+    s->curves = FFTW(malloc)(sizeof(OCC_REAL) * nfft * cap);
+    s->kernels = FFTW(malloc)(sizeof(OCC_REAL) * nfft * cap);
+    s->spectra = FFTW(malloc)(sizeof(FFTW(complex)) * nspec * cap);
+    s->kernel_spectra = FFTW(malloc)(sizeof(FFTW(complex)) * nspec * cap);
+    if (s->curves == NULL || s->kernels == NULL || s->spectra == NULL ||
+        s->kernel_spectra == NULL) {
+        fprintf(stderr, "Out of memory creating smoother\n");
+        exit(EXIT_FAILURE);
+    }
+
+    const char *wisdom = occ_wisdom_file();
+    FFTW(import_wisdom_from_filename)(wisdom);
+    s->forward = FFTW(plan_many_dft_r2c)(1, &nfft, cap, s->curves, NULL, 1, nfft,
+                                         s->spectra, NULL, 1, nspec, flags);
+    s->inverse = FFTW(plan_many_dft_c2r)(1, &nfft, cap, s->spectra, NULL, 1, nspec,
+                                         s->curves, NULL, 1, nfft, flags);
+    if (!(flags & FFTW_ESTIMATE) && !FFTW(export_wisdom_to_filename)(wisdom)) {
+        fprintf(stderr, "Could not save FFTW wisdom to %s\n", wisdom);
+    }
+    return s;
+}
+
+void occ_smoother_destroy(OccSmoother *s) {
+    FFTW(destroy_plan)(s->forward);
+    FFTW(destroy_plan)(s->inverse);
+    FFTW(free)(s->curves);
+    FFTW(free)(s->kernels);
+    FFTW(free)(s->spectra);
+    FFTW(free)(s->kernel_spectra);
+    free(s);
+}
+
+// Area of a disk of radius r left of the chord at x, less half the disk.
+static double disk_area_left(double x, double r) {
+    x = x > r ? r : x < -r ? -r : x;
+    return 0.5 * (x * sqrt(r * r - x * x) + r * r * asin(x / r));
+}
+
+// Fills kernel, nfft long with negative offsets wrapped to the end, with
+// the strip brightness of a uniform disk of radius r averaged over each
+// sample of width gridSz. The weights are exact areas, so they sum to 1
+// and a star smaller than a sample leaves the curve as it is. Returns -1
+// if the disk is wider than the padding.
+static int disk_kernel(OCC_REAL *kernel, int nfft, double r, double gridSz) {
+    memset(kernel, 0, sizeof(OCC_REAL) * nfft);
+    if (r <= 0.0) {
+        kernel[0] = 1;
+        return 0;
+    }
+    int half = (int)ceil(r / gridSz + 0.5);
+    if (half > nfft / 4) {
+        return -1;
+    }
+    double norm = 2.0 * disk_area_left(r, r);
+    for (int k = -half; k <= half; k++) {
+        double w = disk_area_left((k + 0.5) * gridSz, r) - disk_area_left((k - 0.5) * gridSz, r);
+        kernel[(k + nfft) % nfft] = w / norm;
+    }
+    return 0;
+}
+
+// Convolves the n normalized lightcurves in curves, curve k at
+// curves[k * npts .. (k + 1) * npts - 1] with samples gridSz[k] km apart,
+// in place with a star of diameter star_km, cap at a time. Returns 0, or
+// -1 if the star is wider than half a curve.
+int occ_smooth(OccSmoother *s, double *curves, const double *gridSz, int n, double star_km) {
+    int npts = s->npts;
+    int nfft = s->nfft;
+    int nspec = nfft / 2 + 1;
+    double start = wall_clock();
+
+    for (int first = 0; first < n; first += s->cap) {
+        int batch = n - first < s->cap ? n - first : s->cap;
+        for (int b = 0; b < s->cap; b++) {
+            OCC_REAL *dst = s->curves + (size_t)b * nfft;
+            OCC_REAL *kernel = s->kernels + (size_t)b * nfft;
+            if (b >= batch) {
+                memset(dst, 0, sizeof(OCC_REAL) * nfft);
+                memset(kernel, 0, sizeof(OCC_REAL) * nfft);
+                continue;
+            }
+            const double *src = curves + (size_t)(first + b) * npts;
+            for (int i = 0; i < npts; i++) {
+                dst[i] = src[i] - 1.0;
+            }
+            memset(dst + npts, 0, sizeof(OCC_REAL) * (nfft - npts));
+            if (disk_kernel(kernel, nfft, 0.5 * star_km, gridSz[first + b]) != 0) {
+                fprintf(stderr, "A %g km star is wider than half a %g km lightcurve\n",
+                        star_km, gridSz[first + b] * npts);
+                return -1;
             }
         }
+
+        FFTW(execute_dft_r2c)(s->forward, s->curves, s->spectra);
+        FFTW(execute_dft_r2c)(s->forward, s->kernels, s->kernel_spectra);
+        // The c2r transform is unnormalized
+        double scale = 1.0 / nfft;
+        for (size_t f = 0; f < (size_t)nspec * batch; f++) {
+            s->spectra[f] *= scale * s->kernel_spectra[f];
+        }
+        FFTW(execute_dft_c2r)(s->inverse, s->spectra, s->curves);
+
+        for (int b = 0; b < batch; b++) {
+            const OCC_REAL *src = s->curves + (size_t)b * nfft;
+            double *dst = curves + (size_t)(first + b) * npts;
+            for (int i = 0; i < npts; i++) {
+                dst[i] = src[i] + 1.0;
+            }
+        }
+    }
+    if (s->timers != NULL) {
+        s->timers->smooth += wall_clock() - start;
+    }
+    return 0;
+}
+
+// Linear interpolation of the transmission profile at radial position x_val.
+// radial_pos must be increasing; the bracketing interval is found by
+// bisection.
+static double ring_transmission(double x_val, double *radial_pos,
+                                double *trans_values, int num_radial_points) {
+    if (x_val <= radial_pos[0]) {
+        return trans_values[0];
+    }
+    if (x_val >= radial_pos[num_radial_points-1]) {
+        return trans_values[num_radial_points-1];
+    }
+    int lo = 0, hi = num_radial_points - 1;
+    while (hi - lo > 1) {
+        int mid = (lo + hi) / 2;
+        if (radial_pos[mid] <= x_val) {
+            lo = mid;
+        } else {
+            hi = mid;
+        }
+    }
+    double t = (x_val - radial_pos[lo]) / (radial_pos[lo+1] - radial_pos[lo]);
+    return trans_values[lo] * (1-t) + trans_values[lo+1] * t;
+}
+
+// True when radial_pos is evenly spaced, as create_transmission_profile
+// makes it, to within rounding of the spacing.
+static int uniform_radial_grid(const double *radial_pos, int num_radial_points) {
+    if (num_radial_points < 3) {
+        return num_radial_points == 2;
+    }
+    double step = (radial_pos[num_radial_points-1] - radial_pos[0]) / (num_radial_points - 1);
+    for (int k = 1; k < num_radial_points; k++) {
+        double expect = radial_pos[0] + k * step;
+        if (fabs(radial_pos[k] - expect) > 1e-9 * fabs(step) * num_radial_points) {
+            return 0;
+        }
     }
+    return step > 0.0;
+}
+
+// One row of RingSeg_ap, which is the same for every row, for
+// occ_lc_separable. row holds npts values. An evenly spaced profile is
+// indexed directly; any other increasing one goes through ring_transmission.
+void RingSeg_row(double lam, double D, int npts, double wid,
+                 double *radial_pos, double *trans_values, int num_radial_points,
+                 FFTW(complex) *row, double *FOV, double *gridSz) {
+    double lam_km = lam * 1e-9; // Convert microns to km
+    *gridSz = sqrt(lam_km * D / npts);
+    *FOV = sqrt(lam_km * D * npts);
+    int npts2 = npts / 2;
+    double wid2 = 0.5 * wid; // Half the ring width
+    int last = num_radial_points - 1;
+    int uniform = uniform_radial_grid(radial_pos, num_radial_points);
+    double r0 = radial_pos[0];
+    double inv_step = uniform ? last / (radial_pos[last] - r0) : 0.0;
     
-    free(xv);
+    for (int j = 0; j < npts; j++) {
+        double x_val = (j - npts2) * (*gridSz);
+        row[j] = 1.0;
+        if (fabs(x_val) > wid2) {
+            continue;
+        }
+        if (!uniform) {
+            row[j] = ring_transmission(x_val, radial_pos, trans_values, num_radial_points);
+        } else if (x_val <= r0) {
+            row[j] = trans_values[0];
+        } else if (x_val >= radial_pos[last]) {
+            row[j] = trans_values[last];
+        } else {
+            double u = (x_val - r0) * inv_step;
+            int k = (int)u;
+            k = k < last ? k : last - 1;
+            double t = u - k;
+            row[j] = trans_values[k] * (1-t) + trans_values[k+1] * t;
+        }
+    }
+}
+
+// Fills nrows rows of RingSeg_ap's aperture into ap, such as the local
+// slab of an MPI context. The rows are all the same.
+void RingSeg_slab(double lam, double D, int npts, double wid,
+                  double *radial_pos, double *trans_values, int num_radial_points,
+                  FFTW(complex) *ap, ptrdiff_t nrows, double *FOV, double *gridSz) {
+    RingSeg_row(lam, D, npts, wid, radial_pos, trans_values, num_radial_points,
+                ap, FOV, gridSz);
+    #pragma omp parallel for
+    for (ptrdiff_t i = 1; i < nrows; i++) {
+        memcpy(ap + (size_t)i * npts, ap, npts * sizeof(FFTW(complex)));
+    }
+}
+
+// Function to create an aperture with a vertical ring segment running through it.
+// The transmission only depends on the column, so one row is computed and
+// copied down the grid.
+void RingSeg_ap(double lam, double D, int npts, double wid, 
+                double *radial_pos, double *trans_values, int num_radial_points,
+                FFTW(complex) *ap, double *FOV, double *gridSz) {
+    RingSeg_slab(lam, D, npts, wid, radial_pos, trans_values, num_radial_points,
+                 ap, npts, FOV, gridSz);
 }
 
 // Utility function to create and fill transmission profile arrays
@@ -173,18 +815,356 @@ void generate_se_profile(double *wVal, int nRad, double *tau, double *trans) {
     free(pb);
 }
 
-void do_run(int npts) {
-    clock_t start_time, end_time;
-    double cpu_time_used;
+// Output layer. Lightcurves are handed to a background thread that formats
+// and writes them, so a run or sweep only pays for a copy. LC_TEXT is the
+// two column "time flux" file of do_run, LC_CSV the long table of a sweep
+// with the run parameters on every row, and LC_BINARY a columnar file:
+//
+//   char magic[8] = "PHOTLC1"
+//   then per lightcurve, in native byte order,
+//     LcHeader              the run parameters and npts
+//     double t_sec[npts]
+//     double r_km[npts]
+//     double flux[npts]
+typedef enum { LC_TEXT, LC_CSV, LC_BINARY } LcFormat;
+
+#define LC_MAGIC "PHOTLC1"
+
+typedef struct {
+    char profile[8];    // "flat", "cp" or "se"
+    int32_t npts;
+    int32_t scan_row;
+    double tau;
+    double wid;         // km
+    double lam;         // microns
+    double D;           // km
+    double velocity;    // km/s
+    double gridSz;      // km
+} LcHeader;
+
+typedef struct LcRecord {
+    LcHeader head;
+    double *t_sec;
+    double *r_km;
+    double *flux;
+    struct LcRecord *next;
+} LcRecord;
+
+// At most this many lightcurves wait for the writer before submitting
+// blocks, which bounds the memory held by the queue.
+#define LC_QUEUE_DEPTH 16
+
+// Bytes formatted before each fwrite.
+#define LC_BUFFER_SIZE (1 << 20)
+
+typedef struct {
+    FILE *fp;
+    LcFormat format;
+    int failed;
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+    LcRecord *head;
+    LcRecord *tail;
+    int queued;
+    int closing;
+    char *buf;
+    size_t used;
+} LcWriter;
+
+// Appends v with decimals digits after the point (at most 9), as %.*f
+// does. The fraction left after scaling is recovered with an fma, which
+// still rounds it once, so a value within that rounding of a half could
+// be taken for a tie or the wrong side of one: those, and values too
+// large for the integer path, fall back to sprintf.
+static char *format_fixed(char *p, double v, int decimals) {
+    static const double scale[] = {1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9};
+    double scaled = fabs(v) * scale[decimals];
+    if (!(scaled < 1e15)) {
+        return p + sprintf(p, "%.*f", decimals, v);
+    }
+    double whole_part = floor(scaled);
+    double rest = fma(fabs(v), scale[decimals], -whole_part);
+    if (rest < 0.0) {
+        whole_part -= 1.0;
+        rest += 1.0;
+    }
+    if (fabs(rest - 0.5) < 1e-9) {
+        return p + sprintf(p, "%.*f", decimals, v);
+    }
+    uint64_t n = (uint64_t)whole_part;
+    if (rest > 0.5) {
+        n++;
+    }
+    uint64_t unit = (uint64_t)scale[decimals];
+    uint64_t whole = n / unit;
+    uint64_t frac = n % unit;
+    char digits[24];
+    int len = 0;
+    if (signbit(v)) {
+        *p++ = '-';
+    }
+    do {
+        digits[len++] = (char)('0' + whole % 10);
+        whole /= 10;
+    } while (whole > 0);
+    while (len > 0) {
+        *p++ = digits[--len];
+    }
+    if (decimals > 0) {
+        *p++ = '.';
+        for (int d = decimals - 1; d >= 0; d--) {
+            p[d] = (char)('0' + frac % 10);
+            frac /= 10;
+        }
+        p += decimals;
+    }
+    return p;
+}
+
+static void lc_flush(LcWriter *w) {
+    if (w->used > 0 && fwrite(w->buf, 1, w->used, w->fp) != w->used) {
+        w->failed = 1;
+    }
+    w->used = 0;
+}
+
+// Room for one formatted row, with slack for the snprintf fallback.
+#define LC_ROW_MAX 512
+
+static void lc_format(LcWriter *w, const LcRecord *rec) {
+    const LcHeader *h = &rec->head;
+    if (w->format == LC_BINARY) {
+        size_t n = (size_t)h->npts;
+        if (fwrite(h, sizeof(*h), 1, w->fp) != 1 || fwrite(rec->t_sec, sizeof(double), n, w->fp) != n ||
+            fwrite(rec->r_km, sizeof(double), n, w->fp) != n ||
+            fwrite(rec->flux, sizeof(double), n, w->fp) != n) {
+            w->failed = 1;
+        }
+        return;
+    }
+    char prefix[256];
+    int plen = 0;
+    if (w->format == LC_CSV) {
+        plen = snprintf(prefix, sizeof(prefix), "%s,%g,%g,%g,", h->profile, h->tau, h->wid, h->lam);
+    }
+    for (int i = 0; i < h->npts; i++) {
+        if (w->used + LC_ROW_MAX > LC_BUFFER_SIZE) {
+            lc_flush(w);
+        }
+        char *p = w->buf + w->used;
+        if (w->format == LC_CSV) {
+            memcpy(p, prefix, plen);
+            p = format_fixed(p + plen, rec->t_sec[i], 9);
+            *p++ = ',';
+            p = format_fixed(p, rec->flux[i], 9);
+        } else {
+            p = format_fixed(p, rec->t_sec[i], 6);
+            *p++ = ' ';
+            p = format_fixed(p, rec->flux[i], 6);
+        }
+        *p++ = '\n';
+        w->used = p - w->buf;
+    }
+    lc_flush(w);
+    // Readers can follow a sweep as each lightcurve lands
+    if (fflush(w->fp) != 0) {
+        w->failed = 1;
+    }
+}
+
+static void *lc_writer_main(void *arg) {
+    LcWriter *w = arg;
+    pthread_mutex_lock(&w->lock);
+    for (;;) {
+        while (w->head == NULL && !w->closing) {
+            pthread_cond_wait(&w->changed, &w->lock);
+        }
+        LcRecord *rec = w->head;
+        if (rec == NULL) {
+            break;
+        }
+        w->head = rec->next;
+        if (w->head == NULL) {
+            w->tail = NULL;
+        }
+        pthread_mutex_unlock(&w->lock);
+        
+        lc_format(w, rec);
+        free(rec->t_sec);
+        free(rec);
+        
+        pthread_mutex_lock(&w->lock);
+        w->queued--;
+        pthread_cond_broadcast(&w->changed);
+    }
+    pthread_mutex_unlock(&w->lock);
+    return NULL;
+}
+
+// Opens path for lightcurves in format and starts its writer thread.
+// Returns NULL if the file cannot be created.
+LcWriter *lc_writer_open(const char *path, LcFormat format) {
+    FILE *fp = fopen(path, format == LC_BINARY ? "wb" : "w");
+    if (fp == NULL) {
+        return NULL;
+    }
+    LcWriter *w = calloc(1, sizeof(LcWriter));
+    char *buf = malloc(LC_BUFFER_SIZE);
+    if (w == NULL || buf == NULL) {
+        fprintf(stderr, "Out of memory creating lightcurve writer\n");
+        exit(EXIT_FAILURE);
+    }
+    w->buf = buf;
+    w->fp = fp;
+    w->format = format;
+    if (format == LC_BINARY) {
+        char magic[8] = LC_MAGIC;
+        w->failed = fwrite(magic, sizeof(magic), 1, fp) != 1;
+    } else if (format == LC_CSV) {
+        w->failed = fputs("profile,tau,wid_km,lam_um,time_sec,normalized_flux\n", fp) < 0;
+    } else {
+        w->failed = fputs("# Time (s), Normalized Flux\n", fp) < 0;
+    }
+    pthread_mutex_init(&w->lock, NULL);
+    pthread_cond_init(&w->changed, NULL);
+    if (pthread_create(&w->thread, NULL, lc_writer_main, w) != 0) {
+        fprintf(stderr, "Could not start lightcurve writer thread\n");
+        exit(EXIT_FAILURE);
+    }
+    return w;
+}
+
+// Queues a copy of one lightcurve of head->npts samples. r_km may be NULL
+// for the text formats, which do not write it.
+void lc_writer_submit(LcWriter *w, const LcHeader *head, const double *t_sec,
+                      const double *r_km, const double *flux) {
+    size_t n = (size_t)head->npts;
+    LcRecord *rec = malloc(sizeof(LcRecord));
+    double *data = malloc(3 * n * sizeof(double));
+    if (rec == NULL || data == NULL) {
+        fprintf(stderr, "Out of memory queueing lightcurve\n");
+        exit(EXIT_FAILURE);
+    }
+    rec->head = *head;
+    rec->t_sec = data;
+    rec->r_km = data + n;
+    rec->flux = data + 2 * n;
+    rec->next = NULL;
+    memcpy(rec->t_sec, t_sec, n * sizeof(double));
+    if (r_km != NULL) {
+        memcpy(rec->r_km, r_km, n * sizeof(double));
+    } else {
+        memset(rec->r_km, 0, n * sizeof(double));
+    }
+    memcpy(rec->flux, flux, n * sizeof(double));
     
+    pthread_mutex_lock(&w->lock);
+    while (w->queued >= LC_QUEUE_DEPTH) {
+        pthread_cond_wait(&w->changed, &w->lock);
+    }
+    if (w->tail != NULL) {
+        w->tail->next = rec;
+    } else {
+        w->head = rec;
+    }
+    w->tail = rec;
+    w->queued++;
+    pthread_cond_broadcast(&w->changed);
+    pthread_mutex_unlock(&w->lock);
+}
+
+// Waits for the queued lightcurves to be written and closes the file.
+// Returns 0, or -1 if any write failed.
+int lc_writer_close(LcWriter *w) {
+    pthread_mutex_lock(&w->lock);
+    w->closing = 1;
+    pthread_cond_broadcast(&w->changed);
+    pthread_mutex_unlock(&w->lock);
+    pthread_join(w->thread, NULL);
+    
+    int failed = w->failed;
+    if (fclose(w->fp) != 0) {
+        failed = 1;
+    }
+    pthread_mutex_destroy(&w->lock);
+    pthread_cond_destroy(&w->changed);
+    free(w->buf);
+    free(w);
+    return failed ? -1 : 0;
+}
+
+// Normalized lightcurve, into lightcurve[0..npts-1], of a ring segment of
+// width wid (km) whose transmission trans is sampled at wVal, seen at
+// wavelength lam (microns) from distance D (km). A 2-D context reads it
+// from the rolled scan_row; a 1-D one goes through occ_lc_separable. ap is
+// scratch of the context's size. Returns the grid spacing in km. With an
+// MPI context only rank 0 gets the lightcurve. A GPU context builds the
+// aperture on the device and does not touch ap.
+static double ring_lightcurve(OccContext *ctx, int scan_row, double lam,
+                              double D, double wid, double *wVal,
+                              double *trans, int nRad, FFTW(complex) *ap,
+                              double *lightcurve) {
+    int npts = ctx->npts;
+    double FOV, gridSz;
+    double start = wall_clock();
+    
+    // Create aperture and calculate lightcurve along the scan row
+#ifdef PHOTOMETRY_GPU
+    if (ctx->gpu != NULL) {
+        gridSz = sqrt(lam * 1e-9 * D / npts);
+        double seconds[4] = {0.0, 0.0, 0.0, 0.0};
+        if (occ_gpu_ring_rows(ctx->gpu, gridSz, wid, wVal, trans, nRad,
+                              uniform_radial_grid(wVal, nRad), &scan_row, 1,
+                              lightcurve, seconds) != 0) {
+            exit(EXIT_FAILURE);
+        }
+        if (ctx->timers != NULL) {
+            ctx->timers->aperture += seconds[0];
+            ctx->timers->modulate += seconds[1];
+            ctx->timers->fft += seconds[2];
+            ctx->timers->intensity += seconds[3];
+        }
+    } else
+#endif
+    if (ctx->plan == NULL) {
+        RingSeg_row(lam, D, npts, wid, wVal, trans, nRad, ap, &FOV, &gridSz);
+        if (ctx->timers != NULL) {
+            ctx->timers->aperture += wall_clock() - start;
+        }
+        occ_lc_separable(ctx, ap, lightcurve);
+    } else {
+        RingSeg_slab(lam, D, npts, wid, wVal, trans, nRad, ap, ctx->local_n0, &FOV, &gridSz);
+        if (ctx->timers != NULL) {
+            ctx->timers->aperture += wall_clock() - start;
+        }
+        occ_lc_rows(ctx, ap, &scan_row, 1, lightcurve);
+    }
+    
+    // Normalize to baseline of 1
+    double bg = 0;
+    for (int i = 0; i < 100; i++) {
+        bg += lightcurve[i];
+    }
+    bg /= 100.0;
+    for (int i = 0; i < npts; i++) {
+        lightcurve[i] /= bg;
+    }
+    return gridSz;
+}
+
+// scan_row is the row of the observer's plane the lightcurve is read from.
+// With separable set the ring segment goes through occ_lc_separable; its
+// lightcurve is the same on every row. FFTW's threads must be set up
+// already (see main). The wall-clock time of each phase is added to
+// timers, and the return value is the total in seconds. The lightcurve is
+// smoothed by the star when --star is given.
+double do_run(int npts, int scan_row, int separable, OccTimers *timers) {
     // Parameters
     double lam = 0.5;              // wavelength (microns)
     double D = 43 * 150e6;         // Quaoar at 43 AU (km)
     double wid = 46;               // Width of the ring (km)
     
-    // For wider ring simulation
-    double widW = 100;             // Width of the wider ring (km)
-    
     // Create radial profile arrays
     int nRad = 100;
     double *wVal = (double *)malloc(nRad * sizeof(double));
@@ -194,69 +1174,94 @@ void do_run(int npts) {
     // Initialize arrays and wVal
     create_transmission_profile(wid, nRad, wVal, tau, trans);
     
-    // Allocate memory for aperture and result
-    fftw_complex *ap = fftw_malloc(sizeof(fftw_complex) * npts * npts);
-    fftw_complex *result = fftw_malloc(sizeof(fftw_complex) * npts * npts);
-    double FOV, gridSz;
-    
     // Variables for output
     double *r_km = (double *)malloc(npts * sizeof(double));
     double *t_sec = (double *)malloc(npts * sizeof(double));
-    double *lightcurve = (double *)malloc(npts * sizeof(double));
+    double *lightcurve = (double *)calloc(npts, sizeof(double));
     
-    // Initialize FFTW
-    fftw_init_threads();
-    fftw_plan_with_nthreads(4);  // Use 4 threads for parallel execution
-    
-    printf("Starting simulations...\n");
+    // Allocate memory for aperture, a single row in the separable case. A
+    // full grid is modulated and transformed where it is, so one measured
+    // plan on it serves every lightcurve at this grid size.
+#ifdef PHOTOMETRY_MPI
+    OccContext *ctx = occ_context_create_mpi(npts, MPI_COMM_WORLD, FFTW_MEASURE);
+    FFTW(complex) *ap = ctx->M;
+#else
+    OccContext *ctx = NULL;
+    FFTW(complex) *ap = NULL;
+#ifdef PHOTOMETRY_GPU
+    // A GPU context needs no host grid, and FFTW is not planned at all
+    ctx = separable ? NULL : occ_context_create_gpu(npts);
+#endif
+    if (ctx == NULL) {
+        size_t ap_size = separable ? (size_t)npts : (size_t)npts * npts;
+        ap = FFTW(malloc)(sizeof(FFTW(complex)) * ap_size);
+        ctx = separable ? occ_context_create_1d(npts, FFTW_MEASURE)
+                        : occ_context_create_inplace(npts, ap, FFTW_MEASURE);
+    }
+#endif
+    ctx->timers = timers;
+    // Only rank 0 has the lightcurve to smooth
+    OccSmoother *smoother = NULL;
+    if (occ_star_km > 0.0 && occ_rank == 0) {
+        smoother = occ_smoother_create(npts, 1, FFTW_MEASURE);
+        smoother->timers = timers;
+    }
     
-    // Run the first simulation: Flat profile with tau = 0.1
-    printf("Running flat profile (tau = 0.1)...\n");
-    start_time = clock();
+    if (occ_rank == 0) {
+        printf("Starting simulations...\n");
+        
+        // Run the first simulation: Flat profile with tau = 0.1
+        printf("Running flat profile (tau = 0.1)...\n");
+    }
+    double start_time = wall_clock();
     
     // Generate the profile
     generate_flat_profile(0.1, nRad, tau, trans);
     
-    // Create aperture
-    RingSeg_ap(lam, D, npts, wid, wVal, trans, nRad, ap, &FOV, &gridSz);
-    
-    // Calculate lightcurve
-    occ_lc(ap, result, npts);
-    
-    // Normalize to baseline of 1
-    double bg = 0;
-    for (int i = 0; i < 100; i++) {
-        bg += creal(result[2048 * npts + i]);
+    double gridSz = ring_lightcurve(ctx, scan_row, lam, D, wid, wVal, trans, nRad,
+                                    ap, lightcurve);
+    if (smoother != NULL && occ_smooth(smoother, lightcurve, &gridSz, 1, occ_star_km) != 0) {
+        exit(EXIT_FAILURE);
     }
-    bg /= 100.0;
     
     // Create r_km and t_sec arrays
+    double output_start = wall_clock();
     for (int i = 0; i < npts; i++) {
         r_km[i] = gridSz * (i - npts/2);
         t_sec[i] = r_km[i] / 5.8;  // Event velocity in km/s
-        
-        // Extract and normalize the lightcurve
-        lightcurve[i] = creal(result[2048 * npts + i]) / bg;
     }
     
-    end_time = clock();
-    cpu_time_used = ((double)(end_time - start_time)) / CLOCKS_PER_SEC;
-    printf("Simulation completed in %f seconds\n", cpu_time_used);
-    
     // Write results to file
-    FILE *fp = fopen("lightcurve_flat_tau01.txt", "w");
-    fprintf(fp, "# Time (s), Normalized Flux\n");
-    for (int i = 0; i < npts; i++) {
-        fprintf(fp, "%f %f\n", t_sec[i], lightcurve[i]);
+    LcWriter *writer = NULL;
+    if (occ_rank != 0) {
+        // Only rank 0 has the lightcurve
+    } else if ((writer = lc_writer_open("lightcurve_flat_tau01.txt", LC_TEXT)) == NULL) {
+        fprintf(stderr, "Could not open lightcurve_flat_tau01.txt for writing\n");
+    } else {
+        LcHeader head = {"flat", npts, scan_row, 0.1, wid, lam, D, 5.8, gridSz};
+        lc_writer_submit(writer, &head, t_sec, r_km, lightcurve);
+        if (lc_writer_close(writer) != 0) {
+            fprintf(stderr, "Error writing lightcurve_flat_tau01.txt\n");
+        }
+    }
+    
+    double end_time = wall_clock();
+    timers->output += end_time - output_start;
+    if (occ_rank == 0) {
+        printf("Simulation completed in %f seconds\n", end_time - start_time);
     }
-    fclose(fp);
     
-    // Run other simulations (flat tau=1.0, centrally peaked, sharp edges)
-    // Similar code structure for each simulation...
+    // The other profiles (flat tau=1.0, centrally peaked, sharp edges) and
+    // any other widths or wavelengths are run with --sweep.
     
     // Clean up
-    fftw_free(ap);
-    fftw_free(result);
+#ifndef PHOTOMETRY_MPI
+    FFTW(free)(ap);
+#endif
+    occ_context_destroy(ctx);
+    if (smoother != NULL) {
+        occ_smoother_destroy(smoother);
+    }
     free(wVal);
     free(tau);
     free(trans);
@@ -264,14 +1269,500 @@ void do_run(int npts) {
     free(t_sec);
     free(lightcurve);
     
-    fftw_cleanup_threads();
-    fftw_cleanup();
+    if (occ_rank == 0) {
+        printf("All simulations completed. Results written to files.\n");
+    }
+    return end_time - start_time;
+}
+
+// Sets the threads used by FFTW plans made from now on and by the OpenMP
+// loops around them.
+static void set_threads(int threads) {
+    FFTW(plan_with_nthreads)(threads);
+#ifdef _OPENMP
+    omp_set_num_threads(threads);
+#endif
+}
+
+static void print_timers(const OccTimers *t) {
+    if (occ_rank != 0) {
+        return;
+    }
+    printf("  aperture %.4f  modulate %.4f  fft %.4f  intensity %.4f  smooth %.4f  output %.4f\n",
+           t->aperture, t->modulate, t->fft, t->intensity, t->smooth, t->output);
+}
+
+// Runs do_run at each grid size for 1, 2, 4, ... threads up to max_threads
+// and prints the wall-clock time, speedup and parallel efficiency of each.
+static void scaling_report(const int *sizes, int nsizes, int scan_row,
+                           int separable, int max_threads) {
+    for (int s = 0; s < nsizes; s++) {
+        double base = 0.0;
+        if (occ_rank == 0) {
+            printf("\n# scaling npts = %d\n", sizes[s]);
+            printf("# threads seconds speedup efficiency aperture modulate fft intensity smooth output\n");
+        }
+        for (int t = 1; t <= max_threads; t = t * 2 > max_threads && t < max_threads ? max_threads : t * 2) {
+            OccTimers timers = {0};
+            set_threads(t);
+            double secs = do_run(sizes[s], scan_row, separable, &timers);
+            if (t == 1) {
+                base = secs;
+            }
+            if (occ_rank != 0) {
+                continue;
+            }
+            printf("%d %.4f %.2f %.2f %.4f %.4f %.4f %.4f %.4f %.4f\n", t, secs, base / secs,
+                   base / secs / t, timers.aperture, timers.modulate, timers.fft,
+                   timers.intensity, timers.smooth, timers.output);
+        }
+    }
+}
+
+// One lightcurve of a sweep. profile is 'f' (flat, optical depth tau),
+// 'c' (centrally peaked) or 's' (sharp edge).
+typedef struct {
+    char profile;
+    double tau;
+    double wid;
+    double lam;
+} SweepCase;
+
+#define SWEEP_MAX_VALUES 64
+
+// Grids below this size are too small for FFTW's threads to pay off, so a
+// sweep runs one single-threaded lightcurve per core instead.
+#define SWEEP_SPLIT_NPTS 2048
+
+// Lightcurves a sweep smooths at once when it has a star.
+#define SWEEP_SMOOTH_BATCH 16
+
+// Reads up to SWEEP_MAX_VALUES numbers after the key on a spec line.
+static int sweep_values(char *rest, double *values) {
+    int n = 0;
+    for (char *tok = strtok(rest, " \t\r\n"); tok != NULL && n < SWEEP_MAX_VALUES;
+         tok = strtok(NULL, " \t\r\n")) {
+        values[n++] = atof(tok);
+    }
+    return n;
+}
+
+// Runs every combination of the profiles, ring widths and wavelengths in
+// the sweep spec at spec_path, and writes their lightcurves to out_path as
+// one CSV in the order they are listed. The spec has one "key values..."
+// line per parameter; # starts a comment and missing keys keep the
+// defaults of do_run. An out_path ending in .bin gets the binary format of
+// the output layer instead of CSV:
+//
+//   npts 4096
+//   scan_row 2048
+//   separable 1
+//   distance 6.45e9
+//   velocity 5.8
+//   profile flat:0.1 flat:1.0 cp se
+//   wid 46 100
+//   lam 0.5 0.7
+//   star 40
+//
+// star is the projected stellar diameter in km (default: --star); when it
+// is not 0 the lightcurves are smoothed in batches before they are written.
+// All lightcurves share one plan. threads is the number to use in all.
+// Small grids and the separable path run
+// a lightcurve per thread, each with its own buffers, and larger grids
+// give every thread to each FFT in turn. A lightcurve is queued for the
+// writer thread as soon as it and the ones before it are done.
+int run_sweep(const char *spec_path, const char *out_path, int threads) {
+    int npts = 4096, scan_row = 2048, separable = 0;
+    double D = 43 * 150e6, velocity = 5.8, star_km = occ_star_km;
+    SweepCase profiles[SWEEP_MAX_VALUES];
+    double wids[SWEEP_MAX_VALUES], lams[SWEEP_MAX_VALUES];
+    int nprof = 1, nwid = 1, nlam = 1;
+    profiles[0] = (SweepCase){'f', 0.1, 0.0, 0.0};
+    wids[0] = 46;
+    lams[0] = 0.5;
+    
+    FILE *spec = fopen(spec_path, "r");
+    if (spec == NULL) {
+        fprintf(stderr, "Could not open sweep spec %s\n", spec_path);
+        return EXIT_FAILURE;
+    }
+    char line[1024];
+    int lineno = 0;
+    while (fgets(line, sizeof(line), spec) != NULL) {
+        lineno++;
+        char *hash = strchr(line, '#');
+        if (hash != NULL) {
+            *hash = '\0';
+        }
+        char *key = strtok(line, " \t\r\n");
+        if (key == NULL) {
+            continue;
+        }
+        char *rest = key + strlen(key) + 1;
+        double values[SWEEP_MAX_VALUES];
+        if (strcmp(key, "profile") == 0) {
+            nprof = 0;
+            for (char *tok = strtok(rest, " \t\r\n"); tok != NULL && nprof < SWEEP_MAX_VALUES;
+                 tok = strtok(NULL, " \t\r\n")) {
+                SweepCase c = {0, 0.0, 0.0, 0.0};
+                if (strncmp(tok, "flat:", 5) == 0) {
+                    c.profile = 'f';
+                    c.tau = atof(tok + 5);
+                } else if (strcmp(tok, "cp") == 0) {
+                    c.profile = 'c';
+                } else if (strcmp(tok, "se") == 0) {
+                    c.profile = 's';
+                } else {
+                    fprintf(stderr, "%s:%d: unknown profile %s\n", spec_path, lineno, tok);
+                    fclose(spec);
+                    return EXIT_FAILURE;
+                }
+                profiles[nprof++] = c;
+            }
+        } else if (strcmp(key, "wid") == 0) {
+            nwid = sweep_values(rest, wids);
+        } else if (strcmp(key, "lam") == 0) {
+            nlam = sweep_values(rest, lams);
+        } else if (sweep_values(rest, values) != 1) {
+            fprintf(stderr, "%s:%d: %s takes one value\n", spec_path, lineno, key);
+            fclose(spec);
+            return EXIT_FAILURE;
+        } else if (strcmp(key, "npts") == 0) {
+            npts = (int)values[0];
+        } else if (strcmp(key, "scan_row") == 0) {
+            scan_row = (int)values[0];
+        } else if (strcmp(key, "separable") == 0) {
+            separable = values[0] != 0.0;
+        } else if (strcmp(key, "distance") == 0) {
+            D = values[0];
+        } else if (strcmp(key, "velocity") == 0) {
+            velocity = values[0];
+        } else if (strcmp(key, "star") == 0) {
+            star_km = values[0];
+        } else {
+            fprintf(stderr, "%s:%d: unknown key %s\n", spec_path, lineno, key);
+            fclose(spec);
+            return EXIT_FAILURE;
+        }
+    }
+    fclose(spec);
+    if (npts < 200 || scan_row < 0 || scan_row >= npts || nprof == 0 || nwid == 0 || nlam == 0) {
+        fprintf(stderr, "%s: need npts >= 200, 0 <= scan_row < npts and at least one profile, wid and lam\n",
+                spec_path);
+        return EXIT_FAILURE;
+    }
     
-    printf("All simulations completed. Results written to files.\n");
+    int ncases = nprof * nwid * nlam;
+    SweepCase *cases = malloc(ncases * sizeof(SweepCase));
+    for (int p = 0; p < nprof; p++) {
+        for (int w = 0; w < nwid; w++) {
+            for (int l = 0; l < nlam; l++) {
+                SweepCase *c = &cases[(p * nwid + w) * nlam + l];
+                *c = profiles[p];
+                c->wid = wids[w];
+                c->lam = lams[l];
+            }
+        }
+    }
+    
+    size_t len = strlen(out_path);
+    LcFormat format = len > 4 && strcmp(out_path + len - 4, ".bin") == 0 ? LC_BINARY : LC_CSV;
+    LcWriter *out = lc_writer_open(out_path, format);
+    if (out == NULL) {
+        fprintf(stderr, "Could not open %s for writing\n", out_path);
+        free(cases);
+        return EXIT_FAILURE;
+    }
+    
+    int per_case = separable || npts < SWEEP_SPLIT_NPTS;
+    int outer = per_case ? (threads < ncases ? threads : ncases) : 1;
+    
+    FFTW(plan_with_nthreads)(per_case ? 1 : threads);
+    OccContext *base = NULL;
+#ifdef PHOTOMETRY_GPU
+    if (!per_case) {
+        base = occ_context_create_gpu(npts);
+    }
+#endif
+    if (base == NULL) {
+        base = separable ? occ_context_create_1d(npts, FFTW_MEASURE)
+                         : occ_context_create(npts, FFTW_MEASURE);
+    }
+    // Finished lightcurves wait here in case order until a batch is full
+    OccSmoother *smoother = NULL;
+    LcHeader *batch_heads = NULL;
+    double *batch_flux = NULL, *batch_grid = NULL;
+    int batch_cap = ncases < SWEEP_SMOOTH_BATCH ? ncases : SWEEP_SMOOTH_BATCH, nbatch = 0;
+    if (star_km > 0.0) {
+        smoother = occ_smoother_create(npts, batch_cap, FFTW_MEASURE);
+        batch_heads = malloc(batch_cap * sizeof(LcHeader));
+        batch_flux = malloc((size_t)batch_cap * npts * sizeof(double));
+        batch_grid = malloc(batch_cap * sizeof(double));
+        if (batch_heads == NULL || batch_flux == NULL || batch_grid == NULL) {
+            fprintf(stderr, "Out of memory in sweep\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    printf("Sweeping %d lightcurves at npts = %d on %d thread(s)\n", ncases, npts, outer);
+    
+    #pragma omp parallel num_threads(outer)
+    {
+        // The first thread uses the planning context's buffers
+        int first = 1;
+#ifdef _OPENMP
+        first = omp_get_thread_num() == 0;
+#endif
+        OccContext *ctx = first ? base : occ_context_share(base);
+        // A full-grid aperture is built in the context's buffer and
+        // transformed in place; a GPU context has neither
+        FFTW(complex) *ap = separable ? FFTW(malloc)(sizeof(FFTW(complex)) * npts) : ctx->M;
+        int nRad = 100;
+        double *wVal = malloc(nRad * sizeof(double));
+        double *tau = malloc(nRad * sizeof(double));
+        double *trans = malloc(nRad * sizeof(double));
+        double *lightcurve = malloc(npts * sizeof(double));
+        double *r_km = malloc(npts * sizeof(double));
+        double *t_sec = malloc(npts * sizeof(double));
+        if ((separable && ap == NULL) || wVal == NULL || tau == NULL || trans == NULL || lightcurve == NULL ||
+            r_km == NULL || t_sec == NULL) {
+            fprintf(stderr, "Out of memory in sweep\n");
+            exit(EXIT_FAILURE);
+        }
+        
+        #pragma omp for schedule(dynamic) ordered
+        for (int k = 0; k < ncases; k++) {
+            const SweepCase *c = &cases[k];
+            create_transmission_profile(c->wid, nRad, wVal, tau, trans);
+            if (c->profile == 'f') {
+                generate_flat_profile(c->tau, nRad, tau, trans);
+            } else if (c->profile == 'c') {
+                generate_cp_profile(wVal, nRad, tau, trans);
+            } else {
+                generate_se_profile(wVal, nRad, tau, trans);
+            }
+            double gridSz = ring_lightcurve(ctx, scan_row, c->lam, D, c->wid, wVal, trans,
+                                            nRad, ap, lightcurve);
+            for (int i = 0; i < npts; i++) {
+                r_km[i] = gridSz * (i - npts/2);
+                t_sec[i] = r_km[i] / velocity;
+            }
+            LcHeader head = {"", npts, scan_row, c->tau, c->wid, c->lam, D, velocity, gridSz};
+            strcpy(head.profile, c->profile == 'f' ? "flat" : c->profile == 'c' ? "cp" : "se");
+            
+            #pragma omp ordered
+            {
+                if (smoother == NULL) {
+                    lc_writer_submit(out, &head, t_sec, r_km, lightcurve);
+                } else {
+                    batch_heads[nbatch] = head;
+                    batch_grid[nbatch] = gridSz;
+                    memcpy(batch_flux + (size_t)nbatch * npts, lightcurve, npts * sizeof(double));
+                    nbatch++;
+                }
+                if (smoother != NULL && (nbatch == batch_cap || k == ncases - 1)) {
+                    if (occ_smooth(smoother, batch_flux, batch_grid, nbatch, star_km) != 0) {
+                        exit(EXIT_FAILURE);
+                    }
+                    for (int b = 0; b < nbatch; b++) {
+                        for (int i = 0; i < npts; i++) {
+                            r_km[i] = batch_grid[b] * (i - npts/2);
+                            t_sec[i] = r_km[i] / velocity;
+                        }
+                        lc_writer_submit(out, &batch_heads[b], t_sec, r_km,
+                                         batch_flux + (size_t)b * npts);
+                    }
+                    nbatch = 0;
+                }
+            }
+        }
+        
+        if (!first) {
+            occ_context_destroy(ctx);
+        }
+        if (separable) {
+            FFTW(free)(ap);
+        }
+        free(wVal);
+        free(tau);
+        free(trans);
+        free(lightcurve);
+        free(r_km);
+        free(t_sec);
+    }
+    
+    occ_context_destroy(base);
+    if (smoother != NULL) {
+        occ_smoother_destroy(smoother);
+    }
+    free(batch_heads);
+    free(batch_flux);
+    free(batch_grid);
+    free(cases);
+    if (lc_writer_close(out) != 0) {
+        fprintf(stderr, "Error writing %s\n", out_path);
+        return EXIT_FAILURE;
+    }
+    printf("Sweep results written to %s\n", out_path);
+    return EXIT_SUCCESS;
 }
 
-int main() {
-	do_run(4096*1);
-	do_run(4096*2);
-	do_run(4096*3);
+// Largest difference in normalized flux between the lightcurve files
+// written by do_run at path and ref_path, or -1 if they cannot be read or
+// differ in length.
+static double lightcurve_difference(const char *path, const char *ref_path) {
+    FILE *a = fopen(path, "r");
+    FILE *b = fopen(ref_path, "r");
+    double worst = -1.0;
+    if (a != NULL && b != NULL) {
+        char header[256];
+        double ta, fa, tb, fb;
+        int na, nb;
+        worst = 0.0;
+        if (fgets(header, sizeof(header), a) == NULL || fgets(header, sizeof(header), b) == NULL) {
+            worst = -1.0;
+        }
+        while (worst >= 0.0) {
+            na = fscanf(a, "%lf %lf", &ta, &fa);
+            nb = fscanf(b, "%lf %lf", &tb, &fb);
+            if (na != 2 || nb != 2) {
+                worst = na == nb ? worst : -1.0;
+                break;
+            }
+            worst = fabs(fa - fb) > worst ? fabs(fa - fb) : worst;
+        }
+    }
+    if (a != NULL) {
+        fclose(a);
+    }
+    if (b != NULL) {
+        fclose(b);
+    }
+    return worst;
+}
+
+// Normalized flux tolerance of --check, for comparing a single precision
+// lightcurve with the double one.
+#define CHECK_TOLERANCE 1e-4
+
+// Options:
+//   --separable         use the 1-D path for the ring segment
+//   --npts N            run one grid size instead of 4096, 8192 and 12288
+//   --check REF         after the run, compare its lightcurve with REF, as
+//                       written by another build, and fail if the flux
+//                       differs by more than CHECK_TOLERANCE
+//   --threads N         threads for FFTW and the loops around it (default:
+//                       OpenMP's default, or 1 without OpenMP)
+//   --scaling           time each grid size at 1, 2, 4, ... N threads
+//   --sweep spec [out]  run the sweep described by spec into out
+//   --cpu               use FFTW in a GPU build even if there is a device
+//   --star KM           smooth lightcurves by a star of projected diameter
+//                       KM (km), as seen at the ring
+// The MPI build runs the 2-D path at 16384 and 32768 by default (threads
+// are per rank) and has no --separable or --sweep.
+int main(int argc, char *argv[]) {
+	int separable = 0, scaling = 0, threads = 1, npts = 0;
+	const char *sweep_spec = NULL, *sweep_out = "photometry_sweep.csv", *check = NULL;
+#ifdef _OPENMP
+	threads = omp_get_max_threads();
+#endif
+	for (int a = 1; a < argc; a++) {
+		if (strcmp(argv[a], "--separable") == 0) {
+			separable = 1;
+		} else if (strcmp(argv[a], "--cpu") == 0) {
+			occ_gpu_enabled = 0;
+		} else if (strcmp(argv[a], "--star") == 0 && a + 1 < argc) {
+			occ_star_km = atof(argv[++a]);
+		} else if (strcmp(argv[a], "--scaling") == 0) {
+			scaling = 1;
+		} else if (strcmp(argv[a], "--threads") == 0 && a + 1 < argc) {
+			threads = atoi(argv[++a]);
+		} else if (strcmp(argv[a], "--npts") == 0 && a + 1 < argc) {
+			npts = atoi(argv[++a]);
+		} else if (strcmp(argv[a], "--check") == 0 && a + 1 < argc) {
+			check = argv[++a];
+		} else if (strcmp(argv[a], "--sweep") == 0 && a + 1 < argc) {
+			sweep_spec = argv[++a];
+			if (a + 1 < argc && argv[a + 1][0] != '-') {
+				sweep_out = argv[++a];
+			}
+		} else {
+			fprintf(stderr, "usage: %s [--separable] [--threads N] [--npts N] [--check REF] "
+			        "[--scaling] [--cpu] [--star KM] [--sweep spec [out.csv]]\n", argv[0]);
+			return EXIT_FAILURE;
+		}
+	}
+	if (threads < 1) {
+		fprintf(stderr, "--threads must be at least 1\n");
+		return EXIT_FAILURE;
+	}
+	if (occ_star_km < 0.0) {
+		fprintf(stderr, "--star must not be negative\n");
+		return EXIT_FAILURE;
+	}
+	if (npts != 0 && npts < 200) {
+		fprintf(stderr, "--npts must be at least 200\n");
+		return EXIT_FAILURE;
+	}
+#ifdef PHOTOMETRY_MPI
+	if (separable || sweep_spec != NULL) {
+		fprintf(stderr, "--separable and --sweep are not supported by the MPI build\n");
+		return EXIT_FAILURE;
+	}
+	// Only the main thread calls MPI; FFTW's and OpenMP's threads do not
+	int provided;
+	MPI_Init_thread(&argc, &argv, MPI_THREAD_FUNNELED, &provided);
+	MPI_Comm_rank(MPI_COMM_WORLD, &occ_rank);
+#endif
+	
+	// FFTW's threads are set up once for the whole process
+	FFTW(init_threads)();
+#ifdef PHOTOMETRY_MPI
+	FFTW(mpi_init)();
+#endif
+	set_threads(threads);
+	
+	int status = EXIT_SUCCESS;
+#ifdef PHOTOMETRY_MPI
+	int sizes[] = {4096*4, 4096*8};
+#else
+	int sizes[] = {4096*1, 4096*2, 4096*3};
+#endif
+	int nsizes = sizeof(sizes) / sizeof(sizes[0]);
+	int scan_row = 2048;
+	if (npts != 0) {
+		sizes[0] = npts;
+		nsizes = 1;
+		scan_row = npts / 2 < scan_row ? npts / 2 : scan_row;
+	}
+	if (sweep_spec != NULL) {
+		status = run_sweep(sweep_spec, sweep_out, threads);
+	} else if (scaling) {
+		scaling_report(sizes, nsizes, scan_row, separable, threads);
+	} else {
+		for (int s = 0; s < nsizes; s++) {
+			OccTimers timers = {0};
+			do_run(sizes[s], scan_row, separable, &timers);
+			print_timers(&timers);
+		}
+	}
+	if (check != NULL && status == EXIT_SUCCESS && occ_rank == 0) {
+		double diff = lightcurve_difference("lightcurve_flat_tau01.txt", check);
+		if (diff < 0.0) {
+			fprintf(stderr, "Could not compare lightcurve_flat_tau01.txt with %s\n", check);
+			status = EXIT_FAILURE;
+		} else {
+			printf("Largest flux difference from %s: %g\n", check, diff);
+			status = diff <= CHECK_TOLERANCE ? EXIT_SUCCESS : EXIT_FAILURE;
+		}
+	}
+	
+#ifdef PHOTOMETRY_MPI
+	FFTW(mpi_cleanup)();
+#endif
+	FFTW(cleanup_threads)();
+	FFTW(cleanup)();
+#ifdef PHOTOMETRY_MPI
+	MPI_Finalize();
+#endif
+	return status;
 }
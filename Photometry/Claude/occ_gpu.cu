@@ -0,0 +1,294 @@
+// GPU backend for the 2-D occultation path. Built by nvcc against cuFFT
+// (make c-gpu), or by hipcc against hipFFT, which runs rocFFT on AMD
+// devices (make c-hip); the CUDA names below are mapped to HIP's there.
+//
+// A lightcurve goes through four kernels on one stream: the aperture row
+// of RingSeg_row, then one pass that broadcasts it down the grid and
+// multiplies by the chirp, so the aperture grid is never stored; the
+// in-place 2-D transform; and the |E|^2 and roll of just the requested
+// rows, which are all that is copied back. Grids are double precision,
+// like FFTW's default build.
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#ifdef __HIPCC__
+#include <hip/hip_runtime.h>
+#include <hipfft/hipfft.h>
+#define cudaError_t hipError_t
+#define cudaSuccess hipSuccess
+#define cudaGetDeviceCount hipGetDeviceCount
+#define cudaGetErrorString hipGetErrorString
+#define cudaGetLastError hipGetLastError
+#define cudaMalloc hipMalloc
+#define cudaFree hipFree
+#define cudaMemcpy hipMemcpy
+#define cudaMemcpyHostToDevice hipMemcpyHostToDevice
+#define cudaMemcpyDeviceToHost hipMemcpyDeviceToHost
+#define cudaMemGetInfo hipMemGetInfo
+#define cudaEvent_t hipEvent_t
+#define cudaEventCreate hipEventCreate
+#define cudaEventDestroy hipEventDestroy
+#define cudaEventRecord hipEventRecord
+#define cudaEventSynchronize hipEventSynchronize
+#define cudaEventElapsedTime hipEventElapsedTime
+#define cufftHandle hipfftHandle
+#define cufftResult hipfftResult
+#define cufftDoubleComplex hipfftDoubleComplex
+#define cufftPlan2d hipfftPlan2d
+#define cufftExecZ2Z hipfftExecZ2Z
+#define cufftDestroy hipfftDestroy
+#define CUFFT_Z2Z HIPFFT_Z2Z
+#define CUFFT_FORWARD HIPFFT_FORWARD
+#define CUFFT_SUCCESS HIPFFT_SUCCESS
+#else
+#include <cuda_runtime.h>
+#include <cufft.h>
+#endif
+
+#include "occ_gpu.h"
+
+#define OCC_GPU_BLOCK 256
+#define OCC_GPU_EVENTS 5
+
+struct OccGpu {
+    int npts;
+    cufftDoubleComplex *M;
+    cufftHandle plan;
+    double *chirp_re;
+    double *chirp_im;
+    double *row;
+    int *rows;
+    int rows_cap;
+    double *rows_out;
+    int rows_out_cap;
+    double *profile;
+    int profile_cap;
+    cudaEvent_t events[OCC_GPU_EVENTS];
+};
+
+static int gpu_check(cudaError_t err, const char *what)
+{
+    if (err != cudaSuccess) {
+        fprintf(stderr, "GPU %s failed: %s\n", what, cudaGetErrorString(err));
+        return -1;
+    }
+    return 0;
+}
+
+// One aperture row, as RingSeg_row fills it on the host. profile holds the
+// radial positions followed by the transmission values.
+__global__ static void ring_row_kernel(double *row, int npts, double gridSz,
+                                       double wid2, const double *profile,
+                                       int n, int uniform, double inv_step)
+{
+    int j = blockIdx.x * blockDim.x + threadIdx.x;
+    if (j >= npts) {
+        return;
+    }
+    const double *radial_pos = profile;
+    const double *trans = profile + n;
+    int last = n - 1;
+    double x = (j - npts / 2) * gridSz;
+    double t = 1.0;
+    if (fabs(x) <= wid2) {
+        if (x <= radial_pos[0]) {
+            t = trans[0];
+        } else if (x >= radial_pos[last]) {
+            t = trans[last];
+        } else if (uniform) {
+            double u = (x - radial_pos[0]) * inv_step;
+            int k = (int)u;
+            k = k < last ? k : last - 1;
+            double f = u - k;
+            t = trans[k] * (1 - f) + trans[k + 1] * f;
+        } else {
+            int lo = 0, hi = last;
+            while (hi - lo > 1) {
+                int mid = (lo + hi) / 2;
+                if (radial_pos[mid] <= x) {
+                    lo = mid;
+                } else {
+                    hi = mid;
+                }
+            }
+            double f = (x - radial_pos[lo]) / (radial_pos[lo + 1] - radial_pos[lo]);
+            t = trans[lo] * (1 - f) + trans[lo + 1] * f;
+        }
+    }
+    row[j] = t;
+}
+
+// M = row(x) * chirp(y) * chirp(x); every grid row has the same aperture.
+__global__ static void modulate_kernel(cufftDoubleComplex *M, const double *row,
+                                       const double *cre, const double *cim,
+                                       int npts)
+{
+    int j = blockIdx.x * blockDim.x + threadIdx.x;
+    int i = blockIdx.y;
+    if (j >= npts) {
+        return;
+    }
+    double er = cre[i] * cre[j] - cim[i] * cim[j];
+    double ei = cre[i] * cim[j] + cim[i] * cre[j];
+    cufftDoubleComplex e;
+    e.x = row[j] * er;
+    e.y = row[j] * ei;
+    M[(size_t)i * npts + j] = e;
+}
+
+// Rolled intensity row rows[k] into out[k * npts ...], as occ_lc_rows.
+__global__ static void intensity_rows_kernel(const cufftDoubleComplex *M,
+                                             const int *rows, int npts,
+                                             double *out)
+{
+    int j = blockIdx.x * blockDim.x + threadIdx.x;
+    int k = blockIdx.y;
+    if (j >= npts) {
+        return;
+    }
+    int n2 = npts / 2;
+    size_t field_row = (size_t)((rows[k] + n2) % npts);
+    cufftDoubleComplex e = M[field_row * npts + (j + n2) % npts];
+    out[(size_t)k * npts + j] = e.x * e.x + e.y * e.y;
+}
+
+extern "C" void occ_gpu_destroy(OccGpu *gpu)
+{
+    if (gpu == NULL) {
+        return;
+    }
+    if (gpu->plan) {
+        cufftDestroy(gpu->plan);
+    }
+    cudaFree(gpu->M);
+    cudaFree(gpu->chirp_re);
+    cudaFree(gpu->chirp_im);
+    cudaFree(gpu->row);
+    cudaFree(gpu->rows_out);
+    cudaFree(gpu->rows);
+    cudaFree(gpu->profile);
+    for (int e = 0; e < OCC_GPU_EVENTS; e++) {
+        if (gpu->events[e]) {
+            cudaEventDestroy(gpu->events[e]);
+        }
+    }
+    free(gpu);
+}
+
+extern "C" OccGpu *occ_gpu_create(int npts, const double *chirp_re, const double *chirp_im)
+{
+    int devices = 0;
+    if (cudaGetDeviceCount(&devices) != cudaSuccess || devices == 0) {
+        return NULL;
+    }
+    OccGpu *gpu = (OccGpu *)calloc(1, sizeof(OccGpu));
+    if (gpu == NULL) {
+        return NULL;
+    }
+    gpu->npts = npts;
+
+    size_t grid = sizeof(cufftDoubleComplex) * npts * npts;
+    size_t free_bytes = 0, total_bytes = 0;
+    if (gpu_check(cudaMemGetInfo(&free_bytes, &total_bytes), "memory query") != 0 ||
+        free_bytes < grid) {
+        fprintf(stderr, "GPU has %zu MB free, a %d^2 grid needs %zu MB\n",
+                free_bytes >> 20, npts, grid >> 20);
+        occ_gpu_destroy(gpu);
+        return NULL;
+    }
+    size_t table = sizeof(double) * npts;
+    if (gpu_check(cudaMalloc((void **)&gpu->M, grid), "grid allocation") != 0 ||
+        gpu_check(cudaMalloc((void **)&gpu->chirp_re, table), "allocation") != 0 ||
+        gpu_check(cudaMalloc((void **)&gpu->chirp_im, table), "allocation") != 0 ||
+        gpu_check(cudaMalloc((void **)&gpu->row, table), "allocation") != 0 ||
+        gpu_check(cudaMemcpy(gpu->chirp_re, chirp_re, table, cudaMemcpyHostToDevice), "copy") != 0 ||
+        gpu_check(cudaMemcpy(gpu->chirp_im, chirp_im, table, cudaMemcpyHostToDevice), "copy") != 0) {
+        occ_gpu_destroy(gpu);
+        return NULL;
+    }
+    // The plan's work area comes on top of the grid
+    if (cufftPlan2d(&gpu->plan, npts, npts, CUFFT_Z2Z) != CUFFT_SUCCESS) {
+        fprintf(stderr, "GPU FFT plan for a %d^2 grid failed\n", npts);
+        gpu->plan = 0;
+        occ_gpu_destroy(gpu);
+        return NULL;
+    }
+    for (int e = 0; e < OCC_GPU_EVENTS; e++) {
+        if (gpu_check(cudaEventCreate(&gpu->events[e]), "event") != 0) {
+            occ_gpu_destroy(gpu);
+            return NULL;
+        }
+    }
+    return gpu;
+}
+
+// Grows a device buffer of cap elements of size bytes each to n.
+static int gpu_reserve(void **buf, int *cap, int n, size_t size)
+{
+    if (n <= *cap) {
+        return 0;
+    }
+    cudaFree(*buf);
+    *buf = NULL;
+    *cap = 0;
+    if (gpu_check(cudaMalloc(buf, size * n), "allocation") != 0) {
+        return -1;
+    }
+    *cap = n;
+    return 0;
+}
+
+extern "C" int occ_gpu_ring_rows(OccGpu *gpu, double gridSz, double wid,
+                                 const double *radial_pos, const double *trans_values,
+                                 int num_radial_points, int uniform, const int *rows,
+                                 int nrows, double *out, double *seconds)
+{
+    int npts = gpu->npts;
+    int n = num_radial_points;
+    int last = n - 1;
+    if (gpu_reserve((void **)&gpu->profile, &gpu->profile_cap, 2 * n, sizeof(double)) != 0 ||
+        gpu_reserve((void **)&gpu->rows, &gpu->rows_cap, nrows, sizeof(int)) != 0 ||
+        gpu_reserve((void **)&gpu->rows_out, &gpu->rows_out_cap, nrows, sizeof(double) * npts) != 0 ||
+        gpu_check(cudaMemcpy(gpu->profile, radial_pos, sizeof(double) * n,
+                             cudaMemcpyHostToDevice), "copy") != 0 ||
+        gpu_check(cudaMemcpy(gpu->profile + n, trans_values, sizeof(double) * n,
+                             cudaMemcpyHostToDevice), "copy") != 0 ||
+        gpu_check(cudaMemcpy(gpu->rows, rows, sizeof(int) * nrows,
+                             cudaMemcpyHostToDevice), "copy") != 0) {
+        return -1;
+    }
+    double inv_step = uniform ? last / (radial_pos[last] - radial_pos[0]) : 0.0;
+    int blocks = (npts + OCC_GPU_BLOCK - 1) / OCC_GPU_BLOCK;
+
+    cudaEventRecord(gpu->events[0], 0);
+    ring_row_kernel<<<blocks, OCC_GPU_BLOCK>>>(gpu->row, npts, gridSz, 0.5 * wid,
+                                               gpu->profile, n, uniform, inv_step);
+    cudaEventRecord(gpu->events[1], 0);
+    modulate_kernel<<<dim3(blocks, npts), OCC_GPU_BLOCK>>>(gpu->M, gpu->row, gpu->chirp_re,
+                                                          gpu->chirp_im, npts);
+    cudaEventRecord(gpu->events[2], 0);
+    if (cufftExecZ2Z(gpu->plan, gpu->M, gpu->M, CUFFT_FORWARD) != CUFFT_SUCCESS) {
+        fprintf(stderr, "GPU FFT failed\n");
+        return -1;
+    }
+    cudaEventRecord(gpu->events[3], 0);
+    intensity_rows_kernel<<<dim3(blocks, nrows), OCC_GPU_BLOCK>>>(gpu->M, gpu->rows, npts,
+                                                                 gpu->rows_out);
+    if (gpu_check(cudaGetLastError(), "kernel launch") != 0 ||
+        gpu_check(cudaMemcpy(out, gpu->rows_out, sizeof(double) * npts * nrows,
+                             cudaMemcpyDeviceToHost), "copy") != 0) {
+        return -1;
+    }
+    cudaEventRecord(gpu->events[4], 0);
+    cudaEventSynchronize(gpu->events[4]);
+
+    if (seconds != NULL) {
+        for (int e = 0; e < OCC_GPU_EVENTS - 1; e++) {
+            float ms = 0.0f;
+            cudaEventElapsedTime(&ms, gpu->events[e], gpu->events[e + 1]);
+            seconds[e] += 1e-3 * ms;
+        }
+    }
+    return 0;
+}
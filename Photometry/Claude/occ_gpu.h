@@ -0,0 +1,33 @@
+// GPU backend for the 2-D occultation path of Photometry.c; see occ_gpu.cu.
+#ifndef OCC_GPU_H
+#define OCC_GPU_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct OccGpu OccGpu;
+
+// Sets up the device buffers and FFT plan for npts x npts grids, with the
+// chirp tables of an OccContext. Returns NULL if there is no device or
+// the grid and plan do not fit in its memory, so the caller can fall back
+// to FFTW.
+OccGpu *occ_gpu_create(int npts, const double *chirp_re, const double *chirp_im);
+void occ_gpu_destroy(OccGpu *gpu);
+
+// Builds the ring aperture of RingSeg_ap on the device, modulates and
+// transforms it, and copies back only the rolled intensity rows
+// rows[0..nrows-1], row k into out[k * npts .. (k + 1) * npts - 1]. uniform
+// says radial_pos is evenly spaced. When seconds is not NULL, the device
+// time of the aperture, modulate, fft and intensity phases is added to
+// seconds[0..3]. Returns 0, or -1 after printing a device error.
+int occ_gpu_ring_rows(OccGpu *gpu, double gridSz, double wid,
+                      const double *radial_pos, const double *trans_values,
+                      int num_radial_points, int uniform, const int *rows,
+                      int nrows, double *out, double *seconds);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,32 @@
+# Runs the per-node malloc build of binary-trees Version4 Claude under each
+# allocator that is installed, through LD_PRELOAD, and then the arena build,
+# collecting their --stats reports in allocators-binary-trees.txt.
+allocators=('glibc:'
+  'jemalloc:/usr/lib/x86_64-linux-gnu/libjemalloc.so.2'
+  'mimalloc:/usr/lib/x86_64-linux-gnu/libmimalloc.so.2'
+  'tcmalloc:/usr/lib/x86_64-linux-gnu/libtcmalloc_minimal.so.4'
+)
+
+depth=${1:-21}
+
+rm -f allocators-binary-trees.txt
+cd binary-trees/Version4/Claude
+if make c-malloc;
+then
+	for allocator in "${allocators[@]}"
+	do
+		name=${allocator%%:*}
+		library=${allocator#*:}
+		if [ -z "$library" ] || [ -e "$library" ]
+		then
+			echo "binary-trees $depth $name" >> ../../../allocators-binary-trees.txt
+			LD_PRELOAD=$library ./a.out $depth --stats 2>> ../../../allocators-binary-trees.txt > /dev/null
+		fi
+	done
+fi
+if make c;
+then
+	echo "binary-trees $depth arena" >> ../../../allocators-binary-trees.txt
+	./a.out $depth --stats 2>> ../../../allocators-binary-trees.txt > /dev/null
+fi
+cd ../../..
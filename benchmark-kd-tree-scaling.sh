@@ -0,0 +1,75 @@
+#!/bin/bash
+# Sweeps the C kd-tree builds over particle counts and thread counts and
+# writes times-kd-tree-scaling.csv for processTimes.scala. Override the
+# sweep with SIZES, THREADS, STEPS and REPEATS in the environment.
+
+authors=('ChatGPT' 'Claude' 'Gemini2.5' 'Human')
+
+SIZES=${SIZES:-"10000 100000 1000000 10000000"}
+THREADS=${THREADS:-"1 2 4 8 16 32 64"}
+STEPS=${STEPS:-3}
+REPEATS=${REPEATS:-3}
+VersionPattern="Version*"
+
+out="$(pwd)/times-kd-tree-scaling.csv"
+echo "benchmark,version,author,language,particles,steps,threads,seconds,particle_steps_per_sec,peak_rss_kb" > "$out"
+
+max_threads=$(nproc)
+
+# Runs "$@" once and prints "seconds peak_rss_kb". GNU time gives both;
+# without it only the bash timer is available and the RSS is left empty.
+measure() {
+	if [ -x /usr/bin/time ]
+	then
+		/usr/bin/time -f "%e %M" "$@" 2>&1 >/dev/null | tail -1
+	else
+		TIMEFORMAT=%R
+		{ time "$@" > /dev/null 2>&1 ; } 2>&1 | tr -d '\n'
+		echo " "
+	fi
+}
+
+cd kd-tree
+for version in $VersionPattern
+do
+	cd $version
+	for author in "${authors[@]}"
+	do
+		if [ -d "$author" ]
+		then
+  			cd $author
+			if make c > /dev/null
+			then
+				# run-c holds the command with the default arguments last.
+				cmd=$(make -s -n run-c | tail -1 | sed -E 's/ +[0-9]+ +[0-9]+ *$//')
+				# Only builds linked with OpenMP do anything with more threads.
+				threads="1"
+				if grep -qs -- "-fopenmp" Makefile */Makefile
+				then
+					threads=""
+					for t in $THREADS
+					do
+						if [ "$t" -le "$max_threads" ]
+						then
+							threads="$threads $t"
+						fi
+					done
+				fi
+				for n in $SIZES
+				do
+					for t in $threads
+					do
+						for cnt in $(seq 1 $REPEATS)
+						do
+							read secs rss <<< "$(OMP_NUM_THREADS=$t measure $cmd $n $STEPS)"
+							rate=$(awk -v n=$n -v s=$STEPS -v t=$secs 'BEGIN { if (t > 0) printf "%.0f", n * s / t }')
+							echo "kd-tree,$version,$author,c,$n,$STEPS,$t,$secs,$rate,$rss" >> "$out"
+						done
+					done
+				done
+			fi
+			cd ..
+		fi
+	done
+	cd ..
+done
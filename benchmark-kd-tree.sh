@@ -33,3 +33,7 @@ do
 	done
 	cd ..
 done
+
+# One CSV row per run, see results.py
+cd ..
+python3 results.py convert times-kd-tree.txt > results-kd-tree.csv
@@ -1,6 +1,8 @@
 authors=('ChatGPT' 'Claude' 'Gemini2.5' 'Human')
 
 languages=('c' 'rust' 'python')
+# Photometry has no version directories
+version=Version1
 
 rm times-photometry.txt
 cd Photometry
@@ -26,3 +28,12 @@ do
 		cd ..
 	fi
 done
+
+# One CSV row per run, see results.py
+cd ..
+python3 results.py convert times-photometry.txt > results-photometry.csv
+if [ "$(wc -l < results-photometry.csv)" -le 1 ]
+then
+	echo "no runs converted from times-photometry.txt" >&2
+	exit 1
+fi
@@ -34,3 +34,6 @@ do
 	done
 	cd ..
 done
+
+# One CSV row per run, see results.py
+python3 results.py convert times-python.txt > results-python.csv
@@ -37,3 +37,6 @@ do
 	done
 	cd ..
 done
+
+# One CSV row per run, see results.py
+python3 results.py convert times-rust.txt > results-rust.csv
@@ -8,6 +8,7 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <apr_pools.h>
+#include <omp.h>
 
 // intptr_t should be the native integer type on most sane systems.
 typedef intptr_t intnative_t;
@@ -16,6 +17,50 @@ typedef struct tree_node{
 	struct tree_node * left_Node, * right_Node;
 } tree_node;
 
+// Roughly how many nodes the trees of one tree_task add up to. The
+// iterations of each depth are cut into tasks of about this size, so there
+// are enough tasks to keep every thread busy until the end; the trees of
+// the deepest depths are bigger than this on their own and get a task each.
+#define TASK_NODES (1<<18)
+
+// A run of iterations of trees of one tree_Depth, or the long_Lived_Tree if
+// iterations is 0.
+typedef struct{
+	intnative_t tree_Depth, iterations;
+} tree_task;
+
+// The tasks are dealt round-robin to one task_queue per thread, queue q
+// getting positions q, q+threads, q+2*threads, ... of the task list. The
+// [front, back) range of its positions still to take is packed into one
+// word so the owning thread taking from the front and other threads
+// stealing from the back agree with a single compare-and-swap.
+typedef struct{
+	uint64_t range;
+	char padding[64-sizeof(uint64_t)]; // Keep queues on separate cache lines.
+} task_queue;
+
+
+// Take the task at the front (from_Back false) or back (from_Back true) of
+// queue q and return its index in the task list, or -1 if the queue is
+// empty.
+static intnative_t take_Task(task_queue * const queues, const int q,
+  const int threads, const int from_Back){
+	uint64_t range=__atomic_load_n(&queues[q].range, __ATOMIC_ACQUIRE);
+
+	for(;;){
+		const uint32_t front=range>>32, back=(uint32_t)range;
+		if(front>=back)
+			return -1;
+
+		const uint32_t position=from_Back ? back-1 : front;
+		const uint64_t taken=from_Back ? (uint64_t)front<<32 | position :
+		  (uint64_t)(front+1)<<32 | back;
+		if(__atomic_compare_exchange_n(&queues[q].range, &range, taken, 1,
+		  __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+			return (intnative_t)position*threads+q;
+	}
+}
+
 
 // Create a binary tree of depth tree_Depth in memory_Pool and return a pointer
 // to the created binary tree.
@@ -97,44 +142,97 @@ int main(int argc, char *argv[]){
 	// later.
 	intnative_t long_Lived_Tree_Checksum,
 	  tree_Checksums[(maximum_Tree_Depth-minimum_Tree_Depth+2)/2];
+
+	// Make the list of tasks: the long_Lived_Tree first, then the iterations
+	// of each depth from the deepest, whose tasks are the biggest, to the
+	// shallowest, whose small tasks fill in the gaps at the end.
+	intnative_t task_Count=1;
+	for(intnative_t tree_Depth=minimum_Tree_Depth;
+	  tree_Depth<=maximum_Tree_Depth; tree_Depth+=2){
+		const intnative_t iterations=
+		  1<<(maximum_Tree_Depth-tree_Depth+minimum_Tree_Depth),
+		  per_Task=TASK_NODES>>(tree_Depth+1) ? TASK_NODES>>(tree_Depth+1) : 1;
+		task_Count+=(iterations+per_Task-1)/per_Task;
+		tree_Checksums[(tree_Depth-minimum_Tree_Depth)/2]=0;
+	}
+	tree_task * const tasks=malloc(task_Count*sizeof(tree_task));
+	tasks[0]=(tree_task){maximum_Tree_Depth, 0};
+	task_Count=1;
+	for(intnative_t tree_Depth=maximum_Tree_Depth-
+	  (maximum_Tree_Depth-minimum_Tree_Depth)%2;
+	  tree_Depth>=minimum_Tree_Depth; tree_Depth-=2){
+		intnative_t iterations=
+		  1<<(maximum_Tree_Depth-tree_Depth+minimum_Tree_Depth);
+		const intnative_t per_Task=TASK_NODES>>(tree_Depth+1) ?
+		  TASK_NODES>>(tree_Depth+1) : 1;
+		for(; iterations>0; iterations-=per_Task)
+			tasks[task_Count++]=(tree_task){tree_Depth,
+			  iterations<per_Task ? iterations : per_Task};
+	}
+
+	int threads=1;
+	task_queue * queues;
+	double * busy_Times;
+	intnative_t * tasks_Run, * tasks_Stolen;
 	#pragma omp parallel
 	{
-		// Have one thread create the long_Lived_Tree of depth
-		// maximum_Tree_Depth in the memory_Pool which was already previously
-		// used for the stretch_Tree, compute the long_Lived_Tree_Checksum, and
-		// then just leave the long_Lived_Tree alone for a while while the rest
-		// of the binary trees finish processing (which should have
-		// simultaneously been started to be processed by any other available
-		// threads).
-		#pragma omp single nowait
+		const int thread=omp_get_thread_num();
+
+		// Have one thread deal out the tasks once the number of threads is
+		// known.
+		#pragma omp single
 		{
-			long_Lived_Tree=create_Tree(maximum_Tree_Depth, memory_Pool);
-			long_Lived_Tree_Checksum=compute_Tree_Checksum(long_Lived_Tree);
+			threads=omp_get_num_threads();
+			queues=aligned_alloc(64, threads*sizeof(task_queue));
+			busy_Times=calloc(threads, sizeof(double));
+			tasks_Run=calloc(threads, sizeof(intnative_t));
+			tasks_Stolen=calloc(threads, sizeof(intnative_t));
+			for(int q=0; q<threads; q++)
+				queues[q].range=(task_Count-q+threads-1)/threads;
 		}
 
 		// Create a thread_Memory_Pool for this thread to use.
 		apr_pool_t * thread_Memory_Pool;
 		apr_pool_create_unmanaged(&thread_Memory_Pool);
 
-		#pragma omp for nowait
-		for(intnative_t tree_Depth=minimum_Tree_Depth;
-		  tree_Depth<=maximum_Tree_Depth; tree_Depth+=2){
-
-			// Create a bunch of binary trees of depth tree_Depth, compute their
-			// checksums, and add the checksums to the total_Trees_Checksum.
-			intnative_t total_Trees_Checksum=0;
-			for(intnative_t iterations=
-			  1<<(maximum_Tree_Depth-tree_Depth+minimum_Tree_Depth);
-			  iterations-->0;){
-				apr_pool_clear(thread_Memory_Pool);
-				total_Trees_Checksum+=compute_Tree_Checksum(
-				  create_Tree(tree_Depth, thread_Memory_Pool));
-			}
+		// Work through this thread's own queue, then steal from the back of
+		// the others until every queue is empty.
+		for(int i=0; i<threads; i++){
+			const int q=(thread+i)%threads;
+			intnative_t task;
+			while((task=take_Task(queues, q, threads, i>0))>=0){
+				const double start=omp_get_wtime();
+				const intnative_t tree_Depth=tasks[task].tree_Depth;
+
+				if(!tasks[task].iterations){
+					// Create the long_Lived_Tree of depth maximum_Tree_Depth in
+					// the memory_Pool which was already previously used for
+					// the stretch_Tree, compute the long_Lived_Tree_Checksum,
+					// and then just leave the long_Lived_Tree alone for a
+					// while.
+					long_Lived_Tree=create_Tree(tree_Depth, memory_Pool);
+					long_Lived_Tree_Checksum=
+					  compute_Tree_Checksum(long_Lived_Tree);
+				}else{
+					// Create this task's binary trees of depth tree_Depth,
+					// compute their checksums, and add them to the checksum
+					// for that depth.
+					intnative_t total_Trees_Checksum=0;
+					for(intnative_t iterations=tasks[task].iterations;
+					  iterations-->0;){
+						apr_pool_clear(thread_Memory_Pool);
+						total_Trees_Checksum+=compute_Tree_Checksum(
+						  create_Tree(tree_Depth, thread_Memory_Pool));
+					}
+					#pragma omp atomic
+					tree_Checksums[(tree_Depth-minimum_Tree_Depth)/2]+=
+					  total_Trees_Checksum;
+				}
 
-			// Record the total_Trees_Checksum for the trees of depth
-			// tree_Depth.
-			tree_Checksums[(tree_Depth-minimum_Tree_Depth)/2]=
-			  total_Trees_Checksum;
+				busy_Times[thread]+=omp_get_wtime()-start;
+				tasks_Run[thread]++;
+				tasks_Stolen[thread]+=i>0;
+			}
 		}
 
 		apr_pool_destroy(thread_Memory_Pool);
@@ -158,6 +256,19 @@ int main(int argc, char *argv[]){
 	  (intmax_t)long_Lived_Tree_Checksum);
 	apr_pool_destroy(memory_Pool);
 
+	// Report how busy each thread was on stderr, so that any imbalance is
+	// visible without changing the normal output.
+	for(int thread=0; thread<threads; thread++)
+		fprintf(stderr, "thread %d busy %.3f s, %jd tasks, %jd stolen\n",
+		  thread, busy_Times[thread], (intmax_t)tasks_Run[thread],
+		  (intmax_t)tasks_Stolen[thread]);
+
+	free(tasks);
+	free(queues);
+	free(busy_Times);
+	free(tasks_Run);
+	free(tasks_Stolen);
+
 	apr_terminate();
 	return 0;
 }
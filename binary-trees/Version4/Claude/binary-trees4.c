@@ -6,11 +6,37 @@
  * modified by Dominique Wahli, Daniel Nanz, Joerg Baumann, and Jonathan Ultis
  */
 
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
+#include <inttypes.h>
+#include <string.h>
+#include <time.h>
 #include <pthread.h>
 #include <unistd.h>
+#include <dlfcn.h>
+#include <sys/resource.h>
+
+/* Node allocator, chosen at build time. With USE_ARENA=1 (the default)
+ * each thread bump-allocates nodes from its own arena and resets it after
+ * every tree, like the apr_pool_clear() pattern of the Human Version2
+ * without needing APR; -DUSE_ARENA=0 mallocs and frees every node. */
+#ifndef USE_ARENA
+#define USE_ARENA 1
+#endif
+
+/* Tree layout, chosen at build time. With IMPLICIT_TREE=1 a perfect tree
+ * of depth d is stored as its 2^(d+1)-1 nodes in level order, node i
+ * having children 2i+1 and 2i+2, so there are no pointers to chase and a
+ * tree is one buffer reused from tree to tree. A node is one byte marking
+ * it present. The default is the pointer tree. */
+#ifndef IMPLICIT_TREE
+#define IMPLICIT_TREE 0
+#endif
+
+/* Nodes per arena block */
+#define ARENA_BLOCK_NODES (1 << 16)
 
 /* Tree node structure */
 typedef struct node_t {
@@ -18,24 +44,114 @@ typedef struct node_t {
     struct node_t* right;
 } node_t;
 
+/* Arena block, kept across resets */
+typedef struct arena_block_t {
+    struct arena_block_t* next;
+    size_t used;
+    node_t nodes[ARENA_BLOCK_NODES];
+} arena_block_t;
+
+/* Allocation counters, reported per depth band with --stats */
+typedef struct {
+    uint64_t nodes;             /* Nodes handed out */
+    uint64_t mallocs;           /* Calls to malloc behind them */
+    uint64_t bytes;             /* Bytes asked of malloc */
+} alloc_stats_t;
+
+/* Arena of one thread: allocation goes on in current, and the blocks
+ * before it are full */
+typedef struct {
+    arena_block_t* first;
+    arena_block_t* current;
+    uint8_t* implicit;          /* Buffer for implicit trees */
+    size_t implicit_size;
+    alloc_stats_t stats;
+} arena_t;
+
 /* Thread task structure */
 typedef struct {
     int depth;
     int iterations;
     int64_t check_sum;
+    alloc_stats_t stats;
 } task_t;
 
-/* Create a binary tree of specified depth */
-node_t* make_tree(int depth) {
-    node_t* node = (node_t*)malloc(sizeof(node_t));
-    if (node == NULL) {
+static void add_stats(alloc_stats_t* total, const alloc_stats_t* stats) {
+    total->nodes += stats->nodes;
+    total->mallocs += stats->mallocs;
+    total->bytes += stats->bytes;
+}
+
+static void* checked_malloc(size_t size) {
+    void* p = malloc(size);
+    if (p == NULL) {
         fprintf(stderr, "Memory allocation failed\n");
         exit(1);
     }
+    return p;
+}
+
+void arena_init(arena_t* arena) {
+    arena->first = NULL;
+    arena->current = NULL;
+    arena->implicit = NULL;
+    arena->implicit_size = 0;
+    memset(&arena->stats, 0, sizeof(arena->stats));
+}
+
+/* Make every node of the arena free again, keeping its blocks */
+void arena_reset(arena_t* arena) {
+    for (arena_block_t* block = arena->first; block != NULL; block = block->next) {
+        block->used = 0;
+    }
+    arena->current = arena->first;
+}
+
+void arena_destroy(arena_t* arena) {
+    arena_block_t* block = arena->first;
+    while (block != NULL) {
+        arena_block_t* next = block->next;
+        free(block);
+        block = next;
+    }
+    free(arena->implicit);
+    arena_init(arena);
+}
+
+/* Allocate a node, from the arena or with malloc */
+static inline node_t* new_node(arena_t* arena) {
+    arena->stats.nodes++;
+#if USE_ARENA
+    arena_block_t* block = arena->current;
+    if (block == NULL || block->used == ARENA_BLOCK_NODES) {
+        /* Move on to the next kept block, or add one */
+        arena_block_t* next = block ? block->next : arena->first;
+        if (next == NULL) {
+            next = (arena_block_t*)checked_malloc(sizeof(arena_block_t));
+            arena->stats.mallocs++;
+            arena->stats.bytes += sizeof(arena_block_t);
+            next->next = NULL;
+            next->used = 0;
+            if (block) block->next = next;
+            else arena->first = next;
+        }
+        arena->current = block = next;
+    }
+    return &block->nodes[block->used++];
+#else
+    arena->stats.mallocs++;
+    arena->stats.bytes += sizeof(node_t);
+    return (node_t*)checked_malloc(sizeof(node_t));
+#endif
+}
+
+/* Create a binary tree of specified depth */
+node_t* make_tree(int depth, arena_t* arena) {
+    node_t* node = new_node(arena);
     
     if (depth > 0) {
-        node->left = make_tree(depth - 1);
-        node->right = make_tree(depth - 1);
+        node->left = make_tree(depth - 1, arena);
+        node->right = make_tree(depth - 1, arena);
     } else {
         node->left = NULL;
         node->right = NULL;
@@ -53,42 +169,115 @@ int check_tree(node_t* node) {
     }
 }
 
-/* Free memory used by a tree */
-void free_tree(node_t* node) {
+/* Free memory used by a tree, all at once with the arena */
+void free_tree(node_t* node, arena_t* arena) {
+#if USE_ARENA
+    (void)node;
+    arena_reset(arena);
+#else
     if (node == NULL) return;
     
     if (node->left != NULL) {
-        free_tree(node->left);
-        free_tree(node->right);
+        free_tree(node->left, arena);
+        free_tree(node->right, arena);
     }
     
     free(node);
+#endif
+}
+
+/* Create an implicit tree of specified depth in the arena's buffer */
+uint8_t* make_implicit_tree(int depth, arena_t* arena) {
+    size_t count = ((size_t)2 << depth) - 1;
+    
+    if (arena->implicit_size < count) {
+        free(arena->implicit);
+        arena->implicit = (uint8_t*)checked_malloc(count);
+        arena->implicit_size = count;
+        arena->stats.mallocs++;
+        arena->stats.bytes += count;
+    }
+    arena->stats.nodes += count;
+    for (size_t i = 0; i < count; i++) {
+        arena->implicit[i] = 1;
+    }
+    
+    return arena->implicit;
+}
+
+/* Check an implicit tree level by level: the children of one level are
+ * the next level, so no stack or recursion is needed */
+int check_implicit_tree(const uint8_t* nodes, int depth) {
+    size_t first = 0, width = 1;
+    int count = 0;
+    
+    for (int level = 0; level <= depth; level++) {
+        for (size_t i = first; i < first + width; i++) {
+            count += nodes[i];
+        }
+        first = 2 * first + 1;
+        width *= 2;
+    }
+    
+    return count;
 }
 
 /* Make and check a single tree */
-int make_check(int depth) {
-    node_t* tree = make_tree(depth);
+int make_check(int depth, arena_t* arena) {
+#if IMPLICIT_TREE
+    return check_implicit_tree(make_implicit_tree(depth, arena), depth);
+#else
+    node_t* tree = make_tree(depth, arena);
     int result = check_tree(tree);
-    free_tree(tree);
+    free_tree(tree, arena);
     return result;
+#endif
 }
 
 /* Thread function to make and check multiple trees */
 void* process_chunk(void* arg) {
     task_t* task = (task_t*)arg;
     int64_t sum = 0;
+    arena_t arena;
     
+    arena_init(&arena);
     for (int i = 0; i < task->iterations; i++) {
-        sum += make_check(task->depth);
+        sum += make_check(task->depth, &arena);
     }
+    task->stats = arena.stats;
+    arena_destroy(&arena);
     
     task->check_sum = sum;
     return NULL;
 }
 
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/* One line of the --stats report */
+static void report_band(const char* band, double seconds, const alloc_stats_t* stats) {
+    fprintf(stderr, "%-16s %9.3f s %12" PRIu64 " nodes %12" PRIu64 " mallocs %14" PRIu64
+            " bytes %12.4g nodes/s %12.4g mallocs/s\n", band, seconds, stats->nodes,
+            stats->mallocs, stats->bytes, stats->nodes / seconds, stats->mallocs / seconds);
+}
+
+/* The library malloc resolves to, which shows an LD_PRELOADed allocator
+ * such as jemalloc, mimalloc or tcmalloc when the build mallocs per node */
+static const char* allocator_name(void) {
+    Dl_info info;
+    void* symbol = dlsym(RTLD_DEFAULT, "malloc");
+    if (symbol != NULL && dladdr(symbol, &info) && info.dli_fname != NULL) {
+        return info.dli_fname;
+    }
+    return "unknown";
+}
+
 int main(int argc, char* argv[]) {
     if (argc < 2) {
-        fprintf(stderr, "Usage: %s <n>\n", argv[0]);
+        fprintf(stderr, "Usage: %s <n> [--stats]\n", argv[0]);
         return 1;
     }
     
@@ -98,22 +287,48 @@ int main(int argc, char* argv[]) {
     int stretch_depth = max_depth + 1;
     int mmd = max_depth + min_depth;
     
+    /* With --stats, time and count the allocations of every depth band
+     * and report them on stderr after the normal output */
+    int stats = argc > 2 && strcmp(argv[2], "--stats") == 0;
+    alloc_stats_t total_stats = {0, 0, 0};
+    double start = now(), band_start;
+    char band[32];
+    
     /* Calculate number of CPU cores available */
     int num_procs = sysconf(_SC_NPROCESSORS_ONLN);
     if (num_procs <= 0) num_procs = 1;
     
     /* Stretch tree */
     {
-        int stretch_check = make_check(stretch_depth);
+        arena_t arena;
+        arena_init(&arena);
+        band_start = now();
+        int stretch_check = make_check(stretch_depth, &arena);
+        if (stats) {
+            snprintf(band, sizeof(band), "stretch %d", stretch_depth);
+            report_band(band, now() - band_start, &arena.stats);
+            add_stats(&total_stats, &arena.stats);
+        }
+        arena_destroy(&arena);
         printf("stretch tree of depth %d\t check: %d\n", stretch_depth, stretch_check);
     }
     
-    /* Create long-lived tree */
-    node_t* long_lived_tree = make_tree(max_depth);
+    /* Create long-lived tree, in an arena of its own */
+    arena_t long_lived_arena;
+    arena_init(&long_lived_arena);
+    double long_lived_seconds = now();
+#if IMPLICIT_TREE
+    uint8_t* long_lived_tree = make_implicit_tree(max_depth, &long_lived_arena);
+#else
+    node_t* long_lived_tree = make_tree(max_depth, &long_lived_arena);
+#endif
+    long_lived_seconds = now() - long_lived_seconds;
     
     /* Process trees of different depths */
     for (int d = min_depth; d < stretch_depth; d += 2) {
         int iterations = 1 << (mmd - d);
+        alloc_stats_t band_stats = {0, 0, 0};
+        band_start = now();
         
         /* Determine how to parallelize the work */
         int num_threads = num_procs;
@@ -145,6 +360,13 @@ int main(int argc, char* argv[]) {
         for (int i = 0; i < num_threads; i++) {
             pthread_join(threads[i], NULL);
             total_check += tasks[i].check_sum;
+            add_stats(&band_stats, &tasks[i].stats);
+        }
+        
+        if (stats) {
+            snprintf(band, sizeof(band), "depth %d", d);
+            report_band(band, now() - band_start, &band_stats);
+            add_stats(&total_stats, &band_stats);
         }
         
         printf("%d\t trees of depth %d\t check: %ld\n", iterations, d, total_check);
@@ -155,9 +377,26 @@ int main(int argc, char* argv[]) {
     }
     
     /* Check long-lived tree */
+    band_start = now();
+#if IMPLICIT_TREE
+    printf("long lived tree of depth %d\t check: %d\n", 
+           max_depth, check_implicit_tree(long_lived_tree, max_depth));
+#else
     printf("long lived tree of depth %d\t check: %d\n", 
            max_depth, check_tree(long_lived_tree));
-    free_tree(long_lived_tree);
+    free_tree(long_lived_tree, &long_lived_arena);
+#endif
+    
+    if (stats) {
+        struct rusage usage;
+        snprintf(band, sizeof(band), "long lived %d", max_depth);
+        report_band(band, long_lived_seconds + now() - band_start, &long_lived_arena.stats);
+        add_stats(&total_stats, &long_lived_arena.stats);
+        report_band("total", now() - start, &total_stats);
+        getrusage(RUSAGE_SELF, &usage);
+        fprintf(stderr, "peak RSS %ld KB, malloc from %s\n", usage.ru_maxrss, allocator_name());
+    }
+    arena_destroy(&long_lived_arena);
     
     return 0;
 }
\ No newline at end of file
@@ -13,68 +13,93 @@
 
 #include <stdio.h>
 #include <stdint.h>
+#include <inttypes.h>
 #include <string.h>
+#include <unistd.h>
 #include <pthread.h>
-#include <smmintrin.h>  /* SSE 4.1 */
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>  /* SSE 4.1, AVX2 and AVX-512 kernels */
+#elif defined(__aarch64__)
+#include <arm_neon.h>
+#endif
+
+#include "cpu_dispatch.h"
 
 #define MAX_N 16
-#define MAX_BLOCKS 24
+// Guided scheduling: each claim takes the permutations left divided by
+// GUIDED_SHARE * threads, so blocks start large and shrink toward the end,
+// but never below the minimum block.  Blocks start on even indexes, which
+// the += / -= unrolling below relies on.
+#define GUIDED_SHARE 2
+#define MIN_BLOCK 1024
 #define ALIGN(n) __attribute__((aligned(n)))
 #define LIKELY(x) __builtin_expect(!!(x), 1)
 #define UNLIKELY(x) __builtin_expect(!!(x), 0)
 #define RAMP16 0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15
 
-static __m128i masks_shift[16] ALIGN(16);
 static uint64_t factorials[MAX_N + 1];
 
 struct fannkuch_data {
-  uint64_t block_start, block_size, block_end;
-  long long checksum;
-  unsigned max_flips, n, mutex;
+  uint64_t block_start, min_block, block_end;
+  unsigned n, nthreads;
 };
 
-static void* fannkuch_func(void* param) {
-  struct fannkuch_data *data = (struct fannkuch_data*)param;
-  long long checksum = 0;
-  unsigned max_flips = 0;
+// one per thread, on its own cache line; main reduces them after join
+struct fannkuch_thread {
+  struct fannkuch_data *data;
+  int64_t checksum;
+  unsigned max_flips;
+} ALIGN(64);
 
-  int n = data->n;
-  uint64_t block_size = data->block_size;
-  uint64_t block_end = data->block_end;
+// One kernel per instruction set, picked at startup through
+// harness/cpu_dispatch.h, so the binary needs no -march.  Each counts the
+// flips of the permutations [start, start + size) of n into *checksum and
+// *max_flips.
+typedef void (*block_func)(unsigned n, uint64_t start, uint64_t size,
+                           int64_t *checksum, unsigned *max_flips);
 
-  if (n < 1 || n > MAX_N) __builtin_unreachable();
+#if defined(__x86_64__) || defined(__i386__)
+static __m128i masks_shift[16] ALIGN(16);
 
-  // iterate over each block.
-  for (;;) {
-    uint64_t block_start = __sync_fetch_and_add(&data->block_start, block_size);
-    if (block_start >= block_end) break;
-
-    __m128i ramp = _mm_setr_epi8(RAMP16), current = ramp;
-	  __m128i c0 = _mm_setzero_si128();
-		__m128i count_vec = c0;
-    unsigned i = n;
-    {  
-	    uint64_t j = block_start;
-      __m128i v0, v1, v2, mask, c1 = _mm_set1_epi8(1);
-      mask = _mm_sub_epi8(ramp, _mm_set1_epi8(i));
-      while (i--) {
-        uint64_t d = j / factorials[i];
-        j -= d * factorials[i];
-        v2 = _mm_set1_epi8(d);
-				count_vec = _mm_alignr_epi8(count_vec, v2, 15);
-        v1 = _mm_add_epi8(ramp, v2);
-        v0 = _mm_add_epi8(mask, v2);  // ramp - i + d
-        v0 = _mm_blendv_epi8(v0, v1, v0);
-        v2 = _mm_shuffle_epi8(current, v0);
-        current = _mm_blendv_epi8(current, v2, mask);
-        mask = _mm_add_epi8(mask, c1);
-      }
-    }
+// current and count_vec of the generator at permutation j
+CPU_TARGET_SSE41
+static inline void start_permutation(unsigned n, uint64_t j, __m128i *current_out,
+                                     __m128i *count_out) {
+  __m128i ramp = _mm_setr_epi8(RAMP16), current = ramp;
+  __m128i count_vec = _mm_setzero_si128();
+  __m128i v0, v1, v2, mask, c1 = _mm_set1_epi8(1);
+  unsigned i = n;
 
-    // iterate over each permutation in the block.
-    uint64_t block_left = block_size;
+  if (n < 1 || n > MAX_N) __builtin_unreachable();
+  mask = _mm_sub_epi8(ramp, _mm_set1_epi8(i));
+  while (i--) {
+    uint64_t d = j / factorials[i];
+    j -= d * factorials[i];
+    v2 = _mm_set1_epi8(d);
+    count_vec = _mm_alignr_epi8(count_vec, v2, 15);
+    v1 = _mm_add_epi8(ramp, v2);
+    v0 = _mm_add_epi8(mask, v2);  // ramp - i + d
+    v0 = _mm_blendv_epi8(v0, v1, v0);
+    v2 = _mm_shuffle_epi8(current, v0);
+    current = _mm_blendv_epi8(current, v2, mask);
+    mask = _mm_add_epi8(mask, c1);
+  }
+  *current_out = current;
+  *count_out = count_vec;
+}
 
-    do {
+// The SSE kernel: one permutation at a time, flipped by pshufb.
+CPU_TARGET_SSE41
+static void flip_block_sse41(unsigned n, uint64_t start, uint64_t size,
+                             int64_t *checksum, unsigned *max_flips) {
+  const __m128i ramp = _mm_setr_epi8(RAMP16), c0 = _mm_setzero_si128();
+  __m128i current, count_vec;
+  int64_t sum = 0;
+  unsigned most = *max_flips;
+  uint64_t block_left = size;
+
+  start_permutation(n, start, &current, &count_vec);
+  do {
 			__m128i v0, v1, v2, v3;	unsigned i, first;
 #define X(op) \
 			v2 = current; \
@@ -96,37 +121,295 @@ static void* fannkuch_func(void* param) {
           first = _mm_cvtsi128_si32(v3); \
           flips++; \
         } while (UNLIKELY(first & 0xff)); \
-        checksum op flips; \
-        if (flips > max_flips) max_flips = flips; \
+        sum op flips; \
+        if (flips > most) most = flips; \
       }
 			X(+=) if (UNLIKELY(block_left == 1)) break; X(-=)
-    } while (LIKELY(block_left -= 2));
+#undef X
+  } while (LIKELY(block_left -= 2));
+
+  *checksum += sum;
+  *max_flips = most;
+}
+
+// Wide kernels: the flip loop runs on 2 (AVX2) or 4 (AVX-512BW)
+// permutations at once, one per 128-bit lane, as pshufb shuffles within
+// lanes.  A lane whose first element reached 0 flips with the identity
+// and stays at 0, so it idles until the last lane is done, and its flips
+// are only counted while it is active.  Batches start at even indexes,
+// so the lanes alternate +, -; lanes past the end of the block hold the
+// identity, which has no flips.
+
+// advance the permutation generator, returning the permutation it was at;
+// the same steps as the head of X(op) above
+CPU_TARGET_SSE41
+static inline __m128i next_permutation(__m128i *current, __m128i *count_vec) {
+  const __m128i ramp = _mm_setr_epi8(RAMP16);
+  __m128i v0, v1, p = *current;
+  unsigned i;
+  v0 = _mm_sub_epi8(*count_vec, ramp);
+  i = __builtin_ctz(_mm_movemask_epi8(v0) | 0x8000);  // past the last permutation of 16
+  v0 = _mm_set1_epi8(i);
+  v1 = _mm_andnot_si128(_mm_cmpgt_epi8(v0, ramp), *count_vec);
+  *count_vec = _mm_sub_epi8(v1, _mm_cmpeq_epi8(v0, ramp));
+  *current = _mm_shuffle_epi8(*current, masks_shift[i]);
+  return p;
+}
+
+CPU_TARGET_AVX2
+static void flip_block_avx2(unsigned n, uint64_t start, uint64_t left,
+                            int64_t *checksum, unsigned *max_flips) {
+  const __m128i ramp1 = _mm_setr_epi8(RAMP16);
+  const __m256i ramp = _mm256_setr_epi8(RAMP16, RAMP16), c0 = _mm256_setzero_si256();
+  __m128i current, count_vec;
+  int64_t sum = 0;
+  unsigned most = *max_flips;
+
+  start_permutation(n, start, &current, &count_vec);
+  for (; left; left -= left < 2 ? left : 2) {
+    __m128i p0 = next_permutation(&current, &count_vec);
+    __m128i p1 = left > 1 ? next_permutation(&current, &count_vec) : ramp1;
+    __m256i v0, v2 = _mm256_set_m128i(p1, p0);
+    __m256i v3 = _mm256_shuffle_epi8(v2, c0), flips = c0;
+    while (!_mm256_testz_si256(v3, v3)) {
+      v0 = _mm256_sub_epi8(v3, ramp);
+      flips = _mm256_sub_epi8(flips, _mm256_cmpgt_epi8(v3, c0));
+      v3 = _mm256_shuffle_epi8(v2, v3);
+      v0 = _mm256_blendv_epi8(v0, ramp, v0);
+      v2 = _mm256_shuffle_epi8(v2, v0);
+    }
+    unsigned f0 = _mm256_extract_epi8(flips, 0), f1 = _mm256_extract_epi8(flips, 16);
+    sum += (int)f0 - (int)f1;
+    if (f0 > most) most = f0;
+    if (f1 > most) most = f1;
   }
 
-  __sync_add_and_fetch(&data->checksum, checksum);
-  while (__sync_lock_test_and_set(&data->mutex, 1));
-  if (data->max_flips < max_flips) data->max_flips = max_flips;
-  __sync_lock_release(&data->mutex);
-  return NULL;
+  *checksum += sum;
+  *max_flips = most;
 }
 
-#define MAX_THREADS 64
+CPU_TARGET_AVX512
+static void flip_block_avx512(unsigned n, uint64_t start, uint64_t left,
+                              int64_t *checksum, unsigned *max_flips) {
+  const __m128i ramp1 = _mm_setr_epi8(RAMP16);
+  const __m512i ramp = _mm512_broadcast_i32x4(ramp1), c0 = _mm512_setzero_si512();
+  const __m512i c1 = _mm512_set1_epi8(1);
+  __m128i current, count_vec;
+  int64_t sum = 0;
+  unsigned most = *max_flips;
 
-int main(int argc, char **argv) {   
-  int i, n, nthreads = 4; uint64_t tmp = 1;
+  start_permutation(n, start, &current, &count_vec);
+  for (; left; left -= left < 4 ? left : 4) {
+    __m128i p0 = next_permutation(&current, &count_vec);
+    __m128i p1 = left > 1 ? next_permutation(&current, &count_vec) : ramp1;
+    __m128i p2 = left > 2 ? next_permutation(&current, &count_vec) : ramp1;
+    __m128i p3 = left > 3 ? next_permutation(&current, &count_vec) : ramp1;
+    __m512i v0, v2 = _mm512_castsi128_si512(p0);
+    v2 = _mm512_inserti32x4(v2, p1, 1);
+    v2 = _mm512_inserti32x4(v2, p2, 2);
+    v2 = _mm512_inserti32x4(v2, p3, 3);
+    __m512i v3 = _mm512_shuffle_epi8(v2, c0), flips = c0;
+    __mmask64 active;
+    while ((active = _mm512_test_epi8_mask(v3, v3))) {
+      v0 = _mm512_sub_epi8(v3, ramp);
+      flips = _mm512_mask_add_epi8(flips, active, flips, c1);
+      v3 = _mm512_shuffle_epi8(v2, v3);
+      v0 = _mm512_mask_blend_epi8(_mm512_movepi8_mask(v0), v0, ramp);
+      v2 = _mm512_shuffle_epi8(v2, v0);
+    }
+    uint8_t f[64] ALIGN(64);
+    _mm512_store_si512(f, flips);
+    sum += (int)f[0] - (int)f[16] + (int)f[32] - (int)f[48];
+    for (int lane = 0; lane < 64; lane += 16)
+      if (f[lane] > most) most = f[lane];
+  }
+
+  *checksum += sum;
+  *max_flips = most;
+}
+
+#endif
+
+// flips of perm, of n elements with perm[0] != 0, each a reversal of the
+// prefix
+static inline unsigned count_flips_scalar(const uint8_t *perm, unsigned n) {
+  uint8_t p[MAX_N];
+  unsigned flips = 0, first = perm[0];
+  memcpy(p, perm, n);
+  do {
+    for (unsigned lo = 0, hi = first; lo < hi; lo++, hi--) {
+      uint8_t t = p[lo];
+      p[lo] = p[hi];
+      p[hi] = t;
+    }
+    flips++;
+    first = p[0];
+  } while (first);
+  return flips;
+}
+
+// The portable kernels: the generator of the SSE kernel on byte arrays,
+// with count_flips for the flips.  Inlined into each kernel, so the call
+// through count_flips is direct.
+static inline __attribute__((always_inline)) void
+flip_block_bytes(unsigned n, uint64_t start, uint64_t size, int64_t *checksum,
+                 unsigned *max_flips,
+                 unsigned (*count_flips)(const uint8_t *perm, unsigned n)) {
+  uint8_t perm[MAX_N], count[MAX_N], p[MAX_N];
+  int64_t sum = 0;
+  unsigned most = *max_flips, i, k;
+  uint64_t j = start;
+
+  for (i = 0; i < n; i++) perm[i] = i;
+  for (i = n - 1; i > 0; i--) {
+    unsigned d = j / factorials[i];
+    j -= d * factorials[i];
+    count[i] = d;
+    memcpy(p, perm, i + 1);
+    for (k = 0; k <= i; k++) perm[k] = p[k + d <= i ? k + d : k + d - i - 1];
+  }
+
+  for (uint64_t index = 0;; index++) {
+    unsigned first = perm[0];
+    if (first) {
+      unsigned flips = count_flips(perm, n);
+      sum += index & 1 ? -(int64_t)flips : flips;
+      if (flips > most) most = flips;
+    }
+    if (index + 1 == size) break;
+
+    // rotate the first i + 1 elements left while the counts carry
+    first = perm[1];
+    perm[1] = perm[0];
+    perm[0] = first;
+    for (i = 1; ++count[i] > i; i++) {
+      count[i] = 0;
+      unsigned next = perm[0] = perm[1];
+      for (k = 1; k <= i; k++) perm[k] = perm[k + 1];
+      perm[i + 1] = first;
+      first = next;
+    }
+  }
+
+  *checksum += sum;
+  *max_flips = most;
+}
+
+// The scalar kernel, for CPUs without SSSE3 or NEON.
+static void flip_block_scalar(unsigned n, uint64_t start, uint64_t size,
+                              int64_t *checksum, unsigned *max_flips) {
+  flip_block_bytes(n, start, size, checksum, max_flips, count_flips_scalar);
+}
+
+#if defined(__aarch64__)
+// The NEON kernel: the flips of the scalar one as tbl lookups, which
+// reverse the prefix up to first and keep the rest, like the pshufb of
+// the SSE kernel.
+static inline unsigned count_flips_neon(const uint8_t *perm, unsigned n) {
+  static const uint8_t ramp_bytes[16] = {RAMP16};
+  const uint8x16_t ramp = vld1q_u8(ramp_bytes);
+  uint8_t bytes[16] = {0};
+  memcpy(bytes, perm, n);
+  uint8x16_t p = vld1q_u8(bytes);
+  unsigned flips = 0, first = perm[0];
+  do {
+    uint8x16_t k = vdupq_n_u8(first);
+    uint8x16_t reverse = vsubq_u8(k, ramp);
+    p = vqtbl1q_u8(p, vbslq_u8(vcleq_u8(ramp, k), reverse, ramp));
+    flips++;
+    first = vgetq_lane_u8(p, 0);
+  } while (first);
+  return flips;
+}
+
+static void flip_block_neon(unsigned n, uint64_t start, uint64_t size,
+                            int64_t *checksum, unsigned *max_flips) {
+  flip_block_bytes(n, start, size, checksum, max_flips, count_flips_neon);
+}
+#endif
+
+// best first
+static const struct fannkuch_kernel {
+  cpu_level level;
+  block_func flip_block;
+} kernels[] = {
+#if defined(__x86_64__) || defined(__i386__)
+  {CPU_AVX512, flip_block_avx512},
+  {CPU_AVX2, flip_block_avx2},
+  {CPU_SSE41, flip_block_sse41},
+#elif defined(__aarch64__)
+  {CPU_NEON, flip_block_neon},
+#endif
+  {CPU_SCALAR, flip_block_scalar},
+};
+static block_func flip_block;
+
+// claim the next block [*start, *start + *size), or return 0 when done
+static int claim_block(struct fannkuch_data *data, uint64_t *start, uint64_t *size) {
+  uint64_t begin = data->block_start, seen, take;
+  for (;;) {
+    if (begin >= data->block_end) return 0;
+    take = (data->block_end - begin) / (GUIDED_SHARE * data->nthreads) & ~(uint64_t)1;
+    if (take < data->min_block) take = data->min_block;
+    if (take > data->block_end - begin) take = data->block_end - begin;
+    seen = __sync_val_compare_and_swap(&data->block_start, begin, begin + take);
+    if (seen == begin) break;
+    begin = seen;
+  }
+  *start = begin;
+  *size = take;
+  return 1;
+}
+
+static void* fannkuch_func(void* param) {
+  struct fannkuch_thread *thread = (struct fannkuch_thread*)param;
+  struct fannkuch_data *data = thread->data;
+  int64_t checksum = 0;
+  unsigned max_flips = 0;
+
+  uint64_t block_start, block_size;
+
+  while (claim_block(data, &block_start, &block_size))
+    flip_block(data->n, block_start, block_size, &checksum, &max_flips);
+
+  thread->checksum = checksum;
+  thread->max_flips = max_flips;
+  return NULL;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+// masks_shift[i] rotates the first i + 2 elements left by one
+CPU_TARGET_SSE41
+static void init_masks(void) {
   __m128i ramp = _mm_setr_epi8(RAMP16);
   __m128i c1 = _mm_set1_epi8(1), v0, v1, v2;
   __m128i ramp1 = _mm_bsrli_si128(ramp, 1), old = ramp;
-  factorials[0] = 1;
+  int i;
   v0 = _mm_sub_epi8(_mm_setzero_si128(), ramp);
   for (i = 0; i < MAX_N; v0 = _mm_add_epi8(v0, c1)) {
     v2 = _mm_blendv_epi8(v0, ramp, v0);
 		v1 = _mm_blendv_epi8(ramp1, v2, _mm_sub_epi8(v0, c1));
 		old = _mm_shuffle_epi8(old, v1);
-    masks_shift[i] = old;
-		tmp *= ++i;
-		factorials[i] = tmp;
+    masks_shift[i++] = old;
   }
+}
+#endif
+
+#define MAX_THREADS 256
+
+int main(int argc, char **argv) {   
+  int i, n, nthreads = sysconf(_SC_NPROCESSORS_ONLN); uint64_t tmp = 1;
+  const struct fannkuch_kernel *kernel = CPU_PICK(kernels, NULL);
+  factorials[0] = 1;
+  for (i = 0; i < MAX_N;) {
+    tmp *= ++i;
+    factorials[i] = tmp;
+  }
+
+  flip_block = kernel->flip_block;
+#if defined(__x86_64__) || defined(__i386__)
+  if (kernel->level != CPU_SCALAR) init_masks();
+#endif
 
   if (argc > 2 && !strcmp(argv[1], "-t"))
     argc -= 2, argv += 2, nthreads = atoi(*argv);
@@ -137,18 +420,31 @@ int main(int argc, char **argv) {
     struct fannkuch_data data = { 0 };
     uint64_t block_end;
     pthread_t buf[MAX_THREADS];
+    struct fannkuch_thread threads[MAX_THREADS];
+    int64_t checksum = 0;
+    unsigned max_flips = 0;
 
     data.n = n = atoi(*++argv);
     if (n < 1 || n > MAX_N) return 1;
 
+    // the tail blocks are a small fraction of each thread's share, and
+    // large enough that decoding the block start costs nothing
     block_end = factorials[n];
-    data.block_size = block_end / (block_end > MAX_BLOCKS ? MAX_BLOCKS : 1);
+    data.min_block = block_end / ((uint64_t)nthreads * 1024) & ~(uint64_t)1;
+    if (data.min_block < MIN_BLOCK) data.min_block = MIN_BLOCK;
     data.block_end = block_end;
+    data.nthreads = nthreads;
 
+    for (i = 0; i < nthreads; i++) threads[i].data = &data;
     for (i = 1; i < nthreads; i++)
-      pthread_create(buf + i, NULL, fannkuch_func, &data);
-    fannkuch_func(&data);
+      pthread_create(buf + i, NULL, fannkuch_func, threads + i);
+    fannkuch_func(threads);
     for (i = 1; i < nthreads; i++) pthread_join(buf[i], NULL);
-    printf("%lld\nPfannkuchen(%u) = %u\n", data.checksum, n, data.max_flips);
+
+    for (i = 0; i < nthreads; i++) {
+      checksum += threads[i].checksum;
+      if (threads[i].max_flips > max_flips) max_flips = threads[i].max_flips;
+    }
+    printf("%" PRId64 "\nPfannkuchen(%u) = %u\n", checksum, n, max_flips);
   }
 }
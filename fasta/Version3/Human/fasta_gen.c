@@ -0,0 +1,494 @@
+/* The Computer Language Benchmarks Game
+ * https://salsa.debian.org/benchmarksgame-team/benchmarksgame/
+ *
+ * This benchmark uses a lookup table for the symbolic codes from the
+ * output space of the random number generator, so in the case of an
+ * random number generator with a modest number of outputs (the modulo
+ * IM in this case), the table even fits in CPU cache.  For a
+ * different random number generator with much larger number of output
+ * states this strategy could still be used up to around 32 bits, but
+ * then gets impractical.
+ *
+ * Using a table like this avoids using an iterative and branching
+ * algorithm (whether linear or logarithmic tree-based).  This
+ * eliminates several instructions in the innermost loops, as well as
+ * elimnating pipeline busting decisions in those same loops and
+ * better instructions per cycle.
+
+ * The preprocessor random number generator allows the compiler to
+ * optimize across both the memory address calculations for the output
+ * buffer, the hash, and the random number generator.  In particular,
+ * the modulo disappears and the constants are changed, but the
+ * results are equivalent and faster.
+ *
+ * perf stat
+ *  2,904,895,668      cycles                    #    4.306 GHz
+ *  3,511,967,349      instructions              #    1.21  insn per cycle
+ *
+ * About 3/4 of time is spent in the table lookups and a little under
+ * 1/4 in the random number generation. 2 sourcecode lines, 5 instructions.
+ *
+ * The main suboptimality in this code is that the memory operations
+ * are single byte on 32 and 64 bit architectures, and the random
+ * number generation is also just 32 bit on machines with at least 64
+ * bit operations (and up to 512 bits). The instructions per cycle is
+ * good, but not great (above 2.0), so 2-4x performance should be
+ * possible with possibly explicit loop unwinding, larger data types,
+ * and random number generator sequence skipping.  Attempts along this
+ * line have not been fruitful yet, and they will be significantly more 
+ * complex than this.
+ *  Adding random number sequence fast skipping would also allow a threading
+ * speedup, though it my be limited by memory bandwidth.
+ *
+ * The random number sequence can be skipped ahead in O(log n) steps by
+ * composing the affine map seed -> seed*IA + IC with itself by repeated
+ * squaring (lcg_skip below).  Each buffer of BUFLINES lines starts at a
+ * known seed, so with OpenMP the buffers are filled in parallel and
+ * written in order.  The output is the same as the serial version.
+ *
+ * With AVX2 a buffer is filled by 32 interleaved streams in 32 bit
+ * lanes of 4 vectors, lane k producing characters k, k+32, k+64, ... by
+ * stepping its seed 32 times at once (fill_lines_avx2 below).  Each
+ * step is a long dependency chain, so the 4 independent vectors keep
+ * the multipliers busy.  The step multiplier is split so every product
+ * fits in 32 bits, the modulo is a float reciprocal multiply with a +-IM
+ * correction, and the hash lookups are gathers.  The characters are
+ * written 8 at a time to a scratch stream and copied out in whole 60
+ * column lines.
+ *
+ * The generator is a library (fasta_gen.h) that fills any byte range of
+ * the output.  The repeated sequence is indexed directly and the random
+ * ones are skipped ahead to the first line of the range, so ranges can
+ * be filled independently, straight into a caller's buffer or a mapped
+ * file, and several copies can share one generation pass.
+ *
+ * by Drake Diedrich
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#ifdef __AVX2__
+#include <immintrin.h>
+#endif
+
+#include "fasta_gen.h"
+
+#define IM 139968
+#define IA   3877
+#define IC  29573
+#define SEED   42
+#define lcg_next(s) ( (s) = ((s) * IA + IC ) % IM )
+
+/* the affine map seed -> a*seed + c for steps applications of the
+ * generator, built by repeated squaring */
+static void lcg_power(uint64_t steps, uint32_t *a_out, uint32_t *c_out) {
+  uint64_t a = 1, c = 0;
+  uint64_t step_a = IA, step_c = IC;
+  for (; steps; steps >>= 1) {
+    if (steps & 1) {
+      a = (a * step_a) % IM;
+      c = (c * step_a + step_c) % IM;
+    }
+    step_c = (step_c * step_a + step_c) % IM;
+    step_a = (step_a * step_a) % IM;
+  }
+  *a_out = a;
+  *c_out = c;
+}
+
+/* seed after steps more random numbers */
+static uint32_t lcg_skip(const uint32_t s, const uint64_t steps) {
+  uint32_t a, c;
+  lcg_power(steps, &a, &c);
+  return ((uint64_t)a * s + c) % IM;
+}
+
+/* tune up or down to adjust speed vs memory/cache tradeoffs */
+#ifndef BUFLINES
+#define BUFLINES 100
+#endif
+
+/* bytes generated per task when writing fds and files */
+#define CHUNK_SIZE (1 << 20)
+
+static const char *alu =
+  "GGCCGGGCGCGGTGGCTCACGCCTGTAATCCCAGCACTTTGG"
+  "GAGGCCGAGGCGGGCGGATCACCTGAGGTCAGGAGTTCGAGA"
+  "CCAGCCTGGCCAACATGGTGAAACCCCGTCTCTACTAAAAAT"
+  "ACAAAAATTAGCCGGGCGTGGTGGCGCGCGCCTGTAATCCCA"
+  "GCTACTCGGGAGGCTGAGGCAGGAGAATCGCTTGAACCCGGG"
+  "AGGCGGAGGTTGCAGTGAGCCGAGATCGCGCCACTGCACTCC"
+  "AGCCTGGGCGACAGAGCGAGACTCCGTCTCAAAAA";
+
+static const char *iub = "acgtBDHKMNRSVWY";
+static const float iub_p[] = {
+  0.27,
+  0.12,
+  0.12,
+  0.27,
+  0.02,
+  0.02,
+  0.02,
+  0.02,
+  0.02,
+  0.02,
+  0.02,
+  0.02,
+  0.02,
+  0.02,
+  0.02 };
+
+static const char *homosapiens = "acgt";
+static const float homosapiens_p[] = {
+  0.3029549426680,
+  0.1979883004921,
+  0.1975473066391,
+  0.3015094502008
+};
+
+#define LINELEN 60
+
+static const char header1[] = ">ONE Homo sapiens alu\n";
+static const char header2[] = ">TWO IUB ambiguity codes\n";
+static const char header3[] = ">THREE Homo sapiens frequency\n";
+
+static char * build_hash(const char *symb,const float *probability) {
+  int i,j;
+  char *hash = malloc(IM+3); /* gathers read 4 bytes at hash+v */
+  if (!hash) exit(-1);
+  float sum = 0.0;
+  const int len = strlen(symb);
+  sum = probability[0];
+  for (i=0,j=0;i<IM && j<len;i++) {
+    float r = 1.0 * i / IM;
+    if (r>=sum) {
+      j++;
+      sum += probability[j];
+    }
+    hash[i] = symb[j];
+  }
+  return hash;
+}
+
+/* alu twice over, so every line of the repeat is one contiguous copy */
+static char *alu_twice;
+static size_t alu_len;
+static char *iub_hash, *homosapiens_hash;
+static pthread_once_t tables_once = PTHREAD_ONCE_INIT;
+
+static void build_tables(void) {
+  alu_len = strlen(alu);
+  alu_twice = malloc(2*alu_len);
+  if (!alu_twice) exit(-1);
+  memcpy(alu_twice, alu, alu_len);
+  memcpy(alu_twice+alu_len, alu, alu_len);
+  iub_hash = build_hash(iub, iub_p);
+  homosapiens_hash = build_hash(homosapiens, homosapiens_p);
+}
+
+/* one of the three sequences: a header, then chars characters in lines
+ * of LINELEN, each ended by a newline */
+struct section {
+  const char *header;
+  uint64_t header_len;
+  uint64_t chars;
+  const char *hash;  /* NULL for the alu repeat */
+  uint32_t seed;     /* seed before the first character */
+};
+
+static void get_sections(int64_t n, struct section sec[3]) {
+  if (n < 0) n = 0;
+  sec[0] = (struct section){ header1, sizeof(header1)-1, (uint64_t)n*2, NULL, 0 };
+  sec[1] = (struct section){ header2, sizeof(header2)-1, (uint64_t)n*3, iub_hash, SEED };
+  sec[2] = (struct section){ header3, sizeof(header3)-1, (uint64_t)n*5, homosapiens_hash,
+			     lcg_skip(SEED, (uint64_t)n*3) };
+}
+
+static uint64_t body_bytes(const uint64_t chars) {
+  return chars + (chars + LINELEN - 1) / LINELEN;
+}
+
+#ifdef __AVX2__
+/* x % IM for 8 lanes of x < 2^29: the float quotient is off by at most
+ * one, which the compares correct */
+static inline __m256i mod_im_avx2(const __m256i x) {
+  const __m256i im = _mm256_set1_epi32(IM);
+  const __m256 inv_im = _mm256_set1_ps(1.0f / IM);
+  __m256i q = _mm256_cvttps_epi32(_mm256_mul_ps(_mm256_cvtepi32_ps(x), inv_im));
+  __m256i r = _mm256_sub_epi32(x, _mm256_mullo_epi32(q, im));
+  r = _mm256_add_epi32(r, _mm256_and_si256(_mm256_cmpgt_epi32(_mm256_setzero_si256(), r), im));
+  r = _mm256_sub_epi32(r, _mm256_andnot_si256(_mm256_cmpgt_epi32(im, r), im));
+  return r;
+}
+
+#define STREAM_VECTORS 4
+#define STREAMS (8*STREAM_VECTORS)
+
+/* fill lines (at most BUFLINES) of characters into buffer starting from
+ * seed s, STREAMS characters per step */
+static void fill_lines_avx2(char *buffer, const int lines, uint32_t s, const char *hash) {
+  char stream[BUFLINES*LINELEN + STREAMS];
+  uint32_t a, c, first[STREAMS];
+  __m256i v[STREAM_VECTORS];
+  int j, k;
+
+  /* lane k starts at the seed for character k and steps STREAMS at a
+   * time; a = a_hi*512 + a_lo keeps each product below 2^27 */
+  lcg_power(STREAMS, &a, &c);
+  for (j=0; j<STREAMS; j++) first[j] = lcg_next(s);
+  for (k=0; k<STREAM_VECTORS; k++)
+    v[k] = _mm256_loadu_si256((const __m256i *)(first+8*k));
+  const __m256i a_hi = _mm256_set1_epi32(a >> 9);
+  const __m256i a_lo = _mm256_set1_epi32(a & 511);
+  const __m256i c_v = _mm256_set1_epi32(c);
+  const __m256i low_bytes = _mm256_setr_epi8(
+    0, 4, 8, 12, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    0, 4, 8, 12, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1);
+  const __m256i low_dwords = _mm256_setr_epi32(0, 4, 0, 0, 0, 0, 0, 0);
+
+  for (j=0; j<lines*LINELEN; j+=STREAMS) {
+    for (k=0; k<STREAM_VECTORS; k++) {
+      __m256i symbols = _mm256_i32gather_epi32((const int *)hash, v[k], 1);
+      symbols = _mm256_permutevar8x32_epi32(_mm256_shuffle_epi8(symbols, low_bytes), low_dwords);
+      _mm_storel_epi64((__m128i *)(stream+j+8*k), _mm256_castsi256_si128(symbols));
+
+      const __m256i high = mod_im_avx2(_mm256_mullo_epi32(v[k], a_hi));
+      v[k] = mod_im_avx2(_mm256_add_epi32(_mm256_add_epi32(_mm256_slli_epi32(high, 9),
+							      _mm256_mullo_epi32(v[k], a_lo)),
+					   c_v));
+    }
+  }
+
+  for (j=0; j<lines; j++)
+    memcpy(buffer+j*(LINELEN+1), stream+j*LINELEN, LINELEN);
+}
+#endif
+
+/* write count whole lines of sec, from line onwards, to out */
+static void body_lines(const struct section *sec, uint64_t line, uint64_t count, char *out) {
+  int j;
+
+  if (!sec->hash) {
+    for (; count; count--, line++, out += LINELEN+1) {
+      memcpy(out, alu_twice + line*LINELEN % alu_len, LINELEN);
+      out[LINELEN] = '\n';
+    }
+    return;
+  }
+
+  /* blocks of BUFLINES lines, each from its own skipped-ahead seed */
+  while (count) {
+    const int lines = count < BUFLINES ? count : BUFLINES;
+    uint32_t s = lcg_skip(sec->seed, line*LINELEN);
+#ifdef __AVX2__
+    fill_lines_avx2(out, lines, s, sec->hash);
+#else
+    for (j=0;j<lines;j++) {
+      for (int k=0; k<LINELEN;k++) {
+	uint32_t v = lcg_next(s);
+	out[j*(LINELEN+1)+k] = sec->hash[v];
+      }
+    }
+#endif
+    for (j=0; j<lines; j++) out[j*(LINELEN+1)+LINELEN] = '\n';
+    line += lines;
+    count -= lines;
+    out += lines*(LINELEN+1);
+  }
+}
+
+/* write line of sec, which may be the short last one, to out and
+ * return its length including the newline */
+static int body_line(const struct section *sec, const uint64_t line, char *out) {
+  const uint64_t left = sec->chars - line*LINELEN;
+  const int len = left < LINELEN ? left : LINELEN;
+  int k;
+
+  if (!sec->hash) {
+    memcpy(out, alu_twice + line*LINELEN % alu_len, len);
+  } else {
+    uint32_t s = lcg_skip(sec->seed, line*LINELEN);
+    for (k=0; k<len; k++) {
+      uint32_t v = lcg_next(s);
+      out[k] = sec->hash[v];
+    }
+  }
+  out[len] = '\n';
+  return len+1;
+}
+
+/* fill bytes [from, to) of the body of sec into out: whole lines go
+ * straight to out, partial ones through a line buffer */
+static void fill_body(const struct section *sec, uint64_t from, const uint64_t to, char *out) {
+  const uint64_t whole_lines = sec->chars / LINELEN;
+  char line_buffer[LINELEN+1];
+
+  while (from < to) {
+    const uint64_t line = from / (LINELEN+1);
+    const uint64_t column = from % (LINELEN+1);
+    if (column == 0 && line < whole_lines) {
+      uint64_t count = (to - from) / (LINELEN+1);
+      if (count > whole_lines - line) count = whole_lines - line;
+      if (count) {
+	body_lines(sec, line, count, out);
+	from += count*(LINELEN+1);
+	out += count*(LINELEN+1);
+	continue;
+      }
+    }
+    uint64_t take = body_line(sec, line, line_buffer) - column;
+    if (take > to - from) take = to - from;
+    memcpy(out, line_buffer + column, take);
+    from += take;
+    out += take;
+  }
+}
+
+uint64_t fasta_size(int64_t n) {
+  struct section sec[3];
+  uint64_t size = 0;
+  get_sections(n, sec);
+  for (int i=0; i<3; i++) size += sec[i].header_len + body_bytes(sec[i].chars);
+  return size;
+}
+
+void fasta_fill(int64_t n, uint64_t offset, char *out, size_t len) {
+  struct section sec[3];
+  const uint64_t end = offset + len;
+  uint64_t start = 0;
+
+  pthread_once(&tables_once, build_tables);
+  get_sections(n, sec);
+
+  for (int i=0; i<3 && offset<end; i++) {
+    uint64_t stop = start + sec[i].header_len;
+    if (offset < stop) {
+      if (stop > end) stop = end;
+      memcpy(out, sec[i].header + (offset - start), stop - offset);
+      out += stop - offset;
+      offset = stop;
+    }
+    start += sec[i].header_len;
+
+    stop = start + body_bytes(sec[i].chars);
+    if (offset < stop && offset < end) {
+      if (stop > end) stop = end;
+      fill_body(&sec[i], offset - start, stop - start, out);
+      out += stop - offset;
+      offset = stop;
+    }
+    start += body_bytes(sec[i].chars);
+  }
+}
+
+void fasta_fill_many(int64_t n, uint64_t offset, char *const outs[],
+		     int count, size_t len) {
+  if (count <= 0) return;
+
+  /* copy each piece while it is still in cache */
+  for (size_t done = 0; done < len; ) {
+    const size_t take = len - done < CHUNK_SIZE ? len - done : CHUNK_SIZE;
+    fasta_fill(n, offset + done, outs[0] + done, take);
+    for (int i=1; i<count; i++) memcpy(outs[i] + done, outs[0] + done, take);
+    done += take;
+  }
+}
+
+/* 0 or the errno of the failed write */
+static int write_all(const int fd, const char *buffer, size_t len) {
+  while (len) {
+    const ssize_t written = write(fd, buffer, len);
+    if (written < 0) {
+      if (errno == EINTR) continue;
+      return errno;
+    }
+    buffer += written;
+    len -= written;
+  }
+  return 0;
+}
+
+int fasta_write_fd(int fd, int64_t n) {
+  const uint64_t size = fasta_size(n);
+  const int64_t chunks = (size + CHUNK_SIZE - 1) / CHUNK_SIZE;
+  int error = 0;
+
+  /* chunks are generated in parallel; ordered keeps the writes in
+   * sequence */
+#pragma omp parallel
+  {
+    char *buffer = malloc(CHUNK_SIZE);
+    if (!buffer) exit(-1);
+#pragma omp for ordered schedule(static,1)
+    for (int64_t i=0; i<chunks; i++) {
+      const uint64_t offset = (uint64_t)i*CHUNK_SIZE;
+      const size_t len = size - offset < CHUNK_SIZE ? size - offset : CHUNK_SIZE;
+      fasta_fill(n, offset, buffer, len);
+#pragma omp ordered
+      if (!error) error = write_all(fd, buffer, len);
+    }
+    free(buffer);
+  }
+
+  if (error) {
+    errno = error;
+    return -1;
+  }
+  return 0;
+}
+
+int fasta_write_files(int64_t n, const char *const paths[], int count) {
+  const uint64_t size = fasta_size(n);
+  const int64_t chunks = (size + CHUNK_SIZE - 1) / CHUNK_SIZE;
+  char **maps = calloc(count > 0 ? count : 1, sizeof(char *));
+  int i, error = 0;
+  if (!maps) exit(-1);
+
+  for (i=0; i<count && !error; i++) {
+    const int fd = open(paths[i], O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+      error = errno;
+      break;
+    }
+    if (ftruncate(fd, size) == 0) {
+      void *map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+      if (map == MAP_FAILED) error = errno;
+      else maps[i] = map;
+    } else {
+      error = errno;
+    }
+    close(fd);
+  }
+
+  if (!error && count > 0) {
+#pragma omp parallel
+    {
+      char **outs = malloc(count * sizeof(char *));
+      if (!outs) exit(-1);
+#pragma omp for schedule(dynamic)
+      for (int64_t c=0; c<chunks; c++) {
+	const uint64_t offset = (uint64_t)c*CHUNK_SIZE;
+	const size_t len = size - offset < CHUNK_SIZE ? size - offset : CHUNK_SIZE;
+	for (int j=0; j<count; j++) outs[j] = maps[j] + offset;
+	fasta_fill_many(n, offset, outs, count, len);
+      }
+      free(outs);
+    }
+  }
+
+  for (i=0; i<count; i++)
+    if (maps[i]) munmap(maps[i], size);
+  free(maps);
+
+  if (error) {
+    errno = error;
+    return -1;
+  }
+  return 0;
+}
@@ -0,0 +1,40 @@
+/* The Computer Language Benchmarks Game
+ * https://salsa.debian.org/benchmarksgame-team/benchmarksgame/
+ *
+ * Library interface to the fasta generator, so the output can be put
+ * straight into memory or files instead of being piped from stdout.
+ *
+ * The output for n is a fixed string of fasta_size(n) bytes.  Any range
+ * of it can be generated on its own: the repeated sequence is indexed
+ * directly and the random ones skip the generator ahead in O(log n), so
+ * a caller can resume from any byte offset, or have several threads
+ * fill different ranges at once.
+ */
+
+#ifndef FASTA_GEN_H
+#define FASTA_GEN_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* total bytes of the output for n */
+uint64_t fasta_size(int64_t n);
+
+/* fill out with the len bytes of the output for n starting at offset */
+void fasta_fill(int64_t n, uint64_t offset, char *out, size_t len);
+
+/* the same, into each of the count buffers outs[], generating every
+ * byte only once */
+void fasta_fill_many(int64_t n, uint64_t offset, char *const outs[],
+		     int count, size_t len);
+
+/* write the whole output for n to fd, generating blocks in parallel with
+ * OpenMP.  Returns 0, or -1 with errno set if a write fails. */
+int fasta_write_fd(int fd, int64_t n);
+
+/* create or truncate each of the count files paths[], size them for n,
+ * map them and fill them all in one parallel pass.  Returns 0, or -1
+ * with errno set on the first failure. */
+int fasta_write_files(int64_t n, const char *const paths[], int count);
+
+#endif
@@ -8,7 +8,10 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stdint.h>
+#include <stdatomic.h>
 #include <pthread.h>
+#include <sched.h>
 #include <unistd.h>
 
 #define LINE_WIDTH 60
@@ -44,38 +47,50 @@ Frequency HOMOSAPIENS[] = {
 };
 
 // LCG parameters
-#define IM 139968.0
-#define IA 3877.0
-#define IC 29573.0
+#define IM 139968
+#define IA 3877
+#define IC 29573
 
 // Thread synchronization
 pthread_mutex_t stdout_mutex = PTHREAD_MUTEX_INITIALIZER;
-pthread_mutex_t seed_mutex = PTHREAD_MUTEX_INITIALIZER;
-double seed = 42.0;
+uint32_t seed = 42;
 
-// Calculate cumulative probabilities
-void calculate_cumulative(Frequency *freqs, int n, double *cumulative) {
-    double sum = 0.0;
-    for (int i = 0; i < n; i++) {
-        sum += freqs[i].probability;
-        cumulative[i] = sum;
+// Return the seed after steps more random numbers. The LCG step
+// seed -> seed * IA + IC is an affine map, so it is composed with itself by
+// repeated squaring to skip ahead in O(log steps) time.
+uint32_t lcg_skip(uint32_t start, uint64_t steps) {
+    uint64_t a = 1, c = 0;
+    uint64_t step_a = IA, step_c = IC;
+    for (; steps; steps >>= 1) {
+        if (steps & 1) {
+            a = (a * step_a) % IM;
+            c = (c * step_a + step_c) % IM;
+        }
+        step_c = (step_c * step_a + step_c) % IM;
+        step_a = (step_a * step_a) % IM;
     }
+    return (a * start + c) % IM;
 }
 
-// Binary search to find appropriate symbol
-char lookup_symbol(double random, double *cumulative, Frequency *freqs, int n) {
-    int low = 0;
-    int high = n - 1;
-    
-    while (low <= high) {
-        int mid = (low + high) / 2;
-        if (random < cumulative[mid])
-            high = mid - 1;
-        else
-            low = mid + 1;
+// Build a table mapping every LCG output to its symbol, so no search or
+// division is needed per character. This matches build_hash in the Human
+// version, including its single precision sums.
+char *build_lookup(Frequency *freqs, int n) {
+    char *lookup = malloc(IM);
+    if (!lookup) {
+        perror("Failed to allocate lookup table");
+        exit(1);
     }
-    
-    return freqs[low].symbol;
+    float sum = freqs[0].probability;
+    for (int i = 0, j = 0; i < IM && j < n; i++) {
+        float r = 1.0 * i / IM;
+        if (r >= sum) {
+            j++;
+            sum += freqs[j].probability;
+        }
+        lookup[i] = freqs[j].symbol;
+    }
+    return lookup;
 }
 
 // Write output buffer to stdout
@@ -149,86 +164,89 @@ void repeat_fasta(const char *header, const char *sequence, int n) {
     free(buffer);
 }
 
-// Generate random sequence
-void random_fasta(const char *header, Frequency *freqs, int n_freqs, int n) {
-    // Calculate cumulative probabilities
-    double *cumulative = malloc(n_freqs * sizeof(double));
-    calculate_cumulative(freqs, n_freqs, cumulative);
-    
-    // Output buffer
+// Shared state for generating one random sequence in blocks. Threads claim
+// blocks with an atomic counter, start each one at its own skipped-ahead seed
+// and write them in order by waiting for next_to_write to reach their block.
+typedef struct {
+    const char *lookup;
+    int n;
+    uint32_t first_seed;
+    int blocks;
+    atomic_int next_block;
+    atomic_int next_to_write;
+} RandomBlocks;
+
+void *random_fasta_worker(void *arg) {
+    RandomBlocks *job = (RandomBlocks *)arg;
     char *buffer = malloc(BUFFER_SIZE);
-    int buffer_pos = 0;
-    
-    // Write header
-    pthread_mutex_lock(&stdout_mutex);
-    fputs(header, stdout);
-    pthread_mutex_unlock(&stdout_mutex);
-    
-    // Process sequence in blocks
-    int remaining = n;
-    
-    while (remaining > 0) {
-        // Determine size of current block
-        int block_size = (remaining < LINE_WIDTH * LINES_PER_BLOCK) ? 
-                          remaining : LINE_WIDTH * LINES_PER_BLOCK;
-        int lines = (block_size + LINE_WIDTH - 1) / LINE_WIDTH;
-        
-        buffer_pos = 0;
-        
-        // Generate random sequence
-        for (int i = 0; i < lines; i++) {
-            int line_len = (i == lines - 1 && block_size % LINE_WIDTH != 0) ? 
-                            block_size % LINE_WIDTH : LINE_WIDTH;
-            
-            // Generate line
+
+    for (;;) {
+        int block = atomic_fetch_add(&job->next_block, 1);
+        if (block >= job->blocks) break;
+
+        // Generate the block's lines from its own seed
+        int start = block * LINE_WIDTH * LINES_PER_BLOCK;
+        int remaining = job->n - start;
+        if (remaining > LINE_WIDTH * LINES_PER_BLOCK)
+            remaining = LINE_WIDTH * LINES_PER_BLOCK;
+        uint32_t s = lcg_skip(job->first_seed, start);
+
+        int buffer_pos = 0;
+        while (remaining > 0) {
+            int line_len = remaining < LINE_WIDTH ? remaining : LINE_WIDTH;
             for (int j = 0; j < line_len; j++) {
-                // Generate random number
-                pthread_mutex_lock(&seed_mutex);
-                seed = (seed * IA + IC) % IM;
-                double r = seed / IM;
-                pthread_mutex_unlock(&seed_mutex);
-                
-                // Lookup symbol
-                buffer[buffer_pos++] = lookup_symbol(r, cumulative, freqs, n_freqs);
+                s = (s * IA + IC) % IM;
+                buffer[buffer_pos++] = job->lookup[s];
             }
-            
             buffer[buffer_pos++] = '\n';
             remaining -= line_len;
-            
-            if (remaining <= 0) break;
         }
-        
-        // Write block
+
+        // Wait for the previous block to be written, then write this one
+        while (atomic_load_explicit(&job->next_to_write, memory_order_acquire) != block)
+            sched_yield();
         write_output(buffer, buffer_pos);
+        atomic_store_explicit(&job->next_to_write, block + 1, memory_order_release);
     }
-    
-    free(cumulative);
-    free(buffer);
-}
 
-// Thread function for repeat fasta
-void *repeat_fasta_thread(void *arg) {
-    const char **args = (const char **)arg;
-    const char *header = args[0];
-    const char *sequence = args[1];
-    int n = atoi(args[2]);
-    
-    repeat_fasta(header, sequence, n);
-    
+    free(buffer);
     return NULL;
 }
 
-// Thread function for random fasta
-void *random_fasta_thread(void *arg) {
-    void **args = (void **)arg;
-    const char *header = (const char *)args[0];
-    Frequency *freqs = (Frequency *)args[1];
-    int n_freqs = *((int *)args[2]);
-    int n = *((int *)args[3]);
-    
-    random_fasta(header, freqs, n_freqs, n);
-    
-    return NULL;
+// Generate random sequence
+void random_fasta(const char *header, Frequency *freqs, int n_freqs, int n) {
+    RandomBlocks job;
+    job.lookup = build_lookup(freqs, n_freqs);
+    job.n = n;
+    job.first_seed = seed;
+    job.blocks = (n + LINE_WIDTH * LINES_PER_BLOCK - 1) / (LINE_WIDTH * LINES_PER_BLOCK);
+    atomic_init(&job.next_block, 0);
+    atomic_init(&job.next_to_write, 0);
+
+    // Write header
+    pthread_mutex_lock(&stdout_mutex);
+    fputs(header, stdout);
+    pthread_mutex_unlock(&stdout_mutex);
+
+    // Use the available processors, this thread included
+    int num_threads = sysconf(_SC_NPROCESSORS_ONLN);
+    if (num_threads > job.blocks) num_threads = job.blocks;
+    if (num_threads < 1) num_threads = 1;
+
+    pthread_t *threads = malloc(num_threads * sizeof(pthread_t));
+    for (int i = 0; i < num_threads - 1; i++) {
+        pthread_create(&threads[i], NULL, random_fasta_worker, &job);
+    }
+    random_fasta_worker(&job);
+    for (int i = 0; i < num_threads - 1; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    free(threads);
+
+    // Continue the random sequence after this one
+    seed = lcg_skip(job.first_seed, n);
+
+    free((void *)job.lookup);
 }
 
 int main(int argc, char *argv[]) {
@@ -239,58 +257,11 @@ int main(int argc, char *argv[]) {
     
     int n = atoi(argv[1]);
     
-    // Get number of available processors
-    int num_procs = sysconf(_SC_NPROCESSORS_ONLN);
-    
-    if (num_procs < 2) {
-        // Sequential execution
-        repeat_fasta(">ONE Homo sapiens alu\n", ALU, n * 2);
-        random_fasta(">TWO IUB ambiguity codes\n", IUB, sizeof(IUB)/sizeof(IUB[0]), n * 3);
-        random_fasta(">THREE Homo sapiens frequency\n", HOMOSAPIENS, sizeof(HOMOSAPIENS)/sizeof(HOMOSAPIENS[0]), n * 5);
-    } else {
-        // Parallel execution with threads
-        pthread_t threads[3];
-        
-        // Arguments for repeat_fasta
-        const char *repeat_args[3] = {
-            ">ONE Homo sapiens alu\n",
-            ALU,
-            malloc(20)
-        };
-        sprintf((char *)repeat_args[2], "%d", n * 2);
-        
-        // Arguments for IUB
-        int iub_size = sizeof(IUB) / sizeof(IUB[0]);
-        int iub_n = n * 3;
-        void *iub_args[4] = {
-            ">TWO IUB ambiguity codes\n",
-            IUB,
-            &iub_size,
-            &iub_n
-        };
-        
-        // Arguments for HOMOSAPIENS
-        int homosapiens_size = sizeof(HOMOSAPIENS) / sizeof(HOMOSAPIENS[0]);
-        int homosapiens_n = n * 5;
-        void *homosapiens_args[4] = {
-            ">THREE Homo sapiens frequency\n",
-            HOMOSAPIENS,
-            &homosapiens_size,
-            &homosapiens_n
-        };
-        
-        // Create threads
-        pthread_create(&threads[0], NULL, repeat_fasta_thread, (void *)repeat_args);
-        pthread_create(&threads[1], NULL, random_fasta_thread, (void *)iub_args);
-        pthread_create(&threads[2], NULL, random_fasta_thread, (void *)homosapiens_args);
-        
-        // Wait for threads to finish
-        for (int i = 0; i < 3; i++) {
-            pthread_join(threads[i], NULL);
-        }
-        
-        free((void *)repeat_args[2]);
-    }
+    // The sections are written one after another; random_fasta spreads each
+    // random sequence over the available processors
+    repeat_fasta(">ONE Homo sapiens alu\n", ALU, n * 2);
+    random_fasta(">TWO IUB ambiguity codes\n", IUB, sizeof(IUB)/sizeof(IUB[0]), n * 3);
+    random_fasta(">THREE Homo sapiens frequency\n", HOMOSAPIENS, sizeof(HOMOSAPIENS)/sizeof(HOMOSAPIENS[0]), n * 5);
     
     return 0;
 }
\ No newline at end of file
@@ -1,6 +1,67 @@
-cd fasta/Version3/Human/
-make c
-./a.out 25000000 > ../../../k-nuclcotide/knucleotide-input25000000.txt
-./a.out 25000000 > ../../../regex-redux/regexredux-input5000000.txt
-./a.out 1000000001 > ../../../reverse-complement/revcomp-input.txt
+#!/bin/bash
+# Generates the fasta inputs of k-nuclcotide, regex-redux and
+# reverse-complement. Each output is kept in a cache, under
+# BENCH_INPUT_CACHE or .input-cache, named by the fasta size and a hash of
+# the generator's sources, and is only generated again when that changes
+# or the cached file is not whole. The inputs are hard links to the cached
+# files (symbolic ones across file systems), so the benchmarks can map
+# them. --verify also checks the cached contents against their recorded
+# hash, which reads them all.
 
+root=$(cd "$(dirname "$0")" && pwd)
+cache=${BENCH_INPUT_CACHE:-$root/.input-cache}
+generator=$root/fasta/Version3/Human
+
+verify=0
+if [ "$1" = "--verify" ]
+then
+	verify=1
+fi
+
+mkdir -p "$cache" || exit 1
+cd "$generator" || exit 1
+make c > /dev/null || exit 1
+key=$(cat Makefile *.c *.h | sha256sum | cut -c1-16)
+
+# Prints the cached path of fasta $1, generating it first when it is not
+# cached. The .sha256 file next to it holds "hash size" and is written
+# last, so a run that was cut short leaves no valid entry behind.
+cached() {
+	local n=$1
+	local file=$cache/fasta-$n-$key.txt
+	if [ -f "$file" ] && [ -f "$file.sha256" ]
+	then
+		local hash size
+		read -r hash size < "$file.sha256"
+		if [ "$(stat -c %s "$file")" = "$size" ] &&
+			{ [ $verify = 0 ] || [ "$(sha256sum < "$file" | cut -d' ' -f1)" = "$hash" ]; }
+		then
+			echo "$file"
+			return 0
+		fi
+		echo "cached fasta $n is damaged, generating it again" >&2
+	fi
+
+	# Entries for the same size from older generators are never used again
+	rm -f "$cache/fasta-$n-"*
+	echo "generating fasta $n" >&2
+	./a.out "$n" "$file.tmp" || { rm -f "$file.tmp"; return 1; }
+	mv "$file.tmp" "$file"
+	echo "$(sha256sum < "$file" | cut -d' ' -f1) $(stat -c %s "$file")" > "$file.sha256"
+	echo "$file"
+}
+
+# Puts the cached file $1 in place as $2
+place() {
+	if [ "$1" -ef "$2" ]
+	then
+		return 0
+	fi
+	ln -f "$1" "$2" 2> /dev/null || ln -sf "$1" "$2"
+}
+
+input=$(cached 25000000) || exit 1
+place "$input" "$root/k-nuclcotide/knucleotide-input25000000.txt"
+place "$input" "$root/regex-redux/regexredux-input5000000.txt"
+input=$(cached 1000000001) || exit 1
+place "$input" "$root/reverse-complement/revcomp-input.txt"
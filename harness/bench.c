@@ -0,0 +1,242 @@
+/* Shared benchmark harness, see bench.h. */
+
+#define _GNU_SOURCE
+#include <fcntl.h>
+#include <inttypes.h>
+#include <linux/perf_event.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "bench.h"
+
+#define MAX_PHASES 16
+#define MAX_LINE 8192
+
+typedef struct {
+    const char *name;
+    double seconds;
+    double bytes, flops;
+} phase_t;
+
+static const struct {
+    const char *name;
+    uint32_t type;
+    uint64_t config;
+} counter_kinds[] = {
+    {"cycles", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES},
+    {"instructions", PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS},
+    {"cache_misses", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES},
+};
+
+#define COUNTERS (sizeof(counter_kinds) / sizeof(counter_kinds[0]))
+
+static double start;
+static char command[1024];
+static phase_t phases[MAX_PHASES];
+static int phase_count, current = -1;
+static double phase_start;
+static int counter_fds[COUNTERS];
+/* guards the work totals and current against other threads */
+static pthread_mutex_t work_lock = PTHREAD_MUTEX_INITIALIZER;
+static double work_bytes, work_flops;
+static int have_work;
+
+static double now(void)
+{
+    struct timespec t;
+
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec + t.tv_nsec * 1e-9;
+}
+
+/* appends printf output to the line, truncating at MAX_LINE */
+static void append(char *line, size_t *length, const char *format, ...)
+{
+    va_list args;
+    int n;
+
+    if (*length >= MAX_LINE)
+        return;
+    va_start(args, format);
+    n = vsnprintf(line + *length, MAX_LINE - *length, format, args);
+    va_end(args);
+    if (n > 0)
+        *length += (size_t)n < MAX_LINE - *length ? (size_t)n : MAX_LINE - *length - 1;
+}
+
+/* s as a JSON string body, without the quotes */
+static void append_escaped(char *line, size_t *length, const char *s)
+{
+    for (; *s; s++) {
+        if (*s == '"' || *s == '\\')
+            append(line, length, "\\%c", *s);
+        else if ((unsigned char)*s < 0x20)
+            append(line, length, "\\u%04x", *s);
+        else
+            append(line, length, "%c", *s);
+    }
+}
+
+/* per-process counters that follow threads created later; -1 where the
+ * kernel refuses them */
+static void open_counters(void)
+{
+    for (size_t i = 0; i < COUNTERS; i++) {
+        struct perf_event_attr attr;
+
+        memset(&attr, 0, sizeof(attr));
+        attr.size = sizeof(attr);
+        attr.type = counter_kinds[i].type;
+        attr.config = counter_kinds[i].config;
+        attr.disabled = 1;
+        attr.inherit = 1;
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        counter_fds[i] = syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+        if (counter_fds[i] >= 0)
+            ioctl(counter_fds[i], PERF_EVENT_IOC_ENABLE, 0);
+    }
+}
+
+void bench_phase(const char *name)
+{
+    double t = now();
+    int i;
+
+    pthread_mutex_lock(&work_lock);
+    if (current >= 0)
+        phases[current].seconds += t - phase_start;
+    phase_start = t;
+
+    for (i = 0; i < phase_count && strcmp(phases[i].name, name) != 0; i++)
+        ;
+    if (i == phase_count) {
+        if (phase_count == MAX_PHASES) {
+            current = -1;
+            pthread_mutex_unlock(&work_lock);
+            return;
+        }
+        phases[phase_count++].name = name;
+    }
+    current = i;
+    pthread_mutex_unlock(&work_lock);
+}
+
+void bench_work(double bytes, double flops)
+{
+    pthread_mutex_lock(&work_lock);
+    have_work = 1;
+    work_bytes += bytes;
+    work_flops += flops;
+    if (current >= 0) {
+        phases[current].bytes += bytes;
+        phases[current].flops += flops;
+    }
+    pthread_mutex_unlock(&work_lock);
+}
+
+/* glibc passes main's arguments to the constructors of preloaded
+ * libraries too */
+__attribute__((constructor))
+static void bench_start(int argc, char **argv)
+{
+    size_t length = 0;
+
+    for (int i = 0; i < argc && argv && length < sizeof(command); i++)
+        length += snprintf(command + length, sizeof(command) - length,
+                           i ? " %s" : "%s", argv[i]);
+    for (size_t i = 0; i < COUNTERS; i++)
+        counter_fds[i] = -1;
+
+    const char *perf = getenv("BENCH_PERF");
+    if (perf && strcmp(perf, "0") != 0)
+        open_counters();
+
+    start = now();
+}
+
+__attribute__((destructor))
+static void bench_finish(void)
+{
+    double wall = now() - start;
+    const char *label = getenv("BENCH_LABEL");
+    const char *path = getenv("BENCH_OUTPUT");
+    char line[MAX_LINE];
+    size_t length = 0;
+    struct rusage usage;
+    uint64_t counts[COUNTERS];
+    int have_counters = 1;
+
+    for (size_t i = 0; i < COUNTERS; i++) {
+        if (counter_fds[i] < 0 ||
+            read(counter_fds[i], &counts[i], sizeof(counts[i])) != sizeof(counts[i]))
+            have_counters = 0;
+        if (counter_fds[i] >= 0)
+            close(counter_fds[i]);
+    }
+
+    if (current >= 0)
+        phases[current].seconds += now() - phase_start;
+    getrusage(RUSAGE_SELF, &usage);
+
+    append(line, &length, "{\"label\": \"");
+    append_escaped(line, &length, label ? label : "");
+    append(line, &length, "\", \"command\": \"");
+    append_escaped(line, &length, command);
+    append(line, &length, "\", \"wall\": %.6f, \"user\": %.6f, \"sys\": %.6f, "
+           "\"max_rss_kb\": %ld, \"phases\": {", wall,
+           usage.ru_utime.tv_sec + usage.ru_utime.tv_usec * 1e-6,
+           usage.ru_stime.tv_sec + usage.ru_stime.tv_usec * 1e-6,
+           usage.ru_maxrss);
+    for (int i = 0; i < phase_count; i++) {
+        append(line, &length, "%s\"", i ? ", " : "");
+        append_escaped(line, &length, phases[i].name);
+        append(line, &length, "\": %.6f", phases[i].seconds);
+    }
+    append(line, &length, "}, \"counters\": ");
+    if (have_counters) {
+        for (size_t i = 0; i < COUNTERS; i++)
+            append(line, &length, "%s\"%s\": %" PRIu64, i ? ", " : "{",
+                   counter_kinds[i].name, counts[i]);
+        append(line, &length, "}");
+    } else {
+        append(line, &length, "null");
+    }
+    append(line, &length, ", \"work\": ");
+    if (have_work) {
+        append(line, &length, "{\"bytes\": %.9g, \"flops\": %.9g, \"phases\": {",
+               work_bytes, work_flops);
+        for (int i = 0, first = 1; i < phase_count; i++) {
+            if (phases[i].bytes == 0 && phases[i].flops == 0)
+                continue;
+            append(line, &length, "%s\"", first ? "" : ", ");
+            append_escaped(line, &length, phases[i].name);
+            append(line, &length, "\": {\"bytes\": %.9g, \"flops\": %.9g}",
+                   phases[i].bytes, phases[i].flops);
+            first = 0;
+        }
+        append(line, &length, "}}");
+    } else {
+        append(line, &length, "null");
+    }
+    append(line, &length, "}\n");
+
+    int fd = path ? open(path, O_WRONLY | O_CREAT | O_APPEND, 0644) : STDERR_FILENO;
+    if (fd < 0) {
+        perror(path);
+        return;
+    }
+    if (write(fd, line, length) != (ssize_t)length)
+        perror("bench");
+    if (path)
+        close(fd);
+}
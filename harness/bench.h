@@ -0,0 +1,62 @@
+/* Shared benchmark harness.
+ *
+ * libbench.so is preloaded into a benchmark instead of timing it with
+ * "time make run-c", which also times make:
+ *
+ *    LD_PRELOAD=harness/libbench.so ./a.out 1000 > /dev/null
+ *
+ * From just before main until exit it records the monotonic wall time,
+ * user and system time and peak RSS. With BENCH_PERF=1 it also counts
+ * cycles, instructions and cache misses with perf_event_open, over every
+ * thread. At exit it appends one JSON line to the file named by
+ * BENCH_OUTPUT, or to stderr if that is unset:
+ *
+ *    {"label": "...", "command": "./a.out 1000", "wall": 1.234,
+ *     "user": 1.2, "sys": 0.01, "max_rss_kb": 5120,
+ *     "phases": {"read": 0.2, "compute": 1.0},
+ *     "counters": {"cycles": 4.1e9, "instructions": 9.8e9,
+ *                  "cache_misses": 1.2e6},
+ *     "work": {"bytes": 8.0e9, "flops": 2.4e10,
+ *              "phases": {"compute": {"bytes": 8.0e9, "flops": 2.4e10}}}}
+ *
+ * "label" is BENCH_LABEL. "counters" is null if perf events are not
+ * available, and "work" if the program registered none. The line is
+ * written with a single write(), so concurrent runs can share one output
+ * file.
+ *
+ * Programs mark their own phases with BENCH_PHASE. Each call ends the
+ * phase before it, time before the first call belongs to no phase, and a
+ * name used twice adds to the same phase. bench_phase is weak, so the
+ * markers do nothing when the library is not preloaded and nothing needs
+ * to be linked.
+ *
+ * Hot loops register what they did with BENCH_WORK(bytes, flops): the
+ * bytes they have to move to or from memory at least once, which is the
+ * size of the arrays a pass streams through rather than every load that
+ * hits in cache, and the floating-point operations they do, or for
+ * kernels counted in interactions, the flops of one interaction times
+ * their number. Work adds to the phase current when it is registered,
+ * which results.py roofline divides by that phase's time, and always to
+ * the run's totals. It may be called from any thread, but takes a lock,
+ * so loops register once per pass or block rather than per element.
+ */
+
+#ifndef BENCH_H
+#define BENCH_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+void bench_phase(const char *name) __attribute__((weak));
+void bench_work(double bytes, double flops) __attribute__((weak));
+
+#ifdef __cplusplus
+}
+#endif
+
+#define BENCH_PHASE(name) do { if (bench_phase) bench_phase(name); } while (0)
+#define BENCH_WORK(bytes, flops) \
+    do { if (bench_work) bench_work((bytes), (flops)); } while (0)
+
+#endif
@@ -0,0 +1,136 @@
+/* Benchmark input read from a descriptor, mapped when it is a regular file.
+ *
+ * The inputs generate-inputs.sh leaves in place are files in its cache, so
+ * a benchmark reading one through stdin can map it instead of copying it
+ * through read() or stdio:
+ *
+ *    bench_input in;
+ *    bench_input_open(&in, STDIN_FILENO);
+ *    while ((n = bench_input_read(&in, buffer, sizeof(buffer))) > 0)
+ *       ...
+ *    bench_input_close(&in);
+ *
+ * bench_input_open maps the descriptor when it is a nonempty regular file
+ * and returns 1, with the file in data[0, size) and pos at the current
+ * file offset, so input a caller already consumed is skipped. Otherwise it
+ * returns 0 and bench_input_read falls back to read(). Programs that work
+ * on the whole input use bench_input_read_all, which maps it the same way
+ * or else reads it all into a malloc buffer.
+ *
+ * Mapped pages that have been consumed are dropped again, by
+ * bench_input_read as it goes or by bench_input_release for callers that
+ * use data directly, so a GB input is not all resident at once. The page
+ * cache keeps them, so the next run maps the same pages without any I/O.
+ *
+ * Header only, like bench.h: nothing needs to be linked.
+ */
+
+#ifndef BENCH_INPUT_H
+#define BENCH_INPUT_H
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+/* mapped input is dropped this much at a time */
+#define BENCH_INPUT_RELEASE_SIZE 4194304
+
+typedef struct {
+    char *data;         /* the mapping, or what bench_input_read_all read */
+    size_t size;        /* bytes in data */
+    size_t capacity;    /* bytes allocated for data when not mapped */
+    size_t pos;         /* where bench_input_read continues */
+    size_t released;    /* mapped pages before this have been dropped */
+    int fd;
+    int mapped;
+} bench_input;
+
+static inline int bench_input_open(bench_input *in, int fd)
+{
+    struct stat status;
+
+    memset(in, 0, sizeof(*in));
+    in->fd = fd;
+    if (fstat(fd, &status) != 0 || !S_ISREG(status.st_mode) || status.st_size <= 0)
+        return 0;
+
+    void *data = mmap(NULL, status.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (data == MAP_FAILED)
+        return 0;
+    madvise(data, status.st_size, MADV_SEQUENTIAL);
+
+    off_t offset = lseek(fd, 0, SEEK_CUR);
+    in->data = data;
+    in->size = status.st_size;
+    in->pos = offset > 0 && offset < status.st_size ? (size_t)offset : 0;
+    in->mapped = 1;
+    return 1;
+}
+
+/* drops the mapped pages wholly before offset */
+static inline void bench_input_release(bench_input *in, size_t offset)
+{
+    if (!in->mapped || offset < in->released + BENCH_INPUT_RELEASE_SIZE)
+        return;
+    size_t done = offset & ~(size_t)(sysconf(_SC_PAGESIZE) - 1);
+    madvise(in->data + in->released, done - in->released, MADV_DONTNEED);
+    in->released = done;
+}
+
+/* copies up to count bytes of the input to buffer, like read(); returns
+ * 0 at the end and -1 on errors */
+static inline ssize_t bench_input_read(bench_input *in, void *buffer, size_t count)
+{
+    if (!in->mapped) {
+        ssize_t n;
+        do
+            n = read(in->fd, buffer, count);
+        while (n < 0 && errno == EINTR);
+        return n;
+    }
+
+    size_t left = in->size - in->pos;
+    if (count > left)
+        count = left;
+    memcpy(buffer, in->data + in->pos, count);
+    in->pos += count;
+    bench_input_release(in, in->pos);
+    return count;
+}
+
+/* the rest of the input in data[pos, size), mapped or read whole; returns
+ * 0, or -1 with errno set */
+static inline int bench_input_read_all(bench_input *in, int fd)
+{
+    if (bench_input_open(in, fd))
+        return 0;
+
+    in->capacity = 65536;
+    in->data = malloc(in->capacity);
+    for (;;) {
+        if (in->data == NULL)
+            return -1;
+        ssize_t n = bench_input_read(in, in->data + in->size, in->capacity - in->size);
+        if (n < 0)
+            return -1;
+        if (n == 0)
+            return 0;
+        if ((in->size += n) == in->capacity)
+            in->data = realloc(in->data, in->capacity *= 2);
+    }
+}
+
+static inline void bench_input_close(bench_input *in)
+{
+    if (in->mapped)
+        munmap(in->data, in->size);
+    else
+        free(in->data);
+    in->data = NULL;
+}
+
+#endif
@@ -0,0 +1,148 @@
+/* One-time calibration of the host for the roofline report, see results.py.
+ *
+ * Measures the STREAM triad a[i] = b[i] + s * c[i], counted as 24 bytes
+ * an element as STREAM counts it, over arrays of four times the last-level
+ * cache, and the peak double-precision rate of independent multiply-add
+ * chains in the widest vectors -march=native allows. Each is the best of
+ * REPEATS, on one thread and on all of them (OMP_NUM_THREADS), printed as
+ * one JSON line in GB/s and GFLOP/s:
+ *
+ *    {"host": "node1", "threads": 16, "bandwidth_1": 12.1,
+ *     "bandwidth": 85.3, "gflops_1": 70.2, "gflops": 1100.5}
+ *
+ * Divides and square roots run far below this peak, so kernels full of
+ * them stay well under the compute roof even when they are compute-bound.
+ */
+
+#define _GNU_SOURCE
+#include <omp.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+#define REPEATS 7
+/* multiply-add chains per thread: enough to cover the latency of every
+ * FMA port */
+#define CHAINS 12
+#define FMA_ITERATIONS 20000000L
+/* smallest triad array, in doubles, when the cache size is unknown */
+#define MIN_ELEMENTS (4L << 20)
+
+#if defined(__AVX512F__)
+#define LANES 8
+#elif defined(__AVX__)
+#define LANES 4
+#else
+#define LANES 2
+#endif
+
+typedef double vdouble __attribute__((vector_size(LANES * sizeof(double))));
+
+/* keeps the chains' results alive */
+volatile double sink;
+
+static double now(void)
+{
+    struct timespec t;
+
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec + t.tv_nsec * 1e-9;
+}
+
+/* best triad GB/s on threads threads over arrays of n doubles */
+static double triad(double *a, const double *b, const double *c, long n,
+                    int threads)
+{
+    double best = 0;
+
+    for (int r = 0; r < REPEATS; r++) {
+        double t = now();
+#pragma omp parallel for schedule(static) num_threads(threads)
+        for (long i = 0; i < n; i++)
+            a[i] = b[i] + 3.0 * c[i];
+        t = now() - t;
+        if (24.0 * n / t > best)
+            best = 24.0 * n / t;
+    }
+    sink = a[n / 2];
+    return best * 1e-9;
+}
+
+static double fma_chains(long iterations)
+{
+    vdouble acc[CHAINS];
+    vdouble x = (vdouble){0} + 0.999999, y = (vdouble){0} + 1e-7;
+    double total = 0;
+
+    for (int k = 0; k < CHAINS; k++)
+        acc[k] = (vdouble){0} + k;
+    for (long i = 0; i < iterations; i++)
+        for (int k = 0; k < CHAINS; k++)
+            acc[k] = acc[k] * x + y;
+    for (int k = 0; k < CHAINS; k++)
+        for (int l = 0; l < LANES; l++)
+            total += acc[k][l];
+    return total;
+}
+
+/* best GFLOP/s of the chains on threads threads */
+static double peak(int threads)
+{
+    double best = 0;
+
+    for (int r = 0; r < REPEATS; r++) {
+        double t = now();
+#pragma omp parallel num_threads(threads)
+        sink = fma_chains(FMA_ITERATIONS);
+        t = now() - t;
+        double flops = 2.0 * threads * FMA_ITERATIONS * CHAINS * LANES;
+        if (flops / t > best)
+            best = flops / t;
+    }
+    return best * 1e-9;
+}
+
+int main(void)
+{
+    int threads = omp_get_max_threads();
+    long cache = sysconf(_SC_LEVEL3_CACHE_SIZE);
+    long memory = sysconf(_SC_PHYS_PAGES) * sysconf(_SC_PAGESIZE);
+    long n = cache > 0 ? 4 * cache / (long)sizeof(double) : MIN_ELEMENTS;
+    char host[256] = "";
+
+    if (n < MIN_ELEMENTS)
+        n = MIN_ELEMENTS;
+    /* the three arrays take at most a quarter of memory */
+    if (memory > 0 && 3 * n * (long)sizeof(double) > memory / 4)
+        n = memory / 4 / 3 / sizeof(double);
+
+    double *a = malloc(n * sizeof(double));
+    double *b = malloc(n * sizeof(double));
+    double *c = malloc(n * sizeof(double));
+    if (a == NULL || b == NULL || c == NULL) {
+        perror("calibrate");
+        return EXIT_FAILURE;
+    }
+    /* first touched by the threads that use them */
+#pragma omp parallel for schedule(static)
+    for (long i = 0; i < n; i++) {
+        a[i] = 0;
+        b[i] = 1;
+        c[i] = 2;
+    }
+
+    double bandwidth_1 = triad(a, b, c, n, 1);
+    double bandwidth = threads > 1 ? triad(a, b, c, n, threads) : bandwidth_1;
+    double gflops_1 = peak(1);
+    double gflops = threads > 1 ? peak(threads) : gflops_1;
+
+    gethostname(host, sizeof(host) - 1);
+    printf("{\"host\": \"%s\", \"threads\": %d, \"bandwidth_1\": %.3f, "
+           "\"bandwidth\": %.3f, \"gflops_1\": %.3f, \"gflops\": %.3f}\n",
+           host, threads, bandwidth_1, bandwidth, gflops_1, gflops);
+    free(a);
+    free(b);
+    free(c);
+    return 0;
+}
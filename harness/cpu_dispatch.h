@@ -0,0 +1,147 @@
+/* Run-time choice between SIMD kernels.
+ *
+ * A benchmark that should run well on any machine of the fleet is built
+ * without -march. Each kernel is compiled once per instruction set with
+ * the CPU_TARGET_* attribute of its level, the variants are listed best
+ * first in a table whose entries start with their cpu_level, and one is
+ * picked at startup:
+ *
+ *    typedef struct {
+ *        cpu_level level;
+ *        void (*run)(int n);
+ *    } my_kernel;
+ *
+ *    static const my_kernel kernels[] = {
+ *        {CPU_AVX512, run_avx512}, {CPU_AVX2, run_avx2}, {CPU_SCALAR, run_scalar},
+ *    };
+ *
+ *    const my_kernel *k = CPU_PICK(kernels, "MY_KERNEL");
+ *
+ * CPU_PICK returns the first entry the CPU supports. If the environment
+ * variable named there, or else CPU_KERNEL, holds a level name ("scalar",
+ * "sse2", "sse4.1", "avx2", "avx512", "neon", "sve") that entry is taken
+ * instead, so every variant can be run on one host. A name that is not in
+ * the table, or that the CPU does not support, is an error saying which
+ * and listing the entries that would run.
+ *
+ * Support comes from __builtin_cpu_supports on x86, which reads CPUID and
+ * also checks that the OS saves the AVX registers, and from the auxiliary
+ * vector on aarch64. CPU_AVX512 is the F, BW, DQ and VL subset every
+ * AVX-512 server part has. AVX512F implies FMA, so GCC contracts a * b + c
+ * into one rounding in the AVX-512 variants unless told not to: a benchmark
+ * whose levels must give the same results is built with -ffp-contract=off.
+ *
+ * Header only, like bench.h: nothing needs to be linked.
+ */
+
+#ifndef CPU_DISPATCH_H
+#define CPU_DISPATCH_H
+
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#ifdef __aarch64__
+#include <sys/auxv.h>
+#endif
+
+typedef enum {
+    CPU_SCALAR,
+    CPU_SSE2,
+    CPU_SSE41,   /* with SSSE3 */
+    CPU_AVX2,
+    CPU_AVX512,
+    CPU_NEON,
+    CPU_SVE
+} cpu_level;
+
+#define CPU_TARGET_SSE2   __attribute__((target("sse2")))
+#define CPU_TARGET_SSE41  __attribute__((target("ssse3,sse4.1")))
+#define CPU_TARGET_AVX2   __attribute__((target("avx2")))
+#define CPU_TARGET_AVX512 __attribute__((target("avx512f,avx512bw,avx512dq,avx512vl")))
+#define CPU_TARGET_SVE    __attribute__((target("+sve")))
+
+static const char *const cpu_level_names[] = {
+    "scalar", "sse2", "sse4.1", "avx2", "avx512", "neon", "sve"
+};
+
+static inline int cpu_supports(cpu_level level)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_cpu_init();
+    switch (level) {
+    case CPU_SCALAR: return 1;
+    case CPU_SSE2:   return __builtin_cpu_supports("sse2");
+    case CPU_SSE41:  return __builtin_cpu_supports("ssse3") &&
+                            __builtin_cpu_supports("sse4.1");
+    case CPU_AVX2:   return __builtin_cpu_supports("avx2");
+    case CPU_AVX512: return __builtin_cpu_supports("avx512f") &&
+                            __builtin_cpu_supports("avx512bw") &&
+                            __builtin_cpu_supports("avx512dq") &&
+                            __builtin_cpu_supports("avx512vl");
+    default:         return 0;
+    }
+#elif defined(__aarch64__)
+#ifndef HWCAP_SVE
+#define HWCAP_SVE (1 << 22)
+#endif
+    switch (level) {
+    case CPU_SCALAR: return 1;
+    case CPU_NEON:   return 1;
+    case CPU_SVE:    return (getauxval(AT_HWCAP) & HWCAP_SVE) != 0;
+    default:         return 0;
+    }
+#else
+    return level == CPU_SCALAR;
+#endif
+}
+
+/* index of the entry to use in a best-first table of count entries of
+ * size bytes, each starting with its cpu_level; see CPU_PICK */
+static inline size_t cpu_pick(const void *table, size_t count, size_t size,
+                              const char *env)
+{
+    const char *want = env != NULL ? getenv(env) : NULL;
+    size_t k;
+
+    if (want == NULL || *want == '\0') {
+        env = "CPU_KERNEL";
+        want = getenv(env);
+    }
+    if (want != NULL && *want == '\0')
+        want = NULL;
+    for (k = 0; k < count; k++) {
+        cpu_level level = *(const cpu_level *)((const char *)table + k * size);
+        if (want != NULL && strcmp(want, cpu_level_names[level]) != 0)
+            continue;
+        if (cpu_supports(level))
+            return k;
+        if (want != NULL)
+            break;
+    }
+
+    if (want == NULL) {
+        fprintf(stderr, "no kernel of this benchmark runs on this CPU\n");
+        exit(EXIT_FAILURE);
+    }
+    if (k == count)
+        fprintf(stderr, "%s=%s: this benchmark has no %s kernel; try:", env,
+                want, want);
+    else
+        fprintf(stderr, "%s=%s: this CPU does not support %s; try:", env,
+                want, want);
+    for (k = 0; k < count; k++) {
+        cpu_level level = *(const cpu_level *)((const char *)table + k * size);
+        if (cpu_supports(level))
+            fprintf(stderr, " %s", cpu_level_names[level]);
+    }
+    fprintf(stderr, "\n");
+    exit(EXIT_FAILURE);
+}
+
+#define CPU_PICK(table, env) \
+    (&(table)[cpu_pick((table), sizeof(table) / sizeof((table)[0]), sizeof((table)[0]), (env))])
+
+#define CPU_KERNEL_NAME(entry) (cpu_level_names[(entry)->level])
+
+#endif
@@ -14,45 +14,74 @@
 #include <pthread.h>
 #include <unistd.h>
 
-// Hash table for k-nucleotide frequency counting
-typedef struct KmerEntry {
+// Open-addressing table of k-mer counts with linear probing. A count of 0
+// marks an empty slot, since every stored k-mer has been seen at least once.
+typedef struct {
     uint64_t key;           // The encoded k-mer
     int count;              // Frequency count
-    struct KmerEntry *next; // Next entry in the linked list (for hash collisions)
-} KmerEntry;
+} KmerSlot;
+
+typedef struct {
+    KmerSlot *slots;        // Array of slots
+    size_t capacity;        // Number of slots, a power of two
+    size_t size;            // Number of occupied slots
+    int shift;              // 64 - log2(capacity), to take a slot from a hash
+} KmerTable;
 
+// Hash table for k-nucleotide frequency counting. The k-mers are split between
+// partitions by hash, so that threads can merge their private tables one
+// partition each at the same time.
 typedef struct {
-    KmerEntry **buckets;    // Array of hash table buckets
-    int size;               // Number of buckets in the hash table
+    KmerTable *parts;       // Array of partitions
+    int num_parts;          // Number of partitions
 } HashTable;
 
 // Context for worker threads
 typedef struct {
     const unsigned char *sequence;
-    int sequence_len;
     int start;
     int end;
     int frame_length;
+    int thread_index;
+    int num_threads;
+    KmerTable *private_tables;  // num_threads partitions for each thread
     HashTable *hash_table;
-    pthread_mutex_t *mutex;
 } ThreadContext;
 
 // Global constants
 #define MAX_LINE 256
-#define HASH_SIZE 2097152  // 2^21 - Adjust based on expected k-mer count
+#define INITIAL_TABLE_CAPACITY 1024  // Slots in a new table, a power of two
+#define OUTPUT_CHUNK_SIZE 1048576    // Bytes of output written at a time
 
-// Initialize a hash table
-HashTable* create_hash_table(int size) {
+// Initialize an empty k-mer table with capacity slots
+void init_kmer_table(KmerTable *table, size_t capacity) {
+    table->slots = (KmerSlot*)calloc(capacity, sizeof(KmerSlot));
+    if (!table->slots) {
+        perror("Failed to allocate hash table slots");
+        exit(EXIT_FAILURE);
+    }
+
+    table->capacity = capacity;
+    table->size = 0;
+    table->shift = 64;
+    while (capacity > 1) {
+        table->shift--;
+        capacity >>= 1;
+    }
+}
+
+// Initialize a hash table with num_parts empty partitions
+HashTable* create_hash_table(int num_parts) {
     HashTable *table = (HashTable*)malloc(sizeof(HashTable));
     if (!table) {
         perror("Failed to allocate hash table");
         exit(EXIT_FAILURE);
     }
     
-    table->size = size;
-    table->buckets = (KmerEntry**)calloc(size, sizeof(KmerEntry*));
-    if (!table->buckets) {
-        perror("Failed to allocate hash table buckets");
+    table->num_parts = num_parts;
+    table->parts = (KmerTable*)malloc(num_parts * sizeof(KmerTable));
+    if (!table->parts) {
+        perror("Failed to allocate hash table partitions");
         free(table);
         exit(EXIT_FAILURE);
     }
@@ -60,78 +89,78 @@ HashTable* create_hash_table(int size) {
     return table;
 }
 
-// Free a hash table and all its entries
+// Free a hash table and all its partitions
 void free_hash_table(HashTable *table) {
-    for (int i = 0; i < table->size; i++) {
-        KmerEntry *entry = table->buckets[i];
-        while (entry) {
-            KmerEntry *next = entry->next;
-            free(entry);
-            entry = next;
-        }
+    for (int i = 0; i < table->num_parts; i++) {
+        free(table->parts[i].slots);
     }
-    free(table->buckets);
+    free(table->parts);
     free(table);
 }
 
-// Hash function for k-mers
-uint32_t hash_kmer(uint64_t key, int table_size) {
-    // FNV-1a hash
-    uint64_t hash = 14695981039346656037ULL;
-    uint8_t *bytes = (uint8_t*)&key;
-    
-    for (int i = 0; i < sizeof(key); i++) {
-        hash ^= bytes[i];
-        hash *= 1099511628211ULL;
+// Hash function for k-mers. Slots are taken from the top bits of the hash and
+// partitions from the bottom 32 bits.
+static inline uint64_t hash_kmer(uint64_t key) {
+    // Fibonacci hashing
+    return key * 0x9E3779B97F4A7C15ULL;
+}
+
+static inline int partition_for_hash(uint64_t hash, int num_parts) {
+    return (int)(((hash & 0xFFFFFFFFULL) * num_parts) >> 32);
+}
+
+static void add_kmer(KmerTable *table, uint64_t key, uint64_t hash, int count);
+
+// Double the capacity of a k-mer table, reinserting its k-mers
+static void grow_kmer_table(KmerTable *table) {
+    KmerTable grown;
+    init_kmer_table(&grown, table->capacity * 2);
+    
+    for (size_t i = 0; i < table->capacity; i++) {
+        if (table->slots[i].count) {
+            add_kmer(&grown, table->slots[i].key, hash_kmer(table->slots[i].key),
+                     table->slots[i].count);
+        }
     }
     
-    return (uint32_t)(hash % table_size);
+    free(table->slots);
+    *table = grown;
 }
 
-// Insert or increment a k-mer in the hash table
-void increment_kmer(HashTable *table, uint64_t key, pthread_mutex_t *mutex) {
-    uint32_t hash = hash_kmer(key, table->size);
-    
-    // Lock only when accessing the hash table
-    if (mutex) pthread_mutex_lock(mutex);
+// Add count to the count of a k-mer whose hash is hash, inserting it if needed.
+// Tables are kept at most 3/4 full so that probe sequences stay short.
+static void add_kmer(KmerTable *table, uint64_t key, uint64_t hash, int count) {
+    if ((table->size + 1) * 4 > table->capacity * 3) {
+        grow_kmer_table(table);
+    }
     
-    // Look for existing entry
-    KmerEntry *entry = table->buckets[hash];
-    while (entry) {
-        if (entry->key == key) {
-            entry->count++;
-            if (mutex) pthread_mutex_unlock(mutex);
+    size_t mask = table->capacity - 1;
+    size_t i = hash >> table->shift;
+    while (table->slots[i].count) {
+        if (table->slots[i].key == key) {
+            table->slots[i].count += count;
             return;
         }
-        entry = entry->next;
+        i = (i + 1) & mask;
     }
     
-    // Create new entry
-    KmerEntry *new_entry = (KmerEntry*)malloc(sizeof(KmerEntry));
-    if (!new_entry) {
-        perror("Failed to allocate hash entry");
-        if (mutex) pthread_mutex_unlock(mutex);
-        exit(EXIT_FAILURE);
-    }
-    
-    new_entry->key = key;
-    new_entry->count = 1;
-    new_entry->next = table->buckets[hash];
-    table->buckets[hash] = new_entry;
-    
-    if (mutex) pthread_mutex_unlock(mutex);
+    table->slots[i].key = key;
+    table->slots[i].count = count;
+    table->size++;
 }
 
 // Get the count of a k-mer from the hash table
 int get_kmer_count(HashTable *table, uint64_t key) {
-    uint32_t hash = hash_kmer(key, table->size);
-    
-    KmerEntry *entry = table->buckets[hash];
-    while (entry) {
-        if (entry->key == key) {
-            return entry->count;
+    uint64_t hash = hash_kmer(key);
+    KmerTable *part = &table->parts[partition_for_hash(hash, table->num_parts)];
+    
+    size_t mask = part->capacity - 1;
+    size_t i = hash >> part->shift;
+    while (part->slots[i].count) {
+        if (part->slots[i].key == key) {
+            return part->slots[i].count;
         }
-        entry = entry->next;
+        i = (i + 1) & mask;
     }
     
     return 0;
@@ -167,49 +196,107 @@ void decode_kmer(uint64_t key, int length, char *result) {
     result[length] = '\0';
 }
 
-// Worker thread function to count k-mers in a portion of the sequence
+// Worker thread function to count k-mers in a portion of the sequence into the
+// thread's own tables, one for each partition, so no locking is needed
 void* count_kmers_worker(void *arg) {
     ThreadContext *ctx = (ThreadContext*)arg;
     const unsigned char *sequence = ctx->sequence;
     int frame_length = ctx->frame_length;
+    KmerTable *tables = &ctx->private_tables[ctx->thread_index * ctx->num_threads];
     
-    // Process k-mers in the assigned range
-    for (int i = ctx->start; i <= ctx->end - frame_length; i++) {
-        uint64_t key = encode_kmer(&sequence[i], frame_length);
-        increment_kmer(ctx->hash_table, key, ctx->mutex);
+    if (ctx->start >= ctx->end) {
+        return NULL;
+    }
+    
+    // Process the k-mers starting in the assigned range, rolling the key along
+    // one nucleotide at a time instead of encoding each k-mer from scratch
+    uint64_t mask = frame_length < 32 ? (1ULL << 2 * frame_length) - 1 : ~0ULL;
+    uint64_t key = encode_kmer(&sequence[ctx->start], frame_length - 1);
+    for (int i = ctx->start; i < ctx->end; i++) {
+        key = (key << 2 & mask) | encode_kmer(&sequence[i + frame_length - 1], 1);
+        uint64_t hash = hash_kmer(key);
+        add_kmer(&tables[partition_for_hash(hash, ctx->num_threads)], key, hash, 1);
     }
     
     return NULL;
 }
 
-// Count k-mers of a given length in the sequence using multiple threads
-HashTable* count_kmers(const unsigned char *sequence, int sequence_len, int frame_length) {
-    HashTable *table = create_hash_table(HASH_SIZE);
+// Worker thread function to merge every thread's table for the partition
+// numbered by the thread's index into the first thread's, which then becomes
+// that partition of the hash table
+void* merge_kmers_worker(void *arg) {
+    ThreadContext *ctx = (ThreadContext*)arg;
+    int part = ctx->thread_index;
+    KmerTable *merged = &ctx->private_tables[part];
+    
+    for (int t = 1; t < ctx->num_threads; t++) {
+        KmerTable *other = &ctx->private_tables[t * ctx->num_threads + part];
+        for (size_t i = 0; i < other->capacity; i++) {
+            if (other->slots[i].count) {
+                add_kmer(merged, other->slots[i].key, hash_kmer(other->slots[i].key),
+                         other->slots[i].count);
+            }
+        }
+        free(other->slots);
+    }
     
+    ctx->hash_table->parts[part] = *merged;
+    return NULL;
+}
+
+// Run worker on each of num_threads threads and wait for them to finish
+static void run_workers(void *(*worker)(void*), ThreadContext *contexts, int num_threads) {
+    pthread_t *threads = (pthread_t*)malloc(num_threads * sizeof(pthread_t));
+    if (!threads) {
+        perror("Failed to allocate thread resources");
+        exit(EXIT_FAILURE);
+    }
+    
+    for (int i = 0; i < num_threads; i++) {
+        if (pthread_create(&threads[i], NULL, worker, &contexts[i]) != 0) {
+            perror("Failed to create thread");
+            exit(EXIT_FAILURE);
+        }
+    }
+    
+    for (int i = 0; i < num_threads; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    
+    free(threads);
+}
+
+// Count k-mers of a given length in the sequence using multiple threads. Each
+// thread counts its part of the sequence into private tables and then the
+// threads merge them, one partition each.
+HashTable* count_kmers(const unsigned char *sequence, int sequence_len, int frame_length) {
     // Determine number of threads to use
     int num_threads = sysconf(_SC_NPROCESSORS_ONLN);
     if (num_threads <= 0) num_threads = 1;
     
-    // Create mutex for thread synchronization
-    pthread_mutex_t mutex;
-    pthread_mutex_init(&mutex, NULL);
+    HashTable *table = create_hash_table(num_threads);
     
-    // Prepare thread contexts and threads
-    pthread_t *threads = (pthread_t*)malloc(num_threads * sizeof(pthread_t));
+    // Prepare thread contexts and the private tables
     ThreadContext *contexts = (ThreadContext*)malloc(num_threads * sizeof(ThreadContext));
+    KmerTable *private_tables = (KmerTable*)malloc(num_threads * num_threads * sizeof(KmerTable));
     
-    if (!threads || !contexts) {
+    if (!contexts || !private_tables) {
         perror("Failed to allocate thread resources");
         exit(EXIT_FAILURE);
     }
     
-    // Divide the work among threads
-    int chunk_size = (sequence_len - frame_length + 1) / num_threads;
-    int remaining = (sequence_len - frame_length + 1) % num_threads;
+    for (int i = 0; i < num_threads * num_threads; i++) {
+        init_kmer_table(&private_tables[i], INITIAL_TABLE_CAPACITY);
+    }
+    
+    // Divide the k-mer start positions among threads
+    int num_kmers = sequence_len - frame_length + 1;
+    if (num_kmers < 0) num_kmers = 0;
+    int chunk_size = num_kmers / num_threads;
+    int remaining = num_kmers % num_threads;
     
     for (int i = 0; i < num_threads; i++) {
         contexts[i].sequence = sequence;
-        contexts[i].sequence_len = sequence_len;
         contexts[i].start = i * chunk_size;
         contexts[i].end = (i + 1) * chunk_size;
         
@@ -223,23 +310,17 @@ HashTable* count_kmers(const unsigned char *sequence, int sequence_len, int fram
         }
         
         contexts[i].frame_length = frame_length;
+        contexts[i].thread_index = i;
+        contexts[i].num_threads = num_threads;
+        contexts[i].private_tables = private_tables;
         contexts[i].hash_table = table;
-        contexts[i].mutex = &mutex;
-        
-        if (pthread_create(&threads[i], NULL, count_kmers_worker, &contexts[i]) != 0) {
-            perror("Failed to create thread");
-            exit(EXIT_FAILURE);
-        }
     }
     
-    // Wait for all threads to complete
-    for (int i = 0; i < num_threads; i++) {
-        pthread_join(threads[i], NULL);
-    }
+    run_workers(count_kmers_worker, contexts, num_threads);
+    run_workers(merge_kmers_worker, contexts, num_threads);
     
     // Clean up
-    pthread_mutex_destroy(&mutex);
-    free(threads);
+    free(private_tables);
     free(contexts);
     
     return table;
@@ -266,12 +347,8 @@ int compare_frequency(const void *a, const void *b) {
 int extract_kmers(HashTable *table, int frame_length, KmerCount **results) {
     // Count total number of unique k-mers
     int total_kmers = 0;
-    for (int i = 0; i < table->size; i++) {
-        KmerEntry *entry = table->buckets[i];
-        while (entry) {
-            total_kmers++;
-            entry = entry->next;
-        }
+    for (int p = 0; p < table->num_parts; p++) {
+        total_kmers += table->parts[p].size;
     }
     
     // Allocate array for results
@@ -283,20 +360,23 @@ int extract_kmers(HashTable *table, int frame_length, KmerCount **results) {
     
     // Extract all k-mers and counts
     int index = 0;
-    for (int i = 0; i < table->size; i++) {
-        KmerEntry *entry = table->buckets[i];
-        while (entry) {
+    for (int p = 0; p < table->num_parts; p++) {
+        KmerTable *part = &table->parts[p];
+        for (size_t i = 0; i < part->capacity; i++) {
+            if (!part->slots[i].count) {
+                continue;
+            }
+            
             (*results)[index].kmer = (char*)malloc(frame_length + 1);
             if (!(*results)[index].kmer) {
                 perror("Failed to allocate k-mer string");
                 exit(EXIT_FAILURE);
             }
             
-            decode_kmer(entry->key, frame_length, (*results)[index].kmer);
-            (*results)[index].count = entry->count;
+            decode_kmer(part->slots[i].key, frame_length, (*results)[index].kmer);
+            (*results)[index].count = part->slots[i].count;
             
             index++;
-            entry = entry->next;
         }
     }
     
@@ -374,6 +454,127 @@ void print_frequencies(HashTable *table, int frame_length, int sequence_len, int
     free(results);
 }
 
+// Comparison function for sorting k-mer slots by count (descending) and then by
+// key (ascending), which is the same order as compare_frequency since the
+// 2-bit codes are in alphabetical order
+static inline int compare_slots(const KmerSlot *a, const KmerSlot *b) {
+    if (a->count != b->count) {
+        return a->count > b->count ? -1 : 1;
+    }
+    return a->key < b->key ? -1 : a->key > b->key;
+}
+
+static int compare_slots_qsort(const void *a, const void *b) {
+    return compare_slots((const KmerSlot*)a, (const KmerSlot*)b);
+}
+
+// Copy every k-mer and count in the hash table into a new array
+int collect_kmers(HashTable *table, KmerSlot **results) {
+    int total_kmers = 0;
+    for (int p = 0; p < table->num_parts; p++) {
+        total_kmers += table->parts[p].size;
+    }
+    
+    *results = (KmerSlot*)malloc((total_kmers ? total_kmers : 1) * sizeof(KmerSlot));
+    if (!*results) {
+        perror("Failed to allocate results array");
+        exit(EXIT_FAILURE);
+    }
+    
+    int index = 0;
+    for (int p = 0; p < table->num_parts; p++) {
+        KmerTable *part = &table->parts[p];
+        for (size_t i = 0; i < part->capacity; i++) {
+            if (part->slots[i].count) {
+                (*results)[index++] = part->slots[i];
+            }
+        }
+    }
+    
+    return total_kmers;
+}
+
+// Add a k-mer to a heap of the top k-mers seen so far, which keeps the k-mer
+// that sorts last at the root so it is the one replaced by a better k-mer
+static void offer_to_heap(KmerSlot *heap, int *heap_size, int top, KmerSlot slot) {
+    int i;
+    if (*heap_size < top) {
+        // Sift up from the end
+        for (i = (*heap_size)++; i > 0 && compare_slots(&heap[(i - 1) / 2], &slot) < 0; i = (i - 1) / 2) {
+            heap[i] = heap[(i - 1) / 2];
+        }
+    } else {
+        if (compare_slots(&slot, &heap[0]) > 0) {
+            return;
+        }
+        
+        // Sift down from the root
+        for (i = 0; 2 * i + 1 < *heap_size;) {
+            int child = 2 * i + 1;
+            if (child + 1 < *heap_size && compare_slots(&heap[child], &heap[child + 1]) < 0) {
+                child++;
+            }
+            if (compare_slots(&slot, &heap[child]) > 0) {
+                break;
+            }
+            heap[i] = heap[child];
+            i = child;
+        }
+    }
+    heap[i] = slot;
+}
+
+// Select the top most frequent k-mers of the hash table, sorted, into a new
+// array. This only keeps a heap of top k-mers, so it costs O(n log top) rather
+// than a sort of every k-mer.
+int top_kmers(HashTable *table, int top, KmerSlot **results) {
+    *results = (KmerSlot*)malloc((top ? top : 1) * sizeof(KmerSlot));
+    if (!*results) {
+        perror("Failed to allocate results array");
+        exit(EXIT_FAILURE);
+    }
+    
+    int heap_size = 0;
+    for (int p = 0; p < table->num_parts; p++) {
+        KmerTable *part = &table->parts[p];
+        for (size_t i = 0; i < part->capacity; i++) {
+            if (part->slots[i].count) {
+                offer_to_heap(*results, &heap_size, top, part->slots[i]);
+            }
+        }
+    }
+    
+    qsort(*results, heap_size, sizeof(KmerSlot), compare_slots_qsort);
+    return heap_size;
+}
+
+// Write the relative frequencies of sorted k-mers to a file. Lines are
+// formatted into an OUTPUT_CHUNK_SIZE buffer which is written out each time it
+// fills, so tables of any size are written without the whole output in memory.
+void write_frequencies(FILE *file, const KmerSlot *kmers, int num_kmers, int frame_length, int sequence_len) {
+    char *chunk = (char*)malloc(OUTPUT_CHUNK_SIZE);
+    if (!chunk) {
+        perror("Failed to allocate output buffer");
+        exit(EXIT_FAILURE);
+    }
+    
+    size_t used = 0;
+    char kmer[33];
+    for (int i = 0; i < num_kmers; i++) {
+        if (OUTPUT_CHUNK_SIZE - used < (size_t)frame_length + 32) {
+            fwrite(chunk, 1, used, file);
+            used = 0;
+        }
+        
+        decode_kmer(kmers[i].key, frame_length, kmer);
+        double percentage = 100.0 * kmers[i].count / (sequence_len - frame_length + 1);
+        used += snprintf(chunk + used, OUTPUT_CHUNK_SIZE - used, "%s %.3f\n", kmer, percentage);
+    }
+    
+    fwrite(chunk, 1, used, file);
+    free(chunk);
+}
+
 // Print the frequency of a specific set of k-mers
 void print_specific_frequencies(HashTable *table, const char **kmers, int num_kmers, int frame_length, int sequence_len) {
     for (int i = 0; i < num_kmers; i++) {
@@ -383,7 +584,52 @@ void print_specific_frequencies(HashTable *table, const char **kmers, int num_km
     }
 }
 
-int main() {
+// Print the top most frequent k-mers of length frame_length, or all of them
+// when top is 0, and if path is given also write all of them there, sorted
+int report_top_kmers(const unsigned char *sequence, int sequence_len, int frame_length, int top, const char *path) {
+    HashTable *table = count_kmers(sequence, sequence_len, frame_length);
+    KmerSlot *kmers;
+    int num_kmers;
+    
+    if (path || top == 0) {
+        num_kmers = collect_kmers(table, &kmers);
+        qsort(kmers, num_kmers, sizeof(KmerSlot), compare_slots_qsort);
+        if (path) {
+            FILE *file = fopen(path, "w");
+            if (!file) {
+                perror(path);
+                return EXIT_FAILURE;
+            }
+            write_frequencies(file, kmers, num_kmers, frame_length, sequence_len);
+            fclose(file);
+        }
+        if (top && top < num_kmers) {
+            num_kmers = top;
+        }
+    } else {
+        num_kmers = top_kmers(table, top, &kmers);
+    }
+    
+    write_frequencies(stdout, kmers, num_kmers, frame_length, sequence_len);
+    free(kmers);
+    free_hash_table(table);
+    return EXIT_SUCCESS;
+}
+
+// With fewer than two arguments this prints the benchmark's frequencies and
+// counts. "k top [file]" instead reports the top most frequent k-mers of
+// length k with report_top_kmers.
+int main(int argc, char *argv[]) {
+    int frame_length = 0, top = 0;
+    if (argc >= 3) {
+        frame_length = atoi(argv[1]);
+        top = atoi(argv[2]);
+        if (argc > 4 || frame_length < 1 || frame_length > 32 || top < 0) {
+            fprintf(stderr, "usage: %s [k top [file]] with k from 1 to 32\n", argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+    
     // Read the DNA sequence from stdin
     int sequence_len;
     unsigned char *sequence = read_sequence(stdin, "THREE", &sequence_len);
@@ -393,6 +639,12 @@ int main() {
         return EXIT_FAILURE;
     }
     
+    if (frame_length) {
+        int status = report_top_kmers(sequence, sequence_len, frame_length, top, argc > 3 ? argv[3] : NULL);
+        free(sequence);
+        return status;
+    }
+    
     // Count 1-nucleotide frequencies and print
     HashTable *table1 = count_kmers(sequence, sequence_len, 1);
     print_frequencies(table1, 1, sequence_len, 1); // relative percentages
@@ -11,8 +11,17 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <unistd.h>
+#ifdef __AVX2__
+	#include <immintrin.h>
+#endif
+#ifdef _OPENMP
+	#include <omp.h>
+#endif
 
 #include "khash.h"
+#include "bench.h"
+#include "bench_input.h"
 
 // Define a custom hash function to use instead of khash's default hash
 // function. This custom hash function uses a simpler bit shift and XOR which
@@ -32,6 +41,52 @@ typedef struct {
 } element;
 
 
+// Threads only split the counting of oligonucleotides when each of them would
+// get at least this many nucleotides.
+#define MINIMUM_SLICE_LENGTH 65536
+
+
+// Oligonucleotides up to this length are counted in a flat array indexed by
+// key instead of in hash tables. The array for this length takes 4^12 counts,
+// which is 64 MB.
+#define DENSE_MAXIMUM_LENGTH 12
+
+// Up to this many keys each thread counts into its own flat array, which are
+// then added together. Above it the threads share one array and increment it
+// atomically.
+#define PRIVATE_DENSE_MAXIMUM_KEYS 65536
+
+// Up to this many keys a thread's flat array has DENSE_COPIES interleaved
+// copies that consecutive oligonucleotides take turns counting into, so that
+// repeats of the same oligonucleotide don't wait on each other's increment.
+#define DENSE_COPIES_MAXIMUM_KEYS 4096
+#define DENSE_COPIES 4
+
+
+// Counts for all the oligonucleotides of length, either in dense, a flat
+// array indexed by key, or else in hash tables. The keys of the hash tables are
+// split between partitions by a hash of the key so that several threads can
+// merge their private counts at the same time, each thread merging a different
+// partition.
+//
+// With canonical set, an oligonucleotide and its reverse complement are
+// counted together under whichever of their keys is smaller.
+typedef struct {
+	intnative_t	length;
+	intnative_t	partitions;
+	khash_t(oligonucleotide) ** tables;
+	uint32_t *	dense;
+	int	canonical;
+} oligonucleotide_Counts;
+
+
+// Macro to map a key to a partition in [0, partitions). This uses a
+// multiplicative hash and then scales its top 32 bits to the partition count
+// with a multiply instead of a division.
+#define partition_For_Key(key, partitions) \
+  ((intnative_t)(((key)*UINT64_C(0x9E3779B97F4A7C15)>>32)*(partitions)>>32))
+
+
 // Macro to convert a nucleotide character to a code. Note that upper and lower
 // case ASCII letters only differ in the fifth bit from the right and we only
 // need the three least significant bits to differentiate the letters 'A', 'C',
@@ -44,6 +99,377 @@ typedef struct {
 #define nucleotide_For_Code(code) ("ACGT"[code & 0x3])
 
 
+// Macro to get the code of the complement of the nucleotide with code. This is
+// the pairing of COMPLEMENT_LOOKUP in reverse-complement, A with T and C with
+// G, which the order of the codes above makes 3-code.
+#define complement_Code(code) (3-(code))
+
+
+// The polynucleotide is kept packed with the codes of 32 nucleotides to each
+// uint64_t, the first nucleotide in the two least significant bits. This macro
+// gets the code of nucleotide i.
+#define code_At(packed, i) ((packed)[(i)>>5]>>2*((i)&31) & 0x3)
+
+
+// The most lengths count_Oligonucleotides_Of_Lengths counts in one pass.
+#define MAXIMUM_LENGTHS 16
+
+// How many bytes of stdin to read at a time when it isn't a regular file.
+#define INPUT_READ_SIZE 1048576
+
+// How many bytes of frequencies write_Frequencies() writes at a time.
+#define OUTPUT_CHUNK_SIZE 1048576
+
+// How many nucleotides pack_Nucleotide_Block() packs at once.
+#define NUCLEOTIDE_BLOCK 32
+
+// How many nucleotides ahead to prefetch the counts in large flat arrays and
+// in hash tables.
+#define PREFETCH_DISTANCE 32
+
+
+// Add count to the count for key in hash_Table.
+static inline void add_To_Count(khash_t(oligonucleotide) * const hash_Table
+  , const uint64_t key, const uint32_t count){
+
+	int element_Was_Unused;
+	const khiter_t k=kh_put(oligonucleotide, hash_Table, key
+	  , &element_Was_Unused);
+
+	// If the element_Was_Unused, then initialize the count, otherwise increment
+	// the count.
+	if(element_Was_Unused)
+		kh_value(hash_Table, k)=count;
+	else
+		kh_value(hash_Table, k)+=count;
+}
+
+
+// Return how many threads to split counting ends oligonucleotides between.
+static intnative_t threads_For_Slices(const intnative_t ends){
+	intnative_t threads=1;
+#ifdef _OPENMP
+	threads=omp_get_max_threads();
+#endif
+	if(threads>ends/MINIMUM_SLICE_LENGTH)
+		threads=ends/MINIMUM_SLICE_LENGTH>1 ? ends/MINIMUM_SLICE_LENGTH : 1;
+	return threads;
+}
+
+
+// Where one thread puts the counts for each length while counting its slice.
+// The lengths counted in flat arrays come first, then those counted in hash
+// tables. copy_Stride is the number of keys for lengths whose arrays have
+// DENSE_COPIES interleaved copies, and 0 otherwise. When counting canonical
+// oligonucleotides, the reverse complement of each length is its reverse
+// complement key shifted right by its reverse_Shift.
+typedef struct {
+	intnative_t	dense_Lengths, hash_Lengths, partitions;
+	intnative_t	dense_Length[MAXIMUM_LENGTHS], hash_Length[MAXIMUM_LENGTHS];
+	uint64_t	dense_Mask[MAXIMUM_LENGTHS], hash_Mask[MAXIMUM_LENGTHS];
+	intnative_t	dense_Reverse_Shift[MAXIMUM_LENGTHS]
+	  , hash_Reverse_Shift[MAXIMUM_LENGTHS];
+	intnative_t	copy_Stride[MAXIMUM_LENGTHS];
+	int	atomic[MAXIMUM_LENGTHS];
+	uint32_t *	dense[MAXIMUM_LENGTHS];
+	khash_t(oligonucleotide) ** tables[MAXIMUM_LENGTHS];
+} slice_Counters;
+
+
+// Return the key to count an oligonucleotide with key under, given its reverse
+// complement key: key itself or, with canonical set, the smaller of the two.
+static inline uint64_t counted_Key(const uint64_t key
+  , const uint64_t reverse_Key, const int canonical){
+	return canonical && reverse_Key<key ? reverse_Key : key;
+}
+
+
+// Count the oligonucleotide ending at position i of the polynucleotide, whose
+// last nucleotides are in key and the reverse complements of those in
+// reverse_Key, for every length of counters. With check set, only lengths that
+// fit in the first i+1 nucleotides are counted.
+static inline void count_Position(const slice_Counters * const counters
+  , const intnative_t i, const uint64_t key, const uint64_t reverse_Key
+  , const int check, const int canonical){
+
+	for(intnative_t d=0; d<counters->dense_Lengths; d++){
+		if(check && i<counters->dense_Length[d]-1)
+			continue;
+		uint32_t * const count=counters->dense[d]
+		  +(i&(DENSE_COPIES-1))*counters->copy_Stride[d]
+		  +counted_Key(key&counters->dense_Mask[d]
+		  , reverse_Key>>counters->dense_Reverse_Shift[d], canonical);
+		if(counters->atomic[d]){
+			#pragma omp atomic
+			(*count)++;
+		}else
+			(*count)++;
+	}
+
+	for(intnative_t h=0; h<counters->hash_Lengths; h++){
+		if(check && i<counters->hash_Length[h]-1)
+			continue;
+		const uint64_t masked_Key=counted_Key(key&counters->hash_Mask[h]
+		  , reverse_Key>>counters->hash_Reverse_Shift[h], canonical);
+		add_To_Count(counters->tables[h]
+		  [partition_For_Key(masked_Key, counters->partitions)], masked_Key, 1);
+	}
+}
+
+
+// Count the oligonucleotides of every length of counters that end at positions
+// [slice_Start, slice_End) of packed. key only needs the last longest
+// nucleotides, so one rolling key, masked for each length, serves them all.
+// With canonical set, reverse_Key rolls the other way beside it: each
+// nucleotide's complement enters at the top of the longest length's key, so
+// the reverse complement of a shorter length is in its top bits.
+static inline void count_Slice(const uint64_t * const packed
+  , const intnative_t slice_Start, const intnative_t slice_End
+  , const intnative_t longest, const slice_Counters * const counters
+  , const int canonical){
+
+	uint64_t key=0, ahead_Key=0, reverse_Key=0, ahead_Reverse_Key=0;
+	const intnative_t reverse_Top=2*(longest-1);
+	intnative_t i=slice_Start>longest-1 ? slice_Start-(longest-1) : 0;
+
+	// Append the nucleotide at j to key and its complement to reverse_Key. The
+	// reverse complement keys are only kept when they are used.
+	#define append_Nucleotide(key, reverse_Key, j) do{ \
+		const uint64_t code=code_At(packed, j); \
+		key=key<<2 | code; \
+		if(canonical) \
+			reverse_Key=reverse_Key>>2 \
+			  | (uint64_t)complement_Code(code)<<reverse_Top; \
+	}while(0)
+
+	// For the first several nucleotides we only need to append them to key in
+	// preparation for the insertion of complete oligonucleotides.
+	for(; i<slice_Start; i++)
+		append_Nucleotide(key, reverse_Key, i);
+
+	// Near the start of the polynucleotide the longer lengths don't fit yet.
+	for(; i<slice_End && i<longest-1; i++){
+		append_Nucleotide(key, reverse_Key, i);
+		count_Position(counters, i, key, reverse_Key, 1, canonical);
+	}
+
+	// The counts in the large flat arrays and the hash tables are nearly
+	// always cache misses and the shorter lengths' counting between them keeps
+	// too few of them in flight, so ahead_Key runs PREFETCH_DISTANCE
+	// nucleotides ahead of key to prefetch them. A hash table may still grow
+	// before the prefetched bucket is used, which only makes it a wasted
+	// prefetch.
+	for(intnative_t j=i; j<i+PREFETCH_DISTANCE && j<slice_End; j++)
+		append_Nucleotide(ahead_Key, ahead_Reverse_Key, j);
+	for(; i+PREFETCH_DISTANCE<slice_End; i++){
+		append_Nucleotide(ahead_Key, ahead_Reverse_Key, i+PREFETCH_DISTANCE);
+		for(intnative_t d=0; d<counters->dense_Lengths; d++)
+			if(counters->dense_Mask[d]>=PRIVATE_DENSE_MAXIMUM_KEYS)
+				__builtin_prefetch(counters->dense[d]
+				  +counted_Key(ahead_Key&counters->dense_Mask[d]
+				  , ahead_Reverse_Key>>counters->dense_Reverse_Shift[d]
+				  , canonical), 1);
+		for(intnative_t h=0; h<counters->hash_Lengths; h++){
+			const uint64_t masked_Key=counted_Key(
+			  ahead_Key&counters->hash_Mask[h]
+			  , ahead_Reverse_Key>>counters->hash_Reverse_Shift[h], canonical);
+			const khash_t(oligonucleotide) * const hash_Table=counters->tables[h]
+			  [partition_For_Key(masked_Key, counters->partitions)];
+			const khint_t bucket=(khint_t)CUSTOM_HASH_FUNCTION(masked_Key)
+			  & (hash_Table->n_buckets-1);
+			__builtin_prefetch(hash_Table->keys+bucket, 1);
+			__builtin_prefetch(hash_Table->vals+bucket, 1);
+		}
+		append_Nucleotide(key, reverse_Key, i);
+		count_Position(counters, i, key, reverse_Key, 0, canonical);
+	}
+
+	for(; i<slice_End; i++){
+		append_Nucleotide(key, reverse_Key, i);
+		count_Position(counters, i, key, reverse_Key, 0, canonical);
+	}
+
+	#undef append_Nucleotide
+}
+
+
+// Count all the oligonucleotides of each of the lengths_Count lengths in
+// packed, a polynucleotide of polynucleotide_Length nucleotides, into counts,
+// in one pass over it. Each thread counts the oligonucleotides that end in its
+// own slice of the polynucleotide, starting the longest length before the
+// slice so that oligonucleotides that cross the slice boundaries are counted
+// once.
+//
+// Lengths up to DENSE_MAXIMUM_LENGTH are counted in flat arrays with no
+// hashing. Up to PRIVATE_DENSE_MAXIMUM_KEYS keys each thread has its own array
+// and the arrays are added together, and above that the threads share one. Longer lengths go to private hash tables
+// for each partition and the threads then each merge every thread's table for
+// one partition.
+//
+// With canonical set, each oligonucleotide is counted under the smaller of its
+// key and its reverse complement's, so both strands are counted in the same
+// pass and the hash tables only hold half as many keys.
+static void count_Oligonucleotides_Of_Lengths(const uint64_t * const packed
+  , const intnative_t polynucleotide_Length, const intnative_t * const lengths
+  , const intnative_t lengths_Count, const int canonical
+  , oligonucleotide_Counts * const counts){
+
+	intnative_t longest=0;
+	for(intnative_t l=0; l<lengths_Count; l++)
+		longest=lengths[l]>longest ? lengths[l] : longest;
+
+	// Threads are only worth it when each gets a long slice of every length.
+	const intnative_t ends=polynucleotide_Length-(longest-1);
+	intnative_t partitions=0;
+	khash_t(oligonucleotide) ** private_Tables[MAXIMUM_LENGTHS];
+
+	#pragma omp parallel num_threads(threads_For_Slices(ends))
+	{
+		intnative_t thread=0, threads=1;
+#ifdef _OPENMP
+		thread=omp_get_thread_num();
+		threads=omp_get_num_threads();
+#endif
+
+		// The runtime may give us fewer threads than asked for, so the number
+		// of partitions is only known once inside the parallel region.
+		#pragma omp single
+		{
+			partitions=threads;
+			for(intnative_t l=0; l<lengths_Count; l++){
+				const intnative_t keys=(intnative_t)1<<2*lengths[l];
+				counts[l]=(oligonucleotide_Counts){lengths[l], 0, NULL, NULL
+				  , canonical};
+				if(lengths[l]<=DENSE_MAXIMUM_LENGTH)
+					counts[l].dense=calloc(keys, sizeof(uint32_t));
+				else{
+					counts[l].partitions=partitions;
+					counts[l].tables=malloc(partitions*sizeof(*counts[l].tables));
+					private_Tables[l]=malloc(partitions*partitions
+					  *sizeof(*private_Tables[l]));
+				}
+			}
+		}
+
+		slice_Counters counters={0, 0, partitions};
+		for(intnative_t l=0; l<lengths_Count; l++){
+			const intnative_t keys=(intnative_t)1<<2*lengths[l];
+			if(counts[l].dense){
+				const intnative_t d=counters.dense_Lengths++;
+				counters.dense_Length[d]=lengths[l];
+				counters.dense_Mask[d]=keys-1;
+				counters.dense_Reverse_Shift[d]=2*(longest-lengths[l]);
+				if(keys<=PRIVATE_DENSE_MAXIMUM_KEYS){
+					const intnative_t copies
+					  =keys<=DENSE_COPIES_MAXIMUM_KEYS ? DENSE_COPIES : 1;
+					counters.copy_Stride[d]=copies==DENSE_COPIES ? keys : 0;
+					counters.dense[d]=calloc(keys*copies, sizeof(uint32_t));
+				}else{
+					counters.dense[d]=counts[l].dense;
+					counters.atomic[d]=threads>1;
+				}
+			}else{
+				const intnative_t h=counters.hash_Lengths++;
+				counters.hash_Length[h]=lengths[l];
+				counters.hash_Mask[h]=keys-1;
+				counters.hash_Reverse_Shift[h]=2*(longest-lengths[l]);
+				counters.tables[h]=private_Tables[l]+thread*partitions;
+				for(intnative_t p=0; p<partitions; p++)
+					counters.tables[h][p]=kh_init(oligonucleotide);
+			}
+		}
+
+		// The oligonucleotides ending at positions [slice_Start, slice_End).
+		const intnative_t slice_Start=longest-1+ends*thread/threads;
+		const intnative_t slice_End=longest-1+ends*(thread+1)/threads;
+
+		// The first thread also has the oligonucleotides of the shorter lengths
+		// that end before the longest length fits. count_Slice() is inlined
+		// once for each mode so that the usual count pays nothing for
+		// canonical.
+		if(canonical)
+			count_Slice(packed, thread==0 ? 0 : slice_Start, slice_End, longest
+			  , &counters, 1);
+		else
+			count_Slice(packed, thread==0 ? 0 : slice_Start, slice_End, longest
+			  , &counters, 0);
+
+		// Add up the private flat arrays.
+		for(intnative_t l=0, d=0; l<lengths_Count; l++){
+			if(!counts[l].dense)
+				continue;
+			if(counters.dense[d]!=counts[l].dense){
+				const intnative_t keys=counters.dense_Mask[d]+1;
+				const intnative_t copies=counters.copy_Stride[d] ? DENSE_COPIES : 1;
+				#pragma omp critical
+				for(intnative_t c=0; c<copies; c++)
+					for(intnative_t key=0; key<keys; key++)
+						counts[l].dense[key]+=counters.dense[d][c*keys+key];
+				free(counters.dense[d]);
+			}
+			d++;
+		}
+
+		// Merge every thread's table for partition thread into the first
+		// thread's table for it.
+		#pragma omp barrier
+
+		for(intnative_t l=0; l<lengths_Count; l++){
+			if(counts[l].dense)
+				continue;
+			khash_t(oligonucleotide) * const merged=private_Tables[l][thread];
+			for(intnative_t t=1; t<partitions; t++){
+				khash_t(oligonucleotide) * const other
+				  =private_Tables[l][t*partitions+thread];
+				uint64_t other_Key;
+				uint32_t other_Count;
+				kh_foreach(other, other_Key, other_Count
+				  , add_To_Count(merged, other_Key, other_Count));
+				kh_destroy(oligonucleotide, other);
+			}
+			counts[l].tables[thread]=merged;
+		}
+	}
+
+	for(intnative_t l=0; l<lengths_Count; l++)
+		if(!counts[l].dense)
+			free(private_Tables[l]);
+}
+
+
+// Return the key of the reverse complement of the oligonucleotide with key,
+// which has length nucleotides.
+static uint64_t reverse_Complement_Key(uint64_t key, const intnative_t length){
+	uint64_t reverse_Key=0;
+	for(intnative_t j=0; j<length; j++, key>>=2)
+		reverse_Key=reverse_Key<<2 | complement_Code(key&0x3);
+	return reverse_Key;
+}
+
+
+// Return the count in counts for the oligonucleotide with key, which for
+// canonical counts includes its reverse complement.
+static uint32_t lookup_Count(const oligonucleotide_Counts * const counts
+  , uint64_t key){
+	if(counts->canonical)
+		key=counted_Key(key, reverse_Complement_Key(key, counts->length), 1);
+	if(counts->dense)
+		return counts->dense[key];
+	khash_t(oligonucleotide) * const hash_Table
+	  =counts->tables[partition_For_Key(key, counts->partitions)];
+	const khiter_t k=kh_get(oligonucleotide, hash_Table, key);
+	return k==kh_end(hash_Table) ? 0 : kh_value(hash_Table, k);
+}
+
+
+static void free_Counts(oligonucleotide_Counts * const counts){
+	for(intnative_t p=0; p<counts->partitions; p++)
+		kh_destroy(oligonucleotide, counts->tables[p]);
+	free(counts->tables);
+	free(counts->dense);
+}
+
+
 // Function to use when sorting elements with qsort() later. Elements with
 // larger values will come first and in cases of identical values then elements
 // with smaller keys will come first.
@@ -60,50 +486,151 @@ static int element_Compare(const element * const left_Element
 }
 
 
-// Generate frequencies for all oligonucleotides in polynucleotide that are of
-// desired_Length_For_Oligonucleotides and then save it to output.
-static void generate_Frequencies_For_Desired_Length_Oligonucleotides(
-  const char * const polynucleotide, const intnative_t polynucleotide_Length
-  , const intnative_t desired_Length_For_Oligonucleotides, char * const output){
+// Return an array of elements for all the oligonucleotides of counts that were
+// seen, with how many there are in *elements_Array_Size.
+static element * collect_Elements(const oligonucleotide_Counts * const counts
+  , intnative_t * const elements_Array_Size){
 
-	khash_t(oligonucleotide) * hash_Table=kh_init(oligonucleotide);
+	intnative_t i=0;
+	element * elements_Array;
+	*elements_Array_Size=0;
+	if(counts->dense){
+		const intnative_t keys=(intnative_t)1<<2*counts->length;
+		for(intnative_t key=0; key<keys; key++)
+			*elements_Array_Size+=counts->dense[key]!=0;
+		elements_Array=malloc(*elements_Array_Size*sizeof(element));
+		for(intnative_t key=0; key<keys; key++)
+			if(counts->dense[key])
+				elements_Array[i++]=((element){key, counts->dense[key]});
+	}else{
+		for(intnative_t p=0; p<counts->partitions; p++)
+			*elements_Array_Size+=kh_size(counts->tables[p]);
+		elements_Array=malloc(*elements_Array_Size*sizeof(element));
+		uint64_t key;
+		uint32_t value;
+		for(intnative_t p=0; p<counts->partitions; p++)
+			kh_foreach(counts->tables[p], key, value
+			  , elements_Array[i++]=((element){key, value}));
+	}
+	return elements_Array;
+}
 
-	uint64_t key=0;
-	const uint64_t mask=((uint64_t)1<<2*desired_Length_For_Oligonucleotides)-1;
 
-	// For the first several nucleotides we only need to append them to key in
-	// preparation for the insertion of complete oligonucleotides to hash_Table.
-	for(intnative_t i=0; i<desired_Length_For_Oligonucleotides-1; i++)
-		key=(key<<2 & mask) | polynucleotide[i];
-
-	// Add all the complete oligonucleotides of
-	// desired_Length_For_Oligonucleotides to hash_Table and update the count
-	// for each oligonucleotide.
-	for(intnative_t i=desired_Length_For_Oligonucleotides-1
-	  ; i<polynucleotide_Length; i++){
-
-		key=(key<<2 & mask) | polynucleotide[i];
-
-		int element_Was_Unused;
-		const khiter_t k=kh_put(oligonucleotide, hash_Table, key
-		  , &element_Was_Unused);
-
-		// If the element_Was_Unused, then initialize the count to 1, otherwise
-		// increment the count.
-		if(element_Was_Unused)
-			kh_value(hash_Table, k)=1;
-		else
-			kh_value(hash_Table, k)++;
+// Offer new_Element to heap, a heap of heap_Size elements with the element that
+// would be sorted last at the root. Once the heap has top elements, new_Element
+// replaces the root if it would be sorted before it.
+static inline void offer_To_Heap(element * const heap
+  , intnative_t * const heap_Size, const intnative_t top
+  , const element new_Element){
+
+	intnative_t i;
+	if(*heap_Size<top){
+		// Sift new_Element up from the end.
+		for(i=(*heap_Size)++; i>0 && element_Compare(&heap[(i-1)/2]
+		  , &new_Element)<0; i=(i-1)/2)
+			heap[i]=heap[(i-1)/2];
+	}else{
+		if(element_Compare(&new_Element, &heap[0])>0)
+			return;
+
+		// Sift new_Element down from the root.
+		for(i=0; 2*i+1<*heap_Size;){
+			intnative_t child=2*i+1;
+			if(child+1<*heap_Size && element_Compare(&heap[child]
+			  , &heap[child+1])<0)
+				child++;
+			if(element_Compare(&new_Element, &heap[child])>0)
+				break;
+			heap[i]=heap[child];
+			i=child;
+		}
+	}
+	heap[i]=new_Element;
+}
+
+
+// Return a sorted array of the top elements of counts, with how many there are
+// in *elements_Array_Size. Only a heap of top elements is kept while going
+// through counts, so this is O(n log top) and needs no array of every element.
+static element * select_Top_Elements(const oligonucleotide_Counts * const counts
+  , const intnative_t top, intnative_t * const elements_Array_Size){
+
+	element * const heap=malloc(top*sizeof(element));
+	intnative_t heap_Size=0;
+	if(counts->dense){
+		const intnative_t keys=(intnative_t)1<<2*counts->length;
+		for(intnative_t key=0; key<keys; key++)
+			if(counts->dense[key])
+				offer_To_Heap(heap, &heap_Size, top
+				  , (element){key, counts->dense[key]});
+	}else{
+		uint64_t key;
+		uint32_t value;
+		for(intnative_t p=0; p<counts->partitions; p++)
+			kh_foreach(counts->tables[p], key, value
+			  , offer_To_Heap(heap, &heap_Size, top, (element){key, value}));
 	}
 
-	// Create an array of elements from hash_Table.
-	intnative_t elements_Array_Size=kh_size(hash_Table), i=0;
-	element * elements_Array=malloc(elements_Array_Size*sizeof(element));
-	uint32_t value;
-	kh_foreach(hash_Table, key, value
-	  , elements_Array[i++]=((element){key, value}));
+	qsort(heap, heap_Size, sizeof(element)
+	  , (int (*)(const void *, const void *)) element_Compare);
+	*elements_Array_Size=heap_Size;
+	return heap;
+}
+
+
+// Convert key, the key for an oligonucleotide of length nucleotides, to a
+// string in oligonucleotide.
+static void oligonucleotide_For_Key(uint64_t key, const intnative_t length
+  , char * const oligonucleotide){
+	for(intnative_t j=length-1; j>-1; j--){
+		oligonucleotide[j]=nucleotide_For_Code(key);
+		key>>=2;
+	}
+	oligonucleotide[length]='\0';
+}
 
-	kh_destroy(oligonucleotide, hash_Table);
+
+// Write the frequencies for the elements_Array_Size elements of elements_Array,
+// oligonucleotides of length nucleotides from a polynucleotide of
+// polynucleotide_Length nucleotides, to file. The lines are formatted into
+// OUTPUT_CHUNK_SIZE chunks which are each written with one fwrite() so that
+// tables of any size can be written without the whole output in memory.
+static void write_Frequencies(const element * const elements_Array
+  , const intnative_t elements_Array_Size, const intnative_t length
+  , const intnative_t polynucleotide_Length, FILE * const file){
+
+	char * const chunk=malloc(OUTPUT_CHUNK_SIZE);
+	intnative_t chunk_Position=0;
+	for(intnative_t i=0; i<elements_Array_Size; i++){
+		// Write out the chunk once it might not fit another line.
+		if(OUTPUT_CHUNK_SIZE-chunk_Position<length+32){
+			fwrite(chunk, 1, chunk_Position, file);
+			chunk_Position=0;
+		}
+
+		char oligonucleotide[length+1];
+		oligonucleotide_For_Key(elements_Array[i].key, length, oligonucleotide);
+		chunk_Position+=snprintf(chunk+chunk_Position
+		  , OUTPUT_CHUNK_SIZE-chunk_Position, "%s %.3f\n", oligonucleotide
+		  , 100.0f*elements_Array[i].value/(polynucleotide_Length-length+1));
+	}
+	fwrite(chunk, 1, chunk_Position, file);
+	free(chunk);
+}
+
+
+// Generate frequencies for all the oligonucleotides of counts, from a
+// polynucleotide of polynucleotide_Length nucleotides, and then save it to
+// output.
+static void generate_Frequencies_For_Desired_Length_Oligonucleotides(
+  const oligonucleotide_Counts * const counts
+  , const intnative_t polynucleotide_Length, char * const output){
+	const intnative_t desired_Length_For_Oligonucleotides=counts->length;
+
+	// Create an array of elements from the oligonucleotides that were seen.
+	intnative_t elements_Array_Size;
+	element * const elements_Array=collect_Elements(counts
+	  , &elements_Array_Size);
 
 	// Sort elements_Array.
 	qsort(elements_Array, elements_Array_Size, sizeof(element)
@@ -114,11 +641,8 @@ static void generate_Frequencies_For_Desired_Length_Oligonucleotides(
 
 		// Convert the key for the oligonucleotide to a string.
 		char oligonucleotide[desired_Length_For_Oligonucleotides+1];
-		for(intnative_t j=desired_Length_For_Oligonucleotides-1; j>-1; j--){
-			oligonucleotide[j]=nucleotide_For_Code(elements_Array[i].key);
-			elements_Array[i].key>>=2;
-		}
-		oligonucleotide[desired_Length_For_Oligonucleotides]='\0';
+		oligonucleotide_For_Key(elements_Array[i].key
+		  , desired_Length_For_Oligonucleotides, oligonucleotide);
 
 		// Output the frequency for oligonucleotide to output.
 		output_Position+=snprintf(output+output_Position
@@ -131,117 +655,613 @@ static void generate_Frequencies_For_Desired_Length_Oligonucleotides(
 }
 
 
+// Return the key for oligonucleotide, which has length nucleotides.
+static uint64_t key_For_Oligonucleotide(const char * const oligonucleotide
+  , const intnative_t length){
+	uint64_t key=0;
+	for(intnative_t i=0; i<length; i++)
+		key=(key<<2) | code_For_Nucleotide(oligonucleotide[i]);
+	return key;
+}
+
+
 // Generate a count for the number of times oligonucleotide appears in
-// polynucleotide and then save it to output.
+// counts, which must be for its length, and then save it to output.
 static void generate_Count_For_Oligonucleotide(
-  const char * const polynucleotide, const intnative_t polynucleotide_Length
+  const oligonucleotide_Counts * const counts
   , const char * const oligonucleotide, char * const output){
 	const intnative_t oligonucleotide_Length=strlen(oligonucleotide);
 
-	khash_t(oligonucleotide) * const hash_Table=kh_init(oligonucleotide);
+	// Output the count for oligonucleotide to output.
+	uintmax_t count=lookup_Count(counts
+	  , key_For_Oligonucleotide(oligonucleotide, oligonucleotide_Length));
+	snprintf(output, MAXIMUM_OUTPUT_LENGTH, "%ju\t%s", count, oligonucleotide);
+}
+
 
-	uint64_t key=0;
-	const uint64_t mask=((uint64_t)1<<2*oligonucleotide_Length)-1;
+// Input is read with large reads into a buffer, [start, end) of which hasn't
+// been used yet, or when stdin is a regular file the buffer is all of the file
+// mapped into memory by bench_input_open().
+typedef struct {
+	char *	data;
+	intnative_t	start, end, capacity;
+	int	mapped;
+	bench_input	source;
+} input_Buffer;
 
-	// For the first several nucleotides we only need to append them to key in
-	// preparation for the insertion of complete oligonucleotides to hash_Table.
-	for(intnative_t i=0; i<oligonucleotide_Length-1; i++)
-		key=(key<<2 & mask) | polynucleotide[i];
 
-	// Add all the complete oligonucleotides of oligonucleotide_Length to
-	// hash_Table and update the count for each oligonucleotide.
-	for(intnative_t i=oligonucleotide_Length-1; i<polynucleotide_Length; i++){
+// Start input_Buffer on stdin.
+static void open_Input(input_Buffer * const input){
+	if(bench_input_open(&input->source, STDIN_FILENO)){
+		input->data=input->source.data;
+		input->start=input->source.pos;
+		input->end=input->capacity=input->source.size;
+		input->mapped=1;
+		return;
+	}
+
+	input->data=malloc(INPUT_READ_SIZE);
+	input->start=input->end=0;
+	input->capacity=INPUT_READ_SIZE;
+	input->mapped=0;
+}
 
-		key=(key<<2 & mask) | polynucleotide[i];
 
-		int element_Was_Unused;
-		const khiter_t k=kh_put(oligonucleotide, hash_Table, key
-		  , &element_Was_Unused);
+// Move the unused input to the start of input's buffer and read more after it.
+// Return how many bytes were read, which is 0 at the end of the input.
+static intnative_t fill_Input(input_Buffer * const input){
+	if(input->mapped)
+		return 0;
 
-		// If the element_Was_Unused, then initialize the count to 1, otherwise
-		// increment the count.
-		if(element_Was_Unused)
-			kh_value(hash_Table, k)=1;
-		else
-			kh_value(hash_Table, k)++;
+	memmove(input->data, input->data+input->start, input->end-input->start);
+	input->end-=input->start;
+	input->start=0;
+	if(input->capacity-input->end<INPUT_READ_SIZE)
+		input->data=realloc(input->data, input->capacity*=2);
+
+	const ssize_t bytes_Read=bench_input_read(&input->source
+	  , input->data+input->end, input->capacity-input->end);
+	if(bytes_Read<0){
+		perror("read");
+		exit(EXIT_FAILURE);
 	}
+	input->end+=bytes_Read;
+	return bytes_Read;
+}
 
-	// Generate the key for oligonucleotide.
-	key=0;
-	for(intnative_t i=0; i<oligonucleotide_Length; i++)
-		key=(key<<2) | code_For_Nucleotide(oligonucleotide[i]);
 
-	// Output the count for oligonucleotide to output.
-	khiter_t k=kh_get(oligonucleotide, hash_Table, key);
-	uintmax_t count=k==kh_end(hash_Table) ? 0 : kh_value(hash_Table, k);
-	snprintf(output, MAXIMUM_OUTPUT_LENGTH, "%ju\t%s", count, oligonucleotide);
+static void close_Input(input_Buffer * const input){
+	if(input->mapped)
+		bench_input_close(&input->source);
+	else
+		free(input->data);
+}
+
+
+// Return the next line of input, without its newline, in *line and return its
+// length, or return -1 at the end of input. *line is only good until the
+// input is used again.
+static intnative_t next_Line(input_Buffer * const input
+  , const char ** const line){
+
+	const char * newline;
+	intnative_t searched=0;
+	while(!(newline=memchr(input->data+input->start+searched, '\n'
+	  , input->end-input->start-searched))){
+		searched=input->end-input->start;
+		if(!fill_Input(input)){
+			// The last line may not end with a newline.
+			if(!searched)
+				return -1;
+			*line=input->data+input->start;
+			input->start=input->end;
+			return searched;
+		}
+	}
+
+	*line=input->data+input->start;
+	const intnative_t line_Length=newline-*line;
+	input->start+=line_Length+1;
+	return line_Length;
+}
+
+
+// Skip input past the description line that starts with header. FASTA only
+// ever uses '>' to start description lines so memchr() can skip straight from
+// one to the next. Return 0 if there is no such line.
+static int find_Header(input_Buffer * const input, const char * const header){
+	const intnative_t header_Length=strlen(header);
+	for(;;){
+		const char * const found=memchr(input->data+input->start, '>'
+		  , input->end-input->start);
+		if(!found){
+			input->start=input->end;
+			if(!fill_Input(input))
+				return 0;
+			continue;
+		}
+		input->start=found-input->data;
+
+		while(input->end-input->start<header_Length && fill_Input(input));
+		if(input->end-input->start>=header_Length
+		  && !memcmp(input->data+input->start, header, header_Length)){
+			const char * line;
+			next_Line(input, &line);
+			return 1;
+		}
+		input->start++;
+	}
+}
+
+
+// Return the codes for the NUCLEOTIDE_BLOCK nucleotides at nucleotides packed
+// into a uint64_t, the first nucleotide in the two least significant bits.
+static inline uint64_t pack_Nucleotide_Block(const char * const nucleotides){
+#ifdef __AVX2__
+	const __m256i characters=_mm256_loadu_si256((const __m256i *)nucleotides);
+
+	// code_For_Nucleotide() as a shuffle indexed by the three least
+	// significant bits of each character.
+	const __m256i codes=_mm256_shuffle_epi8(
+	  _mm256_setr_epi8(0, 0, 0, 1, 3, 0, 0, 2, 0, 0, 0, 0, 0, 0, 0, 0
+	  , 0, 0, 0, 1, 3, 0, 0, 2, 0, 0, 0, 0, 0, 0, 0, 0)
+	  , _mm256_and_si256(characters, _mm256_set1_epi8(0x7)));
+
+	// Combine pairs of codes into 4 bits and then pairs of those into 8 bits
+	// in the least significant byte of each 32 bit element, and then gather
+	// those bytes into the first 4 bytes of each 128 bit lane.
+	const __m256i pairs=_mm256_maddubs_epi16(codes, _mm256_set1_epi16(0x0401));
+	const __m256i quads=_mm256_madd_epi16(pairs, _mm256_set1_epi32(0x00100001));
+	const __m256i bytes=_mm256_shuffle_epi8(quads, _mm256_setr_epi8(
+	  0, 4, 8, 12, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1
+	  , 0, 4, 8, 12, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1));
+	return (uint32_t)_mm256_extract_epi32(bytes, 0)
+	  | (uint64_t)(uint32_t)_mm256_extract_epi32(bytes, 4)<<32;
+#else
+	uint64_t packed=0;
+	for(intnative_t i=0; i<NUCLEOTIDE_BLOCK; i++)
+		packed|=(uint64_t)code_For_Nucleotide(nucleotides[i])<<2*i;
+	return packed;
+#endif
+}
+
+
+// The packed polynucleotide so far. Every packed word up to the one with
+// nucleotide length-1 has been written.
+typedef struct {
+	uint64_t *	packed;
+	intnative_t	length, capacity;
+} packed_Polynucleotide;
+
+
+// Append the nucleotides_Count nucleotides at nucleotides to polynucleotide.
+static void pack_Nucleotides(packed_Polynucleotide * const polynucleotide
+  , const char * const nucleotides, const intnative_t nucleotides_Count){
+
+	// Make sure there is room for the new words and the one after them.
+	if(((polynucleotide->length+nucleotides_Count)>>5)+2
+	  >polynucleotide->capacity){
+		while(((polynucleotide->length+nucleotides_Count)>>5)+2
+		  >polynucleotide->capacity)
+			polynucleotide->capacity*=2;
+		polynucleotide->packed=realloc(polynucleotide->packed
+		  , polynucleotide->capacity*sizeof(uint64_t));
+	}
+
+	for(intnative_t i=0; i<nucleotides_Count; i+=NUCLEOTIDE_BLOCK){
+		const intnative_t block_Count=nucleotides_Count-i<NUCLEOTIDE_BLOCK
+		  ? nucleotides_Count-i : NUCLEOTIDE_BLOCK;
+		uint64_t codes;
+		if(block_Count==NUCLEOTIDE_BLOCK)
+			codes=pack_Nucleotide_Block(nucleotides+i);
+		else{
+			// Copy a partial block so that the block doesn't read past the end
+			// of the input.
+			char block[NUCLEOTIDE_BLOCK]={0};
+			memcpy(block, nucleotides+i, block_Count);
+			codes=pack_Nucleotide_Block(block)&(((uint64_t)1<<2*block_Count)-1);
+		}
 
-	kh_destroy(oligonucleotide, hash_Table);
+		// The codes generally straddle two words of packed.
+		uint64_t * const word=polynucleotide->packed+(polynucleotide->length>>5);
+		const intnative_t shift=2*(polynucleotide->length&31);
+		word[0]=(shift ? word[0] : 0) | codes<<shift;
+		if(shift+2*block_Count>64)
+			word[1]=codes>>(64-shift);
+		polynucleotide->length+=block_Count;
+	}
 }
 
 
-int main(){
-	char buffer[4096];
+// Read the polynucleotide after the description line that starts with header
+// from stdin and return it packed, with its length in *polynucleotide_Length.
+static uint64_t * read_Polynucleotide(const char * const header
+  , intnative_t * const polynucleotide_Length){
 
-	// Find the start of the third polynucleotide.
-	while(fgets(buffer, sizeof(buffer), stdin) && memcmp(">THREE", buffer
-	  , sizeof(">THREE")-1));
+	input_Buffer input;
+	open_Input(&input);
 
-	// Start with 1 MB of storage for reading in the polynucleotide and grow
+	// Start with 1 MB of storage for the packed polynucleotide and grow
 	// geometrically.
-	intnative_t polynucleotide_Capacity=1048576;
-	intnative_t polynucleotide_Length=0;
-	char * polynucleotide=malloc(polynucleotide_Capacity);
+	packed_Polynucleotide polynucleotide={
+	  malloc(1048576), 0, 1048576/sizeof(uint64_t)};
+
+	if(find_Header(&input, header)){
+		const char * line;
+		intnative_t line_Length;
+		while((line_Length=next_Line(&input, &line))>=0 && line[0]!='>')
+			pack_Nucleotides(&polynucleotide, line, line_Length);
+	}
+	close_Input(&input);
+
+	*polynucleotide_Length=polynucleotide.length;
+	return realloc(polynucleotide.packed
+	  , ((polynucleotide.length>>5)+1)*sizeof(uint64_t));
+}
+
+
+// An index of a polynucleotide's counts for several lengths of
+// oligonucleotides, which answers any number of queries for those lengths. It
+// can be saved to and loaded from a file so that it only needs to be built
+// once for each polynucleotide.
+typedef struct {
+	intnative_t	polynucleotide_Length, lengths_Count;
+	oligonucleotide_Counts	counts[MAXIMUM_LENGTHS];
+} oligonucleotide_Index;
+
+
+// The first bytes of an index file. The rest of the file is the
+// polynucleotide's length, the number of lengths and whether the counts are
+// canonical, and then each length's counts, all in the native byte order, so
+// index files are only meant to be used on the machine that made them.
+#define INDEX_MAGIC "k-nucleotide index 2\n"
+
+
+static void build_Index(oligonucleotide_Index * const index
+  , const uint64_t * const packed, const intnative_t polynucleotide_Length
+  , const intnative_t * const lengths, const intnative_t lengths_Count
+  , const int canonical){
+	index->polynucleotide_Length=polynucleotide_Length;
+	index->lengths_Count=lengths_Count;
+	count_Oligonucleotides_Of_Lengths(packed, polynucleotide_Length, lengths
+	  , lengths_Count, canonical, index->counts);
+}
+
+
+static void free_Index(oligonucleotide_Index * const index){
+	for(intnative_t l=0; l<index->lengths_Count; l++)
+		free_Counts(&index->counts[l]);
+}
 
-	// Start reading and encoding the third polynucleotide.
-	while(fgets(buffer, sizeof(buffer), stdin) && buffer[0]!='>'){
-		for(intnative_t i=0; buffer[i]!='\0'; i++)
-			if(buffer[i]!='\n')
-				polynucleotide[polynucleotide_Length++]
-				  =code_For_Nucleotide(buffer[i]);
 
-		// Make sure we still have enough memory allocated for any potential
-		// nucleotides in the next line.
-		if(polynucleotide_Capacity-polynucleotide_Length<sizeof(buffer))
-			polynucleotide=realloc(polynucleotide, polynucleotide_Capacity*=2);
+// Return the counts in index for length or NULL if index doesn't have them.
+static const oligonucleotide_Counts * counts_For_Length(
+  const oligonucleotide_Index * const index, const intnative_t length){
+	for(intnative_t l=0; l<index->lengths_Count; l++)
+		if(index->counts[l].length==length)
+			return &index->counts[l];
+	return NULL;
+}
+
+
+// Write index to file. Flat arrays are written whole and hash tables as their
+// key and count pairs. Return 0 if writing failed.
+static int save_Index(const oligonucleotide_Index * const index
+  , FILE * const file){
+
+	const int64_t header[3]={index->polynucleotide_Length, index->lengths_Count
+	  , index->lengths_Count ? index->counts[0].canonical : 0};
+	fwrite(INDEX_MAGIC, 1, sizeof(INDEX_MAGIC)-1, file);
+	fwrite(header, sizeof(header[0]), 3, file);
+
+	for(intnative_t l=0; l<index->lengths_Count; l++){
+		const oligonucleotide_Counts * const counts=&index->counts[l];
+		int64_t length_Header[2]={counts->length, 0};
+		if(counts->dense){
+			length_Header[1]=(int64_t)1<<2*counts->length;
+			fwrite(length_Header, sizeof(length_Header[0]), 2, file);
+			fwrite(counts->dense, sizeof(uint32_t), length_Header[1], file);
+		}else{
+			for(intnative_t p=0; p<counts->partitions; p++)
+				length_Header[1]+=kh_size(counts->tables[p]);
+			fwrite(length_Header, sizeof(length_Header[0]), 2, file);
+			uint64_t key;
+			uint32_t value;
+			for(intnative_t p=0; p<counts->partitions; p++)
+				kh_foreach(counts->tables[p], key, value
+				  , fwrite(&key, sizeof(key), 1, file);
+				  fwrite(&value, sizeof(value), 1, file));
+		}
 	}
 
-	// Free up any leftover memory.
-	polynucleotide=realloc(polynucleotide, polynucleotide_Length);
+	return !ferror(file);
+}
 
-	char output_Buffer[7][MAXIMUM_OUTPUT_LENGTH];
 
-	// Do the following functions in parallel.
-	#pragma omp parallel sections
-	{
-		#pragma omp section
-		generate_Count_For_Oligonucleotide(polynucleotide
-		  , polynucleotide_Length, "GGTATTTTAATTTATAGT", output_Buffer[6]);
-		#pragma omp section
-		generate_Count_For_Oligonucleotide(polynucleotide
-		  , polynucleotide_Length, "GGTATTTTAATT", output_Buffer[5]);
-		#pragma omp section
-		generate_Count_For_Oligonucleotide(polynucleotide
-		  , polynucleotide_Length, "GGTATT", output_Buffer[4]);
-		#pragma omp section
-		generate_Count_For_Oligonucleotide(polynucleotide
-		  , polynucleotide_Length, "GGTA", output_Buffer[3]);
-		#pragma omp section
-		generate_Count_For_Oligonucleotide(polynucleotide
-		  , polynucleotide_Length, "GGT", output_Buffer[2]);
-
-		#pragma omp section
-		generate_Frequencies_For_Desired_Length_Oligonucleotides(polynucleotide
-		  , polynucleotide_Length, 2, output_Buffer[1]);
-		#pragma omp section
-		generate_Frequencies_For_Desired_Length_Oligonucleotides(polynucleotide
-		  , polynucleotide_Length, 1, output_Buffer[0]);
+// Read an index written by save_Index() from file into index. Hash tables are
+// loaded into a single partition. Return 0 if file isn't a whole index.
+static int load_Index(oligonucleotide_Index * const index, FILE * const file){
+	char magic[sizeof(INDEX_MAGIC)-1];
+	int64_t header[3];
+	if(fread(magic, 1, sizeof(magic), file)!=sizeof(magic)
+	  || memcmp(magic, INDEX_MAGIC, sizeof(magic))
+	  || fread(header, sizeof(header[0]), 3, file)!=3
+	  || header[1]<0 || header[1]>MAXIMUM_LENGTHS)
+		return 0;
+	index->polynucleotide_Length=header[0];
+	index->lengths_Count=0;
+
+	for(intnative_t l=0; l<header[1]; l++){
+		int64_t length_Header[2];
+		if(fread(length_Header, sizeof(length_Header[0]), 2, file)!=2
+		  || length_Header[0]<1 || length_Header[0]>31 || length_Header[1]<0)
+			break;
+
+		oligonucleotide_Counts * const counts
+		  =&index->counts[index->lengths_Count++];
+		*counts=(oligonucleotide_Counts){length_Header[0], 0, NULL, NULL
+		  , header[2]!=0};
+		if(length_Header[0]<=DENSE_MAXIMUM_LENGTH){
+			if(length_Header[1]!=(int64_t)1<<2*length_Header[0])
+				break;
+			counts->dense=malloc(length_Header[1]*sizeof(uint32_t));
+			if(fread(counts->dense, sizeof(uint32_t), length_Header[1], file)
+			  !=(size_t)length_Header[1])
+				break;
+		}else{
+			counts->partitions=1;
+			counts->tables=malloc(sizeof(*counts->tables));
+			counts->tables[0]=kh_init(oligonucleotide);
+			kh_resize(oligonucleotide, counts->tables[0], length_Header[1]);
+			int64_t i;
+			for(i=0; i<length_Header[1]; i++){
+				uint64_t key;
+				uint32_t value;
+				if(fread(&key, sizeof(key), 1, file)!=1
+				  || fread(&value, sizeof(value), 1, file)!=1)
+					break;
+				add_To_Count(counts->tables[0], key, value);
+			}
+			if(i<length_Header[1])
+				break;
+		}
+	}
+
+	if(index->lengths_Count==header[1])
+		return 1;
+	free_Index(index);
+	return 0;
+}
+
+
+// Answer the queries for the probes, one oligonucleotide per line of the file
+// at probes_Path, writing the count and then the oligonucleotide for each to
+// stdout in the same format as the benchmark's counts. The polynucleotide's
+// index is loaded from index_Path if there is a file there that has every
+// length of the probes, and otherwise it is built from stdin in one pass for
+// those lengths and then saved to index_Path, if not NULL. With canonical set
+// the counts include the probes' reverse complements, and only an index of
+// canonical counts is used.
+static int answer_Queries(const char * const probes_Path
+  , const char * const index_Path, const int canonical){
+
+	FILE * const probes_File=fopen(probes_Path, "r");
+	if(!probes_File){
+		perror(probes_Path);
+		return EXIT_FAILURE;
+	}
+
+	// Read all the probes and note their lengths.
+	intnative_t probes_Count=0, probes_Capacity=1024, lengths_Count=0;
+	char (* probes)[32]=malloc(probes_Capacity*sizeof(*probes));
+	intnative_t lengths[MAXIMUM_LENGTHS];
+	char line[4096];
+	while(fgets(line, sizeof(line), probes_File)){
+		const intnative_t length=strcspn(line, "\r\n");
+		if(!length)
+			continue;
+		if(length>31 || strspn(line, "ACGTacgt")!=length){
+			fprintf(stderr, "probes must be 1 to 31 of A, C, G and T: %.*s\n"
+			  , (int)length, line);
+			return EXIT_FAILURE;
+		}
+
+		intnative_t l=0;
+		while(l<lengths_Count && lengths[l]!=length)
+			l++;
+		if(l==lengths_Count){
+			if(lengths_Count==MAXIMUM_LENGTHS){
+				fprintf(stderr, "probes can only have %d different lengths\n"
+				  , MAXIMUM_LENGTHS);
+				return EXIT_FAILURE;
+			}
+			lengths[lengths_Count++]=length;
+		}
+
+		if(probes_Count==probes_Capacity)
+			probes=realloc(probes, (probes_Capacity*=2)*sizeof(*probes));
+		memcpy(probes[probes_Count], line, length);
+		probes[probes_Count++][length]='\0';
+	}
+	fclose(probes_File);
+
+	// Use the saved index if it has all the lengths.
+	oligonucleotide_Index index;
+	FILE * index_File=index_Path ? fopen(index_Path, "rb") : NULL;
+	int have_Index=0;
+	if(index_File){
+		have_Index=load_Index(&index, index_File);
+		fclose(index_File);
+		for(intnative_t l=0; have_Index && l<lengths_Count; l++)
+			if(!counts_For_Length(&index, lengths[l])
+			  || counts_For_Length(&index, lengths[l])->canonical!=canonical){
+				free_Index(&index);
+				have_Index=0;
+			}
+	}
+
+	if(!have_Index){
+		intnative_t polynucleotide_Length;
+		uint64_t * const packed=read_Polynucleotide(">THREE"
+		  , &polynucleotide_Length);
+		// Empty or missing stdin would leave an index of nothing that later
+		// queries would then load instead of the real polynucleotide.
+		if(index_Path && !polynucleotide_Length){
+			fprintf(stderr, "no >THREE sequence on stdin, not saving %s\n"
+			  , index_Path);
+			free(packed);
+			free(probes);
+			return EXIT_FAILURE;
+		}
+		build_Index(&index, packed, polynucleotide_Length, lengths
+		  , lengths_Count, canonical);
+		free(packed);
+
+		if(index_Path){
+			if(!(index_File=fopen(index_Path, "wb"))){
+				perror(index_Path);
+				return EXIT_FAILURE;
+			}
+			if(!save_Index(&index, index_File)){
+				fprintf(stderr, "failed to write %s\n", index_Path);
+				return EXIT_FAILURE;
+			}
+			fclose(index_File);
+		}
+	}
+
+	for(intnative_t i=0; i<probes_Count; i++){
+		const intnative_t length=strlen(probes[i]);
+		printf("%ju\t%s\n", (uintmax_t)lookup_Count(counts_For_Length(&index
+		  , length), key_For_Oligonucleotide(probes[i], length)), probes[i]);
+	}
+
+	free_Index(&index);
+	free(probes);
+	return 0;
+}
+
+
+// Output the frequencies of the top most frequent oligonucleotides of length
+// in packed, or of all of them when top is 0, and if path isn't NULL also
+// write the frequencies of all of them to the file there. With canonical set
+// each oligonucleotide's frequency includes its reverse complement's.
+static int report_Top_Frequencies(const uint64_t * const packed
+  , const intnative_t polynucleotide_Length, const intnative_t length
+  , const intnative_t top, const char * const path, const int canonical){
+
+	oligonucleotide_Counts counts;
+	count_Oligonucleotides_Of_Lengths(packed, polynucleotide_Length, &length, 1
+	  , canonical, &counts);
+
+	intnative_t elements_Array_Size;
+	element * elements_Array=NULL;
+	if(path){
+		FILE * const file=fopen(path, "w");
+		if(!file){
+			perror(path);
+			return EXIT_FAILURE;
+		}
+		elements_Array=collect_Elements(&counts, &elements_Array_Size);
+		qsort(elements_Array, elements_Array_Size, sizeof(element)
+		  , (int (*)(const void *, const void *)) element_Compare);
+		write_Frequencies(elements_Array, elements_Array_Size, length
+		  , polynucleotide_Length, file);
+		fclose(file);
+
+		// The top elements are then just the start of the whole sorted array.
+		if(top && top<elements_Array_Size)
+			elements_Array_Size=top;
+	}else if(top)
+		elements_Array=select_Top_Elements(&counts, top, &elements_Array_Size);
+	else{
+		elements_Array=collect_Elements(&counts, &elements_Array_Size);
+		qsort(elements_Array, elements_Array_Size, sizeof(element)
+		  , (int (*)(const void *, const void *)) element_Compare);
 	}
+	write_Frequencies(elements_Array, elements_Array_Size, length
+	  , polynucleotide_Length, stdout);
+
+	free(elements_Array);
+	free_Counts(&counts);
+	return 0;
+}
+
+
+// With no arguments this outputs the benchmark's frequencies and counts. Given
+// a length and a number top it instead outputs the frequencies of the top most
+// frequent oligonucleotides of that length, or of all of them when top is 0,
+// and with a file also writes the frequencies of all of them there. "query"
+// answers the counts for a file of probes with answer_Queries(). A leading
+// "canonical" makes any of these count strand-independently, each
+// oligonucleotide together with its reverse complement under the smaller key.
+int main(int argc, char ** argv){
+	const char * const program=argv[0];
+	const int canonical=argc>1 && !strcmp(argv[1], "canonical");
+	if(canonical){
+		argv++;
+		argc--;
+	}
+
+	if(argc>=3 && argc<=4 && !strcmp(argv[1], "query"))
+		return answer_Queries(argv[2], argc==4 ? argv[3] : NULL, canonical);
+	// A lone argument is the benchmark's input size, which isn't needed.
+	if(argc>4){
+		fprintf(stderr, "usage: %s [canonical] [length top [file]]\n"
+		  "       %s [canonical] query probes [index]\n", program, program);
+		return EXIT_FAILURE;
+	}
+
+	intnative_t length=0, top=0;
+	if(argc>2){
+		length=atoll(argv[1]);
+		top=atoll(argv[2]);
+		if(length<1 || length>31 || top<0){
+			fprintf(stderr, "length must be 1 to 31 and top at least 0\n");
+			return EXIT_FAILURE;
+		}
+	}
+
+	// Read in the third polynucleotide.
+	BENCH_PHASE("read");
+	intnative_t polynucleotide_Length;
+	uint64_t * const packed=read_Polynucleotide(">THREE"
+	  , &polynucleotide_Length);
+
+	if(length){
+		const int status=report_Top_Frequencies(packed, polynucleotide_Length
+		  , length, top, argc==4 ? argv[3] : NULL, canonical);
+		free(packed);
+		return status;
+	}
+
+	// Count every length in one pass over the polynucleotide.
+	BENCH_PHASE("count");
+	static const intnative_t lengths[7]={1, 2, 3, 4, 6, 12, 18};
+	oligonucleotide_Counts counts[7];
+	count_Oligonucleotides_Of_Lengths(packed, polynucleotide_Length, lengths, 7
+	  , canonical, counts);
+	free(packed);
+
+	char output_Buffer[7][MAXIMUM_OUTPUT_LENGTH];
+	generate_Frequencies_For_Desired_Length_Oligonucleotides(&counts[0]
+	  , polynucleotide_Length, output_Buffer[0]);
+	generate_Frequencies_For_Desired_Length_Oligonucleotides(&counts[1]
+	  , polynucleotide_Length, output_Buffer[1]);
+	generate_Count_For_Oligonucleotide(&counts[2], "GGT", output_Buffer[2]);
+	generate_Count_For_Oligonucleotide(&counts[3], "GGTA", output_Buffer[3]);
+	generate_Count_For_Oligonucleotide(&counts[4], "GGTATT", output_Buffer[4]);
+	generate_Count_For_Oligonucleotide(&counts[5], "GGTATTTTAATT"
+	  , output_Buffer[5]);
+	generate_Count_For_Oligonucleotide(&counts[6], "GGTATTTTAATTTATAGT"
+	  , output_Buffer[6]);
 
 	// Output the results to stdout.
+	BENCH_PHASE("output");
 	for(intnative_t i=0; i<7; printf("%s\n", output_Buffer[i++]));
 
-	free(polynucleotide);
+	for(intnative_t l=0; l<7; l++)
+		free_Counts(&counts[l]);
 
 	return 0;
 }
@@ -10,98 +10,119 @@
 #include <string.h>
 #include <ctype.h>
 #include <stdbool.h>
+#include <stdint.h>
 
 #define MAX_LINE_LENGTH 256
 #define MAX_SEQUENCE_LENGTH 10000000
-#define HASH_TABLE_SIZE 2097152  // 2^21
+#define INITIAL_TABLE_SIZE 1024  // 2^10, doubled as the table fills
+#define MAX_BASES 32             // k-mers are packed into one uint64_t
 
-// Hash table entry for storing k-mer counts
-typedef struct Entry {
-    char *key;
-    int count;
-    struct Entry *next;
-} Entry;
+// Map a nucleotide to its 2-bit code: A=0, C=1, G=2, T=3. Upper and lower
+// case ASCII letters only differ in the fifth bit, and the three lowest bits
+// already tell A, C, G and T apart. Codes follow alphabetical order, so
+// packed keys of one length sort like the strings they stand for.
+#define code_for_nucleotide(c) (" \0 \1\3  \2"[(c) & 0x7] & 0x3)
 
-// Hash table for storing k-mer counts
+// Open-addressing hash table of k-mer counts keyed by the packed k-mer, the
+// first nucleotide in the most significant bits. A count of 0 marks an empty
+// slot, and collisions probe linearly.
 typedef struct {
-    Entry **buckets;
-    int size;
+    uint64_t *keys;
+    int *counts;
+    int size;   // a power of two
+    int used;
 } HashTable;
 
-// Create a new hash table
+// Create a new hash table with size slots, a power of two
 HashTable* create_hash_table(int size) {
     HashTable *table = (HashTable*)malloc(sizeof(HashTable));
     table->size = size;
-    table->buckets = (Entry**)calloc(size, sizeof(Entry*));
+    table->used = 0;
+    table->keys = (uint64_t*)malloc(size * sizeof(uint64_t));
+    table->counts = (int*)calloc(size, sizeof(int));
     return table;
 }
 
-// Free the hash table and its entries
+// Free the hash table
 void free_hash_table(HashTable *table) {
-    for (int i = 0; i < table->size; i++) {
-        Entry *entry = table->buckets[i];
-        while (entry) {
-            Entry *next = entry->next;
-            free(entry->key);
-            free(entry);
-            entry = next;
-        }
-    }
-    free(table->buckets);
+    free(table->keys);
+    free(table->counts);
     free(table);
 }
 
-// Simple hash function for strings
-unsigned int hash_string(const char *str, int len) {
-    unsigned int hash = 5381;
-    for (int i = 0; i < len; i++) {
-        hash = ((hash << 5) + hash) + str[i];
+// Multiplicative hash of a packed key to a slot
+static inline unsigned int hash_key(uint64_t key, int size) {
+    return (unsigned int)((key * 0x9E3779B97F4A7C15ULL) >> 32) & (size - 1);
+}
+
+// Slot holding key, or the empty slot where it belongs
+static inline unsigned int find_slot(const HashTable *table, uint64_t key) {
+    unsigned int slot = hash_key(key, table->size);
+    while (table->counts[slot] != 0 && table->keys[slot] != key) {
+        slot = (slot + 1) & (table->size - 1);
     }
-    return hash;
+    return slot;
+}
+
+// Double the table and reinsert every entry
+static void grow_hash_table(HashTable *table) {
+    HashTable *bigger = create_hash_table(table->size * 2);
+    for (int i = 0; i < table->size; i++) {
+        if (table->counts[i] != 0) {
+            unsigned int slot = find_slot(bigger, table->keys[i]);
+            bigger->keys[slot] = table->keys[i];
+            bigger->counts[slot] = table->counts[i];
+        }
+    }
+    free(table->keys);
+    free(table->counts);
+    table->keys = bigger->keys;
+    table->counts = bigger->counts;
+    table->size = bigger->size;
+    free(bigger);
 }
 
 // Increment count for a k-mer in the hash table
-void increment_count(HashTable *table, const char *key, int len) {
-    unsigned int hash = hash_string(key, len) % table->size;
-    
-    // Look for existing entry
-    Entry *entry = table->buckets[hash];
-    while (entry) {
-        if (strncmp(entry->key, key, len) == 0 && entry->key[len] == '\0') {
-            entry->count++;
-            return;
+void increment_count(HashTable *table, uint64_t key) {
+    unsigned int slot = find_slot(table, key);
+    if (table->counts[slot] == 0) {
+        // Keep the table at most half full
+        if (2 * (table->used + 1) > table->size) {
+            grow_hash_table(table);
+            slot = find_slot(table, key);
         }
-        entry = entry->next;
+        table->keys[slot] = key;
+        table->used++;
     }
-    
-    // Create new entry
-    entry = (Entry*)malloc(sizeof(Entry));
-    entry->key = (char*)malloc(len + 1);
-    strncpy(entry->key, key, len);
-    entry->key[len] = '\0';
-    entry->count = 1;
-    entry->next = table->buckets[hash];
-    table->buckets[hash] = entry;
+    table->counts[slot]++;
 }
 
 // Get count for a specific k-mer
-int get_count(HashTable *table, const char *key, int len) {
-    unsigned int hash = hash_string(key, len) % table->size;
-    
-    Entry *entry = table->buckets[hash];
-    while (entry) {
-        if (strncmp(entry->key, key, len) == 0 && entry->key[len] == '\0') {
-            return entry->count;
-        }
-        entry = entry->next;
+int get_count(const HashTable *table, uint64_t key) {
+    return table->counts[find_slot(table, key)];
+}
+
+// Pack the first len nucleotides of str into a key
+uint64_t pack_key(const char *str, int len) {
+    uint64_t key = 0;
+    for (int i = 0; i < len; i++) {
+        key = (key << 2) | code_for_nucleotide(str[i]);
     }
-    
-    return 0;  // Not found
+    return key;
+}
+
+// Write the len nucleotides of key into str, followed by a '\0'
+void unpack_key(uint64_t key, int len, char *str) {
+    for (int i = len - 1; i >= 0; i--) {
+        str[i] = "ACGT"[key & 0x3];
+        key >>= 2;
+    }
+    str[len] = '\0';
 }
 
 // Structure for sorted frequency results
 typedef struct {
-    char *key;
+    uint64_t key;
     int count;
     double frequency;
 } FrequencyResult;
@@ -114,16 +135,25 @@ int compare_frequency(const void *a, const void *b) {
     if (fb->count != fa->count) {
         return fb->count - fa->count;  // Sort by count (descending)
     }
-    return strcmp(fa->key, fb->key);   // Then by key (ascending)
+    // Then by key (ascending), which is the order of the strings
+    return (fa->key > fb->key) - (fa->key < fb->key);
 }
 
-// Count k-mers of specified length
+// Count k-mers of specified length. The key of the k-mer at i is rolled on
+// from the one at i - 1, so each position costs one shift, mask and table
+// update whatever the length.
 HashTable* base_counts(const char *sequence, int len, int bases) {
-    HashTable *counts = create_hash_table(HASH_TABLE_SIZE);
+    HashTable *counts = create_hash_table(INITIAL_TABLE_SIZE);
     int size = len + 1 - bases;
+    if (size <= 0) {
+        return counts;
+    }
+    uint64_t mask = bases < MAX_BASES ? (1ULL << (2 * bases)) - 1 : ~0ULL;
+    uint64_t key = pack_key(sequence, bases - 1);
     
     for (int i = 0; i < size; i++) {
-        increment_count(counts, sequence + i, bases);
+        key = ((key << 2) & mask) | code_for_nucleotide(sequence[i + bases - 1]);
+        increment_count(counts, key);
     }
     
     return counts;
@@ -133,30 +163,19 @@ HashTable* base_counts(const char *sequence, int len, int bases) {
 FrequencyResult* sorted_freq(const char *sequence, int len, int bases, int *result_count) {
     HashTable *counts = base_counts(sequence, len, bases);
     
-    // Count number of entries
-    int entry_count = 0;
-    for (int i = 0; i < counts->size; i++) {
-        Entry *entry = counts->buckets[i];
-        while (entry) {
-            entry_count++;
-            entry = entry->next;
-        }
-    }
-    
     // Allocate result array
-    FrequencyResult *results = (FrequencyResult*)malloc(entry_count * sizeof(FrequencyResult));
+    int entry_count = counts->used;
+    FrequencyResult *results = (FrequencyResult*)malloc((entry_count + 1) * sizeof(FrequencyResult));
     int index = 0;
     int size = len + 1 - bases;
     
     // Fill result array
     for (int i = 0; i < counts->size; i++) {
-        Entry *entry = counts->buckets[i];
-        while (entry) {
-            results[index].key = strdup(entry->key);
-            results[index].count = entry->count;
-            results[index].frequency = 100.0 * entry->count / size;
+        if (counts->counts[i] != 0) {
+            results[index].key = counts->keys[i];
+            results[index].count = counts->counts[i];
+            results[index].frequency = 100.0 * counts->counts[i] / size;
             index++;
-            entry = entry->next;
         }
     }
     
@@ -171,7 +190,7 @@ FrequencyResult* sorted_freq(const char *sequence, int len, int bases, int *resu
 // Get count of a specific k-mer
 int specific_count(const char *sequence, int len, const char *code, int code_len) {
     HashTable *counts = base_counts(sequence, len, code_len);
-    int count = get_count(counts, code, code_len);
+    int count = get_count(counts, pack_key(code, code_len));
     free_hash_table(counts);
     return count;
 }
@@ -232,15 +251,13 @@ int main() {
         int result_count;
         FrequencyResult *results = sorted_freq(sequence, sequence_len, bases, &result_count);
         
+        char key[MAX_BASES + 1];
         for (int i = 0; i < result_count; i++) {
-            printf("%s %.3f\n", results[i].key, results[i].frequency);
+            unpack_key(results[i].key, bases, key);
+            printf("%s %.3f\n", key, results[i].frequency);
         }
         printf("\n");
         
-        // Free result memory
-        for (int i = 0; i < result_count; i++) {
-            free(results[i].key);
-        }
         free(results);
     }
     
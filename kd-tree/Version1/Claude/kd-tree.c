@@ -25,7 +25,7 @@ typedef struct {
 typedef struct {
     // For leaves
     int num_parts;
-    int* particles;  // array of particle indices
+    int particles[MAX_PARTS];  // particle indices, stored in the node
 
     // For internal nodes
     int split_dim;
@@ -40,8 +40,9 @@ typedef struct {
 // System structure
 typedef struct {
     int* indices;
-    KDTree* nodes;
-    int nodes_count;
+    KDTree* nodes;      // node arena, sized once for the body count
+    int nodes_count;    // nodes used by the last build
+    int nodes_high_water;
     int nodes_capacity;
 } System;
 
@@ -104,10 +105,9 @@ F64x3 calc_pp_accel(Particle* a, Particle* b) {
 
 // Tree operations
 KDTree create_leaf(int num_parts, int* particles, int particles_count) {
-    KDTree node;
+    KDTree node = {0};
     node.num_parts = num_parts;
     
-    node.particles = (int*)malloc(sizeof(int) * particles_count);
     if (particles != NULL && particles_count > 0) {
         memcpy(node.particles, particles, sizeof(int) * particles_count);
     }
@@ -124,12 +124,19 @@ KDTree create_leaf(int num_parts, int* particles, int particles_count) {
 }
 
 void free_tree(KDTree* nodes, int node_count) {
-    for (int i = 0; i < node_count; i++) {
-        free(nodes[i].particles);
-    }
+    (void)node_count;
     free(nodes);
 }
 
+// Exact node count of a tree over n bodies: build_tree always splits at
+// the middle, so the shape only depends on n.
+int tree_node_count(int n) {
+    if (n <= MAX_PARTS) {
+        return 1;
+    }
+    return 1 + tree_node_count(n / 2) + tree_node_count(n - n / 2);
+}
+
 System system_create(int n) {
     System sys;
     
@@ -140,13 +147,14 @@ System system_create(int n) {
     }
     
     // Initialize nodes
-    int num_nodes = 2 * (n / (MAX_PARTS - 1) + 1);
+    int num_nodes = tree_node_count(n);
     sys.nodes = (KDTree*)malloc(sizeof(KDTree) * num_nodes);
     for (int i = 0; i < num_nodes; i++) {
         sys.nodes[i] = create_leaf(0, NULL, 0);
     }
     
     sys.nodes_count = 0;
+    sys.nodes_high_water = 0;
     sys.nodes_capacity = num_nodes;
     
     return sys;
@@ -191,12 +199,7 @@ int build_tree(System* sys, int start, int end, Particle* particles, int cur_nod
         // Leaf node
         ensure_node_capacity(sys, cur_node);
         
-        // Free previous particles array if it exists
-        free(sys->nodes[cur_node].particles);
-        
         sys->nodes[cur_node].num_parts = np1;
-        sys->nodes[cur_node].particles = (int*)malloc(sizeof(int) * np1);
-        
         for (int i = 0; i < np1; i++) {
             sys->nodes[cur_node].particles[i] = sys->indices[start + i];
         }
@@ -299,10 +302,6 @@ int build_tree(System* sys, int start, int end, Particle* particles, int cur_nod
         
         ensure_node_capacity(sys, cur_node);
         
-        // Free previous particles array if it exists
-        free(sys->nodes[cur_node].particles);
-        sys->nodes[cur_node].particles = NULL;
-        
         sys->nodes[cur_node].num_parts = 0;
         sys->nodes[cur_node].split_dim = split_dim;
         sys->nodes[cur_node].split_val = split_val;
@@ -357,7 +356,10 @@ F64x3 calc_accel(int p, Particle* particles, KDTree* nodes) {
 // Run simulation for given number of steps
 void simple_sim(Particle* bodies, int body_count, double dt, int steps, bool print_steps) {
     System sys = system_create(body_count);
+    F64x3* acc = (F64x3*)malloc(sizeof(F64x3) * body_count);
     
+    // Steady-state steps reuse the node arena and acc, so they allocate
+    // nothing.
     for (int step = 0; step < steps; step++) {
         if (print_steps) {
             printf("Step %d\n", step);
@@ -369,10 +371,12 @@ void simple_sim(Particle* bodies, int body_count, double dt, int steps, bool pri
         }
         
         // Build tree
-        build_tree(&sys, 0, body_count, bodies, 0);
+        sys.nodes_count = build_tree(&sys, 0, body_count, bodies, 0) + 1;
+        if (sys.nodes_count > sys.nodes_high_water) {
+            sys.nodes_high_water = sys.nodes_count;
+        }
         
         // Calculate accelerations
-        F64x3* acc = (F64x3*)malloc(sizeof(F64x3) * body_count);
         for (int i = 0; i < body_count; i++) {
             acc[i] = calc_accel(i, bodies, sys.nodes);
         }
@@ -382,10 +386,13 @@ void simple_sim(Particle* bodies, int body_count, double dt, int steps, bool pri
             bodies[i].v = f64x3_add(bodies[i].v, f64x3_mul(acc[i], dt));
             bodies[i].p = f64x3_add(bodies[i].p, f64x3_mul(bodies[i].v, dt));
         }
-        
-        free(acc);
     }
     
+    if (print_steps) {
+        printf("Node arena: %d of %d nodes used\n", sys.nodes_high_water,
+               sys.nodes_capacity);
+    }
+    free(acc);
     system_free(&sys);
 }
 
@@ -0,0 +1,110 @@
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "kdtree.h"
+#include "leaf_kernel.h"
+#include "particle.h"
+
+// Force error against direct summation versus force-pass time, for the
+// Barnes-Hut (bh) and dual-tree (dual) solvers with monopole and
+// quadrupole expansions over a range of opening angles. vs_double is the
+// RMS difference of bh from the all-double recursive walk, which is only
+// non-zero in a make FLOAT_FAR=1 build.
+// Prints CSV: solver,order,theta,seconds,rms_error,max_error,vs_double.
+
+static double wall_seconds() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+int main(int argc, char *argv[]) {
+  size_t n = argc > 1 ? (size_t)atol(argv[1]) : 20000;
+
+  Particle_array_t parts = circular_orbits(n);
+  ParticleSoA soa = particle_soa_from_array(&parts);
+  KDTree_array_t tree = allocate_node_vec(soa.size);
+  size_t_array_t indices = new_range(0, soa.size);
+  SimOptions opts = default_sim_options();
+  build_tree_parallel(&indices, 0, soa.size, &soa, 0, &tree, &opts);
+  CompactTree compact = new_compact_tree(soa.size);
+  pack_tree(&tree, &indices, soa.size, &compact);
+
+  vect3_array_t direct = new_vect3_array_t(soa.size);
+#pragma omp parallel for schedule(dynamic, 64)
+  for (size_t i = 0; i < soa.size; ++i) {
+    for (size_t j = 0; j < soa.size; ++j) {
+      if (i != j) {
+        calc_pp_accel(&soa, i, j, direct.ptr[i].v);
+      }
+    }
+  }
+  double mag = 0.0;
+  for (size_t i = 0; i < soa.size; ++i) {
+    for (size_t d = 0; d < 3; ++d) {
+      mag += direct.ptr[i].v[d] * direct.ptr[i].v[d];
+    }
+  }
+  double rms_mag = sqrt(mag / soa.size);
+
+  const double thetas[] = {0.2, 0.3, 0.4, 0.5, 0.6, 0.7, 0.8, 1.0};
+  vect3_array_t acc = new_vect3_array_t(soa.size);
+  vect3_array_t ref = new_vect3_array_t(soa.size);
+  DualTree *dual = new_dual_tree();
+  printf("solver,order,theta,seconds,rms_error,max_error,vs_double\n");
+  for (int solver = 0; solver < 2; ++solver) {
+    for (int order = 1; order <= 2; ++order) {
+      for (size_t t = 0; t < sizeof(thetas) / sizeof(thetas[0]); ++t) {
+        opts.order = order;
+        opts.theta = thetas[t];
+        for (size_t i = 0; i < soa.size; ++i) {
+          acc.ptr[i].v[0] = acc.ptr[i].v[1] = acc.ptr[i].v[2] = 0.0;
+          ref.ptr[i].v[0] = ref.ptr[i].v[1] = ref.ptr[i].v[2] = 0.0;
+        }
+        calc_all_accels(&soa, &tree, &ref, &opts);
+        double start = wall_seconds();
+        if (solver == 0) {
+          calc_all_accels_compact(&soa, &compact, &acc, &opts);
+        } else {
+          calc_all_accels_dual(&soa, &tree, &acc, &opts, dual);
+        }
+        double seconds = wall_seconds() - start;
+
+        // Errors are relative to the RMS force, since the star's net force
+        // nearly cancels and would dominate per-body ratios.
+        double err = 0.0, max_err = 0.0, vs_double = 0.0;
+        for (size_t i = 0; i < soa.size; ++i) {
+          double e = 0.0;
+          for (size_t d = 0; d < 3; ++d) {
+            double diff = acc.ptr[i].v[d] - direct.ptr[i].v[d];
+            e += diff * diff;
+            double round = acc.ptr[i].v[d] - ref.ptr[i].v[d];
+            vs_double += round * round;
+          }
+          err += e;
+          max_err = sqrt(e) > max_err ? sqrt(e) : max_err;
+        }
+        printf("%s,%d,%.2f,%.6f,%.3e,%.3e,", solver == 0 ? "bh" : "dual",
+               order, thetas[t], seconds, sqrt(err / soa.size) / rms_mag,
+               max_err / rms_mag);
+        if (solver == 0) {
+          printf("%.3e", sqrt(vs_double / soa.size) / rms_mag);
+        }
+        printf("\n");
+      }
+    }
+  }
+
+  free_particle_soa(&soa);
+  FREE_ARRAY(parts);
+  free_compact_tree(&compact);
+  free_dual_tree(dual);
+  FREE_ARRAY(tree);
+  FREE_ARRAY(indices);
+  FREE_ARRAY(direct);
+  FREE_ARRAY(acc);
+  FREE_ARRAY(ref);
+  return 0;
+}
@@ -0,0 +1,267 @@
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+#include "bench.h"
+#include "kdtree.h"
+#include "particle.h"
+#include "snapshot.h"
+
+// Hierarchical block timesteps. A step of dt is split into 2^max_rung
+// substeps of h, and a body on rung k moves with dt / 2^k through a
+// kick-drift-kick leapfrog. Every body drifts each substep, but only the
+// bodies whose step ends there get a new force, from a tree that is refit
+// to the drifted positions rather than rebuilt. The rung comes from
+// dt_i = sqrt(timestep_length / |a|) and may only grow coarser again when
+// the finer step ends on a boundary of the coarser one.
+
+typedef struct {
+  size_t size;
+  unsigned char *ptr;
+} rung_array_t;
+
+static rung_array_t new_rung_array_t(size_t elem_count) {
+  rung_array_t a = {elem_count, calloc(elem_count, 1)};
+  if (a.ptr == NULL) {
+    fprintf(stderr, "calloc failed: it returned NULL\n");
+    exit(EXIT_FAILURE);
+  }
+  return a;
+}
+
+static int pick_rung(const double a[3], double dt, const SimOptions *opts) {
+  double mag = sqrt(a[0] * a[0] + a[1] * a[1] + a[2] * a[2]);
+  if (mag == 0.0) {
+    return 0;
+  }
+  double want = sqrt(opts->timestep_length / mag);
+  int rung = 0;
+  while (rung < opts->max_rung && dt / (double)(1 << rung) > want) {
+    rung += 1;
+  }
+  return rung;
+}
+
+// Substeps between the ends of a rung's steps.
+static inline size_t rung_span(int rung, const SimOptions *opts) {
+  return (size_t)1 << (opts->max_rung - rung);
+}
+
+static void calc_active_accels(const ParticleSoA *bodies,
+                               const CompactTree *tree,
+                               const size_t_array_t *active,
+                               vect3_array_t *acc, const SimOptions *opts) {
+#ifdef KDTREE_STATS
+  uint64_t opened = 0, far = 0, leaf = 0;
+#endif
+#ifdef _OPENMP
+  size_t chunk = opts->chunk_size > 0 ? opts->chunk_size : 1;
+  int threads = opts->threads > 0 ? opts->threads : omp_get_max_threads();
+#pragma omp parallel for schedule(dynamic, chunk) num_threads(threads)        \
+    STATS_ONLY(reduction(+ : opened, far, leaf))
+#endif
+  for (size_t a = 0; a < active->size; ++a) {
+    size_t i = active->ptr[a];
+    double *v = acc->ptr[i].v;
+    v[0] = v[1] = v[2] = 0.0;
+    WalkCounters count = {0, 0, 0};
+    calc_accel_iter_counted(i, bodies, tree, opts, v, &count);
+#ifdef KDTREE_STATS
+    opened += count.opened;
+    far += count.far;
+    leaf += count.leaf;
+#endif
+  }
+#ifdef KDTREE_STATS
+  if (opts->stats != NULL) {
+    opts->stats->walk.opened += opened;
+    opts->stats->walk.far += far;
+    opts->stats->walk.leaf += leaf;
+  }
+  WalkCounters total = {opened, far, leaf};
+  walk_work(bodies, active->size, &total, opts);
+#endif
+}
+
+// Carries the per-body state that reorder_particles does not know about
+// into the new storage order. Must run before reorder_particles resets
+// indices.
+static void gather_state(const size_t_array_t *indices, vect3_array_t *acc,
+                         vect3_array_t *acc_tmp, rung_array_t *rung,
+                         rung_array_t *rung_tmp) {
+  for (size_t i = 0; i < indices->size; ++i) {
+    acc_tmp->ptr[i] = acc->ptr[indices->ptr[i]];
+    rung_tmp->ptr[i] = rung->ptr[indices->ptr[i]];
+  }
+  vect3_array_t a = *acc;
+  *acc = *acc_tmp;
+  *acc_tmp = a;
+  rung_array_t r = *rung;
+  *rung = *rung_tmp;
+  *rung_tmp = r;
+}
+
+#ifdef KDTREE_STATS
+// Charges the time since *mark to *phase and restarts the mark.
+static void lap(double *phase, double *mark) {
+  double now = stats_clock();
+  *phase += now - *mark;
+  *mark = now;
+}
+#endif
+
+size_t block_sim_opts(Particle_array_t *bodies, double dt, int steps,
+                      const SimOptions *opts) {
+  ParticleSoA soa = particle_soa_from_array(bodies);
+  size_t n = soa.size;
+  vect3_array_t acc = new_vect3_array_t(n);
+  vect3_array_t acc_tmp = new_vect3_array_t(n);
+  rung_array_t rung = new_rung_array_t(n);
+  rung_array_t rung_tmp = new_rung_array_t(n);
+  KDTree_array_t tree = allocate_node_vec(n);
+  size_t_array_t indices = new_range(0, n);
+  size_t_array_t active = new_size_t_array_t(n);
+  size_t_array_t everyone = new_range(0, n);
+  CompactTree compact = new_compact_tree(n);
+  ParticleSoA scratch = {0};
+  if (opts->reorder) {
+    scratch = new_particle_soa(n);
+  }
+  SnapshotWriter writer;
+  if (opts->snapshot_interval > 0) {
+    snapshot_writer_start(&writer, n, opts->snapshot_prefix);
+  }
+
+  size_t substeps = (size_t)1 << opts->max_rung;
+  double h = dt / substeps;
+  size_t evals = 0;
+  size_t high_water = 0;
+  int last_build = 0;
+
+  for (int step = 0; step < steps; ++step) {
+    // Phase times are summed over the step's substeps.
+    STATS_ONLY(double build = 0.0; double force = 0.0; double integrate = 0.0;
+               double mark = stats_clock();)
+    BENCH_PHASE("build");
+    // Every body is synchronised here, so a full rebuild is safe.
+    if (step == 0 || step - last_build >= opts->rebuild_interval) {
+      if (!opts->reorder) {
+        for (size_t i = 0; i < n; ++i) {
+          indices.ptr[i] = i;
+        }
+      }
+      size_t last = build_tree_parallel(&indices, 0, n, &soa, 0, &tree, opts);
+      high_water = last + 1 > high_water ? last + 1 : high_water;
+      if (opts->reorder) {
+        gather_state(&indices, &acc, &acc_tmp, &rung, &rung_tmp);
+        reorder_particles(&soa, &indices, &tree, &scratch);
+      }
+      last_build = step;
+    }
+    if (step == 0) {
+      pack_tree(&tree, &indices, n, &compact);
+      STATS_ONLY(lap(&build, &mark);)
+      BENCH_PHASE("force");
+      calc_active_accels(&soa, &compact, &everyone, &acc, opts);
+      STATS_ONLY(lap(&force, &mark);)
+      BENCH_PHASE("integrate");
+      evals += n;
+      for (size_t i = 0; i < n; ++i) {
+        rung.ptr[i] = (unsigned char)pick_rung(acc.ptr[i].v, dt, opts);
+      }
+    }
+
+    STATS_ONLY(lap(&build, &mark);)
+
+    for (size_t sub = 0; sub < substeps; ++sub) {
+      // Opening half kick for bodies whose step starts now.
+      for (size_t i = 0; i < n; ++i) {
+        if (sub % rung_span(rung.ptr[i], opts) == 0) {
+          double half = 0.5 * dt / (double)(1 << rung.ptr[i]);
+          for (size_t d = 0; d < 3; ++d) {
+            soa.v[d][i] += half * acc.ptr[i].v[d];
+          }
+        }
+      }
+      for (size_t d = 0; d < 3; ++d) {
+        double *restrict p = soa.p[d];
+        double *restrict v = soa.v[d];
+        for (size_t i = 0; i < n; ++i) {
+          p[i] += h * v[i];
+        }
+      }
+
+      active.size = 0;
+      for (size_t i = 0; i < n; ++i) {
+        if ((sub + 1) % rung_span(rung.ptr[i], opts) == 0) {
+          active.ptr[active.size++] = i;
+        }
+      }
+      STATS_ONLY(lap(&integrate, &mark);)
+      BENCH_PHASE("build");
+      refit_tree(&tree, &soa, opts);
+      pack_tree(&tree, &indices, n, &compact);
+      STATS_ONLY(lap(&build, &mark);)
+      BENCH_PHASE("force");
+      calc_active_accels(&soa, &compact, &active, &acc, opts);
+      STATS_ONLY(lap(&force, &mark);)
+      BENCH_PHASE("integrate");
+      evals += active.size;
+
+      // Closing half kick, then a new rung for the next step.
+      for (size_t a = 0; a < active.size; ++a) {
+        size_t i = active.ptr[a];
+        double half = 0.5 * dt / (double)(1 << rung.ptr[i]);
+        for (size_t d = 0; d < 3; ++d) {
+          soa.v[d][i] += half * acc.ptr[i].v[d];
+        }
+        int next = pick_rung(acc.ptr[i].v, dt, opts);
+        while (next < rung.ptr[i] && (sub + 1) % rung_span(next, opts) != 0) {
+          next += 1;
+        }
+        rung.ptr[i] = (unsigned char)next;
+      }
+    }
+#ifdef KDTREE_STATS
+    if (opts->stats != NULL) {
+      lap(&integrate, &mark);
+      stats_step(opts->stats, opts->first_step + step, build, force,
+                 integrate);
+    }
+#endif
+
+    int done = opts->first_step + step + 1;
+    if (opts->snapshot_interval > 0 && done % opts->snapshot_interval == 0) {
+      snapshot_writer_submit(&writer, &soa, done, done * dt);
+    }
+    if (opts->checkpoint_interval > 0 &&
+        done % opts->checkpoint_interval == 0) {
+      write_snapshot(opts->checkpoint_path, &soa, done, done * dt);
+    }
+  }
+
+  if (opts->snapshot_interval > 0) {
+    snapshot_writer_finish(&writer);
+  }
+  if (opts->stats != NULL) {
+    opts->stats->node_capacity = tree.size;
+    opts->stats->node_high_water = high_water;
+  }
+  particle_soa_to_array(&soa, bodies);
+  free_particle_soa(&soa);
+  free_particle_soa(&scratch);
+  free_compact_tree(&compact);
+  FREE_ARRAY(acc);
+  FREE_ARRAY(acc_tmp);
+  FREE_ARRAY(rung);
+  FREE_ARRAY(rung_tmp);
+  FREE_ARRAY(tree);
+  FREE_ARRAY(indices);
+  FREE_ARRAY(active);
+  FREE_ARRAY(everyone);
+  return evals;
+}
@@ -0,0 +1,237 @@
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+#include "kdtree.h"
+#include "particle.h"
+
+// Broad-phase collision search over the step's tree. Every node gets the
+// bounding box of its particles' centres and the largest radius among
+// them, summed bottom-up in one pass. A body then walks the tree and only
+// enters nodes whose box, grown by its own radius, the node's largest
+// radius and the margin, contains its centre; in the leaves it reached it
+// tests each sphere exactly. Each pair is reported once, by the body with
+// the smaller storage index.
+
+#define MIN(a, b) (((a) < (b)) ? (a) : (b))
+#define MAX(a, b) (((a) > (b)) ? (a) : (b))
+
+typedef struct {
+  double lo[3];
+  double hi[3];
+  double max_r;
+} CollisionNode;
+
+struct CollisionTree {
+  size_t size;
+  CollisionNode *nodes;
+};
+
+CollisionTree *new_collision_tree() {
+  CollisionTree *ctree = calloc(1, sizeof(CollisionTree));
+  if (ctree == NULL) {
+    fprintf(stderr, "calloc failed: it returned NULL\n");
+    exit(EXIT_FAILURE);
+  }
+  return ctree;
+}
+
+void free_collision_tree(CollisionTree *ctree) {
+  free(ctree->nodes);
+  free(ctree);
+}
+
+ContactList new_contact_list(size_t cap) {
+  ContactList list = {0, cap, malloc((cap > 0 ? cap : 1) * sizeof(Contact))};
+  if (list.ptr == NULL) {
+    fprintf(stderr, "malloc failed: it returned NULL\n");
+    exit(EXIT_FAILURE);
+  }
+  return list;
+}
+
+void reserve_contacts(ContactList *list, size_t cap) {
+  if (cap <= list->cap) {
+    return;
+  }
+  Contact *ptr = realloc(list->ptr, cap * sizeof(Contact));
+  if (ptr == NULL) {
+    fprintf(stderr, "realloc failed: it returned NULL\n");
+    exit(EXIT_FAILURE);
+  }
+  list->ptr = ptr;
+  list->cap = cap;
+}
+
+// Children always come after their parent, so one backward sweep sees
+// both children of a node before the node itself.
+static void set_collision_nodes(const KDTree_array_t *tree, size_t count,
+                                const ParticleSoA *bodies,
+                                CollisionNode *nodes) {
+  for (size_t n = count; n-- > 0;) {
+    const KDTree *node = tree->ptr + n;
+    CollisionNode c = {{1e100, 1e100, 1e100}, {-1e100, -1e100, -1e100}, 0.0};
+    if (node->num_parts > 0) {
+      for (size_t i = 0; i < node->num_parts; ++i) {
+        size_t p = node->particles[i];
+        for (size_t d = 0; d < 3; ++d) {
+          c.lo[d] = MIN(c.lo[d], bodies->p[d][p]);
+          c.hi[d] = MAX(c.hi[d], bodies->p[d][p]);
+        }
+        c.max_r = MAX(c.max_r, bodies->r[p]);
+      }
+    } else {
+      const CollisionNode *l = nodes + node->left;
+      const CollisionNode *r = nodes + node->right;
+      for (size_t d = 0; d < 3; ++d) {
+        c.lo[d] = MIN(l->lo[d], r->lo[d]);
+        c.hi[d] = MAX(l->hi[d], r->hi[d]);
+      }
+      c.max_r = MAX(l->max_r, r->max_r);
+    }
+    nodes[n] = c;
+  }
+}
+
+static void add_contact(ContactList *contacts, size_t i, size_t j,
+                        double dist) {
+  size_t slot;
+#pragma omp atomic capture
+  slot = contacts->size++;
+  if (slot < contacts->cap) {
+    Contact c = {i, j, dist};
+    contacts->ptr[slot] = c;
+  }
+}
+
+static void contacts_recur(size_t cur, size_t p, const ParticleSoA *bodies,
+                           const KDTree_array_t *tree,
+                           const CollisionNode *nodes, double margin,
+                           ContactList *contacts) {
+  const CollisionNode *c = nodes + cur;
+  double reach = bodies->r[p] + c->max_r + margin;
+  for (size_t d = 0; d < 3; ++d) {
+    double x = bodies->p[d][p];
+    if (x < c->lo[d] - reach || x > c->hi[d] + reach) {
+      return;
+    }
+  }
+
+  const KDTree *node = tree->ptr + cur;
+  if (node->num_parts == 0) {
+    contacts_recur(node->left, p, bodies, tree, nodes, margin, contacts);
+    contacts_recur(node->right, p, bodies, tree, nodes, margin, contacts);
+    return;
+  }
+  for (size_t k = 0; k < node->num_parts; ++k) {
+    size_t q = node->particles[k];
+    if (q <= p) {
+      continue;
+    }
+    double dp[3] = {bodies->p[0][q] - bodies->p[0][p],
+                    bodies->p[1][q] - bodies->p[1][p],
+                    bodies->p[2][q] - bodies->p[2][p]};
+    double dist_sqr = dp[0] * dp[0] + dp[1] * dp[1] + dp[2] * dp[2];
+    double touch = bodies->r[p] + bodies->r[q] + margin;
+    if (dist_sqr <= touch * touch) {
+      add_contact(contacts, p, q, sqrt(dist_sqr));
+    }
+  }
+}
+
+static int contact_order(const void *a, const void *b) {
+  const Contact *x = a;
+  const Contact *y = b;
+  if (x->i != y->i) {
+    return x->i < y->i ? -1 : 1;
+  }
+  return (x->j > y->j) - (x->j < y->j);
+}
+
+size_t find_contacts(const ParticleSoA *bodies, const KDTree_array_t *tree,
+                     double margin, const SimOptions *opts,
+                     CollisionTree *ctree, ContactList *contacts) {
+  size_t count = subtree_node_count(bodies->size);
+  if (count > ctree->size) {
+    free(ctree->nodes);
+    ctree->nodes = malloc(count * sizeof(CollisionNode));
+    if (ctree->nodes == NULL) {
+      fprintf(stderr, "malloc failed: it returned NULL\n");
+      exit(EXIT_FAILURE);
+    }
+    ctree->size = count;
+  }
+  set_collision_nodes(tree, count, bodies, ctree->nodes);
+
+  contacts->size = 0;
+#ifdef _OPENMP
+  size_t chunk = opts->chunk_size > 0 ? opts->chunk_size : 1;
+  int threads = opts->threads > 0 ? opts->threads : omp_get_max_threads();
+#pragma omp parallel for schedule(dynamic, chunk) num_threads(threads)
+#endif
+  for (size_t p = 0; p < bodies->size; ++p) {
+    contacts_recur(0, p, bodies, tree, ctree->nodes, margin, contacts);
+  }
+
+  if (contacts->size <= contacts->cap) {
+    qsort(contacts->ptr, contacts->size, sizeof(Contact), contact_order);
+  }
+  return contacts->size;
+}
+
+typedef struct {
+  size_t a;
+  size_t b;
+  double dist;
+  double overlap;
+} ContactRecord;
+
+static int record_order(const void *a, const void *b) {
+  const ContactRecord *x = a;
+  const ContactRecord *y = b;
+  if (x->a != y->a) {
+    return x->a < y->a ? -1 : 1;
+  }
+  return (x->b > y->b) - (x->b < y->b);
+}
+
+void write_contacts(const char *path, const ParticleSoA *bodies,
+                    const ContactList *contacts, uint64_t step,
+                    double time) {
+  size_t n = MIN(contacts->size, contacts->cap);
+  ContactRecord *records = malloc((n > 0 ? n : 1) * sizeof(ContactRecord));
+  if (records == NULL) {
+    fprintf(stderr, "malloc failed: it returned NULL\n");
+    exit(EXIT_FAILURE);
+  }
+  for (size_t k = 0; k < n; ++k) {
+    const Contact *c = contacts->ptr + k;
+    size_t a = bodies->id[c->i];
+    size_t b = bodies->id[c->j];
+    ContactRecord r = {MIN(a, b), MAX(a, b), c->dist,
+                       bodies->r[c->i] + bodies->r[c->j] - c->dist};
+    records[k] = r;
+  }
+  qsort(records, n, sizeof(ContactRecord), record_order);
+
+  FILE *file = fopen(path, "w");
+  if (file == NULL) {
+    fprintf(stderr, "File couldn't be opened!\n");
+    exit(EXIT_FAILURE);
+  }
+  fprintf(file, "# step %lu time %.17g pairs %lu\n", (unsigned long)step,
+          time, (unsigned long)n);
+  for (size_t k = 0; k < n; ++k) {
+    fprintf(file, "%lu %lu %.17g %.17g\n", (unsigned long)records[k].a,
+            (unsigned long)records[k].b, records[k].dist, records[k].overlap);
+  }
+  if (fclose(file) != 0) {
+    fprintf(stderr, "Collision write failed!\n");
+    exit(EXIT_FAILURE);
+  }
+  free(records);
+}
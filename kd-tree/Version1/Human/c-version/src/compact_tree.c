@@ -0,0 +1,188 @@
+#include <stdio.h>
+#include <stdlib.h>
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+#include "kdtree.h"
+#include "leaf_kernel.h"
+#include "multipole.h"
+#include "particle.h"
+
+#ifdef KDTREE_STATS
+#include "bench.h"
+#endif
+
+// Iterative force walk over the compact node layout. The builders already
+// place a node's left child right after it, so a walk only has to remember
+// the right children it still owes. Those are pushed on a fixed stack; the
+// tree is balanced, so one slot per level is plenty.
+
+#define WALK_STACK 128
+
+CompactTree new_compact_tree(size_t num_parts) {
+  size_t count = subtree_node_count(num_parts);
+  CompactTree tree = {count, calloc(count, sizeof(KDNode)),
+                      calloc(count, sizeof(far_t[6])), NULL};
+  if (tree.nodes == NULL || tree.quad == NULL) {
+    fprintf(stderr, "calloc failed: it returned NULL\n");
+    exit(EXIT_FAILURE);
+  }
+  return tree;
+}
+
+void free_compact_tree(CompactTree *tree) {
+  free(tree->nodes);
+  free(tree->quad);
+  tree->size = 0;
+  tree->nodes = NULL;
+  tree->quad = NULL;
+  tree->order = NULL;
+}
+
+// Copies the traversal fields of a tree built over num_parts particles.
+// tree keeps pointing at indices, which must outlive its use.
+void pack_tree(const KDTree_array_t *nodes, const size_t_array_t *indices,
+               size_t num_parts, CompactTree *tree) {
+  size_t count = subtree_node_count(num_parts);
+  if (count > tree->size) {
+    free_compact_tree(tree);
+    *tree = new_compact_tree(num_parts);
+  }
+  for (size_t i = 0; i < count; ++i) {
+    const KDTree *src = nodes->ptr + i;
+    KDNode *dst = tree->nodes + i;
+    for (size_t d = 0; d < 3; ++d) {
+      dst->cm[d] = (far_t)src->cm[d];
+    }
+    dst->m = (far_t)src->m;
+    dst->size_sqr = (far_t)(src->size * src->size);
+    dst->num_parts = (uint32_t)src->num_parts;
+    dst->link = (uint32_t)(src->num_parts > 0 ? src->start : src->right);
+    for (size_t k = 0; k < 6; ++k) {
+      tree->quad[i][k] = (far_t)src->quad[k];
+    }
+  }
+  tree->order = indices->ptr;
+}
+
+// Visits nodes in the same order as accel_recur and evaluates the same
+// expressions, so with double far_t the two give identical accelerations.
+// With float far_t the far field is summed in float on its own and added
+// to acc at the end, so they only agree to about 1e-4 relative, the bound
+// test.c checks.
+static inline void walk_accel(size_t p, const ParticleSoA *particles,
+                              const CompactTree *tree, const SimOptions *opts,
+                              double acc[3], WalkCounters *count) {
+  uint32_t stack[WALK_STACK];
+  size_t top = 0;
+  uint32_t cur = 0;
+  double px = particles->p[0][p];
+  double py = particles->p[1][p];
+  double pz = particles->p[2][p];
+  far_t theta_sqr = (far_t)(opts->theta * opts->theta);
+#ifdef KDTREE_FLOAT_FAR
+  far_t far[3] = {0.0f, 0.0f, 0.0f};
+#else
+  double *far = acc;
+#endif
+
+  for (;;) {
+    const KDNode *node = tree->nodes + cur;
+    if (node->num_parts > 0) {
+      leaf_accel_members(tree->order + node->link, node->num_parts, p,
+                         particles, acc);
+      STATS_ONLY(count->leaf += node->num_parts;)
+    } else {
+      // The offset is taken in double so float moments cost no position
+      // precision.
+      far_t dp[3] = {(far_t)(px - node->cm[0]), (far_t)(py - node->cm[1]),
+                     (far_t)(pz - node->cm[2])};
+      far_t dist_sqr = dp[0] * dp[0] + dp[1] * dp[1] + dp[2] * dp[2];
+      if (node->size_sqr < theta_sqr * dist_sqr) {
+        far_accel_t(node->m, tree->quad[cur], opts->order, dp, dist_sqr, far);
+        STATS_ONLY(count->far += 1;)
+      } else {
+        STATS_ONLY(count->opened += 1;)
+        stack[top++] = node->link;
+        cur += 1;
+        continue;
+      }
+    }
+    if (top == 0) {
+      break;
+    }
+    cur = stack[--top];
+  }
+#ifdef KDTREE_FLOAT_FAR
+  for (size_t d = 0; d < 3; ++d) {
+    acc[d] += far[d];
+  }
+#endif
+  (void)count;
+}
+
+void calc_accel_iter(size_t p, const ParticleSoA *particles,
+                     const CompactTree *tree, const SimOptions *opts,
+                     double acc[3]) {
+  WalkCounters unused;
+  walk_accel(p, particles, tree, opts, acc, &unused);
+}
+
+void calc_accel_iter_counted(size_t p, const ParticleSoA *particles,
+                             const CompactTree *tree, const SimOptions *opts,
+                             double acc[3], WalkCounters *count) {
+  walk_accel(p, particles, tree, opts, acc, count);
+}
+
+#ifdef KDTREE_STATS
+// The flops are those of the expressions walk_accel evaluates: 19 per leaf
+// pair, 9 to test a node against theta, 9 more for a monopole term and 38
+// more for a quadrupole. The bytes are one pass over the positions, masses
+// and order of every body, the accelerations of the walked ones, and the
+// nodes; revisits hit in cache.
+void walk_work(const ParticleSoA *bodies, size_t walked,
+               const WalkCounters *count, const SimOptions *opts) {
+  double far_flops = opts->order >= 2 ? 9.0 + 38.0 : 9.0;
+  double node_bytes = sizeof(KDNode) + (opts->order >= 2 ? 6 * sizeof(far_t) : 0);
+  double flops = 19.0 * count->leaf + 9.0 * (count->opened + count->far) +
+                 far_flops * count->far;
+  double bytes = bodies->size * (4 * sizeof(double) + sizeof(size_t)) +
+                 walked * 3 * sizeof(double) +
+                 subtree_node_count(bodies->size) * node_bytes;
+  BENCH_WORK(bytes, flops);
+}
+#endif
+
+void calc_all_accels_compact(const ParticleSoA *bodies,
+                             const CompactTree *tree, vect3_array_t *acc,
+                             const SimOptions *opts) {
+#ifdef KDTREE_STATS
+  uint64_t opened = 0, far = 0, leaf = 0;
+#endif
+#ifdef _OPENMP
+  size_t chunk = opts->chunk_size > 0 ? opts->chunk_size : 1;
+  int threads = opts->threads > 0 ? opts->threads : omp_get_max_threads();
+#pragma omp parallel for schedule(dynamic, chunk) num_threads(threads)        \
+    STATS_ONLY(reduction(+ : opened, far, leaf))
+#endif
+  for (size_t i = 0; i < bodies->size; ++i) {
+    WalkCounters count = {0, 0, 0};
+    walk_accel(i, bodies, tree, opts, acc->ptr[i].v, &count);
+#ifdef KDTREE_STATS
+    opened += count.opened;
+    far += count.far;
+    leaf += count.leaf;
+#endif
+  }
+#ifdef KDTREE_STATS
+  if (opts->stats != NULL) {
+    opts->stats->walk.opened += opened;
+    opts->stats->walk.far += far;
+    opts->stats->walk.leaf += leaf;
+  }
+  WalkCounters total = {opened, far, leaf};
+  walk_work(bodies, bodies->size, &total, opts);
+#endif
+}
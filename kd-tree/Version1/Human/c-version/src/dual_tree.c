@@ -0,0 +1,404 @@
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+#include "kdtree.h"
+#include "leaf_kernel.h"
+#include "multipole.h"
+#include "particle.h"
+
+// Dual-tree walk in the style of a fast multipole method. Instead of every
+// particle walking the tree, pairs of nodes are walked together: a pair
+// that is well separated adds the source's field to a second-order Taylor
+// expansion of the field about the target's centre of mass, and
+// only pairs of nearby leaves are summed directly. A downward pass then
+// shifts each node's expansion into its children and finally evaluates it
+// at the particles. The work is linear in the number of particles.
+//
+// Nodes of radius ra and rb whose centres are d apart are accepted when
+// ra + rb < theta * d, where a radius bounds the distance from a node's
+// centre of mass to its particles, and when ra^3 < sb^2 d, where sb^2 is
+// the source's spread2. The first is Barnes-Hut's test on both nodes. The
+// second keeps the remainder of the target's expansion, m ra^3 / d^5,
+// below the source's second-moment term, m sb^2 / d^4, which is what
+// Barnes-Hut leaves out at order 1. Without it a heavy body, such as the
+// star of circular_orbits, has its field Taylor expanded across large
+// targets, and the error at a given theta was hundreds of times that of
+// Barnes-Hut. With it the two are within a few times of each other at any
+// theta and order (make accuracy).
+
+typedef struct {
+  // Field at the node's centre of mass, its gradient and its second
+  // derivatives, both fully symmetric and stored once per index set; see
+  // SYM2 and SYM3.
+  double a[3];
+  double j[6];
+  double k[10];
+} LocalExp;
+
+// Slots of the symmetric tensors: xx, yy, zz, xy, xz, yz and xxx, yyy,
+// zzz, xxy, xxz, xyy, yyz, xzz, yzz, xyz.
+static const unsigned char SYM2[3][3] = {{0, 3, 4}, {3, 1, 5}, {4, 5, 2}};
+static const unsigned char SYM3[3][3][3] = {
+    {{0, 3, 4}, {3, 5, 9}, {4, 9, 7}},
+    {{3, 5, 9}, {5, 1, 6}, {9, 6, 8}},
+    {{4, 9, 7}, {9, 6, 8}, {7, 8, 2}}};
+// One index triple per slot of SYM3.
+static const unsigned char SYM3_INDEX[10][3] = {
+    {0, 0, 0}, {1, 1, 1}, {2, 2, 2}, {0, 0, 1}, {0, 0, 2},
+    {0, 1, 1}, {1, 1, 2}, {0, 2, 2}, {1, 2, 2}, {0, 1, 2}};
+
+// Evaluates l at offset s from its centre: the field, and when grad is
+// not NULL the gradient, so the same code shifts into a child.
+static void eval_local(const LocalExp *l, const double s[3], double a[3],
+                       double grad[6]) {
+  for (size_t i = 0; i < 3; ++i) {
+    double sum = l->a[i];
+    for (size_t j = 0; j < 3; ++j) {
+      double ks = 0.0;
+      for (size_t k = 0; k < 3; ++k) {
+        ks += l->k[SYM3[i][j][k]] * s[k];
+      }
+      sum += (l->j[SYM2[i][j]] + 0.5 * ks) * s[j];
+    }
+    a[i] += sum;
+  }
+  if (grad != NULL) {
+    for (size_t q = 0; q < 6; ++q) {
+      size_t i = q < 3 ? q : (q < 5 ? 0 : 1);
+      size_t j = q < 3 ? q : (q == 3 ? 1 : 2);
+      double sum = l->j[q];
+      for (size_t k = 0; k < 3; ++k) {
+        sum += l->k[SYM3[i][j][k]] * s[k];
+      }
+      grad[q] += sum;
+    }
+  }
+}
+
+typedef struct {
+  double cm[3];
+  double m;
+  double radius;
+  // Mass-weighted mean of the squared distance from cm, so near zero for
+  // a node whose mass sits at its centre.
+  double spread2;
+  // Traceless quadrupole about cm, as KDTree's; leaves have none there.
+  double quad[6];
+} Cell;
+
+struct DualTree {
+  size_t size;
+  Cell *cells;
+  LocalExp *local;
+};
+
+DualTree *new_dual_tree() {
+  DualTree *dual = calloc(1, sizeof(DualTree));
+  if (dual == NULL) {
+    fprintf(stderr, "calloc failed: it returned NULL\n");
+    exit(EXIT_FAILURE);
+  }
+  return dual;
+}
+
+void free_dual_tree(DualTree *dual) {
+  free(dual->cells);
+  free(dual->local);
+  free(dual);
+}
+
+static void reserve_cells(DualTree *dual, size_t size) {
+  if (size <= dual->size) {
+    return;
+  }
+  free(dual->cells);
+  free(dual->local);
+  dual->cells = calloc(size, sizeof(Cell));
+  dual->local = calloc(size, sizeof(LocalExp));
+  if (dual->cells == NULL || dual->local == NULL) {
+    fprintf(stderr, "calloc failed: it returned NULL\n");
+    exit(EXIT_FAILURE);
+  }
+  dual->size = size;
+}
+
+// Leaves carry no moments of their own, so their centres and quadrupoles
+// come from the members; internal nodes reuse the builder's moments and
+// bound their radius and spread by the children's.
+static void set_cells(const KDTree_array_t *nodes, size_t cur,
+                      const ParticleSoA *particles, Cell *cells) {
+  const KDTree *node = nodes->ptr + cur;
+  Cell *cell = cells + cur;
+  if (node->num_parts > 0) {
+    double m = 0.0;
+    double cm[3] = {0.0, 0.0, 0.0};
+    for (size_t i = 0; i < node->num_parts; ++i) {
+      size_t p = node->particles[i];
+      m += particles->m[p];
+      for (size_t d = 0; d < 3; ++d) {
+        cm[d] += particles->m[p] * particles->p[d][p];
+      }
+    }
+    double radius = 0.0, spread2 = 0.0;
+    for (size_t d = 0; d < 3; ++d) {
+      cell->cm[d] = cm[d] / m;
+    }
+    memset(cell->quad, 0, sizeof(cell->quad));
+    for (size_t i = 0; i < node->num_parts; ++i) {
+      size_t p = node->particles[i];
+      double s[3] = {particles->p[0][p] - cell->cm[0],
+                     particles->p[1][p] - cell->cm[1],
+                     particles->p[2][p] - cell->cm[2]};
+      double r = sqrt(s[0] * s[0] + s[1] * s[1] + s[2] * s[2]);
+      radius = r > radius ? r : radius;
+      spread2 += particles->m[p] * r * r;
+      add_quad_point(particles->m[p], s, cell->quad);
+    }
+    cell->m = m;
+    cell->radius = radius;
+    cell->spread2 = spread2 / m;
+    return;
+  }
+
+  set_cells(nodes, node->left, particles, cells);
+  set_cells(nodes, node->right, particles, cells);
+  for (size_t d = 0; d < 3; ++d) {
+    cell->cm[d] = node->cm[d];
+  }
+  cell->m = node->m;
+  memcpy(cell->quad, node->quad, sizeof(cell->quad));
+  cell->radius = 0.0;
+  cell->spread2 = 0.0;
+  size_t children[2] = {node->left, node->right};
+  for (size_t c = 0; c < 2; ++c) {
+    const Cell *child = cells + children[c];
+    double s[3] = {child->cm[0] - cell->cm[0], child->cm[1] - cell->cm[1],
+                   child->cm[2] - cell->cm[2]};
+    double s2 = s[0] * s[0] + s[1] * s[1] + s[2] * s[2];
+    double r = sqrt(s2) + child->radius;
+    cell->radius = r > cell->radius ? r : cell->radius;
+    cell->spread2 += child->m * (child->spread2 + s2);
+  }
+  cell->spread2 /= cell->m;
+}
+
+// Adds the first two derivatives of the quadrupole term of far_accel,
+//   a_i = Q_ij r_j / r^5 - 5/2 (r.Q.r) r_i / r^7,
+// at offset r from a source with traceless quadrupole q:
+//   da_i/dx_j = Q_ij / r^5 - 5 ((Qr)_i r_j + (Qr)_j r_i) / r^7
+//               - 5/2 (r.Q.r) d_ij / r^7 + 35/2 (r.Q.r) r_i r_j / r^9
+// and, summing over the three ways of picking (i, j, k),
+//   d2a_i/dx_j dx_k = sum [-5 (Q_ij r_k + (Qr)_k d_ij) / r^7
+//                          + 35 (Qr)_k r_i r_j / r^9
+//                          + 35/2 (r.Q.r) d_ij r_k / r^9]
+//                     - 315/2 (r.Q.r) r_i r_j r_k / r^11.
+static void add_quad_derivs(const double q[6], const double r[3], double r2,
+                            LocalExp *out) {
+  double qr[3];
+  for (size_t i = 0; i < 3; ++i) {
+    qr[i] = q[SYM2[i][0]] * r[0] + q[SYM2[i][1]] * r[1] + q[SYM2[i][2]] * r[2];
+  }
+  double rqr = r[0] * qr[0] + r[1] * qr[1] + r[2] * qr[2];
+  double inv_r2 = 1.0 / r2;
+  double inv_r5 = inv_r2 * inv_r2 / sqrt(r2);
+  double inv_r7 = inv_r5 * inv_r2;
+  double inv_r9 = inv_r7 * inv_r2;
+
+  for (size_t q2 = 0; q2 < 6; ++q2) {
+    size_t i = q2 < 3 ? q2 : (q2 < 5 ? 0 : 1);
+    size_t j = q2 < 3 ? q2 : (q2 == 3 ? 1 : 2);
+    out->j[q2] += q[q2] * inv_r5 -
+                  5.0 * (qr[i] * r[j] + qr[j] * r[i]) * inv_r7 -
+                  (i == j ? 2.5 * rqr * inv_r7 : 0.0) +
+                  17.5 * rqr * r[i] * r[j] * inv_r9;
+  }
+  for (size_t q3 = 0; q3 < 10; ++q3) {
+    size_t idx[3] = {SYM3_INDEX[q3][0], SYM3_INDEX[q3][1], SYM3_INDEX[q3][2]};
+    double sum = 0.0;
+    for (size_t c = 0; c < 3; ++c) {
+      // (i, j) the pair and k the third index
+      size_t i = idx[c], j = idx[(c + 1) % 3], k = idx[(c + 2) % 3];
+      sum += -5.0 * (q[SYM2[i][j]] * r[k] + (i == j ? qr[k] : 0.0)) * inv_r7 +
+             35.0 * qr[k] * r[i] * r[j] * inv_r9 +
+             (i == j ? 17.5 * rqr * r[k] * inv_r9 : 0.0);
+    }
+    out->k[q3] += sum - 157.5 * rqr * r[idx[0]] * r[idx[1]] * r[idx[2]] *
+                            inv_r9 * inv_r2;
+  }
+}
+
+// Adds source's field and its first two derivatives at target's centre.
+static void add_m2l(const Cell *cells, size_t target, size_t source,
+                    int order, LocalExp *out) {
+  const Cell *t = cells + target;
+  const Cell *s = cells + source;
+  double r[3] = {t->cm[0] - s->cm[0], t->cm[1] - s->cm[1],
+                 t->cm[2] - s->cm[2]};
+  double r2 = r[0] * r[0] + r[1] * r[1] + r[2] * r[2];
+  far_accel(s->m, s->quad, order, r, r2, out->a);
+
+  double inv_r = 1.0 / sqrt(r2);
+  double inv_r3 = inv_r * inv_r * inv_r;
+  double m3_r5 = 3.0 * s->m * inv_r3 / r2;
+  double m_r3 = s->m * inv_r3;
+  out->j[0] += m3_r5 * r[0] * r[0] - m_r3;
+  out->j[1] += m3_r5 * r[1] * r[1] - m_r3;
+  out->j[2] += m3_r5 * r[2] * r[2] - m_r3;
+  out->j[3] += m3_r5 * r[0] * r[1];
+  out->j[4] += m3_r5 * r[0] * r[2];
+  out->j[5] += m3_r5 * r[1] * r[2];
+
+  // d2 a_i / dx_j dx_k = 3m (d_ij r_k + d_ik r_j + d_jk r_i) / r^5
+  //                      - 15m r_i r_j r_k / r^7
+  double m15_r7 = 5.0 * m3_r5 / r2;
+  for (size_t q = 0; q < 10; ++q) {
+    size_t i = SYM3_INDEX[q][0];
+    size_t j = SYM3_INDEX[q][1];
+    size_t k = SYM3_INDEX[q][2];
+    double delta = (i == j ? r[k] : 0.0) + (i == k ? r[j] : 0.0) +
+                   (j == k ? r[i] : 0.0);
+    out->k[q] += m3_r5 * delta - m15_r7 * r[i] * r[j] * r[k];
+  }
+  if (order >= 2) {
+    add_quad_derivs(s->quad, r, r2, out);
+  }
+}
+
+// Direct sum from the members of leaf source onto those of leaf target.
+static void add_p2p(const KDTree *target, const KDTree *source,
+                    const ParticleSoA *particles, vect3 *acc) {
+  for (size_t i = 0; i < target->num_parts; ++i) {
+    size_t p = target->particles[i];
+    leaf_accel_members(source->particles, source->num_parts, p, particles,
+                       acc[p].v);
+  }
+}
+
+typedef struct {
+  const KDTree_array_t *nodes;
+  const ParticleSoA *particles;
+  DualTree *dual;
+  vect3 *acc;
+  double theta;
+  int order;
+} DualWalk;
+
+// Everything interact writes belongs to target's subtree, so calls on
+// disjoint targets may run as concurrent tasks.
+static void interact(const DualWalk *w, size_t target, size_t source,
+                     int depth) {
+  const KDTree *t = w->nodes->ptr + target;
+  const KDTree *s = w->nodes->ptr + source;
+
+  if (target == source) {
+    if (t->num_parts > 0) {
+      add_p2p(t, t, w->particles, w->acc);
+      return;
+    }
+#ifdef _OPENMP
+#pragma omp task if (depth > 0)
+#endif
+    {
+      interact(w, t->left, t->left, depth - 1);
+      interact(w, t->left, t->right, depth - 1);
+    }
+    interact(w, t->right, t->right, depth - 1);
+    interact(w, t->right, t->left, depth - 1);
+#ifdef _OPENMP
+#pragma omp taskwait
+#endif
+    return;
+  }
+
+  const Cell *ct = w->dual->cells + target;
+  const Cell *cs = w->dual->cells + source;
+  double r[3] = {ct->cm[0] - cs->cm[0], ct->cm[1] - cs->cm[1],
+                 ct->cm[2] - cs->cm[2]};
+  double r2 = r[0] * r[0] + r[1] * r[1] + r[2] * r[2];
+  double reach = ct->radius + cs->radius;
+  double ra3 = ct->radius * ct->radius * ct->radius;
+  if (reach * reach < w->theta * w->theta * r2 &&
+      ra3 * ra3 < cs->spread2 * cs->spread2 * r2) {
+    add_m2l(w->dual->cells, target, source, w->order,
+            w->dual->local + target);
+  } else if (t->num_parts > 0 && s->num_parts > 0) {
+    add_p2p(t, s, w->particles, w->acc);
+  } else if (s->num_parts > 0 ||
+             (t->num_parts == 0 && ct->radius >= cs->radius)) {
+#ifdef _OPENMP
+#pragma omp task if (depth > 0)
+#endif
+    interact(w, t->left, source, depth - 1);
+    interact(w, t->right, source, depth - 1);
+#ifdef _OPENMP
+#pragma omp taskwait
+#endif
+  } else {
+    interact(w, target, s->left, depth);
+    interact(w, target, s->right, depth);
+  }
+}
+
+// Shifts each expansion into its children and evaluates the leaves' at
+// their particles.
+static void push_down(const DualWalk *w, size_t cur, int depth) {
+  const KDTree *node = w->nodes->ptr + cur;
+  const LocalExp *l = w->dual->local + cur;
+  const Cell *c = w->dual->cells + cur;
+  if (node->num_parts > 0) {
+    for (size_t i = 0; i < node->num_parts; ++i) {
+      size_t p = node->particles[i];
+      double s[3] = {w->particles->p[0][p] - c->cm[0],
+                     w->particles->p[1][p] - c->cm[1],
+                     w->particles->p[2][p] - c->cm[2]};
+      eval_local(l, s, w->acc[p].v, NULL);
+    }
+    return;
+  }
+
+  size_t children[2] = {node->left, node->right};
+  for (size_t k = 0; k < 2; ++k) {
+    LocalExp *child = w->dual->local + children[k];
+    const Cell *cc = w->dual->cells + children[k];
+    double s[3] = {cc->cm[0] - c->cm[0], cc->cm[1] - c->cm[1],
+                   cc->cm[2] - c->cm[2]};
+    eval_local(l, s, child->a, child->j);
+    for (size_t q = 0; q < 10; ++q) {
+      child->k[q] += l->k[q];
+    }
+  }
+#ifdef _OPENMP
+#pragma omp task if (depth > 0)
+#endif
+  push_down(w, node->left, depth - 1);
+  push_down(w, node->right, depth - 1);
+#ifdef _OPENMP
+#pragma omp taskwait
+#endif
+}
+
+void calc_all_accels_dual(const ParticleSoA *bodies,
+                          const KDTree_array_t *tree, vect3_array_t *acc,
+                          const SimOptions *opts, DualTree *dual) {
+  size_t count = subtree_node_count(bodies->size);
+  reserve_cells(dual, count);
+  memset(dual->local, 0, count * sizeof(LocalExp));
+  set_cells(tree, 0, bodies, dual->cells);
+
+  DualWalk w = {tree, bodies, dual, acc->ptr, opts->theta, opts->order};
+#ifdef _OPENMP
+  int threads = opts->threads > 0 ? opts->threads : omp_get_max_threads();
+#pragma omp parallel num_threads(threads)
+#pragma omp single
+#endif
+  {
+    interact(&w, 0, 0, opts->build_task_depth);
+    push_down(&w, 0, opts->build_task_depth);
+  }
+}
@@ -0,0 +1,320 @@
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+#include "kdtree.h"
+#include "leaf_kernel.h"
+#include "multipole.h"
+#include "particle.h"
+
+// Group traversal: instead of walking the tree once per particle, walk it
+// once per group (a leaf, or the largest subtree holding at most
+// group_size particles) and record the interactions every member needs.
+// A node is accepted for the whole group when its size passes theta
+// against the closest point of the group's bounding box, which is never
+// further than any member, so the opening rule is at least as strict as
+// the per-particle one.
+
+#define WALK_STACK 128
+
+typedef struct {
+  size_t size;
+  size_t cap;
+  // Far-field nodes, stored as SoA so the per-member loop streams them.
+  // Centres are relative to origin, the middle of the group's bounding
+  // box, which keeps offsets small enough for far_t to hold them.
+  double origin[3];
+  far_t *cm[3];
+  far_t *m;
+  // Node indices, for the quadrupole terms when order >= 2.
+  size_t *node;
+} FarList;
+
+typedef struct {
+  size_t size;
+  size_t cap;
+  size_t *ptr;
+} NearList;
+
+static void *checked_realloc(void *ptr, size_t bytes) {
+  void *ret = realloc(ptr, bytes);
+  if (ret == NULL) {
+    fprintf(stderr, "realloc failed: it returned NULL\n");
+    exit(EXIT_FAILURE);
+  }
+  return ret;
+}
+
+static void far_push(FarList *far, const KDTree_array_t *nodes, size_t n) {
+  if (far->size == far->cap) {
+    far->cap = far->cap ? 2 * far->cap : 256;
+    for (size_t d = 0; d < 3; ++d) {
+      far->cm[d] = checked_realloc(far->cm[d], far->cap * sizeof(far_t));
+    }
+    far->m = checked_realloc(far->m, far->cap * sizeof(far_t));
+    far->node = checked_realloc(far->node, far->cap * sizeof(size_t));
+  }
+  for (size_t d = 0; d < 3; ++d) {
+    far->cm[d][far->size] = (far_t)(nodes->ptr[n].cm[d] - far->origin[d]);
+  }
+  far->m[far->size] = (far_t)nodes->ptr[n].m;
+  far->node[far->size] = n;
+  far->size += 1;
+}
+
+static void near_push(NearList *near, size_t node) {
+  if (near->size == near->cap) {
+    near->cap = near->cap ? 2 * near->cap : 64;
+    near->ptr = checked_realloc(near->ptr, near->cap * sizeof(size_t));
+  }
+  near->ptr[near->size++] = node;
+}
+
+// The particles of a subtree are one contiguous run of the builder's
+// index order, from its leftmost leaf to its rightmost one.
+static void subtree_range(const KDTree_array_t *nodes, size_t node,
+                          size_t *lo, size_t *hi) {
+  size_t n = node;
+  while (nodes->ptr[n].num_parts == 0) {
+    n = nodes->ptr[n].left;
+  }
+  *lo = nodes->ptr[n].start;
+  n = node;
+  while (nodes->ptr[n].num_parts == 0) {
+    n = nodes->ptr[n].right;
+  }
+  *hi = nodes->ptr[n].start + nodes->ptr[n].num_parts;
+}
+
+static void collect_groups(const KDTree_array_t *nodes, size_t node,
+                           size_t group_size, NearList *groups) {
+  size_t lo, hi;
+  subtree_range(nodes, node, &lo, &hi);
+  if (nodes->ptr[node].num_parts > 0 || hi - lo <= group_size) {
+    near_push(groups, node);
+  } else {
+    collect_groups(nodes, nodes->ptr[node].left, group_size, groups);
+    collect_groups(nodes, nodes->ptr[node].right, group_size, groups);
+  }
+}
+
+// Returns the number of internal nodes opened.
+static size_t build_lists(const KDTree_array_t *nodes, double theta,
+                          const double bmin[3], const double bmax[3],
+                          FarList *far, NearList *near) {
+  size_t stack[WALK_STACK];
+  size_t top = 0;
+  size_t opened = 0;
+  stack[top++] = 0;
+  far->size = 0;
+  near->size = 0;
+  for (size_t d = 0; d < 3; ++d) {
+    far->origin[d] = 0.5 * (bmin[d] + bmax[d]);
+  }
+
+  while (top > 0) {
+    size_t cur = stack[--top];
+    const KDTree *node = nodes->ptr + cur;
+    if (node->num_parts > 0) {
+      near_push(near, cur);
+      continue;
+    }
+    double dist_sqr = 0.0;
+    for (size_t d = 0; d < 3; ++d) {
+      double gap = 0.0;
+      if (node->cm[d] < bmin[d]) {
+        gap = bmin[d] - node->cm[d];
+      } else if (node->cm[d] > bmax[d]) {
+        gap = node->cm[d] - bmax[d];
+      }
+      dist_sqr += gap * gap;
+    }
+    if (node->size * node->size < theta * theta * dist_sqr) {
+      far_push(far, nodes, cur);
+    } else {
+      // Right first so the left child is visited first, as in accel_recur.
+      stack[top++] = node->right;
+      stack[top++] = node->left;
+      opened += 1;
+    }
+  }
+  return opened;
+}
+
+static void eval_lists(size_t p, const ParticleSoA *particles,
+                       const KDTree_array_t *nodes, int order,
+                       const FarList *far, const NearList *near,
+                       double acc[3]) {
+  far_t px = (far_t)(particles->p[0][p] - far->origin[0]);
+  far_t py = (far_t)(particles->p[1][p] - far->origin[1]);
+  far_t pz = (far_t)(particles->p[2][p] - far->origin[2]);
+  far_t sum[3] = {0.0, 0.0, 0.0};
+  if (order >= 2) {
+    for (size_t f = 0; f < far->size; ++f) {
+      far_t dp[3] = {px - far->cm[0][f], py - far->cm[1][f],
+                     pz - far->cm[2][f]};
+      far_t dist_sqr = dp[0] * dp[0] + dp[1] * dp[1] + dp[2] * dp[2];
+      far_t quad[6];
+      for (size_t k = 0; k < 6; ++k) {
+        quad[k] = (far_t)nodes->ptr[far->node[f]].quad[k];
+      }
+      far_accel_t(far->m[f], quad, order, dp, dist_sqr, sum);
+    }
+  } else {
+    // With float far_t this loop runs twice as many lanes per vector.
+    far_t ax = 0.0, ay = 0.0, az = 0.0;
+    for (size_t f = 0; f < far->size; ++f) {
+      far_t dx = px - far->cm[0][f];
+      far_t dy = py - far->cm[1][f];
+      far_t dz = pz - far->cm[2][f];
+      far_t dist_sqr = dx * dx + dy * dy + dz * dz;
+      far_t dist = far_sqrt(dist_sqr);
+      far_t magi = -far->m[f] / (dist_sqr * dist);
+      ax += dx * magi;
+      ay += dy * magi;
+      az += dz * magi;
+    }
+    sum[0] = ax;
+    sum[1] = ay;
+    sum[2] = az;
+  }
+  acc[0] += sum[0];
+  acc[1] += sum[1];
+  acc[2] += sum[2];
+  for (size_t l = 0; l < near->size; ++l) {
+    leaf_accel(nodes->ptr + near->ptr[l], p, particles, acc);
+  }
+}
+
+struct GroupWalk {
+  NearList groups;
+  // One list pair per thread, kept between calls so steady-state steps
+  // only reuse capacity.
+  size_t lists;
+  FarList *far;
+  NearList *near;
+};
+
+GroupWalk *new_group_walk() {
+  GroupWalk *walk = calloc(1, sizeof(GroupWalk));
+  if (walk == NULL) {
+    fprintf(stderr, "calloc failed: it returned NULL\n");
+    exit(EXIT_FAILURE);
+  }
+  return walk;
+}
+
+void free_group_walk(GroupWalk *walk) {
+  for (size_t t = 0; t < walk->lists; ++t) {
+    for (size_t d = 0; d < 3; ++d) {
+      free(walk->far[t].cm[d]);
+    }
+    free(walk->far[t].m);
+    free(walk->far[t].node);
+    free(walk->near[t].ptr);
+  }
+  free(walk->far);
+  free(walk->near);
+  free(walk->groups.ptr);
+  free(walk);
+}
+
+static void reserve_lists(GroupWalk *walk, size_t lists) {
+  if (lists <= walk->lists) {
+    return;
+  }
+  walk->far = checked_realloc(walk->far, lists * sizeof(FarList));
+  walk->near = checked_realloc(walk->near, lists * sizeof(NearList));
+  for (size_t t = walk->lists; t < lists; ++t) {
+    FarList far = {0, 0, {0.0, 0.0, 0.0}, {NULL, NULL, NULL}, NULL, NULL};
+    NearList near = {0, 0, NULL};
+    walk->far[t] = far;
+    walk->near[t] = near;
+  }
+  walk->lists = lists;
+}
+
+void calc_all_accels_group_walk(const ParticleSoA *bodies,
+                                const KDTree_array_t *tree,
+                                const size_t_array_t *indices,
+                                vect3_array_t *acc, const SimOptions *opts,
+                                GroupWalk *walk) {
+  NearList *groups = &walk->groups;
+  groups->size = 0;
+  collect_groups(tree, 0, opts->group_size, groups);
+#ifdef KDTREE_STATS
+  uint64_t opened = 0, far_terms = 0, leaf = 0;
+#endif
+
+#ifdef _OPENMP
+  int threads = opts->threads > 0 ? opts->threads : omp_get_max_threads();
+  reserve_lists(walk, (size_t)threads);
+#pragma omp parallel num_threads(threads)
+#else
+  reserve_lists(walk, 1);
+#endif
+  {
+#ifdef _OPENMP
+    size_t t = (size_t)omp_get_thread_num();
+#else
+    size_t t = 0;
+#endif
+    FarList *far = walk->far + t;
+    NearList *near = walk->near + t;
+
+#ifdef _OPENMP
+#pragma omp for schedule(dynamic, 1)                                          \
+    STATS_ONLY(reduction(+ : opened, far_terms, leaf))
+#endif
+    for (size_t g = 0; g < groups->size; ++g) {
+      size_t lo, hi;
+      subtree_range(tree, groups->ptr[g], &lo, &hi);
+
+      double bmin[3] = {1e100, 1e100, 1e100};
+      double bmax[3] = {-1e100, -1e100, -1e100};
+      for (size_t i = lo; i < hi; ++i) {
+        size_t p = indices->ptr[i];
+        for (size_t d = 0; d < 3; ++d) {
+          bmin[d] = bmin[d] < bodies->p[d][p] ? bmin[d] : bodies->p[d][p];
+          bmax[d] = bmax[d] > bodies->p[d][p] ? bmax[d] : bodies->p[d][p];
+        }
+      }
+
+      size_t opened_here =
+          build_lists(tree, opts->theta, bmin, bmax, far, near);
+      for (size_t i = lo; i < hi; ++i) {
+        size_t p = indices->ptr[i];
+        eval_lists(p, bodies, tree, opts->order, far, near, acc->ptr[p].v);
+      }
+      (void)opened_here;
+#ifdef KDTREE_STATS
+      // Lists are shared by the group, so every member sees all of them.
+      opened += opened_here;
+      far_terms += (hi - lo) * far->size;
+      for (size_t l = 0; l < near->size; ++l) {
+        leaf += (hi - lo) * tree->ptr[near->ptr[l]].num_parts;
+      }
+#endif
+    }
+  }
+#ifdef KDTREE_STATS
+  if (opts->stats != NULL) {
+    opts->stats->walk.opened += opened;
+    opts->stats->walk.far += far_terms;
+    opts->stats->walk.leaf += leaf;
+  }
+#endif
+}
+
+void calc_all_accels_group(const ParticleSoA *bodies,
+                           const KDTree_array_t *tree,
+                           const size_t_array_t *indices, vect3_array_t *acc,
+                           const SimOptions *opts) {
+  GroupWalk *walk = new_group_walk();
+  calc_all_accels_group_walk(bodies, tree, indices, acc, opts, walk);
+  free_group_walk(walk);
+}
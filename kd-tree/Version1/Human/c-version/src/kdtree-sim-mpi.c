@@ -0,0 +1,577 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <math.h>
+#include <mpi.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+#include "kdtree.h"
+#include "particle.h"
+
+// Distributed kd-tree simulation. Every step:
+//
+// 1. Orthogonal recursive bisection assigns each body to a rank. Like
+//    build_tree, each domain is split on the longest extent of its bodies,
+//    at the count that gives each half its share of ranks. The split value
+//    is found by bisection on globally reduced counts.
+// 2. Bodies migrate to their owners with one all-to-all.
+// 3. Each rank builds a tree over its own bodies and, for every other rank,
+//    walks it against that rank's bounding box. Nodes that pass the opening
+//    test from anywhere in the box are sent as pseudo-particles at their
+//    centre of mass; leaves that do not are sent body by body. This is the
+//    rank's locally essential tree for the other side.
+// 4. Each rank builds a second tree over its bodies plus everything it
+//    received, evaluates forces on its own bodies only, and integrates them.
+//
+// Remote contributions are monopoles, so -q only sharpens the local part.
+
+typedef struct {
+  Particle part;
+  // Global id, or GHOST for received pseudo-particles and remote bodies.
+  uint64_t id;
+} Body;
+
+#define GHOST UINT64_MAX
+
+typedef struct {
+  size_t size;
+  size_t cap;
+  Body *ptr;
+} Body_array_t;
+
+static MPI_Datatype body_type;
+
+static void *checked_realloc(void *ptr, size_t bytes) {
+  void *ret = realloc(ptr, bytes);
+  if (ret == NULL && bytes > 0) {
+    fprintf(stderr, "realloc failed: it returned NULL\n");
+    MPI_Abort(MPI_COMM_WORLD, EXIT_FAILURE);
+  }
+  return ret;
+}
+
+static void body_reserve(Body_array_t *arr, size_t count) {
+  if (count > arr->cap) {
+    arr->cap = count > 2 * arr->cap ? count : 2 * arr->cap;
+    arr->ptr = checked_realloc(arr->ptr, arr->cap * sizeof(Body));
+  }
+}
+
+static void body_push(Body_array_t *arr, Body b) {
+  body_reserve(arr, arr->size + 1);
+  arr->ptr[arr->size++] = b;
+}
+
+static uint64_t mix64(uint64_t z) {
+  z += 0x9e3779b97f4a7c15u;
+  z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9u;
+  z = (z ^ (z >> 27)) * 0x94d049bb133111ebu;
+  return z ^ (z >> 31);
+}
+
+// This rank's share of circular_orbits(n). Angles are hashed from the
+// global id instead of drawn from rand(), so the bodies do not depend on
+// the rank count and no rank holds the whole system.
+static Body_array_t circular_orbits_slice(size_t n, int rank, int ranks) {
+  size_t total = n + 1;
+  size_t first = total * rank / ranks;
+  size_t last = total * (rank + 1) / ranks;
+  Body_array_t bodies = {0, 0, NULL};
+  body_reserve(&bodies, last - first);
+  for (size_t i = first; i < last; ++i) {
+    Body b = {{{0.0, 0.0, 0.0}, {0.0, 0.0, 0.0}, 0.00465047, 1.0}, i};
+    if (i > 0) {
+      double d = 0.1 + (i * 5.0 / n);
+      double v = sqrt(1.0 / d);
+      double theta = (double)(mix64(i) >> 11) / 9007199254740992.0 * 6.28;
+      Particle planet = {{d * cos(theta), d * sin(theta), 0.0},
+                         {-v * sin(theta), v * cos(theta), 0.0},
+                         1e-14,
+                         1e-7};
+      b.part = planet;
+    }
+    body_push(&bodies, b);
+  }
+  return bodies;
+}
+
+typedef struct {
+  int first_rank;
+  int ranks;
+} Domain;
+
+// Fills owner[i] with the rank whose domain holds bodies->ptr[i].
+static void orb_assign(const Body_array_t *bodies, int ranks, int *owner) {
+  size_t n = bodies->size;
+  int *dom = calloc(n + 1, sizeof(int));
+  Domain *domains = malloc(ranks * sizeof(Domain));
+  Domain *next = malloc(ranks * sizeof(Domain));
+  double *lo = malloc(6 * ranks * sizeof(double));
+  double *hi = lo + 3 * ranks;
+  uint64_t *count = malloc(2 * ranks * sizeof(uint64_t));
+  uint64_t *below = count + ranks;
+  double *split_lo = malloc(3 * ranks * sizeof(double));
+  double *split_hi = split_lo + ranks;
+  double *split = split_hi + ranks;
+  int *dim = malloc(2 * ranks * sizeof(int));
+  // Children of domain d are child[d] and, if it splits, child[d] + 1.
+  int *child = dim + ranks;
+  if (dom == NULL || domains == NULL || next == NULL || lo == NULL ||
+      count == NULL || split_lo == NULL || dim == NULL) {
+    fprintf(stderr, "malloc failed: it returned NULL\n");
+    MPI_Abort(MPI_COMM_WORLD, EXIT_FAILURE);
+  }
+
+  int nd = 1;
+  domains[0].first_rank = 0;
+  domains[0].ranks = ranks;
+  int splitting = ranks > 1;
+  while (splitting) {
+    for (int d = 0; d < nd; ++d) {
+      for (int k = 0; k < 3; ++k) {
+        lo[3 * d + k] = 1e100;
+        hi[3 * d + k] = -1e100;
+      }
+      count[d] = 0;
+    }
+    for (size_t i = 0; i < n; ++i) {
+      int d = dom[i];
+      for (int k = 0; k < 3; ++k) {
+        double x = bodies->ptr[i].part.p[k];
+        lo[3 * d + k] = x < lo[3 * d + k] ? x : lo[3 * d + k];
+        hi[3 * d + k] = x > hi[3 * d + k] ? x : hi[3 * d + k];
+      }
+      count[d] += 1;
+    }
+    MPI_Allreduce(MPI_IN_PLACE, lo, 3 * nd, MPI_DOUBLE, MPI_MIN,
+                  MPI_COMM_WORLD);
+    MPI_Allreduce(MPI_IN_PLACE, hi, 3 * nd, MPI_DOUBLE, MPI_MAX,
+                  MPI_COMM_WORLD);
+    MPI_Allreduce(MPI_IN_PLACE, count, nd, MPI_UINT64_T, MPI_SUM,
+                  MPI_COMM_WORLD);
+
+    // Longest extent, as in split_node.
+    for (int d = 0; d < nd; ++d) {
+      dim[d] = 0;
+      for (int k = 1; k < 3; ++k) {
+        if (hi[3 * d + k] - lo[3 * d + k] >
+            hi[3 * d + dim[d]] - lo[3 * d + dim[d]]) {
+          dim[d] = k;
+        }
+      }
+      split_lo[d] = lo[3 * d + dim[d]];
+      split_hi[d] = hi[3 * d + dim[d]];
+    }
+
+    // Bisect every domain's split value at once until each lower half
+    // holds its share of the domain's bodies.
+    for (int iter = 0; iter < 64; ++iter) {
+      for (int d = 0; d < nd; ++d) {
+        split[d] = 0.5 * (split_lo[d] + split_hi[d]);
+        below[d] = 0;
+      }
+      for (size_t i = 0; i < n; ++i) {
+        int d = dom[i];
+        below[d] += bodies->ptr[i].part.p[dim[d]] < split[d];
+      }
+      MPI_Allreduce(MPI_IN_PLACE, below, nd, MPI_UINT64_T, MPI_SUM,
+                    MPI_COMM_WORLD);
+      int settled = 1;
+      for (int d = 0; d < nd; ++d) {
+        if (domains[d].ranks < 2) {
+          continue;
+        }
+        uint64_t target =
+            count[d] * (uint64_t)(domains[d].ranks / 2) / domains[d].ranks;
+        if (below[d] < target) {
+          split_lo[d] = split[d];
+          settled = 0;
+        } else if (below[d] > target) {
+          split_hi[d] = split[d];
+          settled = 0;
+        }
+      }
+      if (settled) {
+        break;
+      }
+    }
+
+    int nn = 0;
+    splitting = 0;
+    for (int d = 0; d < nd; ++d) {
+      child[d] = nn;
+      if (domains[d].ranks < 2) {
+        next[nn++] = domains[d];
+      } else {
+        int low_ranks = domains[d].ranks / 2;
+        Domain a = {domains[d].first_rank, low_ranks};
+        Domain b = {domains[d].first_rank + low_ranks,
+                    domains[d].ranks - low_ranks};
+        next[nn++] = a;
+        next[nn++] = b;
+        splitting |= a.ranks > 1 || b.ranks > 1;
+      }
+    }
+    for (size_t i = 0; i < n; ++i) {
+      int d = dom[i];
+      int c = child[d];
+      if (domains[d].ranks > 1 &&
+          bodies->ptr[i].part.p[dim[d]] >= split[d]) {
+        c += 1;
+      }
+      dom[i] = c;
+    }
+    Domain *tmp = domains;
+    domains = next;
+    next = tmp;
+    nd = nn;
+  }
+
+  for (size_t i = 0; i < n; ++i) {
+    owner[i] = domains[dom[i]].first_rank;
+  }
+  free(dom);
+  free(domains);
+  free(next);
+  free(lo);
+  free(count);
+  free(split_lo);
+  free(dim);
+}
+
+// Sends send->ptr, grouped by destination with send_counts bodies for each
+// rank, and returns what this rank receives.
+static Body_array_t exchange(const Body_array_t *send, const int *send_counts,
+                             int ranks) {
+  int *recv_counts = malloc(4 * ranks * sizeof(int));
+  int *send_displs = recv_counts + ranks;
+  int *recv_displs = send_displs + ranks;
+  if (recv_counts == NULL) {
+    fprintf(stderr, "malloc failed: it returned NULL\n");
+    MPI_Abort(MPI_COMM_WORLD, EXIT_FAILURE);
+  }
+  MPI_Alltoall(send_counts, 1, MPI_INT, recv_counts, 1, MPI_INT,
+               MPI_COMM_WORLD);
+  int sent = 0, received = 0;
+  for (int r = 0; r < ranks; ++r) {
+    send_displs[r] = sent;
+    recv_displs[r] = received;
+    sent += send_counts[r];
+    received += recv_counts[r];
+  }
+  Body_array_t recv = {0, 0, NULL};
+  body_reserve(&recv, (size_t)received + 1);
+  recv.size = (size_t)received;
+  MPI_Alltoallv(send->ptr, send_counts, send_displs, body_type, recv.ptr,
+                recv_counts, recv_displs, body_type, MPI_COMM_WORLD);
+  free(recv_counts);
+  return recv;
+}
+
+static Body_array_t migrate(Body_array_t *bodies, int ranks) {
+  int *owner = malloc((bodies->size + 1) * sizeof(int));
+  int *counts = calloc(2 * ranks, sizeof(int));
+  int *fill = counts + ranks;
+  if (owner == NULL || counts == NULL) {
+    fprintf(stderr, "malloc failed: it returned NULL\n");
+    MPI_Abort(MPI_COMM_WORLD, EXIT_FAILURE);
+  }
+  orb_assign(bodies, ranks, owner);
+
+  for (size_t i = 0; i < bodies->size; ++i) {
+    counts[owner[i]] += 1;
+  }
+  for (int r = 1; r < ranks; ++r) {
+    fill[r] = fill[r - 1] + counts[r - 1];
+  }
+  Body_array_t sorted = {0, 0, NULL};
+  body_reserve(&sorted, bodies->size + 1);
+  sorted.size = bodies->size;
+  for (size_t i = 0; i < bodies->size; ++i) {
+    sorted.ptr[fill[owner[i]]++] = bodies->ptr[i];
+  }
+
+  Body_array_t mine = exchange(&sorted, counts, ranks);
+  free(sorted.ptr);
+  free(owner);
+  free(counts);
+  return mine;
+}
+
+static ParticleSoA soa_from_bodies(const Body_array_t *a,
+                                   const Body_array_t *b) {
+  ParticleSoA soa = new_particle_soa(a->size + b->size);
+  for (size_t i = 0; i < soa.size; ++i) {
+    const Particle *p = i < a->size ? &a->ptr[i].part
+                                    : &b->ptr[i - a->size].part;
+    for (size_t d = 0; d < 3; ++d) {
+      soa.p[d][i] = p->p[d];
+      soa.v[d][i] = p->v[d];
+    }
+    soa.r[i] = p->r;
+    soa.m[i] = p->m;
+  }
+  return soa;
+}
+
+// Appends the parts of the local tree that a rank with bodies inside
+// [bmin, bmax] needs: accepted nodes as pseudo-particles, the rest as the
+// bodies of the leaves reached.
+static void essential_tree(const KDTree_array_t *nodes,
+                           const ParticleSoA *local, double theta,
+                           const double bmin[3], const double bmax[3],
+                           Body_array_t *out) {
+  size_t stack[128];
+  size_t top = 0;
+  stack[top++] = 0;
+  while (top > 0) {
+    const KDTree *node = nodes->ptr + stack[--top];
+    if (node->num_parts > 0) {
+      for (size_t i = 0; i < node->num_parts; ++i) {
+        size_t p = node->particles[i];
+        Body b = {{{local->p[0][p], local->p[1][p], local->p[2][p]},
+                   {0.0, 0.0, 0.0},
+                   local->r[p],
+                   local->m[p]},
+                  GHOST};
+        body_push(out, b);
+      }
+      continue;
+    }
+    double dist_sqr = 0.0;
+    for (size_t d = 0; d < 3; ++d) {
+      double gap = 0.0;
+      if (node->cm[d] < bmin[d]) {
+        gap = bmin[d] - node->cm[d];
+      } else if (node->cm[d] > bmax[d]) {
+        gap = node->cm[d] - bmax[d];
+      }
+      dist_sqr += gap * gap;
+    }
+    if (node->size * node->size < theta * theta * dist_sqr) {
+      Body b = {{{node->cm[0], node->cm[1], node->cm[2]},
+                 {0.0, 0.0, 0.0},
+                 0.0,
+                 node->m},
+                GHOST};
+      body_push(out, b);
+    } else {
+      stack[top++] = node->right;
+      stack[top++] = node->left;
+    }
+  }
+}
+
+static void mpi_step(Body_array_t *mine, double dt, int rank, int ranks,
+                     const SimOptions *opts) {
+  size_t n = mine->size;
+  Body_array_t none = {0, 0, NULL};
+
+  // Tree over this rank's bodies, only used to cut essential trees.
+  ParticleSoA local = soa_from_bodies(mine, &none);
+  KDTree_array_t local_tree = allocate_node_vec(n);
+  size_t_array_t local_indices = new_range(0, n);
+  if (n > 0) {
+    build_tree_parallel(&local_indices, 0, n, &local, 0, &local_tree, opts);
+  }
+
+  double box[6] = {1e100, 1e100, 1e100, -1e100, -1e100, -1e100};
+  for (size_t i = 0; i < n; ++i) {
+    for (size_t d = 0; d < 3; ++d) {
+      box[d] = fmin(box[d], local.p[d][i]);
+      box[3 + d] = fmax(box[3 + d], local.p[d][i]);
+    }
+  }
+  double *boxes = malloc(6 * ranks * sizeof(double));
+  int *counts = calloc(ranks, sizeof(int));
+  if (boxes == NULL || counts == NULL) {
+    fprintf(stderr, "malloc failed: it returned NULL\n");
+    MPI_Abort(MPI_COMM_WORLD, EXIT_FAILURE);
+  }
+  MPI_Allgather(box, 6, MPI_DOUBLE, boxes, 6, MPI_DOUBLE, MPI_COMM_WORLD);
+
+  Body_array_t send = {0, 0, NULL};
+  for (int r = 0; r < ranks; ++r) {
+    size_t before = send.size;
+    // Empty ranks have an inverted box and need nothing.
+    if (r != rank && n > 0 && boxes[6 * r] <= boxes[6 * r + 3]) {
+      essential_tree(&local_tree, &local, opts->theta, boxes + 6 * r,
+                     boxes + 6 * r + 3, &send);
+    }
+    counts[r] = (int)(send.size - before);
+  }
+  Body_array_t ghosts = exchange(&send, counts, ranks);
+  free(send.ptr);
+  free(boxes);
+  free(counts);
+  free_particle_soa(&local);
+  FREE_ARRAY(local_tree);
+  FREE_ARRAY(local_indices);
+
+  // Tree over own bodies and ghosts; forces only for the former.
+  ParticleSoA all = soa_from_bodies(mine, &ghosts);
+  KDTree_array_t tree = allocate_node_vec(all.size);
+  size_t_array_t indices = new_range(0, all.size);
+  vect3_array_t acc = new_vect3_array_t(n + 1);
+  if (all.size > 0) {
+    build_tree_parallel(&indices, 0, all.size, &all, 0, &tree, opts);
+    CompactTree compact = new_compact_tree(all.size);
+    pack_tree(&tree, &indices, all.size, &compact);
+#ifdef _OPENMP
+    size_t chunk = opts->chunk_size > 0 ? opts->chunk_size : 1;
+    int threads = opts->threads > 0 ? opts->threads : omp_get_max_threads();
+#pragma omp parallel for schedule(dynamic, chunk) num_threads(threads)
+#endif
+    for (size_t i = 0; i < n; ++i) {
+      calc_accel_iter(i, &all, &compact, opts, acc.ptr[i].v);
+    }
+    free_compact_tree(&compact);
+  }
+
+  for (size_t i = 0; i < n; ++i) {
+    Particle *p = &mine->ptr[i].part;
+    for (size_t d = 0; d < 3; ++d) {
+      p->v[d] += dt * acc.ptr[i].v[d];
+      p->p[d] += dt * p->v[d];
+    }
+  }
+
+  free(ghosts.ptr);
+  free_particle_soa(&all);
+  FREE_ARRAY(tree);
+  FREE_ARRAY(indices);
+  FREE_ARRAY(acc);
+}
+
+// Collects every rank's bodies on rank 0, in global id order.
+static Particle_array_t gather_bodies(const Body_array_t *mine, size_t total,
+                                      int rank, int ranks) {
+  int count = (int)mine->size;
+  int *counts = malloc(2 * ranks * sizeof(int));
+  int *displs = counts + ranks;
+  MPI_Gather(&count, 1, MPI_INT, counts, 1, MPI_INT, 0, MPI_COMM_WORLD);
+  Body_array_t all = {0, 0, NULL};
+  if (rank == 0) {
+    int sum = 0;
+    for (int r = 0; r < ranks; ++r) {
+      displs[r] = sum;
+      sum += counts[r];
+    }
+    body_reserve(&all, (size_t)sum + 1);
+    all.size = (size_t)sum;
+  }
+  MPI_Gatherv(mine->ptr, count, body_type, all.ptr, counts, displs,
+              body_type, 0, MPI_COMM_WORLD);
+  free(counts);
+
+  Particle_array_t parts = {0, NULL};
+  if (rank == 0) {
+    parts = new_array_t(total);
+    for (size_t i = 0; i < all.size; ++i) {
+      parts.ptr[all.ptr[i].id] = all.ptr[i].part;
+    }
+  }
+  free(all.ptr);
+  return parts;
+}
+
+void usage(const char *prog) {
+  printf("Usage: %s [options] particles steps\n", prog);
+  printf("  -t threads  worker threads per rank (default: OpenMP)\n");
+  printf("  -a theta    opening angle (default %g)\n", THETA);
+  printf("  -q          add quadrupole moments to the local far field\n");
+  printf("  -c          compare against a single-process run on rank 0\n");
+}
+
+int main(int argc, char *argv[]) {
+  MPI_Init(&argc, &argv);
+  int rank, ranks;
+  MPI_Comm_rank(MPI_COMM_WORLD, &rank);
+  MPI_Comm_size(MPI_COMM_WORLD, &ranks);
+  MPI_Type_contiguous(sizeof(Body), MPI_BYTE, &body_type);
+  MPI_Type_commit(&body_type);
+
+  SimOptions opts = default_sim_options();
+  int check = 0;
+  int opt;
+  while ((opt = getopt(argc, argv, "t:a:qch")) != -1) {
+    switch (opt) {
+    case 't':
+      opts.threads = atoi(optarg);
+      break;
+    case 'a':
+      opts.theta = atof(optarg);
+      break;
+    case 'q':
+      opts.order = 2;
+      break;
+    case 'c':
+      check = 1;
+      break;
+    default:
+      if (rank == 0) {
+        usage(argv[0]);
+      }
+      MPI_Finalize();
+      return 1;
+    }
+  }
+  if (argc - optind < 2) {
+    if (rank == 0) {
+      printf("Specify a number of particles and number of steps.\n");
+    }
+    MPI_Finalize();
+    return 1;
+  }
+  if (rank == 0) {
+    printf("Running sim on %d ranks.\n", ranks);
+  }
+
+  size_t n = (size_t)atol(argv[optind]);
+  int steps = atoi(argv[optind + 1]);
+  double dt = 1e-3;
+
+  Body_array_t mine = circular_orbits_slice(n, rank, ranks);
+  Particle_array_t reference = {0, NULL};
+  if (check) {
+    reference = gather_bodies(&mine, n + 1, rank, ranks);
+  }
+
+  for (int step = 0; step < steps; ++step) {
+    Body_array_t moved = migrate(&mine, ranks);
+    free(mine.ptr);
+    mine = moved;
+    mpi_step(&mine, dt, rank, ranks, &opts);
+  }
+
+  if (check) {
+    Particle_array_t result = gather_bodies(&mine, n + 1, rank, ranks);
+    if (rank == 0) {
+      simple_sim_opts(&reference, dt, steps, &opts);
+      double err = 0.0, mag = 0.0;
+      for (size_t i = 0; i < result.size; ++i) {
+        for (size_t d = 0; d < 3; ++d) {
+          double diff = result.ptr[i].p[d] - reference.ptr[i].p[d];
+          err += diff * diff;
+          mag += reference.ptr[i].p[d] * reference.ptr[i].p[d];
+        }
+      }
+      printf("RMS position difference from one process: %.3e\n",
+             sqrt(err / mag));
+    }
+    FREE_ARRAY(result);
+    FREE_ARRAY(reference);
+  }
+
+  free(mine.ptr);
+  MPI_Type_free(&body_type);
+  MPI_Finalize();
+  return 0;
+}
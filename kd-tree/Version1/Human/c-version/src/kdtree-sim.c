@@ -1,24 +1,162 @@
+#define _POSIX_C_SOURCE 200809L
+
 #include "kdtree.h"
 #include "particle.h"
+#include "snapshot.h"
 #include <stdio.h>
 #include <stdlib.h>
+#include <unistd.h>
+
+void usage(const char *prog) {
+  printf("Usage: %s [options] particles steps\n", prog);
+  printf("  -t threads  worker threads (default: OpenMP)\n");
+  printf("  -k chunk    particles per dynamic scheduling chunk\n");
+  printf("  -d depth    tree levels built as parallel tasks (0 = serial)\n");
+  printf("  -z          build the tree from a Morton (Z-order) radix sort\n");
+  printf("  -o          keep particles stored in tree order\n");
+  printf("  -g size     one tree walk per group of up to size particles\n");
+  printf("  -a theta    opening angle (default %g)\n", THETA);
+  printf("  -q          add quadrupole moments to the far field\n");
+  printf("  -r steps    rebuild the tree every steps steps, refit between\n");
+  printf("  -l frac     rebuild early when siblings overlap by frac of size\n");
+  printf("  -s steps    write a binary snapshot every steps steps\n");
+  printf("  -p prefix   snapshot file prefix (default snap)\n");
+  printf("  -C steps    write a checkpoint every steps steps\n");
+  printf("  -f file     checkpoint file (default checkpoint.snap)\n");
+  printf("  -R file     resume from a checkpoint; steps is the run's total\n");
+  printf("  -c steps    write touching body pairs every steps steps\n");
+  printf("  -b rungs    block timesteps down to dt / 2^rungs\n");
+  printf("  -e length   block timestep length scale, dt = sqrt(length/|a|)\n");
+  printf("  -m          dual-tree multipole walk instead of Barnes-Hut\n");
+  printf("  -G          run the force pass on the OpenMP target device\n");
+  printf("  -v          print run statistics (per phase with make STATS=1)\n");
+}
 
 int main(int argc, char *argv[]) {
-  if (argc < 3) {
+  SimOptions opts = default_sim_options();
+  const char *restart = NULL;
+  SimStats stats = {0};
+
+  int opt;
+  while ((opt = getopt(argc, argv, "t:k:d:zog:a:qr:l:s:p:C:f:R:c:b:e:mGvh")) != -1) {
+    switch (opt) {
+    case 't':
+      opts.threads = atoi(optarg);
+      break;
+    case 'k':
+      opts.chunk_size = (size_t)atol(optarg);
+      break;
+    case 'd':
+      opts.build_task_depth = atoi(optarg);
+      break;
+    case 'z':
+      opts.builder = BUILD_MORTON;
+      break;
+    case 'o':
+      opts.reorder = 1;
+      break;
+    case 'g':
+      opts.group_size = (size_t)atol(optarg);
+      break;
+    case 'a':
+      opts.theta = atof(optarg);
+      break;
+    case 'q':
+      opts.order = 2;
+      break;
+    case 'r':
+      opts.rebuild_interval = atoi(optarg);
+      break;
+    case 'l':
+      opts.max_overlap = atof(optarg);
+      break;
+    case 's':
+      opts.snapshot_interval = atoi(optarg);
+      break;
+    case 'p':
+      opts.snapshot_prefix = optarg;
+      break;
+    case 'C':
+      opts.checkpoint_interval = atoi(optarg);
+      break;
+    case 'f':
+      opts.checkpoint_path = optarg;
+      break;
+    case 'R':
+      restart = optarg;
+      break;
+    case 'c':
+      opts.collision_interval = atoi(optarg);
+      break;
+    case 'b':
+      opts.max_rung = atoi(optarg);
+      break;
+    case 'e':
+      opts.timestep_length = atof(optarg);
+      break;
+    case 'm':
+      opts.dual_tree = 1;
+      break;
+    case 'G':
+      opts.offload = 1;
+      break;
+    case 'v':
+      opts.stats = &stats;
+      break;
+    default:
+      usage(argv[0]);
+      return 1;
+    }
+  }
+
+  if (argc - optind < 2) {
     printf("Specify a number of particles and number of steps.\n");
     return 1;
   }
   printf("Running sim.\n");
 
-  int n = atoi(argv[1]);
-  int steps = atoi(argv[2]);
+  int n = atoi(argv[optind]);
+  int steps = atoi(argv[optind + 1]);
 
   double dt = 1e-3; // * 2.0 * std::f64::consts::PI;
 
   // let start = Instant::now();
-  Particle_array_t particles = circular_orbits(n);
-  simple_sim(&particles, dt, steps);
+  Particle_array_t particles;
+  if (restart != NULL) {
+    // The checkpoint holds the whole state, so n is ignored and the run
+    // picks up at the step it was written.
+    SnapshotHeader header;
+    particles = read_snapshot(restart, &header);
+    opts.first_step = (int)header.step;
+  } else {
+    particles = circular_orbits(n);
+  }
+  if (steps > opts.first_step) {
+    simple_sim_opts(&particles, dt, steps - opts.first_step, &opts);
+  }
   // println!("{}", start.elapsed().as_nanos() as f64 / 1e9);
+  if (opts.stats != NULL) {
+    printf("Tree nodes: %lu of %lu allocated used\n", stats.node_high_water,
+           stats.node_capacity);
+#ifdef KDTREE_STATS
+    // One JSON line for scripts. Counters are totals over the run, and
+    // interactions_per_particle is per particle and step.
+    double evals = (double)stats.steps * (double)particles.size;
+    printf("{\"particles\":%lu,\"steps\":%lu,\"build_seconds\":%.6f,"
+           "\"force_seconds\":%.6f,\"integrate_seconds\":%.6f,"
+           "\"node_openings\":%llu,\"far_interactions\":%llu,"
+           "\"leaf_interactions\":%llu,\"interactions_per_particle\":%.2f,"
+           "\"node_high_water\":%lu}\n",
+           (unsigned long)particles.size, (unsigned long)stats.steps,
+           stats.build_seconds, stats.force_seconds, stats.integrate_seconds,
+           (unsigned long long)stats.walk.opened,
+           (unsigned long long)stats.walk.far,
+           (unsigned long long)stats.walk.leaf,
+           evals > 0.0 ? (double)(stats.walk.far + stats.walk.leaf) / evals
+                       : 0.0,
+           (unsigned long)stats.node_high_water);
+#endif
+  }
 
   FREE_ARRAY(particles);
 
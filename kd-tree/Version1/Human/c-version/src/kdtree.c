@@ -1,9 +1,18 @@
 #include <math.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <time.h>
 
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+#include "bench.h"
 #include "kdtree.h"
+#include "leaf_kernel.h"
+#include "multipole.h"
 #include "particle.h"
+#include "snapshot.h"
 
 #define MIN(a, b) (((a) < (b)) ? (a) : (b))
 #define MAX(a, b) (((a) > (b)) ? (a) : (b))
@@ -11,177 +20,440 @@
 const size_t NEGS[MAX_PARTS] = {0, 0, 0, 0,
                                 0, 0, 0}; // TODO - give maximum value here
 
+// Exactly the nodes a tree over num_parts particles uses, so builds into it
+// never resize.
 KDTree_array_t allocate_node_vec(size_t num_parts) {
-  size_t num_nodes = 2 * (num_parts / (MAX_PARTS - 1) + 1);
-  KDTree_array_t ret = new_kdtree_array_t(num_nodes);
+  KDTree_array_t ret = new_kdtree_array_t(subtree_node_count(num_parts));
   return ret;
 }
 
+// Counts the nodes build_tree uses for np particles. Children always get
+// np / 2 and np - np / 2 particles, so every level of the recursion only
+// sees two neighbouring sizes k and k + 1, and we carry both counts down at
+// once: *fk = count(k), *fk1 = count(k + 1).
+static void node_count_pair(size_t k, size_t *fk, size_t *fk1) {
+  if (k + 1 <= MAX_PARTS) {
+    *fk = 1;
+    *fk1 = 1;
+    return;
+  }
+  size_t h = k / 2;
+  size_t fh, fh1;
+  node_count_pair(h, &fh, &fh1);
+  if (k % 2 == 0) {
+    *fk = k <= MAX_PARTS ? 1 : 1 + 2 * fh;
+    *fk1 = 1 + fh + fh1;
+  } else {
+    *fk = k <= MAX_PARTS ? 1 : 1 + fh + fh1;
+    *fk1 = 1 + 2 * fh1;
+  }
+}
+
+size_t subtree_node_count(size_t num_parts) {
+  size_t fk, fk1;
+  node_count_pair(num_parts, &fk, &fk1);
+  return fk;
+}
+
+static void fill_leaf(const size_t_array_t *indices, size_t start, size_t end,
+                      KDTree *node) {
+  size_t np = end - start;
+  node->num_parts = np;
+  node->start = start;
+  for (size_t i = 0; i < np; ++i) {
+    node->particles[i] = indices->ptr[start + i];
+  }
+}
+
+// splitmix64 (Steele, Lea and Flood); one multiply-xorshift round per draw.
+static inline uint64_t splitmix64(uint64_t *state) {
+  uint64_t z = (*state += 0x9e3779b97f4a7c15u);
+  z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9u;
+  z = (z ^ (z >> 27)) * 0x94d049bb133111ebu;
+  return z ^ (z >> 31);
+}
+
+// Computes the moments of [start, end), picks the split dimension and
+// partitions indices around the median on it. Fills in everything but the
+// child links and returns the split position.
+static size_t split_node(size_t_array_t *indices, size_t start, size_t end,
+                         const ParticleSoA *particles, KDTree *node) {
+  // Pick split dim and value
+  double min_arr[3] = {1e100, 1e100, 1e100};
+  double max_arr[3] = {-1e100, -1e100, -1e100};
+  double m = 0.0;
+  double cm[3] = {0.0, 0.0, 0.0};
+  for (size_t i = start; i < end; ++i) {
+    m += particles->m[indices->ptr[i]];
+    cm[0] += particles->m[indices->ptr[i]] *
+             particles->p[0][indices->ptr[i]];
+    cm[1] += particles->m[indices->ptr[i]] *
+             particles->p[1][indices->ptr[i]];
+    cm[2] += particles->m[indices->ptr[i]] *
+             particles->p[2][indices->ptr[i]];
+
+    min_arr[0] = MIN(min_arr[0], particles->p[0][indices->ptr[i]]);
+    min_arr[1] = MIN(min_arr[1], particles->p[1][indices->ptr[i]]);
+    min_arr[2] = MIN(min_arr[2], particles->p[2][indices->ptr[i]]);
+    max_arr[0] = MAX(max_arr[0], particles->p[0][indices->ptr[i]]);
+    max_arr[1] = MAX(max_arr[1], particles->p[1][indices->ptr[i]]);
+    max_arr[2] = MAX(max_arr[2], particles->p[2][indices->ptr[i]]);
+  }
+  cm[0] /= m;
+  cm[1] /= m;
+  cm[2] /= m;
+  size_t split_dim = 0;
+  if (max_arr[1] - min_arr[1] > max_arr[split_dim] - min_arr[split_dim]) {
+    split_dim = 1;
+  }
+  if (max_arr[2] - min_arr[2] > max_arr[split_dim] - min_arr[split_dim]) {
+    split_dim = 2;
+  }
+  double size = max_arr[split_dim] - min_arr[split_dim];
+
+  // Partition particles on split_dim. Pivots come from a generator seeded
+  // by the node's range, so the tree is the same whichever thread builds
+  // which subtree, and no global rand() state is shared.
+  size_t mid = (start + end) / 2;
+  size_t s = start;
+  size_t e = end;
+  uint64_t rng = ((uint64_t)start << 32) ^ (uint64_t)end;
+  while (s + 1 < e) {
+    size_t pivot = (size_t)(splitmix64(&rng) % (e - s)) + s;
+
+    size_t c = indices->ptr[s];
+    indices->ptr[s] = indices->ptr[pivot];
+    indices->ptr[pivot] = c;
+
+    size_t low = s + 1;
+    size_t high = e - 1;
+    while (low <= high) {
+      if (particles->p[split_dim][indices->ptr[low]] <
+          particles->p[split_dim][indices->ptr[s]]) {
+        low += 1;
+      } else {
+        size_t c = indices->ptr[low];
+        indices->ptr[low] = indices->ptr[high];
+        indices->ptr[high] = c;
+        high -= 1;
+      }
+    }
+
+    size_t c2 = indices->ptr[s];
+    indices->ptr[s] = indices->ptr[high];
+    indices->ptr[high] = c2;
+
+    if (high < mid) {
+      s = high + 1;
+    } else if (high > mid) {
+      e = high;
+    } else {
+      s = e;
+    }
+  }
+  double split_val = particles->p[split_dim][indices->ptr[mid]];
+
+  node->num_parts = 0;
+  node->split_dim = split_dim;
+  node->split_val = split_val;
+  node->m = m;
+  node->cm[0] = cm[0];
+  node->cm[1] = cm[1];
+  node->cm[2] = cm[2];
+  node->size = size;
+  return mid;
+}
+
+// Quadrupole of an internal node from its children, shifted to the node's
+// centre of mass: leaf members directly, internal children through the
+// parallel axis theorem. Children must already be built.
+void set_quadrupole(KDTree_array_t *nodes, size_t cur_node,
+                    const ParticleSoA *particles) {
+  KDTree *node = nodes->ptr + cur_node;
+  double q[6] = {0.0, 0.0, 0.0, 0.0, 0.0, 0.0};
+  size_t children[2] = {node->left, node->right};
+  for (size_t c = 0; c < 2; ++c) {
+    const KDTree *child = nodes->ptr + children[c];
+    if (child->num_parts > 0) {
+      for (size_t i = 0; i < child->num_parts; ++i) {
+        size_t p = child->particles[i];
+        double s[3] = {particles->p[0][p] - node->cm[0],
+                       particles->p[1][p] - node->cm[1],
+                       particles->p[2][p] - node->cm[2]};
+        add_quad_point(particles->m[p], s, q);
+      }
+    } else {
+      double s[3] = {child->cm[0] - node->cm[0], child->cm[1] - node->cm[1],
+                     child->cm[2] - node->cm[2]};
+      add_quad_point(child->m, s, q);
+      for (size_t k = 0; k < 6; ++k) {
+        q[k] += child->quad[k];
+      }
+    }
+  }
+  for (size_t k = 0; k < 6; ++k) {
+    node->quad[k] = q[k];
+  }
+}
+
 // Returns the index of the last Node used in the construction.
-size_t build_tree(size_t_array_t *indices, size_t start, size_t end,
-                  const Particle_array_t *particles, size_t cur_node,
-                  KDTree_array_t *nodes) {
+size_t build_tree_soa(size_t_array_t *indices, size_t start, size_t end,
+                      const ParticleSoA *particles, size_t cur_node,
+                      KDTree_array_t *nodes) {
   size_t np = end - start;
   if (np <= MAX_PARTS) {
     if (cur_node >= nodes->size) {
       KDTree_resize(nodes, cur_node + 1);
     }
-    nodes->ptr[cur_node].num_parts = np;
-    for (size_t i = 0; i < np; ++i) {
-      nodes->ptr[cur_node].particles[i] = indices->ptr[start + i];
-    }
+    fill_leaf(indices, start, end, nodes->ptr + cur_node);
     return cur_node;
   } else {
-    // Pick split dim and value
-    double min_arr[3] = {1e100, 1e100, 1e100};
-    double max_arr[3] = {-1e100, -1e100, -1e100};
-    double m = 0.0;
-    double cm[3] = {0.0, 0.0, 0.0};
-    for (size_t i = start; i < end; ++i) {
-      m += particles->ptr[indices->ptr[i]].m;
-      cm[0] += particles->ptr[indices->ptr[i]].m *
-               particles->ptr[indices->ptr[i]].p[0];
-      cm[1] += particles->ptr[indices->ptr[i]].m *
-               particles->ptr[indices->ptr[i]].p[1];
-      cm[2] += particles->ptr[indices->ptr[i]].m *
-               particles->ptr[indices->ptr[i]].p[2];
-
-      min_arr[0] = MIN(min_arr[0], particles->ptr[indices->ptr[i]].p[0]);
-      min_arr[1] = MIN(min_arr[1], particles->ptr[indices->ptr[i]].p[1]);
-      min_arr[2] = MIN(min_arr[2], particles->ptr[indices->ptr[i]].p[2]);
-      max_arr[0] = MAX(max_arr[0], particles->ptr[indices->ptr[i]].p[0]);
-      max_arr[1] = MAX(max_arr[1], particles->ptr[indices->ptr[i]].p[1]);
-      max_arr[2] = MAX(max_arr[2], particles->ptr[indices->ptr[i]].p[2]);
-    }
-    cm[0] /= m;
-    cm[1] /= m;
-    cm[2] /= m;
-    size_t split_dim = 0;
-    if (max_arr[1] - min_arr[1] > max_arr[split_dim] - min_arr[split_dim]) {
-      split_dim = 1;
-    }
-    if (max_arr[2] - min_arr[2] > max_arr[split_dim] - min_arr[split_dim]) {
-      split_dim = 2;
-    }
-    double size = max_arr[split_dim] - min_arr[split_dim];
-
-    // Partition particles on split_dim
-    size_t mid = (start + end) / 2;
-    size_t s = start;
-    size_t e = end;
-    while (s + 1 < e) {
-      double r;
-      do {
-        r = (double)rand() / RAND_MAX;
-      } while (r ==
-               1); // there is a tiny chance r = 1, but we want the range
-                   // [s,e) (excluding e), and if r = 1 we would produce pivot=e
-
-      size_t pivot = (size_t)(r * (e - s)) + s;
-
-      size_t c = indices->ptr[s];
-      indices->ptr[s] = indices->ptr[pivot];
-      indices->ptr[pivot] = c;
-
-      size_t low = s + 1;
-      size_t high = e - 1;
-      while (low <= high) {
-        if (particles->ptr[indices->ptr[low]].p[split_dim] <
-            particles->ptr[indices->ptr[s]].p[split_dim]) {
-          low += 1;
-        } else {
-          size_t c = indices->ptr[low];
-          indices->ptr[low] = indices->ptr[high];
-          indices->ptr[high] = c;
-          high -= 1;
-        }
-      }
-
-      size_t c2 = indices->ptr[s];
-      indices->ptr[s] = indices->ptr[high];
-      indices->ptr[high] = c2;
-
-      if (high < mid) {
-        s = high + 1;
-      } else if (high > mid) {
-        e = high;
-      } else {
-        s = e;
-      }
-    }
-    double split_val = particles->ptr[indices->ptr[mid]].p[split_dim];
+    KDTree node = {0};
+    size_t mid = split_node(indices, start, end, particles, &node);
 
     // Recurse on children and build this node.
     size_t left =
-        build_tree(indices, start, mid, particles, cur_node + 1, nodes);
-    size_t right = build_tree(indices, mid, end, particles, left + 1, nodes);
+        build_tree_soa(indices, start, mid, particles, cur_node + 1, nodes);
+    size_t right =
+        build_tree_soa(indices, mid, end, particles, left + 1, nodes);
 
     if (cur_node >= nodes->size) {
       KDTree_resize(nodes, cur_node + 1);
     }
-    nodes->ptr[cur_node].num_parts = 0;
-    nodes->ptr[cur_node].split_dim = split_dim;
-    nodes->ptr[cur_node].split_val = split_val;
-    nodes->ptr[cur_node].m = m;
-    nodes->ptr[cur_node].cm[0] = cm[0];
-    nodes->ptr[cur_node].cm[1] = cm[1];
-    nodes->ptr[cur_node].cm[2] = cm[2];
-    nodes->ptr[cur_node].size = size;
-    nodes->ptr[cur_node].left = cur_node + 1;
-    nodes->ptr[cur_node].right = left + 1;
+    node.left = cur_node + 1;
+    node.right = left + 1;
+    nodes->ptr[cur_node] = node;
+    set_quadrupole(nodes, cur_node, particles);
 
     return right;
   }
 }
 
-void calc_pp_accel(const Particle *pi, const Particle *pj, double acc[3]) {
-  double dp[3] = {pi->p[0] - pj->p[0], pi->p[1] - pj->p[1],
-                  pi->p[2] - pj->p[2]};
+size_t build_tree(size_t_array_t *indices, size_t start, size_t end,
+                  const Particle_array_t *particles, size_t cur_node,
+                  KDTree_array_t *nodes) {
+  ParticleSoA soa = particle_soa_from_array(particles);
+  size_t last = build_tree_soa(indices, start, end, &soa, cur_node, nodes);
+  free_particle_soa(&soa);
+  return last;
+}
+
+// Same recursion as build_tree_soa, but the right child's first node is
+// known up front from the left child's particle count, so both halves can
+// be built as independent tasks. nodes must already hold the whole subtree.
+static size_t build_subtree_tasks(size_t_array_t *indices, size_t start,
+                                  size_t end, const ParticleSoA *particles,
+                                  size_t cur_node, KDTree_array_t *nodes,
+                                  int depth) {
+  size_t np = end - start;
+  if (np <= MAX_PARTS || depth <= 0) {
+    return build_tree_soa(indices, start, end, particles, cur_node, nodes);
+  }
+
+  KDTree node = {0};
+  size_t mid = split_node(indices, start, end, particles, &node);
+  size_t right_first = cur_node + 1 + subtree_node_count(mid - start);
+
+#pragma omp task
+  build_subtree_tasks(indices, start, mid, particles, cur_node + 1, nodes,
+                      depth - 1);
+  size_t right = build_subtree_tasks(indices, mid, end, particles, right_first,
+                                     nodes, depth - 1);
+#pragma omp taskwait
+
+  node.left = cur_node + 1;
+  node.right = right_first;
+  nodes->ptr[cur_node] = node;
+  set_quadrupole(nodes, cur_node, particles);
+
+  return right;
+}
+
+size_t build_tree_parallel(size_t_array_t *indices, size_t start, size_t end,
+                           const ParticleSoA *particles, size_t cur_node,
+                           KDTree_array_t *nodes, const SimOptions *opts) {
+  if (opts->builder == BUILD_MORTON) {
+    return build_tree_morton(indices, start, end, particles, cur_node, nodes,
+                             opts);
+  }
+  size_t last = cur_node + subtree_node_count(end - start) - 1;
+  if (last >= nodes->size) {
+    KDTree_resize(nodes, last + 1);
+  }
+
+#ifdef _OPENMP
+  int threads = opts->threads > 0 ? opts->threads : omp_get_max_threads();
+#pragma omp parallel num_threads(threads)
+#pragma omp single
+#endif
+  build_subtree_tasks(indices, start, end, particles, cur_node, nodes,
+                      opts->build_task_depth);
+
+  return last;
+}
+
+typedef struct {
+  double min[3];
+  double max[3];
+  double m;
+  // Mass-weighted position sum.
+  double mp[3];
+} Extent;
+
+static void extent_leaf(const KDTree *leaf, const ParticleSoA *particles,
+                        Extent *ext) {
+  Extent e = {{1e100, 1e100, 1e100}, {-1e100, -1e100, -1e100}, 0.0,
+              {0.0, 0.0, 0.0}};
+  for (size_t i = 0; i < leaf->num_parts; ++i) {
+    size_t p = leaf->particles[i];
+    e.m += particles->m[p];
+    for (size_t d = 0; d < 3; ++d) {
+      e.mp[d] += particles->m[p] * particles->p[d][p];
+      e.min[d] = MIN(e.min[d], particles->p[d][p]);
+      e.max[d] = MAX(e.max[d], particles->p[d][p]);
+    }
+  }
+  *ext = e;
+}
+
+// Recomputes m, cm, size and the quadrupole of the subtree at cur_node
+// from current positions, keeping its topology. Returns the largest
+// amount by which two siblings below cur_node overlap along their
+// parent's split dimension, as a fraction of the parent's size.
+static double refit_node(KDTree_array_t *nodes, size_t cur_node,
+                         const ParticleSoA *particles, Extent *ext,
+                         int depth) {
+  KDTree *node = nodes->ptr + cur_node;
+  if (node->num_parts > 0) {
+    extent_leaf(node, particles, ext);
+    return 0.0;
+  }
+
+  Extent left, right;
+  double left_overlap, right_overlap;
+  if (depth > 0) {
+#pragma omp task shared(left, left_overlap)
+    left_overlap = refit_node(nodes, node->left, particles, &left, depth - 1);
+    right_overlap =
+        refit_node(nodes, node->right, particles, &right, depth - 1);
+#pragma omp taskwait
+  } else {
+    left_overlap = refit_node(nodes, node->left, particles, &left, 0);
+    right_overlap = refit_node(nodes, node->right, particles, &right, 0);
+  }
+
+  ext->m = left.m + right.m;
+  double size = 0.0;
+  for (size_t d = 0; d < 3; ++d) {
+    ext->mp[d] = left.mp[d] + right.mp[d];
+    ext->min[d] = MIN(left.min[d], right.min[d]);
+    ext->max[d] = MAX(left.max[d], right.max[d]);
+    size = MAX(size, ext->max[d] - ext->min[d]);
+    node->cm[d] = ext->mp[d] / ext->m;
+  }
+  node->m = ext->m;
+  node->size = size;
+  set_quadrupole(nodes, cur_node, particles);
+
+  size_t dim = node->split_dim;
+  double overlap = size > 0.0 ? (left.max[dim] - right.min[dim]) / size : 0.0;
+  return MAX(overlap, MAX(left_overlap, right_overlap));
+}
+
+double refit_tree(KDTree_array_t *nodes, const ParticleSoA *particles,
+                  const SimOptions *opts) {
+  Extent ext;
+  double overlap = 0.0;
+#ifdef _OPENMP
+  int threads = opts->threads > 0 ? opts->threads : omp_get_max_threads();
+#pragma omp parallel num_threads(threads)
+#pragma omp single
+#endif
+  overlap = refit_node(nodes, 0, particles, &ext, opts->build_task_depth);
+  return overlap;
+}
+
+// Gathers every particle array into tree order (slot i takes the particle
+// at indices[i]) using scratch as the destination, then swaps the two.
+// Leaves are relabelled to their contiguous [start, start + num_parts)
+// range and indices is reset to the identity for the next build.
+void reorder_particles(ParticleSoA *particles, size_t_array_t *indices,
+                       KDTree_array_t *nodes, ParticleSoA *scratch) {
+  size_t n = particles->size;
+  const size_t *order = indices->ptr;
+  for (size_t d = 0; d < 3; ++d) {
+    for (size_t i = 0; i < n; ++i) {
+      scratch->p[d][i] = particles->p[d][order[i]];
+    }
+    for (size_t i = 0; i < n; ++i) {
+      scratch->v[d][i] = particles->v[d][order[i]];
+    }
+  }
+  for (size_t i = 0; i < n; ++i) {
+    scratch->r[i] = particles->r[order[i]];
+    scratch->m[i] = particles->m[order[i]];
+    scratch->id[i] = particles->id[order[i]];
+  }
+
+  ParticleSoA tmp = *particles;
+  *particles = *scratch;
+  *scratch = tmp;
+
+  for (size_t i = 0; i < nodes->size; ++i) {
+    KDTree *node = nodes->ptr + i;
+    for (size_t j = 0; j < node->num_parts; ++j) {
+      node->particles[j] = node->start + j;
+    }
+  }
+  for (size_t i = 0; i < n; ++i) {
+    indices->ptr[i] = i;
+  }
+}
+
+void calc_pp_accel(const ParticleSoA *particles, size_t i, size_t j,
+                   double acc[3]) {
+  double dp[3] = {particles->p[0][i] - particles->p[0][j],
+                  particles->p[1][i] - particles->p[1][j],
+                  particles->p[2][i] - particles->p[2][j]};
   double dist = sqrt(dp[0] * dp[0] + dp[1] * dp[1] + dp[2] * dp[2]);
-  double magi = -pj->m / (dist * dist * dist);
+  double magi = -particles->m[j] / (dist * dist * dist);
   acc[0] += dp[0] * magi;
   acc[1] += dp[1] * magi;
   acc[2] += dp[2] * magi;
 }
 
-void accel_recur(size_t cur_node, size_t p, const Particle_array_t *particles,
-                 const KDTree_array_t *nodes, double acc[3]) {
+void accel_recur(size_t cur_node, size_t p, const ParticleSoA *particles,
+                 const KDTree_array_t *nodes, const SimOptions *opts,
+                 double acc[3]) {
   // println!("accel {}", cur_node);
   if (nodes->ptr[cur_node].num_parts > 0) {
-    for (size_t i = 0; i < nodes->ptr[cur_node].num_parts; ++i) {
-      if (nodes->ptr[cur_node].particles[i] != p) {
-        calc_pp_accel(particles->ptr + p,
-                      particles->ptr + nodes->ptr[cur_node].particles[i], acc);
-      }
-    }
+    leaf_accel(nodes->ptr + cur_node, p, particles, acc);
   } else {
     double dp[3];
-    dp[0] = particles->ptr[p].p[0] - nodes->ptr[cur_node].cm[0];
-    dp[1] = particles->ptr[p].p[1] - nodes->ptr[cur_node].cm[1];
-    dp[2] = particles->ptr[p].p[2] - nodes->ptr[cur_node].cm[2];
+    dp[0] = particles->p[0][p] - nodes->ptr[cur_node].cm[0];
+    dp[1] = particles->p[1][p] - nodes->ptr[cur_node].cm[1];
+    dp[2] = particles->p[2][p] - nodes->ptr[cur_node].cm[2];
     double dist_sqr = dp[0] * dp[0] + dp[1] * dp[1] + dp[2] * dp[2];
     // println!("dist = {}, size = {}", dist, nodes[cur_node].size);
     if (nodes->ptr[cur_node].size * nodes->ptr[cur_node].size <
-        THETA * THETA * dist_sqr) {
-      double dist = sqrt(dist_sqr);
-      double magi = -nodes->ptr[cur_node].m / (dist_sqr * dist);
-      acc[0] += dp[0] * magi;
-      acc[1] += dp[1] * magi;
-      acc[2] += dp[2] * magi;
+        opts->theta * opts->theta * dist_sqr) {
+      far_accel(nodes->ptr[cur_node].m, nodes->ptr[cur_node].quad,
+                opts->order, dp, dist_sqr, acc);
     } else {
-      accel_recur(nodes->ptr[cur_node].left, p, particles, nodes, acc);
-      accel_recur(nodes->ptr[cur_node].right, p, particles, nodes, acc);
+      accel_recur(nodes->ptr[cur_node].left, p, particles, nodes, opts, acc);
+      accel_recur(nodes->ptr[cur_node].right, p, particles, nodes, opts, acc);
     }
   }
 }
 
-void calc_accel(size_t p, const Particle_array_t *particles,
-                const KDTree_array_t *nodes, double acc[3]) {
-  accel_recur(0, p, particles, nodes, acc);
+void calc_accel(size_t p, const ParticleSoA *particles,
+                const KDTree_array_t *nodes, const SimOptions *opts,
+                double acc[3]) {
+  accel_recur(0, p, particles, nodes, opts, acc);
 }
 
 void print_tree(int step, const KDTree_array_t *tree,
-                const Particle_array_t *particles) {
+                const ParticleSoA *particles) {
 
   if (step > 9999999) {
     fprintf(stderr, "Step too big!\n");
@@ -206,8 +478,8 @@ void print_tree(int step, const KDTree_array_t *tree,
 
       for (size_t i = 0; i < n->num_parts; ++i) {
         size_t p = n->particles[i];
-        fprintf(file, "%f %f %f\n", particles->ptr[p].p[0],
-                particles->ptr[p].p[1], particles->ptr[p].p[2]);
+        fprintf(file, "%f %f %f\n", particles->p[0][p], particles->p[1][p],
+                particles->p[2][p]);
       }
     } else {
       fprintf(file, "I %lu %f %lu %lu\n", n->split_dim, n->split_val, n->left,
@@ -218,40 +490,196 @@ void print_tree(int step, const KDTree_array_t *tree,
   fclose(file);
 }
 
-void simple_sim(Particle_array_t *bodies, double dt, int steps) {
-  vect3_array_t acc = new_vect3_array_t(bodies->size);
+SimOptions default_sim_options() {
+  SimOptions opts = {0,      256, 8, BUILD_MEDIAN, 0, 0, THETA, 1, 1, 0.1, 0,
+                     "snap", 0,   0, "checkpoint.snap", 0, "collisions", 0,
+                     4e-4,   0,   0, NULL};
+  return opts;
+}
+
+// Every body's acceleration is summed by one thread in the same traversal
+// order as the serial loop, and no sums cross particles, so the result is
+// bit-identical for any thread count or schedule.
+void calc_all_accels(const ParticleSoA *bodies, const KDTree_array_t *tree,
+                     vect3_array_t *acc, const SimOptions *opts) {
+#ifdef _OPENMP
+  size_t chunk = opts->chunk_size > 0 ? opts->chunk_size : 1;
+  int threads = opts->threads > 0 ? opts->threads : omp_get_max_threads();
+#pragma omp parallel for schedule(dynamic, chunk) num_threads(threads)
+#endif
   for (size_t i = 0; i < bodies->size; ++i) {
+    calc_accel(i, bodies, tree, opts, acc->ptr[i].v);
+  }
+}
+
+#ifdef KDTREE_STATS
+double stats_clock(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (double)ts.tv_sec + 1e-9 * (double)ts.tv_nsec;
+}
+
+void stats_step(SimStats *stats, int step, double build, double force,
+                double integrate) {
+  stats->steps += 1;
+  stats->build_seconds += build;
+  stats->force_seconds += force;
+  stats->integrate_seconds += integrate;
+  fprintf(stderr, "step %d: build %.6f force %.6f integrate %.6f\n", step,
+          build, force, integrate);
+}
+#endif
+
+void simple_sim(Particle_array_t *bodies, double dt, int steps) {
+  SimOptions opts = default_sim_options();
+  simple_sim_opts(bodies, dt, steps, &opts);
+}
+
+void simple_sim_opts(Particle_array_t *bodies, double dt, int steps,
+                     const SimOptions *opts) {
+  if (opts->max_rung > 0) {
+    block_sim_opts(bodies, dt, steps, opts);
+    return;
+  }
+
+  ParticleSoA soa = particle_soa_from_array(bodies);
+  vect3_array_t acc = new_vect3_array_t(soa.size);
+  for (size_t i = 0; i < soa.size; ++i) {
     vect3 a = {0.0, 0.0, 0.0};
     acc.ptr[i] = a;
   }
-  KDTree_array_t tree = allocate_node_vec(bodies->size);
-  size_t_array_t indices = new_range(0, bodies->size);
+  KDTree_array_t tree = allocate_node_vec(soa.size);
+  size_t_array_t indices = new_range(0, soa.size);
+  CompactTree compact = new_compact_tree(soa.size);
+  GroupWalk *walk = opts->group_size > 0 ? new_group_walk() : NULL;
+  DualTree *dual = opts->dual_tree ? new_dual_tree() : NULL;
+  ParticleSoA scratch = {0};
+  if (opts->reorder) {
+    scratch = new_particle_soa(soa.size);
+  }
+  CollisionTree *ctree = NULL;
+  ContactList contacts = {0};
+  if (opts->collision_interval > 0) {
+    ctree = new_collision_tree();
+    contacts = new_contact_list(soa.size);
+  }
+  size_t high_water = 0;
+
+  // Everything a step needs is allocated above; steady-state steps only
+  // reuse it.
+  SnapshotWriter writer;
+  if (opts->snapshot_interval > 0) {
+    snapshot_writer_start(&writer, soa.size, opts->snapshot_prefix);
+  }
 
+  int last_build = 0;
   for (int step = 0; step < steps; ++step) {
-    for (size_t i = 0; i < bodies->size; ++i) {
-      indices.ptr[i] = i;
+    STATS_ONLY(double t0 = stats_clock();)
+    BENCH_PHASE("build");
+    // Between rebuilds the tree keeps its shape and is only refit, unless
+    // the particles have drifted far enough that siblings overlap badly.
+    int rebuild = step == 0 || step - last_build >= opts->rebuild_interval;
+    if (!rebuild && refit_tree(&tree, &soa, opts) > opts->max_overlap) {
+      rebuild = 1;
     }
 
-    build_tree(&indices, 0, bodies->size, bodies, 0, &tree);
+    if (rebuild) {
+      // Reordered storage is already laid out in the last tree's order,
+      // which is the identity indices reorder_particles left behind.
+      if (!opts->reorder) {
+        for (size_t i = 0; i < soa.size; ++i) {
+          indices.ptr[i] = i;
+        }
+      }
+
+      size_t last =
+          build_tree_parallel(&indices, 0, soa.size, &soa, 0, &tree, opts);
+      high_water = MAX(high_water, last + 1);
+      if (opts->reorder) {
+        reorder_particles(&soa, &indices, &tree, &scratch);
+      }
+      last_build = step;
+    }
 //    if (step % 10 == 0) {
-//      print_tree(step, &tree, bodies);
+//      print_tree(step, &tree, &soa);
 //    }
-    for (size_t i = 0; i < bodies->size; ++i) {
-      calc_accel(i, bodies, &tree, acc.ptr[i].v);
+    if (!opts->dual_tree && opts->group_size == 0) {
+      pack_tree(&tree, &indices, soa.size, &compact);
+    }
+    // Contacts are found at the positions the step starts from, which the
+    // tree was just built or refit for.
+    int at = opts->first_step + step;
+    if (opts->collision_interval > 0 && at % opts->collision_interval == 0) {
+      if (find_contacts(&soa, &tree, 0.0, opts, ctree, &contacts) >
+          contacts.cap) {
+        reserve_contacts(&contacts, contacts.size);
+        find_contacts(&soa, &tree, 0.0, opts, ctree, &contacts);
+      }
+      char name[4096];
+      snprintf(name, sizeof(name), "%s%07d.txt", opts->collision_prefix, at);
+      write_contacts(name, &soa, &contacts, at, at * dt);
+    }
+    STATS_ONLY(double t1 = stats_clock();)
+    BENCH_PHASE("force");
+    if (opts->dual_tree) {
+      calc_all_accels_dual(&soa, &tree, &acc, opts, dual);
+    } else if (opts->group_size > 0) {
+      calc_all_accels_group_walk(&soa, &tree, &indices, &acc, opts, walk);
+    } else if (opts->offload) {
+      calc_all_accels_offload(&soa, &compact, &acc, opts);
+    } else {
+      calc_all_accels_compact(&soa, &compact, &acc, opts);
+    }
+    STATS_ONLY(double t2 = stats_clock();)
+    BENCH_PHASE("integrate");
+    for (size_t d = 0; d < 3; ++d) {
+      double *restrict p = soa.p[d];
+      double *restrict v = soa.v[d];
+      for (size_t i = 0; i < soa.size; ++i) {
+        v[i] += dt * acc.ptr[i].v[d];
+        p[i] += dt * v[i];
+        acc.ptr[i].v[d] = 0.0;
+      }
     }
-    for (size_t i = 0; i < bodies->size; ++i) {
-      bodies->ptr[i].v[0] += dt * acc.ptr[i].v[0];
-      bodies->ptr[i].v[1] += dt * acc.ptr[i].v[1];
-      bodies->ptr[i].v[2] += dt * acc.ptr[i].v[2];
-      bodies->ptr[i].p[0] += dt * bodies->ptr[i].v[0];
-      bodies->ptr[i].p[1] += dt * bodies->ptr[i].v[1];
-      bodies->ptr[i].p[2] += dt * bodies->ptr[i].v[2];
-      acc.ptr[i].v[0] = 0.0;
-      acc.ptr[i].v[1] = 0.0;
-      acc.ptr[i].v[2] = 0.0;
+#ifdef KDTREE_STATS
+    if (opts->stats != NULL) {
+      stats_step(opts->stats, opts->first_step + step, t1 - t0, t2 - t1,
+                 stats_clock() - t2);
     }
+#endif
+    // Step numbers count from the start of the run, across restarts.
+    int done = opts->first_step + step + 1;
+    if (opts->snapshot_interval > 0 && done % opts->snapshot_interval == 0) {
+      snapshot_writer_submit(&writer, &soa, done, done * dt);
+    }
+    if (opts->checkpoint_interval > 0 &&
+        done % opts->checkpoint_interval == 0) {
+      write_snapshot(opts->checkpoint_path, &soa, done, done * dt);
+    }
+  }
+
+  if (opts->snapshot_interval > 0) {
+    snapshot_writer_finish(&writer);
   }
 
+  particle_soa_to_array(&soa, bodies);
+  free_particle_soa(&soa);
+  free_particle_soa(&scratch);
+  free_compact_tree(&compact);
+  if (walk != NULL) {
+    free_group_walk(walk);
+  }
+  if (dual != NULL) {
+    free_dual_tree(dual);
+  }
+  if (ctree != NULL) {
+    free_collision_tree(ctree);
+  }
+  FREE_ARRAY(contacts);
+  if (opts->stats != NULL) {
+    opts->stats->node_capacity = tree.size;
+    opts->stats->node_high_water = high_water;
+  }
   FREE_ARRAY(acc);
   FREE_ARRAY(tree);
   FREE_ARRAY(indices);
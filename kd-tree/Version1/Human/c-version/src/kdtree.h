@@ -1,6 +1,8 @@
 #ifndef KDTREE
 #define KDTREE
 
+#include <stdint.h>
+
 #include "particle.h"
 
 #define MAX_PARTS ((size_t)7)
@@ -10,6 +12,9 @@ typedef struct {
   // For leaves
   size_t num_parts;
   size_t particles[MAX_PARTS];
+  // Position of particles[0] in the builder's index order. After
+  // reorder_particles the leaf holds exactly [start, start + num_parts).
+  size_t start;
 
   // For internal nodes
   size_t split_dim;
@@ -19,13 +24,127 @@ typedef struct {
   double size;
   size_t left;
   size_t right;
+  // Traceless quadrupole about cm: xx, yy, zz, xy, xz, yz.
+  double quad[6];
 } KDTree;
 
 typedef struct {
   double v[3];
 } vect3;
 
+// Phase timers and walk counters only exist in make STATS=1 builds; the
+// default build compiles them out entirely.
+#ifdef KDTREE_STATS
+#define STATS_ONLY(x) x
+#else
+#define STATS_ONLY(x)
+#endif
+
+// What a force walk did: internal nodes opened, nodes taken as a far-field
+// term, and particle pairs evaluated directly in leaves.
+typedef struct {
+  uint64_t opened;
+  uint64_t far;
+  uint64_t leaf;
+} WalkCounters;
+
+// Filled in by a run when SimOptions.stats is set.
+typedef struct {
+  // Nodes allocated up front for the run, and the most any build used.
+  size_t node_capacity;
+  size_t node_high_water;
+  // STATS=1 only. Seconds summed over the run's steps, where build covers
+  // refits, rebuilds, reordering and packing the compact tree.
+  size_t steps;
+  double build_seconds;
+  double force_seconds;
+  double integrate_seconds;
+  WalkCounters walk;
+} SimStats;
+
+#ifdef KDTREE_STATS
+// Monotonic wall-clock seconds from an arbitrary origin.
+double stats_clock(void);
+// Adds one step's phase times to stats and prints them to stderr.
+void stats_step(SimStats *stats, int step, double build, double force,
+                double integrate);
+#endif
+
+// BUILD_MEDIAN partitions every node around the median of its longest
+// axis. BUILD_MORTON sorts the particles along a Morton curve once and cuts
+// the sorted order in halves, see build_tree_morton.
+typedef enum { BUILD_MEDIAN, BUILD_MORTON } TreeBuilder;
+
+typedef struct {
+  // Threads used for the force pass. 0 means the OpenMP default, which
+  // honours OMP_NUM_THREADS.
+  int threads;
+  // Particles handed out at a time by the dynamic scheduler. Traversal cost
+  // varies a lot between dense and sparse regions, so chunks stay small.
+  size_t chunk_size;
+  // Levels of build_tree below the root whose two children are built as
+  // concurrent tasks. 0 builds the tree serially.
+  int build_task_depth;
+  // Which builder build_tree_parallel runs, see TreeBuilder.
+  int builder;
+  // Permute particle storage into leaf order after every build, so a leaf's
+  // particles are contiguous and the next partition starts from sorted data.
+  int reorder;
+  // When non-zero, walk the tree once per group of at most this many
+  // particles (at least one leaf) instead of once per particle.
+  size_t group_size;
+  // Opening angle; a node is used whole when size < theta * distance.
+  double theta;
+  // Far-field expansion order: 1 uses the monopole, 2 adds the quadrupole
+  // moments build_tree stores, which allows a larger theta for the same
+  // force error.
+  int order;
+  // Steps between full rebuilds. In between, the tree keeps its topology
+  // and refit_tree recomputes the node moments bottom-up. 1 rebuilds every
+  // step.
+  int rebuild_interval;
+  // A refit tree is rebuilt early once siblings overlap along their split
+  // dimension by more than this fraction of the parent's size.
+  double max_overlap;
+  // Write a binary snapshot every this many steps from a background
+  // thread; 0 disables snapshots. Files are <snapshot_prefix><step>.snap.
+  int snapshot_interval;
+  const char *snapshot_prefix;
+  // Steps already taken before this call, when resuming from a checkpoint.
+  int first_step;
+  // Overwrite checkpoint_path with the full state every this many steps;
+  // 0 disables checkpoints. Uses the snapshot layout, see read_snapshot.
+  int checkpoint_interval;
+  const char *checkpoint_path;
+  // Write the pairs of touching bodies every this many steps; 0 disables.
+  // Files are <collision_prefix><step>.txt, see write_contacts. Ignored
+  // with block timesteps.
+  int collision_interval;
+  const char *collision_prefix;
+  // Block timesteps: when > 0, each step of dt is split into 2^max_rung
+  // substeps and a body moves with the largest dt / 2^k not above
+  // sqrt(timestep_length / |a|). See block_sim_opts.
+  int max_rung;
+  double timestep_length;
+  // Run the force pass through calc_all_accels_offload. Ignored with
+  // group_size or block timesteps.
+  int offload;
+  // Use the dual-tree walk of calc_all_accels_dual for the force pass,
+  // with theta as its opening angle. Ignored with block timesteps.
+  int dual_tree;
+  // When set, receives run statistics.
+  SimStats *stats;
+} SimOptions;
+
+SimOptions default_sim_options();
+
 void simple_sim(Particle_array_t *bodies, double dt, int steps);
+void simple_sim_opts(Particle_array_t *bodies, double dt, int steps,
+                     const SimOptions *opts);
+// Kick-drift-kick block timestep integrator behind simple_sim_opts when
+// opts->max_rung > 0. Returns the number of per-body force evaluations.
+size_t block_sim_opts(Particle_array_t *bodies, double dt, int steps,
+                      const SimOptions *opts);
 
 typedef struct {
   size_t size;
@@ -41,11 +160,175 @@ typedef struct {
 
 vect3_array_t new_vect3_array_t(size_t elem_count);
 
+void calc_accel(size_t p, const ParticleSoA *particles,
+                const KDTree_array_t *nodes, const SimOptions *opts,
+                double acc[3]);
+void calc_all_accels(const ParticleSoA *bodies, const KDTree_array_t *tree,
+                     vect3_array_t *acc, const SimOptions *opts);
+void calc_all_accels_group(const ParticleSoA *bodies,
+                           const KDTree_array_t *tree,
+                           const size_t_array_t *indices, vect3_array_t *acc,
+                           const SimOptions *opts);
+
+// Node expansions of the dual-tree walk, kept across steps like a
+// GroupWalk.
+typedef struct DualTree DualTree;
+
+DualTree *new_dual_tree();
+void free_dual_tree(DualTree *dual);
+// Node-node walk with second-order local expansions (field, gradient and
+// second derivatives), linear in the number of particles. Reads the
+// moments build_tree stores; order 2 adds the sources' quadrupoles to the
+// field and its derivatives. Accepts pairs so that a given theta gives
+// about the error of the Barnes-Hut walks.
+void calc_all_accels_dual(const ParticleSoA *bodies,
+                          const KDTree_array_t *tree, vect3_array_t *acc,
+                          const SimOptions *opts, DualTree *dual);
+
+// A pair of bodies, by storage index with i < j, whose centres are dist
+// apart and no further than r[i] + r[j] + margin.
+typedef struct {
+  size_t i;
+  size_t j;
+  double dist;
+} Contact;
+
+// Preallocated pair buffer. size counts every pair found, so a search that
+// returns more than cap stored only cap of them and should be run again
+// after reserve_contacts.
+typedef struct {
+  size_t size;
+  size_t cap;
+  Contact *ptr;
+} ContactList;
+
+ContactList new_contact_list(size_t cap);
+void reserve_contacts(ContactList *list, size_t cap);
+
+// Per-node boxes and largest radii of the collision search, kept across
+// steps like a GroupWalk.
+typedef struct CollisionTree CollisionTree;
+
+CollisionTree *new_collision_tree();
+void free_collision_tree(CollisionTree *ctree);
+// Finds every pair of spheres of radius r that overlap or are within
+// margin of each other, using a tree built or refit for the current
+// positions. Returns the number of pairs; when they all fit they are
+// sorted by i, then j.
+size_t find_contacts(const ParticleSoA *bodies, const KDTree_array_t *tree,
+                     double margin, const SimOptions *opts,
+                     CollisionTree *ctree, ContactList *contacts);
+// Writes the stored pairs as text for the collision resolver:
+//
+//   # step <step> time <time> pairs <count>
+//   <a> <b> <distance> <overlap>
+//
+// one line per pair, where a < b are the bodies' slots in the array
+// simple_sim_opts was given and overlap is r[a] + r[b] - distance, so
+// positive when the spheres touch. Lines are sorted by a, then b.
+void write_contacts(const char *path, const ParticleSoA *bodies,
+                    const ContactList *contacts, uint64_t step, double time);
+
+// Scratch lists of the group walk. Keeping one across steps means the
+// walk stops allocating once its lists have grown to the tree's needs.
+typedef struct GroupWalk GroupWalk;
+GroupWalk *new_group_walk();
+void free_group_walk(GroupWalk *walk);
+void calc_all_accels_group_walk(const ParticleSoA *bodies,
+                                const KDTree_array_t *tree,
+                                const size_t_array_t *indices,
+                                vect3_array_t *acc, const SimOptions *opts,
+                                GroupWalk *walk);
+
+// Precision of node moments and far-field sums in the compact and group
+// walks. Positions and leaf interactions are always double. Build with
+// make FLOAT_FAR=1 for float.
+#ifdef KDTREE_FLOAT_FAR
+typedef float far_t;
+#else
+typedef double far_t;
+#endif
+
+// Traversal copy of a built tree. The fields every walk reads sit together
+// in a 48-byte node (28 with float moments), and the left child of an
+// internal node is always the next node, so only the right one is stored.
+// Quadrupoles, which are only read when a node is accepted at order 2,
+// live in their own array.
+typedef struct {
+  far_t cm[3];
+  far_t m;
+  far_t size_sqr;
+  // Internal nodes: index of the right child. Leaves: position of the
+  // leaf's first particle in order.
+  uint32_t link;
+  // 0 for internal nodes.
+  uint32_t num_parts;
+} KDNode;
+
+typedef struct {
+  size_t size;
+  KDNode *nodes;
+  far_t (*quad)[6];
+  // The builder's index order; a leaf's particles are
+  // order[link, link + num_parts).
+  const size_t *order;
+} CompactTree;
+
+CompactTree new_compact_tree(size_t num_parts);
+void free_compact_tree(CompactTree *tree);
+void pack_tree(const KDTree_array_t *nodes, const size_t_array_t *indices,
+               size_t num_parts, CompactTree *tree);
+void calc_accel_iter(size_t p, const ParticleSoA *particles,
+                     const CompactTree *tree, const SimOptions *opts,
+                     double acc[3]);
+// calc_accel_iter that also adds what it did to count. Only STATS=1 builds
+// count; otherwise count is left alone.
+void calc_accel_iter_counted(size_t p, const ParticleSoA *particles,
+                             const CompactTree *tree, const SimOptions *opts,
+                             double acc[3], WalkCounters *count);
+#ifdef KDTREE_STATS
+// Registers a compact walk of walked of the bodies, which did count, with
+// the benchmark harness (harness/bench.h).
+void walk_work(const ParticleSoA *bodies, size_t walked,
+               const WalkCounters *count, const SimOptions *opts);
+#endif
+// Adds its counters to opts->stats when that is set, and in STATS=1 builds
+// registers its work with the harness.
+void calc_all_accels_compact(const ParticleSoA *bodies,
+                             const CompactTree *tree, vect3_array_t *acc,
+                             const SimOptions *opts);
+// calc_all_accels_compact on the default OpenMP target device. Overwrites
+// acc rather than adding to it, so only the accelerations are copied back.
+void calc_all_accels_offload(const ParticleSoA *bodies,
+                             const CompactTree *tree, vect3_array_t *acc,
+                             const SimOptions *opts);
+
 void KDTree_resize(KDTree_array_t *arr, size_t new_elem_count);
 KDTree_array_t allocate_node_vec(size_t num_parts);
 
 size_t build_tree(size_t_array_t *indices, size_t start, size_t end,
                   const Particle_array_t *particles, size_t cur_node,
                   KDTree_array_t *nodes);
+size_t build_tree_soa(size_t_array_t *indices, size_t start, size_t end,
+                      const ParticleSoA *particles, size_t cur_node,
+                      KDTree_array_t *nodes);
+size_t build_tree_parallel(size_t_array_t *indices, size_t start, size_t end,
+                           const ParticleSoA *particles, size_t cur_node,
+                           KDTree_array_t *nodes, const SimOptions *opts);
+size_t subtree_node_count(size_t num_parts);
+// Same node layout as build_tree_parallel, with indices left in Morton
+// order, which is also the order of the leaves.
+size_t build_tree_morton(size_t_array_t *indices, size_t start, size_t end,
+                         const ParticleSoA *particles, size_t cur_node,
+                         KDTree_array_t *nodes, const SimOptions *opts);
+// Quadrupole of the internal node cur_node from its built children.
+void set_quadrupole(KDTree_array_t *nodes, size_t cur_node,
+                    const ParticleSoA *particles);
+
+double refit_tree(KDTree_array_t *nodes, const ParticleSoA *particles,
+                  const SimOptions *opts);
+
+void reorder_particles(ParticleSoA *particles, size_t_array_t *indices,
+                       KDTree_array_t *nodes, ParticleSoA *scratch);
 
 #endif
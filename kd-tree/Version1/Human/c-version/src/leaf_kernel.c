@@ -0,0 +1,164 @@
+#include <math.h>
+
+#if !defined(KDTREE_SCALAR_LEAF) && defined(__AVX2__)
+#include <immintrin.h>
+#endif
+
+#include "kdtree.h"
+#include "leaf_kernel.h"
+
+// The leaf kernel is picked at build time: AVX-512 evaluates a whole leaf
+// (MAX_PARTS <= 8) in one register, AVX2 uses two halves, and
+// KDTREE_SCALAR_LEAF (make SIMD=scalar) keeps the plain loop. Lanes past
+// num_parts and the target particle itself are masked off rather than
+// branched around. KDTREE_RSQRT swaps the exact sqrt and divide for a
+// refined reciprocal square root, like nbody/Version1/Human does.
+
+#if !defined(KDTREE_SCALAR_LEAF) && defined(__AVX512F__)
+
+static inline __m512d inv_dist_cubed(__m512d d2) {
+#ifdef KDTREE_RSQRT
+  // rsqrt14 has 14 good bits; two Newton steps take it past 1e-9.
+  __m512d half = _mm512_set1_pd(0.5);
+  __m512d three_halves = _mm512_set1_pd(1.5);
+  __m512d x = _mm512_rsqrt14_pd(d2);
+  __m512d hd2 = _mm512_mul_pd(half, d2);
+  for (int i = 0; i < 2; ++i) {
+    __m512d x2 = _mm512_mul_pd(x, x);
+    x = _mm512_mul_pd(x, _mm512_fnmadd_pd(hd2, x2, three_halves));
+  }
+  return _mm512_mul_pd(x, _mm512_mul_pd(x, x));
+#else
+  __m512d dist = _mm512_sqrt_pd(d2);
+  return _mm512_div_pd(_mm512_set1_pd(1.0),
+                       _mm512_mul_pd(_mm512_mul_pd(dist, dist), dist));
+#endif
+}
+
+void leaf_accel_members(const size_t *members, size_t count, size_t p,
+                        const ParticleSoA *particles, double acc[3]) {
+  __mmask8 live = (__mmask8)((1u << count) - 1);
+  __m512i idx = _mm512_maskz_loadu_epi64(live, members);
+  live &= _mm512_cmpneq_epi64_mask(idx, _mm512_set1_epi64((long long)p));
+
+  __m512d dx = _mm512_sub_pd(
+      _mm512_set1_pd(particles->p[0][p]),
+      _mm512_mask_i64gather_pd(_mm512_setzero_pd(), live, idx,
+                               particles->p[0], 8));
+  __m512d dy = _mm512_sub_pd(
+      _mm512_set1_pd(particles->p[1][p]),
+      _mm512_mask_i64gather_pd(_mm512_setzero_pd(), live, idx,
+                               particles->p[1], 8));
+  __m512d dz = _mm512_sub_pd(
+      _mm512_set1_pd(particles->p[2][p]),
+      _mm512_mask_i64gather_pd(_mm512_setzero_pd(), live, idx,
+                               particles->p[2], 8));
+  __m512d m = _mm512_mask_i64gather_pd(_mm512_setzero_pd(), live, idx,
+                                       particles->m, 8);
+
+  __m512d d2 = _mm512_mul_pd(dx, dx);
+  d2 = _mm512_fmadd_pd(dy, dy, d2);
+  d2 = _mm512_fmadd_pd(dz, dz, d2);
+  // Dead lanes get distance 1 and mass 0 so they contribute exactly zero.
+  d2 = _mm512_mask_blend_pd(live, _mm512_set1_pd(1.0), d2);
+
+  __m512d magi = _mm512_mul_pd(_mm512_sub_pd(_mm512_setzero_pd(), m),
+                               inv_dist_cubed(d2));
+  acc[0] += _mm512_reduce_add_pd(_mm512_mul_pd(dx, magi));
+  acc[1] += _mm512_reduce_add_pd(_mm512_mul_pd(dy, magi));
+  acc[2] += _mm512_reduce_add_pd(_mm512_mul_pd(dz, magi));
+}
+
+#elif !defined(KDTREE_SCALAR_LEAF) && defined(__AVX2__)
+
+#ifdef KDTREE_RSQRT
+// Same refinement as _mm256_rsqrt_pd in nbody/Version1/Human/nbody.c.
+static inline __m256d rsqrt_pd(__m256d s) {
+  __m128 q = _mm256_cvtpd_ps(s);
+  q = _mm_rsqrt_ps(q);
+  __m256d x = _mm256_cvtps_pd(q);
+  __m256d y = _mm256_mul_pd(_mm256_mul_pd(s, x), x);
+  __m256d a = _mm256_mul_pd(y, _mm256_set1_pd(0.375));
+  a = _mm256_mul_pd(a, y);
+  __m256d b = _mm256_mul_pd(y, _mm256_set1_pd(1.25));
+  b = _mm256_sub_pd(b, _mm256_set1_pd(1.875));
+  y = _mm256_sub_pd(a, b);
+  return _mm256_mul_pd(x, y);
+}
+#endif
+
+static inline __m256d inv_dist_cubed(__m256d d2) {
+#ifdef KDTREE_RSQRT
+  __m256d x = rsqrt_pd(d2);
+  return _mm256_mul_pd(x, _mm256_mul_pd(x, x));
+#else
+  __m256d dist = _mm256_sqrt_pd(d2);
+  return _mm256_div_pd(_mm256_set1_pd(1.0),
+                       _mm256_mul_pd(_mm256_mul_pd(dist, dist), dist));
+#endif
+}
+
+static inline double hsum(__m256d x) {
+  __m128d lo = _mm256_castpd256_pd128(x);
+  __m128d hi = _mm256_extractf128_pd(x, 1);
+  lo = _mm_add_pd(lo, hi);
+  return _mm_cvtsd_f64(_mm_add_sd(lo, _mm_unpackhi_pd(lo, lo)));
+}
+
+void leaf_accel_members(const size_t *members, size_t count, size_t p,
+                        const ParticleSoA *particles, double acc[3]) {
+  __m256d px = _mm256_set1_pd(particles->p[0][p]);
+  __m256d py = _mm256_set1_pd(particles->p[1][p]);
+  __m256d pz = _mm256_set1_pd(particles->p[2][p]);
+  __m256i self = _mm256_set1_epi64x((long long)p);
+  __m256i lane = _mm256_setr_epi64x(0, 1, 2, 3);
+  __m256d ax = _mm256_setzero_pd();
+  __m256d ay = _mm256_setzero_pd();
+  __m256d az = _mm256_setzero_pd();
+
+  for (size_t base = 0; base < count; base += 4) {
+    __m256i in_leaf = _mm256_cmpgt_epi64(
+        _mm256_set1_epi64x((long long)(count - base)), lane);
+    __m256i idx = _mm256_maskload_epi64(
+        (const long long *)(members + base), in_leaf);
+    __m256d live = _mm256_castsi256_pd(_mm256_andnot_si256(
+        _mm256_cmpeq_epi64(idx, self), in_leaf));
+
+    __m256d zero = _mm256_setzero_pd();
+    __m256d dx = _mm256_sub_pd(
+        px, _mm256_mask_i64gather_pd(zero, particles->p[0], idx, live, 8));
+    __m256d dy = _mm256_sub_pd(
+        py, _mm256_mask_i64gather_pd(zero, particles->p[1], idx, live, 8));
+    __m256d dz = _mm256_sub_pd(
+        pz, _mm256_mask_i64gather_pd(zero, particles->p[2], idx, live, 8));
+    __m256d m = _mm256_mask_i64gather_pd(zero, particles->m, idx, live, 8);
+
+    __m256d d2 = _mm256_mul_pd(dx, dx);
+    d2 = _mm256_add_pd(d2, _mm256_mul_pd(dy, dy));
+    d2 = _mm256_add_pd(d2, _mm256_mul_pd(dz, dz));
+    // Dead lanes get distance 1 and mass 0 so they contribute exactly zero.
+    d2 = _mm256_blendv_pd(_mm256_set1_pd(1.0), d2, live);
+
+    __m256d magi = _mm256_mul_pd(_mm256_sub_pd(zero, m), inv_dist_cubed(d2));
+    ax = _mm256_add_pd(ax, _mm256_mul_pd(dx, magi));
+    ay = _mm256_add_pd(ay, _mm256_mul_pd(dy, magi));
+    az = _mm256_add_pd(az, _mm256_mul_pd(dz, magi));
+  }
+
+  acc[0] += hsum(ax);
+  acc[1] += hsum(ay);
+  acc[2] += hsum(az);
+}
+
+#else
+
+void leaf_accel_members(const size_t *members, size_t count, size_t p,
+                        const ParticleSoA *particles, double acc[3]) {
+  for (size_t i = 0; i < count; ++i) {
+    if (members[i] != p) {
+      calc_pp_accel(particles, p, members[i], acc);
+    }
+  }
+}
+
+#endif
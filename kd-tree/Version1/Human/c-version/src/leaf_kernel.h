@@ -0,0 +1,20 @@
+#ifndef LEAF_KERNEL
+#define LEAF_KERNEL
+
+#include "kdtree.h"
+#include "particle.h"
+
+void calc_pp_accel(const ParticleSoA *particles, size_t i, size_t j,
+                   double acc[3]);
+
+// Adds the acceleration on particle p from every member of a leaf other
+// than p itself. members holds the leaf's count <= MAX_PARTS particles.
+void leaf_accel_members(const size_t *members, size_t count, size_t p,
+                        const ParticleSoA *particles, double acc[3]);
+
+static inline void leaf_accel(const KDTree *leaf, size_t p,
+                              const ParticleSoA *particles, double acc[3]) {
+  leaf_accel_members(leaf->particles, leaf->num_parts, p, particles, acc);
+}
+
+#endif
@@ -0,0 +1,284 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+#include "kdtree.h"
+#include "particle.h"
+
+// Tree builder over a Morton (Z-order) sort. Positions are quantised to
+// MORTON_BITS per axis in the bounding cube and interleaved into one key,
+// the keys are radix sorted once, and the tree is cut out of the sorted
+// order. Every node splits its range at the same midpoint build_tree uses,
+// so node numbering, subtree_node_count and everything built on them work
+// unchanged; only which particles land in which half differs. The sort is
+// linear and the moments are summed bottom-up from the children, so there
+// is no per-level pass over the particles as in the median builder.
+//
+// The price is looser nodes: a half of a Z-order range is not a box, so
+// node sizes grow and the force walk opens more of them. On circular_orbits
+// the build takes about a third of the median builder's time but a step
+// does several times the interactions, so BUILD_MEDIAN stays the default.
+
+#define MORTON_BITS 21
+#define RADIX_BITS 8
+#define RADIX (1 << RADIX_BITS)
+#define RADIX_PASSES ((3 * MORTON_BITS + RADIX_BITS - 1) / RADIX_BITS)
+
+#define MIN(a, b) (((a) < (b)) ? (a) : (b))
+#define MAX(a, b) (((a) > (b)) ? (a) : (b))
+
+typedef struct {
+  uint64_t key;
+  size_t index;
+} MortonKey;
+
+typedef struct {
+  double min[3];
+  double max[3];
+  double m;
+  // Mass-weighted position sum.
+  double mp[3];
+} Bounds;
+
+// Moves the low MORTON_BITS bits of x two places apart.
+static inline uint64_t spread_bits(uint64_t x) {
+  x &= (1u << MORTON_BITS) - 1;
+  x = (x | x << 32) & 0x001f00000000ffffu;
+  x = (x | x << 16) & 0x001f0000ff0000ffu;
+  x = (x | x << 8) & 0x100f00f00f00f00fu;
+  x = (x | x << 4) & 0x10c30c30c30c30c3u;
+  x = (x | x << 2) & 0x1249249249249249u;
+  return x;
+}
+
+// Stable LSD radix sort of keys on key, RADIX_BITS at a time. Each thread
+// counts and scatters its own slice; the offsets give thread t's elements
+// of one digit a place after those of threads before it, so the result is
+// the same for any thread count. An even number of passes leaves the
+// sorted keys back in keys.
+static void radix_sort(MortonKey *keys, MortonKey *tmp, size_t n,
+                       int threads) {
+  size_t(*counts)[RADIX] = malloc((size_t)threads * sizeof(*counts));
+  if (counts == NULL) {
+    fprintf(stderr, "malloc failed: it returned NULL\n");
+    exit(EXIT_FAILURE);
+  }
+
+#ifdef _OPENMP
+#pragma omp parallel num_threads(threads)
+#endif
+  {
+#ifdef _OPENMP
+    int t = omp_get_thread_num();
+    int nt = omp_get_num_threads();
+#else
+    int t = 0;
+    int nt = 1;
+#endif
+    size_t lo = n * (size_t)t / (size_t)nt;
+    size_t hi = n * (size_t)(t + 1) / (size_t)nt;
+    MortonKey *from = keys;
+    MortonKey *to = tmp;
+    for (int pass = 0; pass < RADIX_PASSES; ++pass) {
+      int shift = pass * RADIX_BITS;
+      size_t *count = counts[t];
+      memset(count, 0, sizeof(counts[t]));
+      for (size_t i = lo; i < hi; ++i) {
+        count[(from[i].key >> shift) & (RADIX - 1)] += 1;
+      }
+#ifdef _OPENMP
+#pragma omp barrier
+#pragma omp single
+#endif
+      {
+        size_t offset = 0;
+        for (size_t digit = 0; digit < RADIX; ++digit) {
+          for (int u = 0; u < nt; ++u) {
+            size_t c = counts[u][digit];
+            counts[u][digit] = offset;
+            offset += c;
+          }
+        }
+      }
+      for (size_t i = lo; i < hi; ++i) {
+        to[count[(from[i].key >> shift) & (RADIX - 1)]++] = from[i];
+      }
+#ifdef _OPENMP
+#pragma omp barrier
+#endif
+      MortonKey *swap = from;
+      from = to;
+      to = swap;
+    }
+  }
+
+  free(counts);
+}
+
+// Morton keys of the particles at indices[start, end), in that order.
+static void morton_keys(const size_t_array_t *indices, size_t start,
+                        size_t end, const ParticleSoA *particles,
+                        MortonKey *keys, int threads) {
+  double lo[3] = {1e100, 1e100, 1e100};
+  double hi[3] = {-1e100, -1e100, -1e100};
+#ifdef _OPENMP
+#pragma omp parallel for num_threads(threads) reduction(min : lo[:3])         \
+    reduction(max : hi[:3])
+#endif
+  for (size_t i = start; i < end; ++i) {
+    size_t p = indices->ptr[i];
+    for (size_t d = 0; d < 3; ++d) {
+      lo[d] = MIN(lo[d], particles->p[d][p]);
+      hi[d] = MAX(hi[d], particles->p[d][p]);
+    }
+  }
+
+  // One scale for all axes keeps the cells cubes.
+  double extent = MAX(hi[0] - lo[0], MAX(hi[1] - lo[1], hi[2] - lo[2]));
+  double cells = (double)((1u << MORTON_BITS) - 1);
+  double scale = extent > 0.0 ? cells / extent : 0.0;
+
+#ifdef _OPENMP
+#pragma omp parallel for num_threads(threads)
+#endif
+  for (size_t i = start; i < end; ++i) {
+    size_t p = indices->ptr[i];
+    uint64_t key = 0;
+    for (size_t d = 0; d < 3; ++d) {
+      double q = (particles->p[d][p] - lo[d]) * scale;
+      key |= spread_bits((uint64_t)MIN(q, cells)) << (2 - d);
+    }
+    keys[i - start].key = key;
+    keys[i - start].index = p;
+  }
+}
+
+static void bounds_leaf(const KDTree *leaf, const ParticleSoA *particles,
+                        Bounds *b) {
+  Bounds e = {{1e100, 1e100, 1e100}, {-1e100, -1e100, -1e100}, 0.0,
+              {0.0, 0.0, 0.0}};
+  for (size_t i = 0; i < leaf->num_parts; ++i) {
+    size_t p = leaf->particles[i];
+    e.m += particles->m[p];
+    for (size_t d = 0; d < 3; ++d) {
+      e.mp[d] += particles->m[p] * particles->p[d][p];
+      e.min[d] = MIN(e.min[d], particles->p[d][p]);
+      e.max[d] = MAX(e.max[d], particles->p[d][p]);
+    }
+  }
+  *b = e;
+}
+
+// Builds the subtree over the sorted range [start, end) at cur_node and
+// returns its last node. The top depth levels build their halves as tasks.
+static size_t build_morton_node(const size_t_array_t *indices, size_t start,
+                                size_t end, const ParticleSoA *particles,
+                                size_t cur_node, KDTree_array_t *nodes,
+                                Bounds *b, int depth) {
+  KDTree *node = nodes->ptr + cur_node;
+  size_t np = end - start;
+  if (np <= MAX_PARTS) {
+    node->num_parts = np;
+    node->start = start;
+    for (size_t i = 0; i < np; ++i) {
+      node->particles[i] = indices->ptr[start + i];
+    }
+    bounds_leaf(node, particles, b);
+    return cur_node;
+  }
+
+  size_t mid = (start + end) / 2;
+  Bounds left, right;
+  size_t right_first, last;
+  if (depth > 0) {
+    right_first = cur_node + 1 + subtree_node_count(mid - start);
+#pragma omp task shared(left)
+    build_morton_node(indices, start, mid, particles, cur_node + 1, nodes,
+                      &left, depth - 1);
+    last = build_morton_node(indices, mid, end, particles, right_first, nodes,
+                             &right, depth - 1);
+#pragma omp taskwait
+  } else {
+    right_first = build_morton_node(indices, start, mid, particles,
+                                    cur_node + 1, nodes, &left, 0) +
+                  1;
+    last = build_morton_node(indices, mid, end, particles, right_first, nodes,
+                             &right, 0);
+  }
+
+  b->m = left.m + right.m;
+  for (size_t d = 0; d < 3; ++d) {
+    b->mp[d] = left.mp[d] + right.mp[d];
+    b->min[d] = MIN(left.min[d], right.min[d]);
+    b->max[d] = MAX(left.max[d], right.max[d]);
+  }
+
+  // The halves of a Morton range are not cut by one plane, so split_dim is
+  // the axis along which they overlap least and split_val the right half's
+  // lower edge on it, as for a median split. refit_tree measures overlap
+  // along it.
+  size_t split_dim = 0;
+  double size = 0.0;
+  for (size_t d = 0; d < 3; ++d) {
+    if (left.max[d] - right.min[d] <
+        left.max[split_dim] - right.min[split_dim]) {
+      split_dim = d;
+    }
+    size = MAX(size, b->max[d] - b->min[d]);
+  }
+
+  node->num_parts = 0;
+  node->split_dim = split_dim;
+  node->split_val = right.min[split_dim];
+  node->m = b->m;
+  for (size_t d = 0; d < 3; ++d) {
+    node->cm[d] = b->mp[d] / b->m;
+  }
+  node->size = size;
+  node->left = cur_node + 1;
+  node->right = right_first;
+  set_quadrupole(nodes, cur_node, particles);
+  return last;
+}
+
+size_t build_tree_morton(size_t_array_t *indices, size_t start, size_t end,
+                         const ParticleSoA *particles, size_t cur_node,
+                         KDTree_array_t *nodes, const SimOptions *opts) {
+  size_t last = cur_node + subtree_node_count(end - start) - 1;
+  if (last >= nodes->size) {
+    KDTree_resize(nodes, last + 1);
+  }
+#ifdef _OPENMP
+  int threads = opts->threads > 0 ? opts->threads : omp_get_max_threads();
+#else
+  int threads = 1;
+#endif
+
+  size_t n = end - start;
+  MortonKey *keys = malloc(2 * n * sizeof(MortonKey) + 1);
+  if (keys == NULL) {
+    fprintf(stderr, "malloc failed: it returned NULL\n");
+    exit(EXIT_FAILURE);
+  }
+  morton_keys(indices, start, end, particles, keys, threads);
+  radix_sort(keys, keys + n, n, threads);
+  for (size_t i = 0; i < n; ++i) {
+    indices->ptr[start + i] = keys[i].index;
+  }
+  free(keys);
+
+  Bounds b;
+#ifdef _OPENMP
+#pragma omp parallel num_threads(threads)
+#pragma omp single
+#endif
+  build_morton_node(indices, start, end, particles, cur_node, nodes, &b,
+                    opts->build_task_depth);
+
+  return last;
+}
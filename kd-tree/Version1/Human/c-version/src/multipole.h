@@ -0,0 +1,56 @@
+#ifndef MULTIPOLE
+#define MULTIPOLE
+
+#include <math.h>
+
+#include "kdtree.h"
+
+// Far-field acceleration at offset dp = x - cm from a node of mass m. With
+// order >= 2 the traceless quadrupole q (xx, yy, zz, xy, xz, yz) about cm
+// adds Q.dp / r^5 - 5/2 (dp.Q.dp) dp / r^7. Defined for double and, as
+// far_accel_f, for float, so the far field can run in either precision.
+#define DEFINE_FAR_ACCEL(name, T, SQRT)                                        \
+  static inline void name(T m, const T q[6], int order, const T dp[3],         \
+                          T dist_sqr, T acc[3]) {                              \
+    T dist = SQRT(dist_sqr);                                                   \
+    T magi = -m / (dist_sqr * dist);                                           \
+    acc[0] += dp[0] * magi;                                                    \
+    acc[1] += dp[1] * magi;                                                    \
+    acc[2] += dp[2] * magi;                                                    \
+    if (order >= 2) {                                                          \
+      T qd[3] = {q[0] * dp[0] + q[3] * dp[1] + q[4] * dp[2],                   \
+                 q[3] * dp[0] + q[1] * dp[1] + q[5] * dp[2],                   \
+                 q[4] * dp[0] + q[5] * dp[1] + q[2] * dp[2]};                  \
+      T dqd = dp[0] * qd[0] + dp[1] * qd[1] + dp[2] * qd[2];                   \
+      T inv_r5 = (T)1.0 / (dist_sqr * dist_sqr * dist);                        \
+      T radial = (T)2.5 * dqd * inv_r5 / dist_sqr;                             \
+      acc[0] += qd[0] * inv_r5 - dp[0] * radial;                               \
+      acc[1] += qd[1] * inv_r5 - dp[1] * radial;                               \
+      acc[2] += qd[2] * inv_r5 - dp[2] * radial;                               \
+    }                                                                          \
+  }
+
+DEFINE_FAR_ACCEL(far_accel, double, sqrt)
+DEFINE_FAR_ACCEL(far_accel_f, float, sqrtf)
+
+// The far field of the compact and group walks, in far_t precision.
+#ifdef KDTREE_FLOAT_FAR
+#define far_accel_t far_accel_f
+#define far_sqrt sqrtf
+#else
+#define far_accel_t far_accel
+#define far_sqrt sqrt
+#endif
+
+// Adds m (3 s s^T - |s|^2 I) for an offset s to a traceless quadrupole.
+static inline void add_quad_point(double m, const double s[3], double q[6]) {
+  double s2 = s[0] * s[0] + s[1] * s[1] + s[2] * s[2];
+  q[0] += m * (3.0 * s[0] * s[0] - s2);
+  q[1] += m * (3.0 * s[1] * s[1] - s2);
+  q[2] += m * (3.0 * s[2] * s[2] - s2);
+  q[3] += m * 3.0 * s[0] * s[1];
+  q[4] += m * 3.0 * s[0] * s[2];
+  q[5] += m * 3.0 * s[1] * s[2];
+}
+
+#endif
@@ -0,0 +1,107 @@
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "kdtree.h"
+#include "particle.h"
+
+#pragma omp declare target
+#include "multipole.h"
+#pragma omp end declare target
+
+// OpenMP target backend for the force pass. The compact tree and the
+// positions and masses are copied to the device for each pass and only
+// the accelerations come back. Each team takes OFFLOAD_GROUP consecutive
+// particles of the tree order, so the threads of a warp (or wavefront)
+// walk neighbouring particles and mostly open the same nodes. Compilers
+// without a device for OpenMP run the same loops on the host.
+
+#define OFFLOAD_GROUP 32
+#define WALK_STACK 128
+
+#pragma omp declare target
+// calc_accel_iter over plain arrays, with the portable leaf loop.
+static void device_accel(size_t p, const double *px, const double *py,
+                         const double *pz, const double *pm,
+                         const KDNode *nodes, far_t (*quad)[6],
+                         const size_t *order, far_t theta_sqr, int expansion,
+                         double acc[3]) {
+  uint32_t stack[WALK_STACK];
+  size_t top = 0;
+  uint32_t cur = 0;
+  double x = px[p];
+  double y = py[p];
+  double z = pz[p];
+  far_t far[3] = {0.0, 0.0, 0.0};
+  for (;;) {
+    const KDNode *node = nodes + cur;
+    if (node->num_parts > 0) {
+      for (uint32_t k = 0; k < node->num_parts; ++k) {
+        size_t j = order[node->link + k];
+        if (j == p) {
+          continue;
+        }
+        double dp[3] = {x - px[j], y - py[j], z - pz[j]};
+        double dist = sqrt(dp[0] * dp[0] + dp[1] * dp[1] + dp[2] * dp[2]);
+        double magi = -pm[j] / (dist * dist * dist);
+        acc[0] += dp[0] * magi;
+        acc[1] += dp[1] * magi;
+        acc[2] += dp[2] * magi;
+      }
+    } else {
+      far_t dp[3] = {(far_t)(x - node->cm[0]), (far_t)(y - node->cm[1]),
+                     (far_t)(z - node->cm[2])};
+      far_t dist_sqr = dp[0] * dp[0] + dp[1] * dp[1] + dp[2] * dp[2];
+      if (node->size_sqr < theta_sqr * dist_sqr) {
+        far_accel_t(node->m, quad[cur], expansion, dp, dist_sqr, far);
+      } else {
+        stack[top++] = node->link;
+        cur += 1;
+        continue;
+      }
+    }
+    if (top == 0) {
+      break;
+    }
+    cur = stack[--top];
+  }
+  for (size_t d = 0; d < 3; ++d) {
+    acc[d] += far[d];
+  }
+}
+#pragma omp end declare target
+
+void calc_all_accels_offload(const ParticleSoA *bodies,
+                             const CompactTree *tree, vect3_array_t *acc,
+                             const SimOptions *opts) {
+  size_t n = bodies->size;
+  size_t count = subtree_node_count(n);
+  const double *px = bodies->p[0];
+  const double *py = bodies->p[1];
+  const double *pz = bodies->p[2];
+  const double *pm = bodies->m;
+  const KDNode *nodes = tree->nodes;
+  far_t(*quad)[6] = tree->quad;
+  const size_t *order = tree->order;
+  vect3 *out = acc->ptr;
+  far_t theta_sqr = (far_t)(opts->theta * opts->theta);
+  int expansion = opts->order;
+  size_t groups = (n + OFFLOAD_GROUP - 1) / OFFLOAD_GROUP;
+
+#pragma omp target teams distribute                                          \
+    map(to : px[0 : n], py[0 : n], pz[0 : n], pm[0 : n], nodes[0 : count],   \
+            quad[0 : count], order[0 : n]) map(from : out[0 : n])
+  for (size_t g = 0; g < groups; ++g) {
+    size_t end = (g + 1) * OFFLOAD_GROUP < n ? (g + 1) * OFFLOAD_GROUP : n;
+#pragma omp parallel for
+    for (size_t k = g * OFFLOAD_GROUP; k < end; ++k) {
+      size_t p = order[k];
+      double a[3] = {0.0, 0.0, 0.0};
+      device_accel(p, px, py, pz, pm, nodes, quad, order, theta_sqr,
+                   expansion, a);
+      for (size_t d = 0; d < 3; ++d) {
+        out[p].v[d] = a[d];
+      }
+    }
+  }
+}
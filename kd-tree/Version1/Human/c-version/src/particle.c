@@ -1,6 +1,7 @@
 #include <math.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include "particle.h"
 
@@ -25,6 +26,82 @@ Particle_array_t new_array_t(size_t elem_count) {
   return a;
 }
 
+ParticleSoA new_particle_soa(size_t elem_count) {
+  ParticleSoA a;
+  a.size = elem_count;
+  double *data = (double *)calloc(8 * elem_count + 1, sizeof(double));
+
+  if (data == NULL) {
+    fprintf(stderr, "calloc failed: it returned NULL\n");
+    exit(EXIT_FAILURE);
+  }
+
+  for (size_t d = 0; d < 3; ++d) {
+    a.p[d] = data + d * elem_count;
+    a.v[d] = data + (3 + d) * elem_count;
+  }
+  a.r = data + 6 * elem_count;
+  a.m = data + 7 * elem_count;
+
+  a.id = (size_t *)calloc(elem_count + 1, sizeof(size_t));
+  if (a.id == NULL) {
+    fprintf(stderr, "calloc failed: it returned NULL\n");
+    exit(EXIT_FAILURE);
+  }
+  for (size_t i = 0; i < elem_count; ++i) {
+    a.id[i] = i;
+  }
+  return a;
+}
+
+ParticleSoA particle_soa_from_array(const Particle_array_t *arr) {
+  ParticleSoA a = new_particle_soa(arr->size);
+  for (size_t i = 0; i < arr->size; ++i) {
+    for (size_t d = 0; d < 3; ++d) {
+      a.p[d][i] = arr->ptr[i].p[d];
+      a.v[d][i] = arr->ptr[i].v[d];
+    }
+    a.r[i] = arr->ptr[i].r;
+    a.m[i] = arr->ptr[i].m;
+  }
+  return a;
+}
+
+void particle_soa_to_array(const ParticleSoA *soa, Particle_array_t *arr) {
+  for (size_t i = 0; i < soa->size; ++i) {
+    Particle *dst = arr->ptr + soa->id[i];
+    for (size_t d = 0; d < 3; ++d) {
+      dst->p[d] = soa->p[d][i];
+      dst->v[d] = soa->v[d][i];
+    }
+    dst->r = soa->r[i];
+    dst->m = soa->m[i];
+  }
+}
+
+void copy_particle_soa(ParticleSoA *dst, const ParticleSoA *src) {
+  memcpy(dst->p[0], src->p[0], 8 * src->size * sizeof(double));
+  memcpy(dst->id, src->id, src->size * sizeof(size_t));
+}
+
+void free_particle_soa(ParticleSoA *soa) {
+  // Every array is a slice of the block that starts at p[0].
+  if (soa->p[0] != NULL) {
+    free(soa->p[0]);
+  }
+  if (soa->id != NULL) {
+    free(soa->id);
+  }
+  soa->size = 0;
+  soa->id = NULL;
+  for (size_t d = 0; d < 3; ++d) {
+    soa->p[d] = NULL;
+    soa->v[d] = NULL;
+  }
+  soa->r = NULL;
+  soa->m = NULL;
+}
+
 size_t_array_t new_size_t_array_t(size_t elem_count) {
   size_t_array_t a = {elem_count, (size_t *)calloc(elem_count, sizeof(size_t))};
 
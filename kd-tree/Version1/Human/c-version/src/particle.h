@@ -24,6 +24,28 @@ typedef struct {
 
 Particle_array_t new_array_t(size_t elem_count);
 
+// Structure-of-arrays copy of a Particle_array_t. Each component lives in
+// its own contiguous array so passes that only need one coordinate (tree
+// partitioning) or positions and masses (force evaluation) stream just
+// those. All double arrays are slices of one allocation. id[i] is the
+// Particle_array_t slot that element i came from, so the storage can be
+// permuted freely and still be written back in the original order.
+typedef struct {
+  size_t size;
+  double *p[3];
+  double *v[3];
+  double *r;
+  double *m;
+  size_t *id;
+} ParticleSoA;
+
+ParticleSoA new_particle_soa(size_t elem_count);
+ParticleSoA particle_soa_from_array(const Particle_array_t *arr);
+void particle_soa_to_array(const ParticleSoA *soa, Particle_array_t *arr);
+// dst must already hold src->size elements.
+void copy_particle_soa(ParticleSoA *dst, const ParticleSoA *src);
+void free_particle_soa(ParticleSoA *soa);
+
 typedef struct {
   size_t size;
   size_t *ptr;
@@ -0,0 +1,205 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "particle.h"
+#include "snapshot.h"
+
+_Static_assert(sizeof(SnapshotHeader) == 64, "snapshot header is 64 bytes");
+_Static_assert(sizeof(size_t) == sizeof(uint64_t), "ids are written raw");
+
+static void write_or_die(const void *ptr, size_t size, size_t count,
+                         FILE *file) {
+  if (fwrite(ptr, size, count, file) != count) {
+    fprintf(stderr, "Snapshot write failed!\n");
+    exit(EXIT_FAILURE);
+  }
+}
+
+void write_snapshot(const char *path, const ParticleSoA *particles,
+                    uint64_t step, double time) {
+  size_t len = strlen(path);
+  char *tmp = malloc(len + 5);
+  if (tmp == NULL) {
+    fprintf(stderr, "malloc failed: it returned NULL\n");
+    exit(EXIT_FAILURE);
+  }
+  memcpy(tmp, path, len);
+  memcpy(tmp + len, ".tmp", 5);
+
+  FILE *file = fopen(tmp, "wb");
+  if (file == NULL) {
+    fprintf(stderr, "File couldn't be opened!\n");
+    exit(EXIT_FAILURE);
+  }
+
+  SnapshotHeader header = {{0}, particles->size, step, time, {0}};
+  memcpy(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic));
+  write_or_die(&header, sizeof(header), 1, file);
+  write_or_die(particles->p[0], sizeof(double), 8 * particles->size, file);
+  write_or_die(particles->id, sizeof(size_t), particles->size, file);
+
+  if (fclose(file) != 0 || rename(tmp, path) != 0) {
+    fprintf(stderr, "Snapshot write failed!\n");
+    exit(EXIT_FAILURE);
+  }
+  free(tmp);
+}
+
+Particle_array_t read_snapshot(const char *path, SnapshotHeader *header) {
+  int fd = open(path, O_RDONLY);
+  if (fd < 0) {
+    fprintf(stderr, "File couldn't be opened!\n");
+    exit(EXIT_FAILURE);
+  }
+  struct stat st;
+  if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(SnapshotHeader)) {
+    fprintf(stderr, "%s is not a snapshot\n", path);
+    exit(EXIT_FAILURE);
+  }
+  size_t bytes = (size_t)st.st_size;
+  const char *map = mmap(NULL, bytes, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED) {
+    fprintf(stderr, "mmap failed on %s\n", path);
+    exit(EXIT_FAILURE);
+  }
+  posix_madvise((void *)map, bytes, POSIX_MADV_SEQUENTIAL);
+
+  SnapshotHeader h;
+  memcpy(&h, map, sizeof(h));
+  size_t n = h.num_parts;
+  if (memcmp(h.magic, SNAPSHOT_MAGIC, sizeof(h.magic)) != 0 ||
+      bytes != sizeof(h) + n * (8 * sizeof(double) + sizeof(uint64_t))) {
+    fprintf(stderr, "%s is not a snapshot\n", path);
+    exit(EXIT_FAILURE);
+  }
+
+  // The arrays are read in place from the mapping; only the scatter back
+  // into original order touches memory of our own.
+  const double *data = (const double *)(map + sizeof(h));
+  const uint64_t *id = (const uint64_t *)(data + 8 * n);
+  Particle_array_t parts = new_array_t(n);
+  for (size_t i = 0; i < n; ++i) {
+    if (id[i] >= n) {
+      fprintf(stderr, "%s has a bad particle id\n", path);
+      exit(EXIT_FAILURE);
+    }
+    Particle *dst = parts.ptr + id[i];
+    for (size_t d = 0; d < 3; ++d) {
+      dst->p[d] = data[d * n + i];
+      dst->v[d] = data[(3 + d) * n + i];
+    }
+    dst->r = data[6 * n + i];
+    dst->m = data[7 * n + i];
+  }
+  munmap((void *)map, bytes);
+
+  if (header != NULL) {
+    *header = h;
+  }
+  return parts;
+}
+
+static void write_slot(const SnapshotWriter *writer,
+                       const SnapshotSlot *slot) {
+  char name[4096];
+  snprintf(name, sizeof(name), "%s%07lu.snap", writer->prefix,
+           (unsigned long)slot->step);
+  write_snapshot(name, &slot->parts, slot->step, slot->time);
+}
+
+static void *writer_main(void *arg) {
+  SnapshotWriter *writer = arg;
+  pthread_mutex_lock(&writer->lock);
+  for (;;) {
+    SnapshotSlot *next = NULL;
+    for (size_t s = 0; s < 2; ++s) {
+      SnapshotSlot *slot = writer->slots + s;
+      if (slot->busy && (next == NULL || slot->seq < next->seq)) {
+        next = slot;
+      }
+    }
+    if (next == NULL) {
+      if (writer->done) {
+        break;
+      }
+      pthread_cond_wait(&writer->cond, &writer->lock);
+      continue;
+    }
+
+    // The slot stays busy, so submit leaves it alone while it is written.
+    pthread_mutex_unlock(&writer->lock);
+    write_slot(writer, next);
+    pthread_mutex_lock(&writer->lock);
+    next->busy = 0;
+    pthread_cond_broadcast(&writer->cond);
+  }
+  pthread_mutex_unlock(&writer->lock);
+  return NULL;
+}
+
+void snapshot_writer_start(SnapshotWriter *writer, size_t num_parts,
+                           const char *prefix) {
+  memset(writer, 0, sizeof(*writer));
+  writer->prefix = prefix;
+  for (size_t s = 0; s < 2; ++s) {
+    writer->slots[s].parts = new_particle_soa(num_parts);
+  }
+  pthread_mutex_init(&writer->lock, NULL);
+  pthread_cond_init(&writer->cond, NULL);
+  if (pthread_create(&writer->thread, NULL, writer_main, writer) != 0) {
+    fprintf(stderr, "Snapshot writer thread couldn't be started!\n");
+    exit(EXIT_FAILURE);
+  }
+}
+
+void snapshot_writer_submit(SnapshotWriter *writer,
+                            const ParticleSoA *particles, uint64_t step,
+                            double time) {
+  pthread_mutex_lock(&writer->lock);
+  SnapshotSlot *slot = NULL;
+  while (slot == NULL) {
+    for (size_t s = 0; s < 2 && slot == NULL; ++s) {
+      if (!writer->slots[s].busy) {
+        slot = writer->slots + s;
+      }
+    }
+    if (slot == NULL) {
+      pthread_cond_wait(&writer->cond, &writer->lock);
+    }
+  }
+  pthread_mutex_unlock(&writer->lock);
+
+  // Only this thread hands out free slots, so the copy needs no lock.
+  copy_particle_soa(&slot->parts, particles);
+  slot->step = step;
+  slot->time = time;
+
+  pthread_mutex_lock(&writer->lock);
+  slot->seq = writer->submitted++;
+  slot->busy = 1;
+  pthread_cond_broadcast(&writer->cond);
+  pthread_mutex_unlock(&writer->lock);
+}
+
+void snapshot_writer_finish(SnapshotWriter *writer) {
+  pthread_mutex_lock(&writer->lock);
+  writer->done = 1;
+  pthread_cond_broadcast(&writer->cond);
+  pthread_mutex_unlock(&writer->lock);
+  pthread_join(writer->thread, NULL);
+
+  for (size_t s = 0; s < 2; ++s) {
+    free_particle_soa(&writer->slots[s].parts);
+  }
+  pthread_mutex_destroy(&writer->lock);
+  pthread_cond_destroy(&writer->cond);
+}
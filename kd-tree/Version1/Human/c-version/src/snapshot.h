@@ -0,0 +1,73 @@
+#ifndef SNAPSHOT
+#define SNAPSHOT
+
+#include <pthread.h>
+#include <stdint.h>
+
+#include "particle.h"
+
+// Binary snapshot layout, all in host byte order:
+//
+//   SnapshotHeader                 64 bytes
+//   p[0], p[1], p[2]               num_parts doubles each
+//   v[0], v[1], v[2]               num_parts doubles each
+//   r, m                           num_parts doubles each
+//   id                             num_parts uint64_t
+//
+// The double block is exactly the ParticleSoA allocation, so a snapshot is
+// written with two fwrites and can be mapped and used in place.
+
+#define SNAPSHOT_MAGIC "KDTSNAP1"
+
+typedef struct {
+  char magic[8];
+  uint64_t num_parts;
+  uint64_t step;
+  double time;
+  uint64_t reserved[4];
+} SnapshotHeader;
+
+// Writes particles to path through a temporary file, so a reader never
+// sees a partial snapshot. Exits on I/O errors.
+void write_snapshot(const char *path, const ParticleSoA *particles,
+                    uint64_t step, double time);
+
+// Maps a snapshot or checkpoint and returns its particles in their
+// original order, which is what simple_sim_opts takes. Fills header when
+// it is not NULL. Exits if the file is missing, truncated or not a
+// snapshot.
+Particle_array_t read_snapshot(const char *path, SnapshotHeader *header);
+
+typedef struct {
+  ParticleSoA parts;
+  uint64_t step;
+  double time;
+  // Set while the slot waits for or is being written by the writer thread.
+  int busy;
+  // Submission order, so queued slots are written oldest first.
+  uint64_t seq;
+} SnapshotSlot;
+
+// Background writer with two particle buffers. submit copies the particles
+// into a free buffer and returns, so the file is written while the next
+// step runs; it only blocks when both buffers are still in flight.
+typedef struct {
+  pthread_t thread;
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  SnapshotSlot slots[2];
+  uint64_t submitted;
+  int done;
+  const char *prefix;
+} SnapshotWriter;
+
+// Files are named <prefix><step>.snap, with the step zero padded.
+void snapshot_writer_start(SnapshotWriter *writer, size_t num_parts,
+                           const char *prefix);
+void snapshot_writer_submit(SnapshotWriter *writer,
+                            const ParticleSoA *particles, uint64_t step,
+                            double time);
+// Writes everything still queued and joins the thread.
+void snapshot_writer_finish(SnapshotWriter *writer);
+
+#endif
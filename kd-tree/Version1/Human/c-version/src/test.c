@@ -1,9 +1,12 @@
+#include <math.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
 #include "kdtree.h"
+#include "leaf_kernel.h"
 #include "particle.h"
+#include "snapshot.h"
 
 // void assert_eq_int(int actual, int expected) {
 //   if (actual != expected) {
@@ -61,7 +64,7 @@ void single_node() {
   Particle_array_t parts = two_bodies();
   KDTree_array_t node_vec = allocate_node_vec(parts.size);
 
-  assert_eq_size_t(node_vec.size, 2);
+  assert_eq_size_t(node_vec.size, 1);
   size_t_array_t indices = new_range(0, parts.size);
 
   build_tree(&indices, 0, parts.size, &parts, 0, &node_vec);
@@ -75,7 +78,7 @@ void single_node() {
 void two_leaves() {
   Particle_array_t parts = circular_orbits(11);
   KDTree_array_t node_vec = allocate_node_vec(parts.size);
-  assert_eq_size_t(node_vec.size, 6);
+  assert_eq_size_t(node_vec.size, 3);
   size_t_array_t indices = new_range(0, parts.size);
 
   build_tree(&indices, 0, parts.size, &parts, 0, &node_vec);
@@ -122,6 +125,740 @@ void big_solar_with_steps() {
   FREE_ARRAY(indices);
 }
 
+void parallel_build_layout() {
+  Particle_array_t parts = circular_orbits(5000);
+  size_t count = subtree_node_count(parts.size);
+
+  KDTree_array_t serial = allocate_node_vec(parts.size);
+  size_t_array_t indices = new_range(0, parts.size);
+  size_t last = build_tree(&indices, 0, parts.size, &parts, 0, &serial);
+  assert_eq_size_t(last + 1, count);
+
+  KDTree_array_t parallel = allocate_node_vec(parts.size);
+  size_t_array_t par_indices = new_range(0, parts.size);
+  ParticleSoA soa = particle_soa_from_array(&parts);
+  SimOptions opts = default_sim_options();
+  opts.threads = 4;
+  last = build_tree_parallel(&par_indices, 0, parts.size, &soa, 0, &parallel,
+                             &opts);
+  free_particle_soa(&soa);
+  assert_eq_size_t(last + 1, count);
+
+  double min[3] = {-1e100, -1e100, -1e100};
+  double max[3] = {1e100, 1e100, 1e100};
+  recur_test_tree_struct(0, &parallel, &parts, min, max);
+
+  // Median splits are unique, so both builders must agree on the shape.
+  for (size_t n = 0; n < count; ++n) {
+    assert_eq_size_t(parallel.ptr[n].num_parts, serial.ptr[n].num_parts);
+    if (serial.ptr[n].num_parts == 0) {
+      assert_eq_size_t(parallel.ptr[n].split_dim, serial.ptr[n].split_dim);
+      assert_eq_size_t(parallel.ptr[n].left, serial.ptr[n].left);
+      assert_eq_size_t(parallel.ptr[n].right, serial.ptr[n].right);
+      assert(parallel.ptr[n].split_val == serial.ptr[n].split_val,
+             "Node %lu split differs: %f vs %f", n, parallel.ptr[n].split_val,
+             serial.ptr[n].split_val);
+    }
+  }
+
+  FREE_ARRAY(parts);
+  FREE_ARRAY(serial);
+  FREE_ARRAY(parallel);
+  FREE_ARRAY(indices);
+  FREE_ARRAY(par_indices);
+}
+
+void morton_build_layout() {
+  Particle_array_t parts = circular_orbits(5000);
+  ParticleSoA soa = particle_soa_from_array(&parts);
+  size_t count = subtree_node_count(parts.size);
+  SimOptions opts = default_sim_options();
+  opts.builder = BUILD_MORTON;
+  opts.threads = 4;
+
+  KDTree_array_t morton = allocate_node_vec(parts.size);
+  size_t_array_t indices = new_range(0, parts.size);
+  size_t last =
+      build_tree_parallel(&indices, 0, soa.size, &soa, 0, &morton, &opts);
+  assert_eq_size_t(last + 1, count);
+
+  // Leaves come in index order and together hold every particle once.
+  char *seen = calloc(parts.size, 1);
+  size_t next = 0;
+  for (size_t n = 0; n <= last; ++n) {
+    const KDTree *node = morton.ptr + n;
+    if (node->num_parts == 0) {
+      assert_eq_size_t(node->left, n + 1);
+      continue;
+    }
+    assert_eq_size_t(node->start, next);
+    for (size_t j = 0; j < node->num_parts; ++j) {
+      size_t i = node->particles[j];
+      assert_eq_size_t(i, indices.ptr[next + j]);
+      assert(!seen[i], "Particle %lu is in two leaves", i);
+      seen[i] = 1;
+    }
+    next += node->num_parts;
+  }
+  assert_eq_size_t(next, parts.size);
+  free(seen);
+
+  // The sort is stable, so a serial build gives the same tree.
+  KDTree_array_t serial = allocate_node_vec(parts.size);
+  size_t_array_t serial_indices = new_range(0, parts.size);
+  opts.threads = 1;
+  opts.build_task_depth = 0;
+  build_tree_parallel(&serial_indices, 0, soa.size, &soa, 0, &serial, &opts);
+  assert(memcmp(serial.ptr, morton.ptr, count * sizeof(KDTree)) == 0,
+         "Serial Morton build differs from the %d thread one", 4);
+
+  // Moments summed bottom-up agree with a refit of the same topology.
+  double overlap = refit_tree(&serial, &soa, &opts);
+  assert(overlap >= 0.0, "Negative overlap %g", overlap);
+  for (size_t n = 0; n <= last; ++n) {
+    const KDTree *a = morton.ptr + n;
+    const KDTree *b = serial.ptr + n;
+    if (a->num_parts > 0) {
+      continue;
+    }
+    assert(fabs(a->m - b->m) <= 1e-12 * a->m, "Node %lu mass differs", n);
+    assert(fabs(a->size - b->size) <= 1e-12 * a->size,
+           "Node %lu size %g refit to %g", n, a->size, b->size);
+    for (size_t d = 0; d < 3; ++d) {
+      assert(fabs(a->cm[d] - b->cm[d]) <= 1e-12 * a->size,
+             "Node %lu cm[%lu] differs", n, d);
+    }
+  }
+
+  // A sim on Morton trees stays close to one on median trees.
+  Particle_array_t median = circular_orbits(5000);
+  Particle_array_t sorted = new_array_t(median.size);
+  memcpy(sorted.ptr, median.ptr, median.size * sizeof(Particle));
+  opts = default_sim_options();
+  opts.reorder = 1;
+  simple_sim_opts(&median, 1e-3, 5, &opts);
+  opts.builder = BUILD_MORTON;
+  simple_sim_opts(&sorted, 1e-3, 5, &opts);
+  for (size_t i = 0; i < median.size; ++i) {
+    for (size_t d = 0; d < 3; ++d) {
+      double diff = median.ptr[i].p[d] - sorted.ptr[i].p[d];
+      assert(fabs(diff) < 1e-6, "Particle %lu moved %g apart", i, diff);
+    }
+  }
+
+  free_particle_soa(&soa);
+  FREE_ARRAY(parts);
+  FREE_ARRAY(median);
+  FREE_ARRAY(sorted);
+  FREE_ARRAY(morton);
+  FREE_ARRAY(serial);
+  FREE_ARRAY(indices);
+  FREE_ARRAY(serial_indices);
+}
+
+void contacts_match_brute_force() {
+  Particle_array_t parts = circular_orbits(4000);
+  // Radii large enough that the inner orbits crowd into each other.
+  for (size_t i = 1; i < parts.size; ++i) {
+    parts.ptr[i].r = 5e-3 * (double)(1 + i % 3);
+  }
+  ParticleSoA soa = particle_soa_from_array(&parts);
+  KDTree_array_t tree = allocate_node_vec(parts.size);
+  size_t_array_t indices = new_range(0, parts.size);
+  SimOptions opts = default_sim_options();
+  opts.threads = 4;
+  build_tree_parallel(&indices, 0, soa.size, &soa, 0, &tree, &opts);
+
+  ContactList brute = new_contact_list(1);
+  brute.size = 0;
+  for (size_t i = 0; i < soa.size; ++i) {
+    for (size_t j = i + 1; j < soa.size; ++j) {
+      double dp[3] = {soa.p[0][j] - soa.p[0][i], soa.p[1][j] - soa.p[1][i],
+                      soa.p[2][j] - soa.p[2][i]};
+      double dist = sqrt(dp[0] * dp[0] + dp[1] * dp[1] + dp[2] * dp[2]);
+      if (dist <= soa.r[i] + soa.r[j]) {
+        reserve_contacts(&brute, 2 * (brute.size + 1));
+        Contact c = {i, j, dist};
+        brute.ptr[brute.size++] = c;
+      }
+    }
+  }
+  assert(brute.size > 100, "Only %lu brute force contacts", brute.size);
+
+  // Too small a buffer reports how many pairs there were.
+  CollisionTree *ctree = new_collision_tree();
+  ContactList found = new_contact_list(10);
+  size_t count = find_contacts(&soa, &tree, 0.0, &opts, ctree, &found);
+  assert_eq_size_t(count, brute.size);
+  reserve_contacts(&found, count);
+  find_contacts(&soa, &tree, 0.0, &opts, ctree, &found);
+  assert_eq_size_t(found.size, brute.size);
+  for (size_t k = 0; k < brute.size; ++k) {
+    assert_eq_size_t(found.ptr[k].i, brute.ptr[k].i);
+    assert_eq_size_t(found.ptr[k].j, brute.ptr[k].j);
+    assert(fabs(found.ptr[k].dist - brute.ptr[k].dist) <= 1e-15,
+           "Contact %lu distance differs", k);
+  }
+
+  free_collision_tree(ctree);
+  free_particle_soa(&soa);
+  FREE_ARRAY(parts);
+  FREE_ARRAY(tree);
+  FREE_ARRAY(indices);
+  FREE_ARRAY(brute);
+  FREE_ARRAY(found);
+}
+
+void soa_round_trip() {
+  Particle_array_t parts = circular_orbits(100);
+  ParticleSoA soa = particle_soa_from_array(&parts);
+  assert_eq_size_t(soa.size, parts.size);
+
+  Particle_array_t back = new_array_t(parts.size);
+  particle_soa_to_array(&soa, &back);
+  assert(memcmp(parts.ptr, back.ptr, parts.size * sizeof(Particle)) == 0,
+         "SoA round trip changed %lu particles", parts.size);
+
+  free_particle_soa(&soa);
+  FREE_ARRAY(parts);
+  FREE_ARRAY(back);
+}
+
+void reordered_leaves() {
+  Particle_array_t parts = circular_orbits(5000);
+  ParticleSoA soa = particle_soa_from_array(&parts);
+  ParticleSoA scratch = new_particle_soa(soa.size);
+  KDTree_array_t node_vec = allocate_node_vec(parts.size);
+  size_t_array_t indices = new_range(0, parts.size);
+
+  build_tree_soa(&indices, 0, soa.size, &soa, 0, &node_vec);
+  reorder_particles(&soa, &indices, &node_vec, &scratch);
+
+  for (size_t n = 0; n < node_vec.size; ++n) {
+    KDTree *node = node_vec.ptr + n;
+    for (size_t j = 0; j < node->num_parts; ++j) {
+      size_t i = node->particles[j];
+      assert_eq_size_t(i, node->start + j);
+      assert(soa.p[0][i] == parts.ptr[soa.id[i]].p[0],
+             "Slot %lu does not hold particle %lu", i, soa.id[i]);
+    }
+  }
+
+  // The tree still describes the particles once they have moved.
+  Particle_array_t sorted = new_array_t(parts.size);
+  for (size_t i = 0; i < soa.size; ++i) {
+    soa.id[i] = i;
+  }
+  particle_soa_to_array(&soa, &sorted);
+  double min[3] = {-1e100, -1e100, -1e100};
+  double max[3] = {1e100, 1e100, 1e100};
+  recur_test_tree_struct(0, &node_vec, &sorted, min, max);
+
+  free_particle_soa(&soa);
+  free_particle_soa(&scratch);
+  FREE_ARRAY(parts);
+  FREE_ARRAY(sorted);
+  FREE_ARRAY(node_vec);
+  FREE_ARRAY(indices);
+}
+
+void reordered_sim_matches() {
+  Particle_array_t plain = circular_orbits(5000);
+  Particle_array_t sorted = new_array_t(plain.size);
+  memcpy(sorted.ptr, plain.ptr, plain.size * sizeof(Particle));
+
+  SimOptions opts = default_sim_options();
+  simple_sim_opts(&plain, 1e-3, 5, &opts);
+  opts.reorder = 1;
+  simple_sim_opts(&sorted, 1e-3, 5, &opts);
+
+  // Only the summation order inside node moments differs.
+  for (size_t i = 0; i < plain.size; ++i) {
+    for (size_t d = 0; d < 3; ++d) {
+      double diff = plain.ptr[i].p[d] - sorted.ptr[i].p[d];
+      assert(diff < 1e-12 && diff > -1e-12,
+             "Particle %lu moved differently when reordered: %g", i, diff);
+    }
+  }
+
+  FREE_ARRAY(plain);
+  FREE_ARRAY(sorted);
+}
+
+void leaf_kernel_matches_direct() {
+  // Seven bodies fit one leaf, so the tree force is a pure leaf sum.
+  Particle_array_t parts = circular_orbits(MAX_PARTS - 1);
+  ParticleSoA soa = particle_soa_from_array(&parts);
+  KDTree_array_t node_vec = allocate_node_vec(parts.size);
+  size_t_array_t indices = new_range(0, parts.size);
+  build_tree_soa(&indices, 0, soa.size, &soa, 0, &node_vec);
+  assert_eq_size_t(node_vec.ptr[0].num_parts, parts.size);
+
+  vect3_array_t acc = new_vect3_array_t(parts.size);
+  SimOptions opts = default_sim_options();
+  calc_all_accels(&soa, &node_vec, &acc, &opts);
+
+  for (size_t i = 0; i < parts.size; ++i) {
+    double direct[3] = {0.0, 0.0, 0.0};
+    for (size_t j = 0; j < parts.size; ++j) {
+      if (i != j) {
+        calc_pp_accel(&soa, i, j, direct);
+      }
+    }
+    for (size_t d = 0; d < 3; ++d) {
+      double err = acc.ptr[i].v[d] - direct[d];
+      double tol = 1e-9 * (direct[d] < 0 ? -direct[d] : direct[d]) + 1e-300;
+      assert(err <= tol && err >= -tol,
+             "Leaf kernel differs for particle %lu dim %lu: %g vs %g", i, d,
+             acc.ptr[i].v[d], direct[d]);
+    }
+  }
+
+  free_particle_soa(&soa);
+  FREE_ARRAY(parts);
+  FREE_ARRAY(node_vec);
+  FREE_ARRAY(indices);
+  FREE_ARRAY(acc);
+}
+
+// RMS force error relative to the RMS direct-sum force. A per-body ratio
+// would be dominated by the star, whose net force nearly cancels.
+double rms_force_error(const vect3_array_t *acc, const ParticleSoA *soa) {
+  double err = 0.0, mag = 0.0;
+  for (size_t i = 0; i < soa->size; ++i) {
+    double direct[3] = {0.0, 0.0, 0.0};
+    for (size_t j = 0; j < soa->size; ++j) {
+      if (i != j) {
+        calc_pp_accel(soa, i, j, direct);
+      }
+    }
+    for (size_t d = 0; d < 3; ++d) {
+      double diff = acc->ptr[i].v[d] - direct[d];
+      err += diff * diff;
+      mag += direct[d] * direct[d];
+    }
+  }
+  return sqrt(err / mag);
+}
+
+void group_walk_accuracy() {
+  Particle_array_t parts = circular_orbits(3000);
+  ParticleSoA soa = particle_soa_from_array(&parts);
+  KDTree_array_t node_vec = allocate_node_vec(parts.size);
+  size_t_array_t indices = new_range(0, parts.size);
+  build_tree_soa(&indices, 0, soa.size, &soa, 0, &node_vec);
+
+  SimOptions opts = default_sim_options();
+  vect3_array_t single = new_vect3_array_t(parts.size);
+  calc_all_accels(&soa, &node_vec, &single, &opts);
+  double single_err = rms_force_error(&single, &soa);
+
+  size_t sizes[2] = {1, 64};
+  for (size_t s = 0; s < 2; ++s) {
+    opts.group_size = sizes[s];
+    vect3_array_t group = new_vect3_array_t(parts.size);
+    calc_all_accels_group(&soa, &node_vec, &indices, &group, &opts);
+    double group_err = rms_force_error(&group, &soa);
+    // The group opening rule is stricter, so it must not be less accurate.
+    assert(group_err <= single_err,
+           "Group walk (size %lu) error %g exceeds per-particle error %g",
+           sizes[s], group_err, single_err);
+    FREE_ARRAY(group);
+  }
+
+  free_particle_soa(&soa);
+  FREE_ARRAY(single);
+  FREE_ARRAY(parts);
+  FREE_ARRAY(node_vec);
+  FREE_ARRAY(indices);
+}
+
+void quadrupole_accuracy() {
+  Particle_array_t parts = circular_orbits(3000);
+  ParticleSoA soa = particle_soa_from_array(&parts);
+  KDTree_array_t node_vec = allocate_node_vec(parts.size);
+  size_t_array_t indices = new_range(0, parts.size);
+  build_tree_soa(&indices, 0, soa.size, &soa, 0, &node_vec);
+
+  SimOptions opts = default_sim_options();
+  opts.theta = 0.6;
+  vect3_array_t mono = new_vect3_array_t(parts.size);
+  calc_all_accels(&soa, &node_vec, &mono, &opts);
+  opts.order = 2;
+  vect3_array_t quad = new_vect3_array_t(parts.size);
+  calc_all_accels(&soa, &node_vec, &quad, &opts);
+
+  double mono_err = rms_force_error(&mono, &soa);
+  double quad_err = rms_force_error(&quad, &soa);
+  assert(quad_err < 0.5 * mono_err,
+         "Quadrupole error %g is not well below monopole error %g", quad_err,
+         mono_err);
+
+  free_particle_soa(&soa);
+  FREE_ARRAY(mono);
+  FREE_ARRAY(quad);
+  FREE_ARRAY(parts);
+  FREE_ARRAY(node_vec);
+  FREE_ARRAY(indices);
+}
+
+void compact_walk_matches_recursive() {
+  Particle_array_t parts = circular_orbits(3000);
+  ParticleSoA soa = particle_soa_from_array(&parts);
+  KDTree_array_t node_vec = allocate_node_vec(parts.size);
+  size_t_array_t indices = new_range(0, parts.size);
+  build_tree_soa(&indices, 0, soa.size, &soa, 0, &node_vec);
+  CompactTree compact = new_compact_tree(soa.size);
+  pack_tree(&node_vec, &indices, soa.size, &compact);
+
+  SimOptions opts = default_sim_options();
+  for (opts.order = 1; opts.order <= 2; ++opts.order) {
+    for (size_t i = 0; i < soa.size; ++i) {
+      double recur[3] = {0.0, 0.0, 0.0};
+      double iter[3] = {0.0, 0.0, 0.0};
+      calc_accel(i, &soa, &node_vec, &opts, recur);
+      calc_accel_iter(i, &soa, &compact, &opts, iter);
+#ifdef KDTREE_FLOAT_FAR
+      // Float moments round the far field; it must stay well inside the
+      // tree's own error.
+      double diff = 0.0, mag = 0.0;
+      for (size_t d = 0; d < 3; ++d) {
+        diff += (recur[d] - iter[d]) * (recur[d] - iter[d]);
+        mag += recur[d] * recur[d];
+      }
+      assert(diff <= 1e-8 * mag, "Order %d walks differ for particle %lu",
+             opts.order, i);
+#else
+      assert(memcmp(recur, iter, sizeof(recur)) == 0,
+             "Order %d walks differ for particle %lu", opts.order, i);
+#endif
+    }
+  }
+
+  free_compact_tree(&compact);
+  free_particle_soa(&soa);
+  FREE_ARRAY(parts);
+  FREE_ARRAY(node_vec);
+  FREE_ARRAY(indices);
+}
+
+void offload_matches_compact() {
+  Particle_array_t parts = circular_orbits(3000);
+  ParticleSoA soa = particle_soa_from_array(&parts);
+  KDTree_array_t node_vec = allocate_node_vec(parts.size);
+  size_t_array_t indices = new_range(0, parts.size);
+  build_tree_soa(&indices, 0, soa.size, &soa, 0, &node_vec);
+  CompactTree compact = new_compact_tree(soa.size);
+  pack_tree(&node_vec, &indices, soa.size, &compact);
+  vect3_array_t host = new_vect3_array_t(soa.size);
+  vect3_array_t device = new_vect3_array_t(soa.size);
+
+  SimOptions opts = default_sim_options();
+  for (opts.order = 1; opts.order <= 2; ++opts.order) {
+    memset(host.ptr, 0, host.size * sizeof(vect3));
+    calc_all_accels_compact(&soa, &compact, &host, &opts);
+    calc_all_accels_offload(&soa, &compact, &device, &opts);
+    // Same walk, but the leaf kernel and far-field sums round differently.
+    for (size_t i = 0; i < soa.size; ++i) {
+      double diff = 0.0, mag = 0.0;
+      for (size_t d = 0; d < 3; ++d) {
+        double e = host.ptr[i].v[d] - device.ptr[i].v[d];
+        diff += e * e;
+        mag += host.ptr[i].v[d] * host.ptr[i].v[d];
+      }
+#ifdef KDTREE_FLOAT_FAR
+      assert(diff <= 1e-8 * mag, "Order %d walks differ for particle %lu",
+             opts.order, i);
+#else
+      assert(diff <= 1e-20 * mag, "Order %d walks differ for particle %lu",
+             opts.order, i);
+#endif
+    }
+  }
+
+  free_compact_tree(&compact);
+  free_particle_soa(&soa);
+  FREE_ARRAY(parts);
+  FREE_ARRAY(node_vec);
+  FREE_ARRAY(indices);
+  FREE_ARRAY(host);
+  FREE_ARRAY(device);
+}
+
+void dual_tree_tracks_direct_sum() {
+  Particle_array_t parts = circular_orbits(3000);
+  ParticleSoA soa = particle_soa_from_array(&parts);
+  KDTree_array_t node_vec = allocate_node_vec(parts.size);
+  size_t_array_t indices = new_range(0, parts.size);
+  build_tree_soa(&indices, 0, soa.size, &soa, 0, &node_vec);
+  vect3_array_t direct = new_vect3_array_t(soa.size);
+  vect3_array_t serial = new_vect3_array_t(soa.size);
+  vect3_array_t parallel = new_vect3_array_t(soa.size);
+  for (size_t i = 0; i < soa.size; ++i) {
+    for (size_t j = 0; j < soa.size; ++j) {
+      if (i != j) {
+        calc_pp_accel(&soa, i, j, direct.ptr[i].v);
+      }
+    }
+  }
+
+  SimOptions opts = default_sim_options();
+  DualTree *dual = new_dual_tree();
+  opts.build_task_depth = 0;
+  calc_all_accels_dual(&soa, &node_vec, &serial, &opts, dual);
+  opts.build_task_depth = 8;
+  calc_all_accels_dual(&soa, &node_vec, &parallel, &opts, dual);
+  assert(memcmp(serial.ptr, parallel.ptr, soa.size * sizeof(vect3)) == 0,
+         "%s\n", "Task-parallel dual walk differs from the serial one");
+
+  // Relative to the RMS force, as in make accuracy. At either order the
+  // RMS error should be within a small factor of Barnes-Hut's at the same
+  // theta, and the quadrupoles should make it smaller.
+  double dual_err[3] = {0.0, 0.0, 0.0};
+  for (opts.order = 1; opts.order <= 2; ++opts.order) {
+    vect3_array_t bh = new_vect3_array_t(soa.size);
+    for (size_t i = 0; i < soa.size; ++i) {
+      serial.ptr[i].v[0] = serial.ptr[i].v[1] = serial.ptr[i].v[2] = 0.0;
+      calc_accel(i, &soa, &node_vec, &opts, bh.ptr[i].v);
+    }
+    calc_all_accels_dual(&soa, &node_vec, &serial, &opts, dual);
+    double err = 0.0, bh_err = 0.0, mag = 0.0;
+    for (size_t i = 0; i < soa.size; ++i) {
+      for (size_t d = 0; d < 3; ++d) {
+        double e = serial.ptr[i].v[d] - direct.ptr[i].v[d];
+        double b = bh.ptr[i].v[d] - direct.ptr[i].v[d];
+        err += e * e;
+        bh_err += b * b;
+        mag += direct.ptr[i].v[d] * direct.ptr[i].v[d];
+      }
+    }
+    assert(err < 9.0 * bh_err,
+           "Order %d dual walk RMS error %g is far above Barnes-Hut's %g\n",
+           opts.order, sqrt(err / mag), sqrt(bh_err / mag));
+    dual_err[opts.order] = err;
+    FREE_ARRAY(bh);
+  }
+  assert(dual_err[2] < dual_err[1], "%s\n",
+         "Quadrupoles do not improve the dual walk");
+
+  free_dual_tree(dual);
+  free_particle_soa(&soa);
+  FREE_ARRAY(parts);
+  FREE_ARRAY(node_vec);
+  FREE_ARRAY(indices);
+  FREE_ARRAY(direct);
+  FREE_ARRAY(serial);
+  FREE_ARRAY(parallel);
+}
+
+void refit_matches_build() {
+  Particle_array_t parts = circular_orbits(3000);
+  ParticleSoA soa = particle_soa_from_array(&parts);
+  KDTree_array_t built = allocate_node_vec(parts.size);
+  size_t_array_t indices = new_range(0, parts.size);
+  size_t last = build_tree_soa(&indices, 0, soa.size, &soa, 0, &built);
+  KDTree_array_t refit = new_kdtree_array_t(built.size);
+  memcpy(refit.ptr, built.ptr, built.size * sizeof(KDTree));
+
+  // Without motion a refit recovers the built moments and no overlap.
+  SimOptions opts = default_sim_options();
+  double overlap = refit_tree(&refit, &soa, &opts);
+  assert(overlap <= 0.0, "Unmoved tree has overlap %g", overlap);
+  for (size_t i = 0; i <= last; ++i) {
+    const KDTree *a = built.ptr + i;
+    const KDTree *b = refit.ptr + i;
+    if (a->num_parts > 0) {
+      continue;
+    }
+    assert(fabs(a->m - b->m) <= 1e-12 * a->m, "Node %lu mass differs", i);
+    assert(fabs(a->size - b->size) <= 1e-12 * a->size,
+           "Node %lu size %g refit to %g", i, a->size, b->size);
+    for (size_t d = 0; d < 3; ++d) {
+      assert(fabs(a->cm[d] - b->cm[d]) <= 1e-12 * a->size,
+             "Node %lu cm[%lu] differs", i, d);
+    }
+  }
+
+  // A sim that mostly refits stays close to one that rebuilds every step.
+  Particle_array_t rebuilt = circular_orbits(3000);
+  Particle_array_t refitted = new_array_t(rebuilt.size);
+  memcpy(refitted.ptr, rebuilt.ptr, rebuilt.size * sizeof(Particle));
+  opts.rebuild_interval = 5;
+  opts.max_overlap = 1.0;
+  simple_sim_opts(&refitted, 1e-3, 5, &opts);
+  opts.rebuild_interval = 1;
+  simple_sim_opts(&rebuilt, 1e-3, 5, &opts);
+  for (size_t i = 0; i < rebuilt.size; ++i) {
+    for (size_t d = 0; d < 3; ++d) {
+      double diff = rebuilt.ptr[i].p[d] - refitted.ptr[i].p[d];
+      assert(fabs(diff) < 1e-8, "Particle %lu moved %g apart", i, diff);
+    }
+  }
+
+  free_particle_soa(&soa);
+  FREE_ARRAY(parts);
+  FREE_ARRAY(rebuilt);
+  FREE_ARRAY(refitted);
+  FREE_ARRAY(built);
+  FREE_ARRAY(refit);
+  FREE_ARRAY(indices);
+}
+
+void snapshot_round_trip() {
+  Particle_array_t parts = circular_orbits(1000);
+  SimOptions opts = default_sim_options();
+  opts.reorder = 1;
+  opts.snapshot_interval = 3;
+  opts.snapshot_prefix = "test-snap";
+  simple_sim_opts(&parts, 1e-3, 3, &opts);
+
+  FILE *file = fopen("test-snap0000003.snap", "rb");
+  assert(file != NULL, "Snapshot %s was not written\n", "test-snap0000003");
+  SnapshotHeader header;
+  assert(fread(&header, sizeof(header), 1, file) == 1, "Short header%s\n", "");
+  assert(memcmp(header.magic, SNAPSHOT_MAGIC, 8) == 0, "Bad magic%s\n", "");
+  assert_eq_size_t(header.num_parts, parts.size);
+  assert_eq_size_t(header.step, 3);
+
+  ParticleSoA snap = new_particle_soa(parts.size);
+  size_t doubles = 8 * parts.size;
+  assert(fread(snap.p[0], sizeof(double), doubles, file) == doubles,
+         "Short particle block%s\n", "");
+  assert(fread(snap.id, sizeof(size_t), parts.size, file) == parts.size,
+         "Short id block%s\n", "");
+  fclose(file);
+  remove("test-snap0000003.snap");
+
+  // Snapshots hold storage order; id maps each slot back to its particle.
+  for (size_t i = 0; i < snap.size; ++i) {
+    const Particle *p = parts.ptr + snap.id[i];
+    for (size_t d = 0; d < 3; ++d) {
+      assert(snap.p[d][i] == p->p[d] && snap.v[d][i] == p->v[d],
+             "Snapshot slot %lu disagrees with particle %lu\n", i,
+             snap.id[i]);
+    }
+    assert(snap.m[i] == p->m, "Snapshot slot %lu has the wrong mass\n", i);
+  }
+
+  free_particle_soa(&snap);
+  FREE_ARRAY(parts);
+}
+
+void restart_matches_straight_run() {
+  Particle_array_t straight = circular_orbits(2000);
+  Particle_array_t first = new_array_t(straight.size);
+  memcpy(first.ptr, straight.ptr, straight.size * sizeof(Particle));
+
+  SimOptions opts = default_sim_options();
+  simple_sim_opts(&straight, 1e-3, 4, &opts);
+
+  opts.checkpoint_interval = 2;
+  opts.checkpoint_path = "test-checkpoint.snap";
+  simple_sim_opts(&first, 1e-3, 2, &opts);
+  SnapshotHeader header;
+  Particle_array_t resumed = read_snapshot(opts.checkpoint_path, &header);
+  remove(opts.checkpoint_path);
+  assert_eq_size_t(header.step, 2);
+  assert(memcmp(first.ptr, resumed.ptr, first.size * sizeof(Particle)) == 0,
+         "Checkpoint does not hold the state it was written from%s\n", "");
+
+  opts.checkpoint_interval = 0;
+  opts.first_step = (int)header.step;
+  simple_sim_opts(&resumed, 1e-3, 2, &opts);
+  for (size_t i = 0; i < straight.size; ++i) {
+    assert(memcmp(straight.ptr + i, resumed.ptr + i, sizeof(Particle)) == 0,
+           "Particle %lu differs after restart\n", i);
+  }
+
+  FREE_ARRAY(straight);
+  FREE_ARRAY(first);
+  FREE_ARRAY(resumed);
+}
+
+// Largest relative change in orbital radius about the star over a run.
+double max_radius_drift(const Particle_array_t *before,
+                        const Particle_array_t *after) {
+  double worst = 0.0;
+  for (size_t i = 1; i < before->size; ++i) {
+    double r0 = 0.0, r1 = 0.0;
+    for (size_t d = 0; d < 3; ++d) {
+      double s0 = before->ptr[i].p[d] - before->ptr[0].p[d];
+      double s1 = after->ptr[i].p[d] - after->ptr[0].p[d];
+      r0 += s0 * s0;
+      r1 += s1 * s1;
+    }
+    double drift = fabs(sqrt(r1) - sqrt(r0)) / sqrt(r0);
+    worst = drift > worst ? drift : worst;
+  }
+  return worst;
+}
+
+void block_steps_track_fine_steps() {
+  Particle_array_t start = circular_orbits(2000);
+  Particle_array_t fine = new_array_t(start.size);
+  Particle_array_t block = new_array_t(start.size);
+  memcpy(fine.ptr, start.ptr, start.size * sizeof(Particle));
+  memcpy(block.ptr, start.ptr, start.size * sizeof(Particle));
+
+  // The finest block rung equals the fine run's global step.
+  SimOptions opts = default_sim_options();
+  simple_sim_opts(&fine, 1e-2 / 8, 8 * 8, &opts);
+  opts.max_rung = 3;
+  size_t evals = block_sim_opts(&block, 1e-2, 8, &opts);
+
+  // Most of the disk sits on the coarse rungs, and the leapfrog keeps the
+  // orbits at least as circular as the global first-order step.
+  assert(evals < 8 * 8 * block.size / 2,
+         "%lu force evaluations is not well below %lu\n", evals,
+         8 * 8 * block.size);
+  double fine_drift = max_radius_drift(&start, &fine);
+  double block_drift = max_radius_drift(&start, &block);
+  assert(block_drift <= fine_drift,
+         "Block orbits drift %g, more than the fine run's %g\n", block_drift,
+         fine_drift);
+
+  FREE_ARRAY(start);
+  FREE_ARRAY(fine);
+  FREE_ARRAY(block);
+}
+
+void node_arena_is_exact() {
+  for (size_t n = 1; n < 300; ++n) {
+    Particle_array_t parts = circular_orbits(n);
+    SimStats stats = {0, 0};
+    SimOptions opts = default_sim_options();
+    opts.stats = &stats;
+    opts.group_size = 16;
+    simple_sim_opts(&parts, 1e-3, 2, &opts);
+    assert_eq_size_t(stats.node_high_water, stats.node_capacity);
+    FREE_ARRAY(parts);
+  }
+}
+
+void parallel_matches_serial() {
+  Particle_array_t serial = circular_orbits(5000);
+  Particle_array_t parallel = new_array_t(serial.size);
+  memcpy(parallel.ptr, serial.ptr, serial.size * sizeof(Particle));
+
+  SimOptions opts = default_sim_options();
+  opts.build_task_depth = 0;
+  opts.threads = 1;
+  simple_sim_opts(&serial, 1e-3, 5, &opts);
+
+  opts.build_task_depth = 8;
+  opts.threads = 4;
+  opts.chunk_size = 7;
+  simple_sim_opts(&parallel, 1e-3, 5, &opts);
+
+  for (size_t i = 0; i < serial.size; ++i) {
+    assert(memcmp(serial.ptr + i, parallel.ptr + i, sizeof(Particle)) == 0,
+           "Particle %lu differs between serial and parallel runs", i);
+  }
+
+  FREE_ARRAY(serial);
+  FREE_ARRAY(parallel);
+}
+
 int main(int argc, char **argv) {
   if (argc != 2 || strcmp(argv[1], "single_node") == 0) {
     fprintf(stderr, "Running test: single_node\n");
@@ -143,5 +880,95 @@ int main(int argc, char **argv) {
     big_solar_with_steps();
   }
 
+  if (argc != 2 || strcmp(argv[1], "soa_round_trip") == 0) {
+    fprintf(stderr, "Running test: soa_round_trip\n");
+    soa_round_trip();
+  }
+
+  if (argc != 2 || strcmp(argv[1], "parallel_build_layout") == 0) {
+    fprintf(stderr, "Running test: parallel_build_layout\n");
+    parallel_build_layout();
+  }
+
+  if (argc != 2 || strcmp(argv[1], "morton_build_layout") == 0) {
+    fprintf(stderr, "Running test: morton_build_layout\n");
+    morton_build_layout();
+  }
+
+  if (argc != 2 || strcmp(argv[1], "contacts_match_brute_force") == 0) {
+    fprintf(stderr, "Running test: contacts_match_brute_force\n");
+    contacts_match_brute_force();
+  }
+
+  if (argc != 2 || strcmp(argv[1], "reordered_leaves") == 0) {
+    fprintf(stderr, "Running test: reordered_leaves\n");
+    reordered_leaves();
+  }
+
+  if (argc != 2 || strcmp(argv[1], "reordered_sim_matches") == 0) {
+    fprintf(stderr, "Running test: reordered_sim_matches\n");
+    reordered_sim_matches();
+  }
+
+  if (argc != 2 || strcmp(argv[1], "leaf_kernel_matches_direct") == 0) {
+    fprintf(stderr, "Running test: leaf_kernel_matches_direct\n");
+    leaf_kernel_matches_direct();
+  }
+
+  if (argc != 2 || strcmp(argv[1], "group_walk_accuracy") == 0) {
+    fprintf(stderr, "Running test: group_walk_accuracy\n");
+    group_walk_accuracy();
+  }
+
+  if (argc != 2 || strcmp(argv[1], "quadrupole_accuracy") == 0) {
+    fprintf(stderr, "Running test: quadrupole_accuracy\n");
+    quadrupole_accuracy();
+  }
+
+  if (argc != 2 || strcmp(argv[1], "compact_walk_matches_recursive") == 0) {
+    fprintf(stderr, "Running test: compact_walk_matches_recursive\n");
+    compact_walk_matches_recursive();
+  }
+
+  if (argc != 2 || strcmp(argv[1], "offload_matches_compact") == 0) {
+    fprintf(stderr, "Running test: offload_matches_compact\n");
+    offload_matches_compact();
+  }
+
+  if (argc != 2 || strcmp(argv[1], "dual_tree_tracks_direct_sum") == 0) {
+    fprintf(stderr, "Running test: dual_tree_tracks_direct_sum\n");
+    dual_tree_tracks_direct_sum();
+  }
+
+  if (argc != 2 || strcmp(argv[1], "refit_matches_build") == 0) {
+    fprintf(stderr, "Running test: refit_matches_build\n");
+    refit_matches_build();
+  }
+
+  if (argc != 2 || strcmp(argv[1], "snapshot_round_trip") == 0) {
+    fprintf(stderr, "Running test: snapshot_round_trip\n");
+    snapshot_round_trip();
+  }
+
+  if (argc != 2 || strcmp(argv[1], "restart_matches_straight_run") == 0) {
+    fprintf(stderr, "Running test: restart_matches_straight_run\n");
+    restart_matches_straight_run();
+  }
+
+  if (argc != 2 || strcmp(argv[1], "block_steps_track_fine_steps") == 0) {
+    fprintf(stderr, "Running test: block_steps_track_fine_steps\n");
+    block_steps_track_fine_steps();
+  }
+
+  if (argc != 2 || strcmp(argv[1], "node_arena_is_exact") == 0) {
+    fprintf(stderr, "Running test: node_arena_is_exact\n");
+    node_arena_is_exact();
+  }
+
+  if (argc != 2 || strcmp(argv[1], "parallel_matches_serial") == 0) {
+    fprintf(stderr, "Running test: parallel_matches_serial\n");
+    parallel_matches_serial();
+  }
+
   return EXIT_SUCCESS;
 }
@@ -9,28 +9,50 @@
 // - Processed 64 pixels at a time if width was a multiple of 64,
 //    thereby reducing writes to the bitmap.
 //
+// ver 3: AVX2 and AVX-512 kernels picked at run time. -ffp-contract=off
+//    keeps gcc from fusing the multiplies and adds into FMAs (which
+//    -mno-fma alone does not stop once AVX-512 is enabled), so every
+//    path gives the same bitmap as the Python version.
+//
+// ver 4: groups of pixels wholly inside the main cardioid or the
+//    period-2 bulb are set without iterating.
+//
+// ver 5: the kernel is picked through harness/cpu_dispatch.h and the
+//    build has no -march, so one binary runs on any x86-64 (CPU_KERNEL=sse2
+//    or avx2 forces a narrower one). The 2-wide kernel is plain vector
+//    extension code, which is SSE2 on x86-64 and NEON on aarch64, and a
+//    scalar one comes last, so the file also builds off x86.
+//
 // compile with following gcc flags
-//  -pipe -Wall -O3 -ffast-math -fno-finite-math-only -march=native -mfpmath=sse -msse3 -fopenmp
+//  -pipe -Wall -O3 -fomit-frame-pointer -ffp-contract=off -fno-finite-math-only -fopenmp
 
 
 #include <stdlib.h>
 #include <stdio.h>
 #include <unistd.h>
-#include <emmintrin.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
 
+#include "cpu_dispatch.h"
+#include "mandelbrot_render.h"
 
-long numDigits(long n)
-{
-    long len = 0;
-    while(n)
-    {
-        n=n/10;
-        len++;
-    }
-    return len;
-}
+// interior fast path, the cardioid/bulb test below;
+// -DINTERIOR_CULLING=0 turns it off
+#ifndef INTERIOR_CULLING
+#define INTERIOR_CULLING 1
+#endif
+
+// rows per band of the streamed bitmap
+#ifndef BAND_ROWS
+#define BAND_ROWS 16
+#endif
 
-inline long vec_nle(__m128d *v, double f)
+// two doubles, the layout of vec2d without needing x86
+typedef double vec2d __attribute__((vector_size(16)));
+
+
+inline long vec_nle(vec2d *v, double f)
 {
     return (v[0][0] <= f ||
         v[0][1] <= f ||
@@ -42,7 +64,7 @@ inline long vec_nle(__m128d *v, double f)
         v[3][1] <= f) ? 0 : -1;
 }
 
-inline void clrPixels_nle(__m128d *v, double f, unsigned long * pix8)
+inline void clrPixels_nle(vec2d *v, double f, unsigned long * pix8)
 {
     if(!(v[0][0] <= f)) *pix8 &= 0x7f;
     if(!(v[0][1] <= f)) *pix8 &= 0xbf;
@@ -54,13 +76,13 @@ inline void clrPixels_nle(__m128d *v, double f, unsigned long * pix8)
     if(!(v[3][1] <= f)) *pix8 &= 0xfe;
 }
 
-inline void calcSum(__m128d *r, __m128d *i, __m128d *sum, __m128d *init_r, __m128d init_i)
+inline void calcSum(vec2d *r, vec2d *i, vec2d *sum, vec2d *init_r, vec2d init_i)
 {
     for(long pair=0; pair<4; pair++)
     {
-        __m128d r2 = r[pair] * r[pair];
-        __m128d i2 = i[pair] * i[pair];
-        __m128d ri = r[pair] * i[pair];
+        vec2d r2 = r[pair] * r[pair];
+        vec2d i2 = i[pair] * i[pair];
+        vec2d ri = r[pair] * i[pair];
 
         sum[pair] = r2 + i2;
 
@@ -69,9 +91,9 @@ inline void calcSum(__m128d *r, __m128d *i, __m128d *sum, __m128d *init_r, __m12
     }
 }
 
-inline unsigned long mand8(__m128d *init_r, __m128d init_i)
+static inline unsigned long mand8(vec2d *init_r, vec2d init_i)
 {
-    __m128d r[4], i[4], sum[4];
+    vec2d r[4], i[4], sum[4];
     for(long pair=0; pair<4; pair++)
     {
         r[pair]=init_r[pair];
@@ -101,7 +123,7 @@ inline unsigned long mand8(__m128d *init_r, __m128d init_i)
     return pix8;
 }
 
-unsigned long mand64(__m128d *init_r, __m128d init_i)
+unsigned long mand64(vec2d *init_r, vec2d init_i)
 {
     unsigned long pix64 = 0;
 
@@ -118,6 +140,444 @@ unsigned long mand64(__m128d *init_r, __m128d init_i)
 
 
 
+// mand8/mand64 one pixel at a time with no vectors, for any CPU. The
+// operations and their order are the same, so is the bitmap.
+
+static inline void calcSum_scalar(double *r, double *i, double *sum, const double *cr, double ci)
+{
+    for(long k=0; k<8; k++)
+    {
+        double r2 = r[k] * r[k];
+        double i2 = i[k] * i[k];
+        double ri = r[k] * i[k];
+
+        sum[k] = r2 + i2;
+
+        r[k]=r2 - i2 + cr[k];
+        i[k]=ri + ri + ci;
+    }
+}
+
+static unsigned long mand8_scalar(vec2d *init_r, vec2d init_i)
+{
+    const double *cr = (const double *)init_r;
+    const double ci = init_i[0];
+    double r[8], i[8], sum[8];
+    for(long k=0; k<8; k++)
+    {
+        r[k]=cr[k];
+        i[k]=ci;
+    }
+
+    for (long j = 0; j < 6; j++)
+    {
+        for(long k=0; k<8; k++)
+            calcSum_scalar(r, i, sum, cr, ci);
+
+        // all 8 escaped: none of the sums is <= 4.0
+        long escaped = 1;
+        for(long k=0; k<8; k++)
+            escaped &= !(sum[k] <= 4.0);
+        if (escaped)
+            return 0;
+    }
+
+    calcSum_scalar(r, i, sum, cr, ci);
+    calcSum_scalar(r, i, sum, cr, ci);
+
+    unsigned long pix8 = 0;
+    for(long k=0; k<8; k++)
+        if (sum[k] <= 4.0) pix8 |= 0x80 >> k;
+
+    return pix8;
+}
+
+static unsigned long mand64_scalar(vec2d *init_r, vec2d init_i)
+{
+    unsigned long pix64 = 0;
+
+    for(long byte=0; byte<8; byte++)
+    {
+        unsigned long pix8 = mand8_scalar(init_r, init_i);
+
+        pix64 = (pix64 >> 8) | (pix8 << 56);
+        init_r += 4;
+    }
+
+    return pix64;
+}
+
+
+typedef unsigned long (*mand_func)(vec2d *init_r, vec2d init_i);
+
+#if defined(__x86_64__) || defined(__i386__)
+
+// AVX2 and AVX-512 versions of mand8/mand64, chosen at run time. They
+// do the same operations in the same order on 4 or 8 doubles per vector,
+// so the bitmap is bit-identical to the SSE2 one. init_r is the same
+// vec2d table, read as 8 consecutive doubles per byte.
+
+CPU_TARGET_AVX2
+static inline unsigned long mand8_avx2(vec2d *init_r, vec2d init_i)
+{
+    const double *ir = (const double *)init_r;
+    const __m256d four = _mm256_set1_pd(4.0);
+    __m256d cr[2], ci = _mm256_set1_pd(init_i[0]);
+    __m256d r[2], i[2], sum[2];
+    for(long quad=0; quad<2; quad++)
+    {
+        cr[quad] = _mm256_loadu_pd(ir + 4*quad);
+        r[quad] = cr[quad];
+        i[quad] = ci;
+    }
+
+    unsigned long pix8 = 0xff;
+
+    for (long j = 0; j < 6; j++)
+    {
+        for(long k=0; k<8; k++)
+            for(long quad=0; quad<2; quad++)
+            {
+                __m256d r2 = r[quad] * r[quad];
+                __m256d i2 = i[quad] * i[quad];
+                __m256d ri = r[quad] * i[quad];
+
+                sum[quad] = r2 + i2;
+
+                r[quad]=r2 - i2 + cr[quad];
+                i[quad]=ri + ri + ci;
+            }
+
+        // all 8 escaped: none of the sums is <= 4.0
+        if ((_mm256_movemask_pd(_mm256_cmp_pd(sum[0], four, _CMP_NLE_UQ)) &
+             _mm256_movemask_pd(_mm256_cmp_pd(sum[1], four, _CMP_NLE_UQ))) == 0xf)
+        {
+            pix8 = 0x00;
+            break;
+        }
+    }
+    if (pix8)
+    {
+        for(long k=0; k<2; k++)
+            for(long quad=0; quad<2; quad++)
+            {
+                __m256d r2 = r[quad] * r[quad];
+                __m256d i2 = i[quad] * i[quad];
+                __m256d ri = r[quad] * i[quad];
+
+                sum[quad] = r2 + i2;
+
+                r[quad]=r2 - i2 + cr[quad];
+                i[quad]=ri + ri + ci;
+            }
+
+        // lane k of the mask is pixel bit 0x80 >> k
+        unsigned long inside =
+            _mm256_movemask_pd(_mm256_cmp_pd(sum[0], four, _CMP_LE_OQ)) |
+            _mm256_movemask_pd(_mm256_cmp_pd(sum[1], four, _CMP_LE_OQ)) << 4;
+        pix8 = 0;
+        for(long k=0; k<8; k++)
+            if (inside & (1 << k)) pix8 |= 0x80 >> k;
+    }
+
+    return pix8;
+}
+
+// 32 pixels (4 bytes) as 8 independent vectors, so the dependency chains
+// of the iteration overlap; byte b of the result is vectors 2b, 2b+1
+CPU_TARGET_AVX2
+static inline unsigned long mand32_avx2(const double *ir, __m256d ci)
+{
+    const __m256d four = _mm256_set1_pd(4.0);
+    __m256d cr[8], r[8], i[8], sum[8];
+    for(long quad=0; quad<8; quad++)
+    {
+        cr[quad] = _mm256_loadu_pd(ir + 4*quad);
+        r[quad] = cr[quad];
+        i[quad] = ci;
+    }
+
+    for (long j = 0; j < 6; j++)
+    {
+        for(long k=0; k<8; k++)
+            for(long quad=0; quad<8; quad++)
+            {
+                __m256d r2 = r[quad] * r[quad];
+                __m256d i2 = i[quad] * i[quad];
+                __m256d ri = r[quad] * i[quad];
+
+                sum[quad] = r2 + i2;
+
+                r[quad]=r2 - i2 + cr[quad];
+                i[quad]=ri + ri + ci;
+            }
+
+        __m256d escaped = _mm256_cmp_pd(sum[0], four, _CMP_NLE_UQ);
+        for(long quad=1; quad<8; quad++)
+            escaped = _mm256_and_pd(escaped, _mm256_cmp_pd(sum[quad], four, _CMP_NLE_UQ));
+        if (_mm256_movemask_pd(escaped) == 0xf)
+            return 0;
+    }
+
+    for(long k=0; k<2; k++)
+        for(long quad=0; quad<8; quad++)
+        {
+            __m256d r2 = r[quad] * r[quad];
+            __m256d i2 = i[quad] * i[quad];
+            __m256d ri = r[quad] * i[quad];
+
+            sum[quad] = r2 + i2;
+
+            r[quad]=r2 - i2 + cr[quad];
+            i[quad]=ri + ri + ci;
+        }
+
+    unsigned long pix32 = 0;
+    for(long quad=0; quad<8; quad++)
+    {
+        unsigned long inside = _mm256_movemask_pd(_mm256_cmp_pd(sum[quad], four, _CMP_LE_OQ));
+        for(long k=0; k<4; k++)
+            if (inside & (1 << k))
+                pix32 |= (0x80UL >> (k + 4*(quad&1))) << (8*(quad>>1));
+    }
+
+    return pix32;
+}
+
+// escaped pixels stay escaped, so stopping only when all 64 have gives
+// the same bits as stopping per byte
+CPU_TARGET_AVX2
+static unsigned long mand64_avx2(vec2d *init_r, vec2d init_i)
+{
+    const double *ir = (const double *)init_r;
+    const __m256d ci = _mm256_set1_pd(init_i[0]);
+
+    return mand32_avx2(ir, ci) | mand32_avx2(ir + 32, ci) << 32;
+}
+
+CPU_TARGET_AVX512
+static inline unsigned long mand8_avx512(vec2d *init_r, vec2d init_i)
+{
+    const __m512d four = _mm512_set1_pd(4.0);
+    const __m512d cr = _mm512_loadu_pd((const double *)init_r);
+    const __m512d ci = _mm512_set1_pd(init_i[0]);
+    __m512d r = cr, i = ci, sum = four;
+
+    unsigned long pix8 = 0xff;
+
+    for (long j = 0; j < 6; j++)
+    {
+        for(long k=0; k<8; k++)
+        {
+            __m512d r2 = r * r;
+            __m512d i2 = i * i;
+            __m512d ri = r * i;
+
+            sum = r2 + i2;
+
+            r = r2 - i2 + cr;
+            i = ri + ri + ci;
+        }
+
+        // all 8 escaped: none of the sums is <= 4.0
+        if (_mm512_cmp_pd_mask(sum, four, _CMP_NLE_UQ) == 0xff)
+        {
+            pix8 = 0x00;
+            break;
+        }
+    }
+    if (pix8)
+    {
+        for(long k=0; k<2; k++)
+        {
+            __m512d r2 = r * r;
+            __m512d i2 = i * i;
+            __m512d ri = r * i;
+
+            sum = r2 + i2;
+
+            r = r2 - i2 + cr;
+            i = ri + ri + ci;
+        }
+
+        // lane k of the mask is pixel bit 0x80 >> k
+        __mmask8 inside = _mm512_cmp_pd_mask(sum, four, _CMP_LE_OQ);
+        pix8 = 0;
+        for(long k=0; k<8; k++)
+            if (inside & (1 << k)) pix8 |= 0x80 >> k;
+    }
+
+    return pix8;
+}
+
+// 64 pixels as 8 independent vectors, one per byte; as with AVX2 the
+// whole group stops once every pixel has escaped
+CPU_TARGET_AVX512
+static unsigned long mand64_avx512(vec2d *init_r, vec2d init_i)
+{
+    const double *ir = (const double *)init_r;
+    const __m512d four = _mm512_set1_pd(4.0);
+    const __m512d ci = _mm512_set1_pd(init_i[0]);
+    __m512d cr[8], r[8], i[8], sum[8];
+    for(long byte=0; byte<8; byte++)
+    {
+        cr[byte] = _mm512_loadu_pd(ir + 8*byte);
+        r[byte] = cr[byte];
+        i[byte] = ci;
+    }
+
+    for (long j = 0; j < 6; j++)
+    {
+        for(long k=0; k<8; k++)
+            for(long byte=0; byte<8; byte++)
+            {
+                __m512d r2 = r[byte] * r[byte];
+                __m512d i2 = i[byte] * i[byte];
+                __m512d ri = r[byte] * i[byte];
+
+                sum[byte] = r2 + i2;
+
+                r[byte]=r2 - i2 + cr[byte];
+                i[byte]=ri + ri + ci;
+            }
+
+        __mmask8 escaped = 0xff;
+        for(long byte=0; byte<8; byte++)
+            escaped &= _mm512_cmp_pd_mask(sum[byte], four, _CMP_NLE_UQ);
+        if (escaped == 0xff)
+            return 0;
+    }
+
+    for(long k=0; k<2; k++)
+        for(long byte=0; byte<8; byte++)
+        {
+            __m512d r2 = r[byte] * r[byte];
+            __m512d i2 = i[byte] * i[byte];
+            __m512d ri = r[byte] * i[byte];
+
+            sum[byte] = r2 + i2;
+
+            r[byte]=r2 - i2 + cr[byte];
+            i[byte]=ri + ri + ci;
+        }
+
+    unsigned long pix64 = 0;
+    for(long byte=0; byte<8; byte++)
+    {
+        __mmask8 inside = _mm512_cmp_pd_mask(sum[byte], four, _CMP_LE_OQ);
+        for(long k=0; k<8; k++)
+            if (inside & (1 << k))
+                pix64 |= (0x80UL >> k) << (8*byte);
+    }
+
+    return pix64;
+}
+
+#endif
+
+
+// best first; the 2-wide kernel is the compiler's own vectors, and the
+// scalar one runs anywhere
+typedef struct
+{
+    cpu_level level;
+    mand_func mand8, mand64;
+} mand_kernel;
+
+static const mand_kernel kernels[] =
+{
+#if defined(__x86_64__) || defined(__i386__)
+    {CPU_AVX512, mand8_avx512, mand64_avx512},
+    {CPU_AVX2,   mand8_avx2,   mand64_avx2},
+    {CPU_SSE2,   mand8,        mand64},
+#elif defined(__aarch64__)
+    {CPU_NEON,   mand8,        mand64},
+#endif
+    {CPU_SCALAR, mand8_scalar, mand64_scalar},
+};
+
+
+
+// Closed-form interior tests. Points of the main cardioid and of the
+// period-2 bulb never escape, so a group lying wholly inside them is set
+// without iterating. Checking the first point alone rejects most groups.
+
+static inline long in_main_bulbs(double x, double y)
+{
+    double y2 = y * y;
+    double q = (x - 0.25) * (x - 0.25) + y2;
+
+    return q * (q + (x - 0.25)) <= 0.25 * y2 ||
+        (x + 1.0) * (x + 1.0) + y2 <= 0.0625;
+}
+
+static long all_in_main_bulbs(vec2d *init_r, long count, double init_i)
+{
+    const double *ir = (const double *)init_r;
+
+    for(long x=0; x<count; x++)
+        if (!in_main_bulbs(ir[x], init_i))
+            return 0;
+
+    return -1;
+}
+
+
+
+// write all of buf, carrying on after partial writes; large bands can
+// exceed what a single write() takes
+static void writeAll(int fd, const void *buf, long len)
+{
+    const char *p = buf;
+    while (len > 0)
+    {
+        long ret = write(fd, p, len);
+        if (ret < 0)
+        {
+            perror("write");
+            exit(1);
+        }
+        p += ret;
+        len -= ret;
+    }
+}
+
+
+
+// render a size x size view around a centre with mandelbrot_bitmap and
+// write it as P4
+static int renderView(int argc, char ** argv)
+{
+    long size = atol(argv[1]);
+    mandelbrot_view view = {
+        .center_re = argv[2],
+        .center_im = argv[3],
+        .step = atof(argv[4]) / (size > 0 ? size : 1),
+        .width = size,
+        .height = size,
+        .max_iterations = argc >= 6 ? atol(argv[5]) : 50,
+        .mode = MANDELBROT_AUTO
+    };
+    long rowLength = (size + 7) / 8;
+    unsigned char *bits = malloc(size > 0 ? rowLength * size : 1);
+
+    if (!bits || mandelbrot_bitmap(&view, bits) != 0)
+    {
+        fprintf(stderr, "usage: %s size center_re center_im view_width [max_iterations]\n", argv[0]);
+        return 1;
+    }
+
+    char header[64];
+    long headerLength = sprintf(header, "P4\n%ld %ld\n", size, size);
+    writeAll(STDOUT_FILENO, header, headerLength);
+    writeAll(STDOUT_FILENO, bits, rowLength * size);
+
+    free(bits);
+    return 0;
+}
+
+
+
 int main(int argc, char ** argv)
 {
     // get width/height from arguments
@@ -130,72 +590,108 @@ int main(int argc, char ** argv)
     wid_ht = (wid_ht+7) & ~7;
 
 
-    // allocate memory for header and pixels
-
-    long headerLength = numDigits(wid_ht)*2+5;
-    long pad = ((headerLength + 7) & ~7) - headerLength; // pad aligns pixels on 8
-    long dataLength = headerLength + wid_ht*(wid_ht>>3);
-    unsigned char * const buffer = malloc(pad + dataLength);
-    unsigned char * const header = buffer + pad;
-    unsigned char * const pixels = header + headerLength;
+    // any other view goes through the general renderer:
+    //  ./a.out size center_re center_im view_width [max_iterations]
 
+    if (argc >= 5)
+        return renderView(argc, argv);
 
-    // generate the bitmap header
 
-    sprintf((char *)header, "P4\n%ld %ld\n", wid_ht, wid_ht);
+    // calculate initial values, store in r0, i0 (on the heap, so the
+    // stack does not limit the size)
 
-
-    // calculate initial values, store in r0, i0
-
-    __m128d r0[wid_ht/2];
-    double i0[wid_ht];
+    vec2d * const r0 = aligned_alloc(16, wid_ht/2 * sizeof(vec2d));
+    double * const i0 = malloc(wid_ht * sizeof(double));
+    if (!r0 || !i0)
+    {
+        perror("malloc");
+        return 1;
+    }
 
     for(long xy=0; xy<wid_ht; xy+=2)
     {
-        r0[xy>>1] = 2.0 / wid_ht * (__m128d){xy,  xy+1} - 1.5;
+        r0[xy>>1] = 2.0 / wid_ht * (vec2d){xy,  xy+1} - 1.5;
         i0[xy]    = 2.0 / wid_ht *  xy    - 1.0;
         i0[xy+1]  = 2.0 / wid_ht * (xy+1) - 1.0;
     }
 
 
-    // generate the bitmap
+    // pick the widest vectors the cpu has
+
+    const mand_kernel *kernel = CPU_PICK(kernels, NULL);
+    mand_func mand8_func = kernel->mand8, mand64_func = kernel->mand64;
+
+
+    // write the bitmap header
 
+    char header[64];
+    long headerLength = sprintf(header, "P4\n%ld %ld\n", wid_ht, wid_ht);
+    writeAll(STDOUT_FILENO, header, headerLength);
+
+
+    // generate and write the bitmap a band of rows at a time. Each thread
+    // fills its own band buffer and the bands are written in order while
+    // the other threads compute later ones, so memory stays at one band
+    // per thread whatever the size.
+
+    long rowLength = wid_ht/8;
+    long bands = (wid_ht + BAND_ROWS - 1) / BAND_ROWS;
     long use8 = wid_ht%64;
-    if (use8)
+
+    #pragma omp parallel
     {
-        // process 8 pixels (one byte) at a time    
-        #pragma omp parallel for schedule(guided)
-        for(long y=0; y<wid_ht; y++)
+        unsigned char * const pixels = aligned_alloc(8, BAND_ROWS*rowLength);
+        if (!pixels)
         {
-            __m128d init_i = (__m128d){i0[y], i0[y]};
-            long rowstart = y*wid_ht/8;
-            for(long x=0; x<wid_ht; x+=8)
-            {
-                pixels[rowstart + x/8] = mand8(r0+x/2, init_i);
-            }
+            perror("malloc");
+            exit(1);
         }
-    }
-    else
-    {
-        // process 64 pixels (8 bytes) at a time
-        #pragma omp parallel for schedule(guided)
-        for(long y=0; y<wid_ht; y++)
+
+        #pragma omp for ordered schedule(dynamic)
+        for(long band=0; band<bands; band++)
         {
-            __m128d init_i = (__m128d){i0[y], i0[y]};
-            long rowstart = y*wid_ht/64;
-            for(long x=0; x<wid_ht; x+=64)
+            long y0 = band*BAND_ROWS;
+            long rows = wid_ht - y0 < BAND_ROWS ? wid_ht - y0 : BAND_ROWS;
+
+            for(long y=y0; y<y0+rows; y++)
             {
-                ((unsigned long *)pixels)[rowstart + x/64] = mand64(r0+x/2, init_i);
+                vec2d init_i = (vec2d){i0[y], i0[y]};
+                unsigned char * const row = pixels + (y-y0)*rowLength;
+
+                if (use8)
+                {
+                    // process 8 pixels (one byte) at a time
+                    for(long x=0; x<wid_ht; x+=8)
+                    {
+                        if (INTERIOR_CULLING && all_in_main_bulbs(r0+x/2, 8, i0[y]))
+                            row[x/8] = 0xff;
+                        else
+                            row[x/8] = mand8_func(r0+x/2, init_i);
+                    }
+                }
+                else
+                {
+                    // process 64 pixels (8 bytes) at a time
+                    for(long x=0; x<wid_ht; x+=64)
+                    {
+                        if (INTERIOR_CULLING && all_in_main_bulbs(r0+x/2, 64, i0[y]))
+                            ((unsigned long *)row)[x/64] = ~0UL;
+                        else
+                            ((unsigned long *)row)[x/64] = mand64_func(r0+x/2, init_i);
+                    }
+                }
             }
-        }
-    }
 
-    // write the data
+            #pragma omp ordered
+            writeAll(STDOUT_FILENO, pixels, rows*rowLength);
+        }
 
-    long ret = ret = write(STDOUT_FILENO, header, dataLength);
+        free(pixels);
+    }
 
 
-    free(buffer);
+    free(r0);
+    free(i0);
 
     return 0;
 }
@@ -0,0 +1,46 @@
+// The Computer Language Benchmarks Game
+// https://salsa.debian.org/benchmarksgame-team/benchmarksgame/
+//
+// General mandelbrot renderer: any viewport, resolution and iteration
+// limit, giving escape counts or a P4 bitmap.
+//
+// Pixel (x, y) is c = center + ((x - width/2) * step, (y - height/2) * step),
+// with row 0 at the lowest imaginary part as in the benchmark. The centre
+// is given as decimal strings so deep zooms keep all their digits. step
+// is a double, which allows zooms down to about 1e-300.
+//
+// counts[y*width + x] is the number of iterations of z = z*z + c, from
+// z = 0, done while |z| <= 2, so max_iterations means the point did not
+// escape. The bitmap sets a bit for exactly those points.
+
+#ifndef MANDELBROT_RENDER_H
+#define MANDELBROT_RENDER_H
+
+#include <stdint.h>
+
+typedef enum
+{
+    MANDELBROT_AUTO,          // perturbation once doubles run out of digits
+    MANDELBROT_DIRECT,        // every pixel in double precision
+    MANDELBROT_PERTURBATION   // one GMP reference orbit, double deltas
+} mandelbrot_mode;
+
+typedef struct
+{
+    const char *center_re;    // decimal, any number of digits
+    const char *center_im;
+    double step;              // distance between neighbouring pixels
+    long width, height;       // resolution in pixels
+    long max_iterations;
+    mandelbrot_mode mode;
+} mandelbrot_view;
+
+// fill counts with width*height escape counts; returns 0, or -1 if the
+// view is invalid
+int mandelbrot_counts(const mandelbrot_view *view, uint32_t *counts);
+
+// fill bits with height rows of (width+7)/8 bytes, the P4 layout, bit set
+// for points that did not escape; returns 0, or -1 if the view is invalid
+int mandelbrot_bitmap(const mandelbrot_view *view, unsigned char *bits);
+
+#endif
@@ -2,194 +2,200 @@
 // https://salsa.debian.org/benchmarksgame-team/benchmarksgame/
 //
 // Converted from Python to C by Claude
+//
+// The image is cut into 2-D tiles that are computed straight into the
+// packed bitmap, so there is no per-row allocation or reordering. Each
+// tile's cost is estimated from a few sample points and the tiles are
+// dealt, heaviest first, to one work-stealing queue per thread: a thread
+// takes from the front of its own queue, and when that is empty steals
+// from the back of the others.
 
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
 #include <string.h>
 #include <pthread.h>
+#include <stdatomic.h>
 #include <unistd.h>
 #include <complex.h>
 
+// The original Python has 7 iterations of 7 iterations = 49 total
+#define MAX_ITERATIONS 49
+
+// Tile size: TILE_ROWS rows of TILE_BYTES bytes (8 pixels each)
+#define TILE_ROWS 64
+#define TILE_BYTES 32
+
+// Cost samples per tile side
+#define COST_SAMPLES 3
+
+// Structure to hold the image and the tile layout
+typedef struct {
+    int n;                  // Image size
+    int byte_count;         // Bytes per row
+    uint8_t* pixels;        // Packed bitmap, byte_count bytes per row
+    int tile_columns;       // Tiles across a row
+    int tile_count;         // Total tiles
+} Image;
+
+// Queue of tiles owned by one thread. The range [front, back) of
+// positions still to take is packed into one word, so the owner taking
+// from the front and thieves taking from the back agree with a single
+// compare-and-swap.
+typedef struct {
+    _Atomic uint64_t range;
+    char padding[64 - sizeof(uint64_t)]; // Keep queues on separate cache lines
+} TileQueue;
+
+// Structure to share the queues among the workers
+typedef struct {
+    Image* image;
+    const int* order;       // Tiles, position k of queue q at order[k*num_queues + q]
+    TileQueue* queues;
+    int num_queues;
+} TileScheduler;
+
 // Structure to hold thread arguments
 typedef struct {
-    int y;           // Row to compute
-    int n;           // Image size
-    uint8_t* result; // Buffer for result
-} RowTask;
+    TileScheduler* scheduler;
+    int id;                 // Index of the thread's own queue
+} Worker;
 
-// Structure to manage row ordering
+// Tile index with its estimated cost, for sorting
 typedef struct {
-    int n;                  // Image size
-    uint8_t** rows;         // Array of row buffers
-    pthread_mutex_t mutex;  // Mutex for thread safety
-    int next_row_to_output; // Next row to be output
-    int rows_completed;     // Count of completed rows
-    pthread_cond_t row_ready; // Condition variable for signaling
-} RowManager;
-
-// Initialize the row manager
-void init_row_manager(RowManager* manager, int n) {
-    manager->n = n;
-    manager->rows = (uint8_t**)calloc(n, sizeof(uint8_t*));
-    manager->next_row_to_output = 0;
-    manager->rows_completed = 0;
-    pthread_mutex_init(&manager->mutex, NULL);
-    pthread_cond_init(&manager->row_ready, NULL);
-}
+    int tile;
+    int cost;
+} TileCost;
+
+// Iterations before z escapes for c, or MAX_ITERATIONS if it stays bounded
+static int escape_time(double complex c) {
+    double complex z = c;
+    int i;
 
-// Clean up the row manager
-void destroy_row_manager(RowManager* manager) {
-    // Free any rows that might not have been output
-    for (int i = 0; i < manager->n; i++) {
-        free(manager->rows[i]);
+    for (i = 0; i < MAX_ITERATIONS; i++) {
+        z = z * z + c;
+        if (cabs(z) >= 2.0) break;
     }
-    free(manager->rows);
-    
-    pthread_mutex_destroy(&manager->mutex);
-    pthread_cond_destroy(&manager->row_ready);
+
+    return i;
 }
 
-// Compute pixels for a row
-uint8_t* compute_pixels(int y, int n) {
-    int byte_count = (n + 7) / 8;
-    uint8_t* row = (uint8_t*)calloc(byte_count, sizeof(uint8_t));
-    
+// Compute the 8 pixels of byte x/8 of row y
+static uint8_t compute_byte(int x, int y, int n) {
     double c1 = 2.0 / n;
     double complex c0 = -1.5 + I * (y * c1 - 1.0);
-    
+
     // Pixel bit patterns for each position in a byte
-    uint8_t pixel_bits[8] = {128, 64, 32, 16, 8, 4, 2, 1};
-    
-    for (int x = 0; x < n; x += 8) {
-        uint8_t pixel = 0;
-        double complex c = x * c1 + c0;
-        
-        for (int bit = 0; bit < 8 && x + bit < n; bit++) {
-            double complex z = c;
-            int i;
-            
-            // Unroll the loop for better performance
-            // The original Python has 7 iterations of 7 iterations = 49 total
-            for (i = 0; i < 49; i++) {
-                z = z * z + c;
-                if (cabs(z) >= 2.0) break;
-            }
-            
-            // If we didn't escape, set the corresponding bit
-            if (i == 49) {
-                pixel |= pixel_bits[bit];
-            }
-            
-            c += c1;
+    static const uint8_t pixel_bits[8] = {128, 64, 32, 16, 8, 4, 2, 1};
+
+    uint8_t pixel = 0;
+    double complex c = x * c1 + c0;
+
+    for (int bit = 0; bit < 8 && x + bit < n; bit++) {
+        // If we didn't escape, set the corresponding bit
+        if (escape_time(c) == MAX_ITERATIONS) {
+            pixel |= pixel_bits[bit];
         }
-        
-        // Store the computed byte
-        row[x/8] = pixel;
-    }
-    
-    // Clear any unused bits in the last byte
-    if (n % 8 != 0) {
-        row[byte_count-1] &= 0xff << (8 - n % 8);
+
+        c += c1;
     }
-    
-    return row;
+
+    return pixel;
 }
 
-// Compute a row and store it in the row manager
-void* compute_row(void* arg) {
-    RowTask* task = (RowTask*)arg;
-    int y = task->y;
-    int n = task->n;
-    
-    // Compute the row
-    uint8_t* row = compute_pixels(y, n);
-    
-    // Store the result in the task's result buffer
-    memcpy(task->result, row, (n + 7) / 8);
-    
-    // Free temporary buffer
-    free(row);
-    
-    // Thread is done with this task
-    free(task);
-    return NULL;
+// Bounds of a tile: rows [y0, y1) and bytes [b0, b1)
+static void tile_bounds(const Image* image, int tile, int* y0, int* y1, int* b0, int* b1) {
+    *y0 = tile / image->tile_columns * TILE_ROWS;
+    *b0 = tile % image->tile_columns * TILE_BYTES;
+    *y1 = *y0 + TILE_ROWS < image->n ? *y0 + TILE_ROWS : image->n;
+    *b1 = *b0 + TILE_BYTES < image->byte_count ? *b0 + TILE_BYTES : image->byte_count;
 }
 
-// Thread pool worker function
-void* worker_thread(void* arg) {
-    RowManager* manager = (RowManager*)arg;
-    int n = manager->n;
-    
-    while (1) {
-        // Get the next row to compute
-        int y;
-        pthread_mutex_lock(&manager->mutex);
-        
-        // Find an uncomputed row
-        y = manager->rows_completed;
-        if (y >= n) {
-            // All rows have been assigned
-            pthread_mutex_unlock(&manager->mutex);
-            break;
+// Compute one tile into the bitmap
+static void render_tile(Image* image, int tile) {
+    int y0, y1, b0, b1;
+    tile_bounds(image, tile, &y0, &y1, &b0, &b1);
+
+    for (int y = y0; y < y1; y++) {
+        uint8_t* row = image->pixels + (size_t)y * image->byte_count;
+        for (int b = b0; b < b1; b++) {
+            row[b] = compute_byte(b * 8, y, image->n);
         }
-        
-        // Mark this row as being computed
-        manager->rows_completed++;
-        pthread_mutex_unlock(&manager->mutex);
-        
-        // Allocate memory for the row result
-        int byte_count = (n + 7) / 8;
-        uint8_t* row_result = (uint8_t*)malloc(byte_count);
-        
-        // Compute the row
-        RowTask task = {y, n, row_result};
-        compute_row(&task);
-        
-        // Store the result and signal that a row is ready
-        pthread_mutex_lock(&manager->mutex);
-        manager->rows[y] = row_result;
-        pthread_cond_signal(&manager->row_ready);
-        pthread_mutex_unlock(&manager->mutex);
-    }
-    
-    return NULL;
+    }
 }
 
-// Output thread function
-void* output_thread(void* arg) {
-    RowManager* manager = (RowManager*)arg;
-    int n = manager->n;
-    int byte_count = (n + 7) / 8;
-    
-    // Write PBM header
-    printf("P4\n%d %d\n", n, n);
-    
-    // Output rows in order
-    while (manager->next_row_to_output < n) {
-        pthread_mutex_lock(&manager->mutex);
-        
-        // Wait until the next row is ready
-        while (manager->next_row_to_output < n && 
-               manager->rows[manager->next_row_to_output] == NULL) {
-            pthread_cond_wait(&manager->row_ready, &manager->mutex);
+// Estimate the cost of a tile from a grid of sample points; interior
+// points run all MAX_ITERATIONS and dominate
+static int estimate_cost(const Image* image, int tile) {
+    int y0, y1, b0, b1;
+    tile_bounds(image, tile, &y0, &y1, &b0, &b1);
+
+    int x0 = b0 * 8, x1 = b1 * 8 < image->n ? b1 * 8 : image->n;
+    double c1 = 2.0 / image->n;
+    int cost = 0;
+
+    for (int i = 0; i < COST_SAMPLES; i++) {
+        int y = y0 + (y1 - 1 - y0) * i / (COST_SAMPLES - 1);
+        for (int j = 0; j < COST_SAMPLES; j++) {
+            int x = x0 + (x1 - 1 - x0) * j / (COST_SAMPLES - 1);
+            cost += escape_time(x * c1 - 1.5 + I * (y * c1 - 1.0));
         }
-        
-        if (manager->next_row_to_output < n) {
-            uint8_t* row = manager->rows[manager->next_row_to_output];
-            manager->rows[manager->next_row_to_output] = NULL; // Mark as output
-            manager->next_row_to_output++;
-            
-            pthread_mutex_unlock(&manager->mutex);
-            
-            // Write the row to stdout
-            fwrite(row, 1, byte_count, stdout);
-            free(row);
+    }
+
+    return cost;
+}
+
+// Heaviest first, then in image order
+static int compare_cost(const void* a, const void* b) {
+    const TileCost* ta = (const TileCost*)a;
+    const TileCost* tb = (const TileCost*)b;
+    if (ta->cost != tb->cost) return tb->cost - ta->cost;
+    return ta->tile - tb->tile;
+}
+
+// Take the tile at the front (owner) or back (thief) of a queue, or -1
+// if it is empty
+static int take_tile(TileScheduler* scheduler, int q, int from_back) {
+    TileQueue* queue = &scheduler->queues[q];
+    uint64_t range = atomic_load(&queue->range);
+
+    for (;;) {
+        uint32_t front = range >> 32, back = (uint32_t)range;
+        if (front >= back) return -1;
+
+        uint32_t position;
+        uint64_t taken;
+        if (from_back) {
+            position = back - 1;
+            taken = (uint64_t)front << 32 | position;
         } else {
-            pthread_mutex_unlock(&manager->mutex);
+            position = front;
+            taken = (uint64_t)(front + 1) << 32 | back;
+        }
+
+        if (atomic_compare_exchange_weak(&queue->range, &range, taken)) {
+            return scheduler->order[(size_t)position * scheduler->num_queues + q];
+        }
+    }
+}
+
+// Thread pool worker function
+void* worker_thread(void* arg) {
+    Worker* worker = (Worker*)arg;
+    TileScheduler* scheduler = worker->scheduler;
+    int tile;
+
+    // Work through our own queue, then steal until every queue is empty
+    while ((tile = take_tile(scheduler, worker->id, 0)) >= 0) {
+        render_tile(scheduler->image, tile);
+    }
+    for (int i = 1; i < scheduler->num_queues; i++) {
+        int victim = (worker->id + i) % scheduler->num_queues;
+        while ((tile = take_tile(scheduler, victim, 1)) >= 0) {
+            render_tile(scheduler->image, tile);
         }
     }
-    
+
     return NULL;
 }
 
@@ -199,43 +205,82 @@ int main(int argc, char* argv[]) {
         fprintf(stderr, "Usage: %s <size>\n", argv[0]);
         return 1;
     }
-    
+
     // Parse image size
     int n = atoi(argv[1]);
     if (n <= 0) {
         fprintf(stderr, "Size must be a positive integer\n");
         return 1;
     }
-    
-    // Initialize row manager
-    RowManager manager;
-    init_row_manager(&manager, n);
-    
+
+    // Allocate the bitmap and lay out the tiles
+    Image image;
+    image.n = n;
+    image.byte_count = (n + 7) / 8;
+    image.pixels = (uint8_t*)malloc((size_t)image.byte_count * n);
+    image.tile_columns = (image.byte_count + TILE_BYTES - 1) / TILE_BYTES;
+    image.tile_count = image.tile_columns * ((n + TILE_ROWS - 1) / TILE_ROWS);
+    if (!image.pixels) {
+        fprintf(stderr, "Out of memory\n");
+        return 1;
+    }
+
+    // Sort the tiles by estimated cost
+    TileCost* costs = (TileCost*)malloc(image.tile_count * sizeof(TileCost));
+    for (int t = 0; t < image.tile_count; t++) {
+        costs[t].tile = t;
+        costs[t].cost = estimate_cost(&image, t);
+    }
+    qsort(costs, image.tile_count, sizeof(TileCost), compare_cost);
+
     // Determine number of threads to use (number of CPU cores)
     int num_threads = sysconf(_SC_NPROCESSORS_ONLN);
     if (num_threads <= 0) num_threads = 1;
-    
-    // Create worker threads
+    if (num_threads > image.tile_count) num_threads = image.tile_count;
+
+    // Deal the sorted tiles round-robin, so every queue starts with its
+    // share of the heaviest ones
+    int* order = (int*)malloc(image.tile_count * sizeof(int));
+    for (int t = 0; t < image.tile_count; t++) {
+        order[t] = costs[t].tile;
+    }
+    free(costs);
+
+    TileQueue* queues = (TileQueue*)aligned_alloc(64, num_threads * sizeof(TileQueue));
+    for (int q = 0; q < num_threads; q++) {
+        uint32_t length = (image.tile_count - q + num_threads - 1) / num_threads;
+        atomic_init(&queues[q].range, length);
+    }
+
+    TileScheduler scheduler = {&image, order, queues, num_threads};
+
+    // Create worker threads; the main thread works the first queue
     pthread_t* threads = (pthread_t*)malloc(num_threads * sizeof(pthread_t));
+    Worker* workers = (Worker*)malloc(num_threads * sizeof(Worker));
     for (int i = 0; i < num_threads; i++) {
-        pthread_create(&threads[i], NULL, worker_thread, &manager);
+        workers[i].scheduler = &scheduler;
+        workers[i].id = i;
     }
-    
-    // Create output thread
-    pthread_t output_thread_id;
-    pthread_create(&output_thread_id, NULL, output_thread, &manager);
-    
+    for (int i = 1; i < num_threads; i++) {
+        pthread_create(&threads[i], NULL, worker_thread, &workers[i]);
+    }
+    worker_thread(&workers[0]);
+
     // Wait for worker threads to complete
-    for (int i = 0; i < num_threads; i++) {
+    for (int i = 1; i < num_threads; i++) {
         pthread_join(threads[i], NULL);
     }
-    
-    // Wait for output thread
-    pthread_join(output_thread_id, NULL);
-    
+
+    // Write PBM header and the bitmap
+    printf("P4\n%d %d\n", n, n);
+    fwrite(image.pixels, 1, (size_t)image.byte_count * n, stdout);
+
     // Clean up
-    destroy_row_manager(&manager);
+    free(image.pixels);
+    free(order);
+    free(queues);
     free(threads);
-    
+    free(workers);
+
     return 0;
-}
\ No newline at end of file
+}
@@ -0,0 +1,324 @@
+/* The Computer Language Benchmarks Game
+ * https://salsa.debian.org/benchmarksgame-team/benchmarksgame/
+ *
+ * contributed by Miles
+ *
+ * nbody.c for an ensemble of independent systems of the same number of
+ * bodies. Instead of packing (0,x,y,z) of one body into a vector, each
+ * coordinate of a body is a vector over LANES = 8 systems, so every lane
+ * does useful work and a block of 8 systems takes the step of nbody.c
+ * together: one zmm register per quantity with AVX-512, two ymm with
+ * AVX2. As in nbody-n.c the loops are compiled once per kernel and the
+ * best the CPU supports is picked at startup (NBODY_KERNEL=name picks
+ * another), and with OpenMP the blocks are split between threads.
+ *
+ * usage: nbody-ensemble steps [states [energies]]
+ *        nbody-ensemble jovian count [spread [seed]]
+ *
+ * The states (stdin by default) are a line "systems bodies" and then, for
+ * each system, a line "m x y z vx vy vz" per body in the units of nbody.c's
+ * constants: solar masses, AU and AU per day. The momentum of each system
+ * is offset onto its first body as nbody.c does. The energies (stdout by
+ * default) are a line "system before after" per system after steps of
+ * 0.01 years.
+ *
+ * "jovian" writes such a file of count copies of nbody.c's system with
+ * every position and velocity scaled by 1 + spread * u, u uniform in
+ * [-1, 1), from the seed. The first copy is always unperturbed.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+
+#include "cpu_dispatch.h"
+
+#define PI 3.141592653589793
+#define SOLAR_MASS (4 * PI * PI)
+#define DAYS_PER_YEAR 365.24
+
+// Systems per block
+#define LANES 8
+
+typedef double vec8 __attribute__((vector_size(LANES * sizeof(double))));
+
+// The loops below are inlined into each kernel's own copies of energy and
+// advance so they are compiled for that kernel's target.
+#define LOOPS static inline __attribute__((always_inline))
+
+// Replaces x by 1/sqrt(x), to < 1e-9 relative error
+typedef void rsqrt_fn(vec8 *x);
+
+static void rsqrt_scalar(vec8 *x) {
+    for (int k = 0; k < LANES; k++)
+        (*x)[k] = 1.0 / sqrt((*x)[k]);
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+// utilize vrsqrtps to compute an approximation of 1/sqrt(x) with float,
+// cast back to double and refine using a variation of
+// Goldschmidt’s algorithm to get < 1e-9 error
+__attribute__((target("avx2")))
+static inline __m256d _mm256_rsqrt_pd(__m256d s) {
+    __m128 q = _mm256_cvtpd_ps(s);
+    q = _mm_rsqrt_ps(q);
+    __m256d x = _mm256_cvtps_pd(q);
+    __m256d y = s * x * x;
+    __m256d a = _mm256_mul_pd(y, _mm256_set1_pd(0.375));
+    a = _mm256_mul_pd(a, y);
+    __m256d b = _mm256_mul_pd(y, _mm256_set1_pd(1.25));
+    b = _mm256_sub_pd(b, _mm256_set1_pd(1.875));
+    y = _mm256_sub_pd(a, b);
+    x = _mm256_mul_pd(x, y);
+    return x;
+}
+
+__attribute__((target("avx2")))
+static inline void rsqrt_avx2(vec8 *x) {
+    double *d = (double *)x;
+    _mm256_store_pd(d, _mm256_rsqrt_pd(_mm256_load_pd(d)));
+    _mm256_store_pd(d+4, _mm256_rsqrt_pd(_mm256_load_pd(d+4)));
+}
+
+// vrsqrt14pd is good to 2^-14, so the same refinement is well under 1e-9
+__attribute__((target("avx512f")))
+static inline void rsqrt_avx512(vec8 *x) {
+    __m512d s = _mm512_load_pd(x);
+    __m512d r = _mm512_rsqrt14_pd(s);
+    __m512d y = s * r * r;
+    __m512d a = y * _mm512_set1_pd(0.375) * y;
+    __m512d b = y * _mm512_set1_pd(1.25) - _mm512_set1_pd(1.875);
+    _mm512_store_pd(x, r * (a - b));
+}
+#endif
+
+// LANES systems of n bodies, body k of lane q being m[k][q], p[k][axis][q]
+// and v[k][axis][q]
+typedef struct {
+    vec8 *m;
+    vec8 (*p)[3];
+    vec8 (*v)[3];
+} block;
+
+LOOPS void energy_loops(int n, const block *b, vec8 *e, rsqrt_fn *rsqrt) {
+    vec8 sum = {0.0};
+    for (int i = 0; i < n; i++) {
+        const vec8 *v = b->v[i];
+        sum += 0.5 * b->m[i] * (v[0] * v[0] + (v[1] * v[1] + v[2] * v[2]));
+    }
+    for (int i = 1; i < n; i++)
+        for (int j = 0; j < i; j++) {
+            vec8 dx = b->p[i][0] - b->p[j][0];
+            vec8 dy = b->p[i][1] - b->p[j][1];
+            vec8 dz = b->p[i][2] - b->p[j][2];
+            vec8 w = dx * dx + (dy * dy + dz * dz);
+            rsqrt(&w);
+            sum -= b->m[i] * b->m[j] * w;
+        }
+    *e = sum;
+}
+
+// The kick then drift of nbody.c, with the pairs in its order
+LOOPS void advance_loops(int steps, int n, double dt, block *b, rsqrt_fn *rsqrt) {
+    const vec8 *restrict m = b->m;
+    vec8 (*restrict p)[3] = b->p;
+    vec8 (*restrict v)[3] = b->v;
+    for (int step = 0; step < steps; step++) {
+        for (int i = 1; i < n; i++)
+            for (int j = 0; j < i; j++) {
+                vec8 d[3];
+                for (int a = 0; a < 3; a++)
+                    d[a] = p[i][a] - p[j][a];
+                vec8 w = d[0] * d[0] + (d[1] * d[1] + d[2] * d[2]);
+                rsqrt(&w);
+                w = w * w * (w * dt);
+                for (int a = 0; a < 3; a++) {
+                    vec8 tk = d[a] * w;
+                    v[i][a] -= tk * m[j];
+                    v[j][a] += tk * m[i];
+                }
+            }
+
+        for (int i = 0; i < n; i++)
+            for (int a = 0; a < 3; a++)
+                p[i][a] += v[i][a] * dt;
+    }
+}
+
+// energy and advance for one rsqrt kernel, compiled for its target
+#define KERNEL_FUNCTIONS(isa, attr)                                               \
+    attr static void energy_##isa(int n, const block *b, vec8 *e) {               \
+        energy_loops(n, b, e, rsqrt_##isa);                                       \
+    }                                                                             \
+    attr static void advance_##isa(int steps, int n, double dt, block *b) {       \
+        advance_loops(steps, n, dt, b, rsqrt_##isa);                              \
+    }
+
+typedef struct {
+    cpu_level level;
+    void (*energy)(int n, const block *b, vec8 *e);
+    void (*advance)(int steps, int n, double dt, block *b);
+} ensemble_kernel;
+
+#define KERNEL_ENTRY(isa, level) {level, energy_##isa, advance_##isa}
+
+KERNEL_FUNCTIONS(scalar, )
+
+#if defined(__x86_64__) || defined(__i386__)
+KERNEL_FUNCTIONS(avx2, CPU_TARGET_AVX2)
+KERNEL_FUNCTIONS(avx512, CPU_TARGET_AVX512)
+#endif
+
+// Best first
+static const ensemble_kernel kernels[] = {
+#if defined(__x86_64__) || defined(__i386__)
+    KERNEL_ENTRY(avx512, CPU_AVX512),
+    KERNEL_ENTRY(avx2, CPU_AVX2),
+#endif
+    KERNEL_ENTRY(scalar, CPU_SCALAR),
+};
+
+// The kernel named by NBODY_KERNEL or CPU_KERNEL, or else the best one the
+// CPU supports
+static const ensemble_kernel *pick_kernel(void) {
+    return CPU_PICK(kernels, "NBODY_KERNEL");
+}
+
+// The Jovian bodies of nbody.c as m x y z vx vy vz
+static const double jovian[5][7] = {
+    // sun
+    {1.0, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0},
+    // jupiter
+    {9.54791938424326609e-04,
+      4.84143144246472090e+00, -1.16032004402742839e+00, -1.03622044471123109e-01,
+      1.66007664274403694e-03,  7.69901118419740425e-03, -6.90460016972063023e-05},
+    // saturn
+    {2.85885980666130812e-04,
+      8.34336671824457987e+00,  4.12479856412430479e+00, -4.03523417114321381e-01,
+     -2.76742510726862411e-03,  4.99852801234917238e-03,  2.30417297573763929e-05},
+    // uranus
+    {4.36624404335156298e-05,
+      1.28943695621391310e+01, -1.51111514016986312e+01, -2.23307578892655734e-01,
+      2.96460137564761618e-03,  2.37847173959480950e-03, -2.96589568540237556e-05},
+    // neptune
+    {5.15138902046611451e-05,
+      1.53796971148509165e+01, -2.59193146099879641e+01,  1.79258772950371181e-01,
+      2.68067772490389322e-03,  1.62824170038242295e-03, -9.51592254519715870e-05},
+};
+
+static int write_jovian(int count, double spread, unsigned long long seed) {
+    printf("%d 5\n", count);
+    for (int s = 0; s < count; s++)
+        for (int k = 0; k < 5; k++) {
+            printf("%.17g", jovian[k][0]);
+            for (int a = 1; a < 7; a++) {
+                seed = seed * 6364136223846793005ULL + 1442695040888963407ULL;
+                double u = 2.0 * ((seed >> 11) * (1.0 / 9007199254740992.0)) - 1.0;
+                printf(" %.17g", s == 0 ? jovian[k][a] : jovian[k][a] * (1.0 + spread * u));
+            }
+            printf("\n");
+        }
+    return 0;
+}
+
+static FILE *open_or_die(const char *path, const char *mode) {
+    FILE *f = fopen(path, mode);
+    if (f == NULL) {
+        fprintf(stderr, "cannot open %s\n", path);
+        exit(EXIT_FAILURE);
+    }
+    return f;
+}
+
+int main(int argc, char *argv[]) {
+    if (argc < 2 || (strcmp(argv[1], "jovian") == 0 && argc < 3)) {
+        fprintf(stderr, "usage: %s steps [states [energies]]\n"
+                        "       %s jovian count [spread [seed]]\n", argv[0], argv[0]);
+        return EXIT_FAILURE;
+    }
+    if (strcmp(argv[1], "jovian") == 0)
+        return write_jovian(atoi(argv[2]), argc > 3 ? atof(argv[3]) : 1e-3,
+                            argc > 4 ? strtoull(argv[4], NULL, 10) : 42);
+
+    int steps = atoi(argv[1]);
+    FILE *in = argc > 2 ? open_or_die(argv[2], "r") : stdin;
+    FILE *out = argc > 3 ? open_or_die(argv[3], "w") : stdout;
+
+    int systems, n;
+    if (fscanf(in, "%d %d", &systems, &n) != 2 || systems < 1 || n < 2) {
+        fprintf(stderr, "states must start with \"systems bodies\"\n");
+        return EXIT_FAILURE;
+    }
+
+    // Per block: n masses, then 3n positions and 3n velocities
+    int blocks = (systems + LANES - 1) / LANES;
+    size_t per_block = (size_t)7 * n;
+    vec8 *data = aligned_alloc(sizeof(vec8), blocks * per_block * sizeof(vec8));
+    double (*e)[2] = malloc(blocks * LANES * sizeof(*e));
+    if (data == NULL || e == NULL) {
+        fprintf(stderr, "out of memory\n");
+        return EXIT_FAILURE;
+    }
+
+    for (int s = 0; s < systems; s++) {
+        vec8 *b = data + s / LANES * per_block;
+        int q = s % LANES;
+        for (int k = 0; k < n; k++) {
+            double x[7];
+            for (int a = 0; a < 7; a++)
+                if (fscanf(in, "%lf", &x[a]) != 1) {
+                    fprintf(stderr, "states end in system %d\n", s);
+                    return EXIT_FAILURE;
+                }
+            b[k][q] = x[0] * SOLAR_MASS;
+            for (int a = 0; a < 3; a++) {
+                b[n + 3 * k + a][q] = x[1 + a];
+                b[4 * n + 3 * k + a][q] = x[4 + a] * DAYS_PER_YEAR;
+            }
+        }
+
+        // offset momentum
+        for (int a = 0; a < 3; a++) {
+            double o = 0.0;
+            for (int k = 0; k < n; k++)
+                o += b[k][q] * b[4 * n + 3 * k + a][q];
+            b[4 * n + a][q] = o * (-1.0 / SOLAR_MASS);
+        }
+    }
+
+    // The lanes past the last system repeat it, so they stay finite.
+    vec8 *last = data + (blocks - 1) * per_block;
+    for (int q = (systems - 1) % LANES + 1; q < LANES; q++)
+        for (size_t k = 0; k < per_block; k++)
+            last[k][q] = last[k][(systems - 1) % LANES];
+    if (in != stdin)
+        fclose(in);
+
+    const ensemble_kernel *kern = pick_kernel();
+    #pragma omp parallel for schedule(dynamic, 1)
+    for (int k = 0; k < blocks; k++) {
+        vec8 *d = data + k * per_block;
+        block b = {d, (vec8 (*)[3])(d + n), (vec8 (*)[3])(d + 4 * n)};
+        vec8 before, after;
+        kern->energy(n, &b, &before);
+        kern->advance(steps, n, 0.01, &b);
+        kern->energy(n, &b, &after);
+        for (int q = 0; q < LANES; q++) {
+            e[k * LANES + q][0] = before[q];
+            e[k * LANES + q][1] = after[q];
+        }
+    }
+
+    for (int s = 0; s < systems; s++)
+        fprintf(out, "%d %.9f %.9f\n", s, e[s][0], e[s][1]);
+    if (out != stdout)
+        fclose(out);
+
+    free(data);
+    free(e);
+    return 0;
+}
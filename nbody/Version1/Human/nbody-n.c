@@ -0,0 +1,666 @@
+/* The Computer Language Benchmarks Game
+ * https://salsa.debian.org/benchmarksgame-team/benchmarksgame/
+ *
+ * contributed by Miles
+ *
+ * nbody.c with the number of bodies chosen at run time. The rsqrt kernel
+ * and the (0,x,y,z) vector layout are the same, but the pairs are taken
+ * a tile of TILE x TILE bodies at a time so their separations stay in L1
+ * or L2 for any N. With N = 5 there is one tile whose pairs come in the
+ * order of nbody.c, so the energies printed are the same.
+ *
+ * Built with OpenMP, systems of at least PARALLEL_MIN_N bodies are
+ * advanced by advance_threaded instead, which splits the bodies i between
+ * threads.
+ *
+ * The bodies are GCC vector extension types rather than __m256d so the
+ * code also builds for aarch64, and only the batched rsqrt is written per
+ * instruction set: the vrsqrtps kernel of nbody.c for AVX2, vrsqrt14pd
+ * for AVX-512, and frsqrte with Newton steps for NEON and SVE. Each
+ * kernel gets its own copy of the loops compiled for its target, and the
+ * best one the CPU supports is picked at startup, so the binary needs no
+ * -march. NBODY_KERNEL=name in the environment picks another one.
+ *
+ * The step is nbody.c's kick then drift by default, or a leapfrog or one
+ * of Yoshida's fourth and sixth order compositions of it, which reach the
+ * same energy error with far fewer force evaluations. "accuracy" prints
+ * the energy error and time of each for a range of dt.
+ *
+ * usage: nbody-n steps [N [euler|leapfrog|yoshida4|yoshida6]]
+ *        nbody-n accuracy years [N]
+ * N = 5 (the default) is the Jovian system of nbody.c. Larger N add
+ * N - 5 light bodies on near circular orbits between 2 and 40 AU.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#elif defined(__aarch64__)
+#include <arm_neon.h>
+#ifndef NBODY_NO_SVE
+#include <arm_sve.h>
+#endif
+#endif
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+#include "cpu_dispatch.h"
+
+#define PI 3.141592653589793
+#define SOLAR_MASS (4 * PI * PI)
+#define DAYS_PER_YEAR 365.24
+
+// Bodies per side of a tile. A tile has at most TILE * TILE pairs, so its
+// separations take TILE * TILE * 32 bytes.
+#ifndef TILE
+#define TILE 32
+#endif
+#define TILE_PAIRS (TILE * TILE)
+
+// Smallest N that advance_threaded is used for
+#ifndef PARALLEL_MIN_N
+#define PARALLEL_MIN_N 512
+#endif
+
+// (0, x, y, z), as __m256d was
+typedef double vec4 __attribute__((vector_size(32)));
+
+// The loops below are inlined into each kernel's own copies of energy and
+// advance so they are compiled for that kernel's target.
+#define LOOPS static inline __attribute__((always_inline))
+
+// Replaces x[0..n) by 1/sqrt(x), to < 1e-9 relative error
+typedef void rsqrt_fn(double *x, int n);
+
+static void rsqrt_scalar(double *x, int n) {
+    for (int k = 0; k < n; k++)
+        x[k] = 1.0 / sqrt(x[k]);
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+// utilize vrsqrtps to compute an approximation of 1/sqrt(x) with float,
+// cast back to double and refine using a variation of
+// Goldschmidt’s algorithm to get < 1e-9 error
+__attribute__((target("avx2")))
+static inline __m256d _mm256_rsqrt_pd(__m256d s) {
+    __m128 q = _mm256_cvtpd_ps(s);
+    q = _mm_rsqrt_ps(q);
+    __m256d x = _mm256_cvtps_pd(q);
+    __m256d y = s * x * x;
+    __m256d a = _mm256_mul_pd(y, _mm256_set1_pd(0.375));
+    a = _mm256_mul_pd(a, y);
+    __m256d b = _mm256_mul_pd(y, _mm256_set1_pd(1.25));
+    b = _mm256_sub_pd(b, _mm256_set1_pd(1.875));
+    y = _mm256_sub_pd(a, b);
+    x = _mm256_mul_pd(x, y);
+    return x;
+}
+
+// The last partial group of four is padded with 1.0 and stored masked, so
+// x needs no slack.
+__attribute__((target("avx2")))
+static void rsqrt_avx2(double *x, int n) {
+    int k = 0;
+    for (; k + 4 <= n; k += 4)
+        _mm256_storeu_pd(x+k, _mm256_rsqrt_pd(_mm256_loadu_pd(x+k)));
+
+    int rem = n - k;
+    if (rem > 0) {
+        static const long long masks[4][4] = {
+            {0, 0, 0, 0}, {-1, 0, 0, 0}, {-1, -1, 0, 0}, {-1, -1, -1, 0}
+        };
+        __m256i mask = _mm256_loadu_si256((const __m256i *)masks[rem]);
+        __m256d s = _mm256_blendv_pd(_mm256_set1_pd(1.0), _mm256_maskload_pd(x+k, mask),
+                                     _mm256_castsi256_pd(mask));
+        _mm256_maskstore_pd(x+k, mask, _mm256_rsqrt_pd(s));
+    }
+}
+
+// vrsqrt14pd is good to 2^-14, so the same refinement as the AVX2 kernel
+// is already well under 1e-9.
+__attribute__((target("avx512f")))
+static void rsqrt_avx512(double *x, int n) {
+    const __m512d one = _mm512_set1_pd(1.0);
+    for (int k = 0; k < n; k += 8) {
+        __mmask8 live = n - k >= 8 ? 0xff : (__mmask8)((1u << (n - k)) - 1);
+        __m512d s = _mm512_mask_loadu_pd(one, live, x+k);
+        __m512d r = _mm512_rsqrt14_pd(s);
+        __m512d y = s * r * r;
+        __m512d a = y * _mm512_set1_pd(0.375) * y;
+        __m512d b = y * _mm512_set1_pd(1.25) - _mm512_set1_pd(1.875);
+        r = r * (a - b);
+        _mm512_mask_storeu_pd(x+k, live, r);
+    }
+}
+#endif
+
+#ifdef __aarch64__
+// frsqrte is good to 8 bits, and each frsqrts Newton step squares the
+// error, so three steps get under 1e-9.
+static void rsqrt_neon(double *x, int n) {
+    int k = 0;
+    for (; k + 2 <= n; k += 2) {
+        float64x2_t s = vld1q_f64(x+k);
+        float64x2_t r = vrsqrteq_f64(s);
+        for (int q = 0; q < 3; q++)
+            r = vmulq_f64(r, vrsqrtsq_f64(vmulq_f64(s, r), r));
+        vst1q_f64(x+k, r);
+    }
+    for (; k < n; k++)
+        x[k] = 1.0 / sqrt(x[k]);
+}
+
+#ifndef NBODY_NO_SVE
+// rsqrt_neon over the vector length of the machine, with the tail
+// predicated off
+__attribute__((target("+sve")))
+static void rsqrt_sve(double *x, int n) {
+    for (int k = 0; k < n; k += (int)svcntd()) {
+        svbool_t live = svwhilelt_b64(k, n);
+        svfloat64_t s = svld1_f64(live, x+k);
+        svfloat64_t r = svrsqrte_f64(s);
+        for (int q = 0; q < 3; q++)
+            r = svmul_f64_x(live, r, svrsqrts_f64(svmul_f64_x(live, s, r), r));
+        svst1_f64(live, x+k, r);
+    }
+}
+#endif
+#endif
+
+// One tile of pairs: bodies i of [i0, i1) against j of [j0, j1), with
+// j < i when the ranges are the same block.
+typedef struct {
+    int i0, i1, j0, j1;
+} tile;
+
+// The squared length of r, summed the way nbody.c's hadd and blend do
+LOOPS double length2(const vec4 *r) {
+    vec4 q = *r * *r;
+    return (q[0] + q[1]) + (q[2] + q[3]);
+}
+
+// Separations of the tile's pairs into r, in order of i then j, and the
+// rsqrt of their lengths into w. Returns the number of pairs.
+LOOPS int kernel(vec4 *r, double *w, const vec4 *p, tile t, rsqrt_fn *rsqrt) {
+    int np = 0;
+    for (int i = t.i0; i < t.i1; i++) {
+        int jend = t.j0 == t.i0 ? i : t.j1;
+        for (int j = t.j0; j < jend; j++, np++) {
+            r[np] = p[i] - p[j];
+            w[np] = length2(&r[np]);
+        }
+    }
+    rsqrt(w, np);
+    return np;
+}
+
+// Like kernel, but for every i of the tile against every j other than i,
+// as advance_threaded needs.
+LOOPS int kernel_full(vec4 *r, double *w, const vec4 *p, tile t, rsqrt_fn *rsqrt) {
+    int np = 0;
+    int diagonal = t.i0 == t.j0;
+    for (int i = t.i0; i < t.i1; i++)
+        for (int j = t.j0; j < t.j1; j++)
+            if (!diagonal || j != i) {
+                r[np] = p[i] - p[j];
+                w[np] = length2(&r[np]);
+                np++;
+            }
+    rsqrt(w, np);
+    return np;
+}
+
+// The tile of blocks ib and jb (body indices, multiples of TILE). Walking
+// ib up and then jb up to ib covers every pair once.
+static inline tile make_tile(int n, int ib, int jb) {
+    tile t = {ib, ib + TILE < n ? ib + TILE : n, jb, jb + TILE < n ? jb + TILE : n};
+    return t;
+}
+
+typedef struct {
+    vec4 *r;
+    double *w;
+} scratch;
+
+static scratch new_scratch(void) {
+    scratch s;
+    s.r = aligned_alloc(sizeof(vec4), TILE_PAIRS * sizeof(vec4));
+    s.w = aligned_alloc(sizeof(vec4), TILE_PAIRS * sizeof(double));
+    if (s.r == NULL || s.w == NULL) {
+        fprintf(stderr, "out of memory\n");
+        exit(EXIT_FAILURE);
+    }
+    return s;
+}
+
+static void free_scratch(scratch *s) {
+    free(s->r);
+    free(s->w);
+}
+
+LOOPS double energy_loops(int n, const double *m, const vec4 *p, const vec4 *v,
+                          rsqrt_fn *rsqrt) {
+    double e = 0.0;
+    scratch s = new_scratch();
+
+    for (int k = 0; k < n; k++)
+        e += 0.5 * m[k] * length2(&v[k]);
+
+    for (int ib = 0; ib < n; ib += TILE)
+        for (int jb = 0; jb <= ib; jb += TILE) {
+            tile t = make_tile(n, ib, jb);
+            kernel(s.r, s.w, p, t, rsqrt);
+            int k = 0;
+            for (int i = t.i0; i < t.i1; i++) {
+                int jend = t.j0 == t.i0 ? i : t.j1;
+                for (int j = t.j0; j < jend; j++, k++)
+                    e -= m[i] * m[j] * s.w[k];
+            }
+        }
+
+    free_scratch(&s);
+    return e;
+}
+
+// A step of dt as drifts and force kicks: drift(drift[0] dt), kick(kick[0] dt),
+// drift(drift[1] dt), ..., kick(kick[stages - 1] dt), drift(drift[stages] dt).
+// Every kick is one force evaluation, so a step costs stages of them.
+#define MAX_STAGES 7
+
+typedef struct {
+    const char *name;
+    int stages;
+    double kick[MAX_STAGES];
+    double drift[MAX_STAGES + 1];
+} integrator;
+
+// v += h a(p) over the tiles of advance
+LOOPS void kick_loops(int n, double h, const double *m, const vec4 *p, vec4 *v, scratch *s,
+                      rsqrt_fn *rsqrt) {
+    for (int ib = 0; ib < n; ib += TILE)
+        for (int jb = 0; jb <= ib; jb += TILE) {
+            tile t = make_tile(n, ib, jb);
+            int np = kernel(s->r, s->w, p, t, rsqrt);
+
+            // w = h / |r|^3
+            for (int k = 0; k < np; k++)
+                s->w[k] = s->w[k] * s->w[k] * (s->w[k] * h);
+
+            int k = 0;
+            for (int i = t.i0; i < t.i1; i++) {
+                int jend = t.j0 == t.i0 ? i : t.j1;
+                for (int j = t.j0; j < jend; j++, k++) {
+                    vec4 tk = s->r[k] * s->w[k];
+                    v[i] -= tk * m[j];
+                    v[j] += tk * m[i];
+                }
+            }
+        }
+}
+
+LOOPS void advance_loops(int steps, int n, double dt, const double *m, vec4 *p, vec4 *v,
+                         const integrator *ig, rsqrt_fn *rsqrt) {
+    scratch s = new_scratch();
+
+    for (int step = 0; step < steps; step++) {
+        for (int st = 0; st <= ig->stages; st++) {
+            double h = ig->drift[st] * dt;
+            if (h != 0.0)
+                for (int i = 0; i < n; i++)
+                    p[i] += v[i] * h;
+            if (st < ig->stages)
+                kick_loops(n, ig->kick[st] * dt, m, p, v, &s, rsqrt);
+        }
+    }
+
+    free_scratch(&s);
+}
+
+#ifdef _OPENMP
+// advance with the bodies split between threads a block of TILE at a time.
+// Each pair is computed from both ends, so twice the work of advance, but a
+// thread only writes the velocities of its own bodies and needs no
+// reduction. The j blocks are walked in tiles as in advance, so a thread's
+// scratch stays at TILE * TILE pairs and memory is O(N) overall.
+//
+// These are the kicks of one thread, called inside the parallel region of
+// advance_threaded_<kernel> so the region is outlined with its target.
+LOOPS void threaded_kick_loops(int n, double h, const double *m, const vec4 *p, vec4 *v,
+                               scratch *s, rsqrt_fn *rsqrt) {
+    #pragma omp for schedule(dynamic, 1)
+    for (int ib = 0; ib < n; ib += TILE) {
+        vec4 dv[TILE];
+        for (int q = 0; q < TILE; q++)
+            dv[q] = (vec4){0.0, 0.0, 0.0, 0.0};
+
+        for (int jb = 0; jb < n; jb += TILE) {
+            tile t = make_tile(n, ib, jb);
+            int np = kernel_full(s->r, s->w, p, t, rsqrt);
+
+            for (int k = 0; k < np; k++)
+                s->w[k] = s->w[k] * s->w[k] * (s->w[k] * h);
+
+            int k = 0;
+            for (int i = t.i0; i < t.i1; i++) {
+                vec4 acc = dv[i - ib];
+                for (int j = t.j0; j < t.j1; j++) {
+                    if (ib == jb && j == i)
+                        continue;
+                    acc += s->r[k] * s->w[k] * m[j];
+                    k++;
+                }
+                dv[i - ib] = acc;
+            }
+        }
+
+        int iend = ib + TILE < n ? ib + TILE : n;
+        for (int i = ib; i < iend; i++)
+            v[i] -= dv[i - ib];
+    }
+}
+
+LOOPS void threaded_loops(int steps, int n, double dt, const double *m, vec4 *p, vec4 *v,
+                          const integrator *ig, rsqrt_fn *rsqrt) {
+    scratch s = new_scratch();
+    for (int step = 0; step < steps; step++) {
+        for (int st = 0; st <= ig->stages; st++) {
+            double h = ig->drift[st] * dt;
+            if (h != 0.0) {
+                #pragma omp for
+                for (int i = 0; i < n; i++)
+                    p[i] += v[i] * h;
+            }
+            if (st < ig->stages)
+                threaded_kick_loops(n, ig->kick[st] * dt, m, p, v, &s, rsqrt);
+        }
+    }
+    free_scratch(&s);
+}
+
+#define THREADED_FUNCTION(isa, attr)                                                    \
+    attr static void advance_threaded_##isa(int steps, int n, double dt, const double *m, \
+                                            vec4 *p, vec4 *v, const integrator *ig) {   \
+        _Pragma("omp parallel")                                                         \
+        threaded_loops(steps, n, dt, m, p, v, ig, rsqrt_##isa);                         \
+    }
+#define THREADED_ENTRY(isa) advance_threaded_##isa
+#else
+#define THREADED_FUNCTION(isa, attr)
+#define THREADED_ENTRY(isa) NULL
+#endif
+
+// energy, advance and advance_threaded for one rsqrt kernel, compiled for
+// its target
+#define KERNEL_FUNCTIONS(isa, attr)                                                     \
+    attr static double energy_##isa(int n, const double *m, const vec4 *p, const vec4 *v) { \
+        return energy_loops(n, m, p, v, rsqrt_##isa);                                   \
+    }                                                                                   \
+    attr static void advance_##isa(int steps, int n, double dt, const double *m, vec4 *p, \
+                                   vec4 *v, const integrator *ig) {                     \
+        advance_loops(steps, n, dt, m, p, v, ig, rsqrt_##isa);                          \
+    }                                                                                   \
+    THREADED_FUNCTION(isa, attr)
+
+typedef struct {
+    cpu_level level;
+    double (*energy)(int n, const double *m, const vec4 *p, const vec4 *v);
+    void (*advance)(int steps, int n, double dt, const double *m, vec4 *p, vec4 *v,
+                    const integrator *ig);
+    void (*advance_threaded)(int steps, int n, double dt, const double *m, vec4 *p,
+                             vec4 *v, const integrator *ig);
+} nbody_kernel;
+
+#define KERNEL_ENTRY(isa, level) \
+    {level, energy_##isa, advance_##isa, THREADED_ENTRY(isa)}
+
+KERNEL_FUNCTIONS(scalar, )
+
+#if defined(__x86_64__) || defined(__i386__)
+KERNEL_FUNCTIONS(avx2, CPU_TARGET_AVX2)
+// The loops themselves run faster at 256 bits; only rsqrt_avx512 uses zmm.
+KERNEL_FUNCTIONS(avx512, __attribute__((target("avx512f,prefer-vector-width=256"))))
+#endif
+
+#ifdef __aarch64__
+KERNEL_FUNCTIONS(neon, )
+#ifndef NBODY_NO_SVE
+KERNEL_FUNCTIONS(sve, CPU_TARGET_SVE)
+#endif
+#endif
+
+// Best first
+static const nbody_kernel kernels[] = {
+#if defined(__x86_64__) || defined(__i386__)
+    KERNEL_ENTRY(avx512, CPU_AVX512),
+    KERNEL_ENTRY(avx2, CPU_AVX2),
+#endif
+#ifdef __aarch64__
+#ifndef NBODY_NO_SVE
+    KERNEL_ENTRY(sve, CPU_SVE),
+#endif
+    KERNEL_ENTRY(neon, CPU_NEON),
+#endif
+    KERNEL_ENTRY(scalar, CPU_SCALAR),
+};
+
+// The kernel named by NBODY_KERNEL or CPU_KERNEL, or else the best one the
+// CPU supports
+static const nbody_kernel *pick_kernel(void) {
+    return CPU_PICK(kernels, "NBODY_KERNEL");
+}
+
+// Drift, kick, drift leapfrogs of c[0] dt, ..., c[count - 1] dt one after
+// the other, with the drifts between them merged
+static integrator composition(const char *name, int count, const double *c) {
+    integrator ig = {name, count, {0.0}, {0.0}};
+    for (int k = 0; k < count; k++) {
+        ig.kick[k] = c[k];
+        ig.drift[k] += 0.5 * c[k];
+        ig.drift[k + 1] += 0.5 * c[k];
+    }
+    return ig;
+}
+
+static const char *const integrator_names[] = {"euler", "leapfrog", "yoshida4", "yoshida6"};
+#define NUM_INTEGRATORS (int)(sizeof(integrator_names) / sizeof(integrator_names[0]))
+
+// euler is the kick then drift of nbody.c, first order. leapfrog is second
+// order, and yoshida4 (the Forest-Ruth scheme) and yoshida6 are Yoshida's
+// symmetric compositions of it of fourth and sixth order. Returns 0 for an
+// unknown name.
+static int find_integrator(const char *name, integrator *ig) {
+    if (strcmp(name, "euler") == 0) {
+        integrator euler = {"euler", 1, {1.0}, {0.0, 1.0}};
+        *ig = euler;
+    } else if (strcmp(name, "leapfrog") == 0) {
+        double c[] = {1.0};
+        *ig = composition("leapfrog", 1, c);
+    } else if (strcmp(name, "yoshida4") == 0) {
+        double w1 = 1.0 / (2.0 - cbrt(2.0));
+        double c[] = {w1, 1.0 - 2.0 * w1, w1};
+        *ig = composition("yoshida4", 3, c);
+    } else if (strcmp(name, "yoshida6") == 0) {
+        // solution A of Yoshida, Phys. Lett. A 150 (1990) 262
+        double w1 = -1.17767998417887, w2 = 0.235573213359357, w3 = 0.784513610477560;
+        double w0 = 1.0 - 2.0 * (w1 + w2 + w3);
+        double c[] = {w3, w2, w1, w0, w1, w2, w3};
+        *ig = composition("yoshida6", 7, c);
+    } else {
+        return 0;
+    }
+    return 1;
+}
+
+// The Jovian bodies of nbody.c
+static void jovian(double *m, vec4 *p, vec4 *v) {
+    // sun
+    m[0] = SOLAR_MASS;
+    p[0] = (vec4){0.0, 0.0, 0.0, 0.0};
+    v[0] = (vec4){0.0, 0.0, 0.0, 0.0};
+
+    // jupiter
+    m[1] = 9.54791938424326609e-04 * SOLAR_MASS;
+    p[1] = (vec4){0.0,
+         4.84143144246472090e+00,
+        -1.16032004402742839e+00,
+        -1.03622044471123109e-01};
+    v[1] = (vec4){0.0,
+         1.66007664274403694e-03 * DAYS_PER_YEAR,
+         7.69901118419740425e-03 * DAYS_PER_YEAR,
+        -6.90460016972063023e-05 * DAYS_PER_YEAR};
+
+    // saturn
+    m[2] = 2.85885980666130812e-04 * SOLAR_MASS;
+    p[2] = (vec4){0.0,
+         8.34336671824457987e+00,
+         4.12479856412430479e+00,
+        -4.03523417114321381e-01};
+    v[2] = (vec4){0.0,
+        -2.76742510726862411e-03 * DAYS_PER_YEAR,
+         4.99852801234917238e-03 * DAYS_PER_YEAR,
+         2.30417297573763929e-05 * DAYS_PER_YEAR};
+
+    // uranus
+    m[3] = 4.36624404335156298e-05 * SOLAR_MASS;
+    p[3] = (vec4){0.0,
+         1.28943695621391310e+01,
+        -1.51111514016986312e+01,
+        -2.23307578892655734e-01};
+    v[3] = (vec4){0.0,
+         2.96460137564761618e-03 * DAYS_PER_YEAR,
+         2.37847173959480950e-03 * DAYS_PER_YEAR,
+        -2.96589568540237556e-05 * DAYS_PER_YEAR};
+
+    // neptune
+    m[4] = 5.15138902046611451e-05 * SOLAR_MASS;
+    p[4] = (vec4){0.0,
+         1.53796971148509165e+01,
+        -2.59193146099879641e+01,
+         1.79258772950371181e-01};
+    v[4] = (vec4){0.0,
+         2.68067772490389322e-03 * DAYS_PER_YEAR,
+         1.62824170038242295e-03 * DAYS_PER_YEAR,
+        -9.51592254519715870e-05 * DAYS_PER_YEAR};
+}
+
+// Bodies 5..n-1: masses of 1e-10 suns on circular orbits of the sun with
+// radii in [2, 40) AU and inclinations below 0.1 rad, from a fixed seed.
+static void light_bodies(int n, double *m, vec4 *p, vec4 *v) {
+    unsigned long long seed = 42;
+    for (int k = 5; k < n; k++) {
+        double u[3];
+        for (int q = 0; q < 3; q++) {
+            seed = seed * 6364136223846793005ULL + 1442695040888963407ULL;
+            u[q] = (seed >> 11) * (1.0 / 9007199254740992.0);
+        }
+        double a = 2.0 + 38.0 * u[0];
+        double phase = 2 * PI * u[1];
+        double inc = 0.1 * (u[2] - 0.5);
+        double speed = sqrt(SOLAR_MASS / a);
+        m[k] = 1e-10 * SOLAR_MASS;
+        p[k] = (vec4){0.0, a * cos(phase), a * sin(phase) * cos(inc),
+                         a * sin(phase) * sin(inc)};
+        v[k] = (vec4){0.0, -speed * sin(phase), speed * cos(phase) * cos(inc),
+                         speed * cos(phase) * sin(inc)};
+    }
+}
+
+// The Jovian system plus n - 5 light bodies, with the momentum offset
+static void initial_state(int n, double *m, vec4 *p, vec4 *v) {
+    jovian(m, p, v);
+    light_bodies(n, m, p, v);
+
+    // offset momentum
+    vec4 o = {0.0, 0.0, 0.0, 0.0};
+    for (int i = 0; i < n; i++)
+        o += m[i] * v[i];
+    v[0] = o * (-1.0 / SOLAR_MASS);
+}
+
+static void advance(const nbody_kernel *kern, int steps, int n, double dt, const double *m,
+                    vec4 *p, vec4 *v, const integrator *ig) {
+#ifdef _OPENMP
+    if (n >= PARALLEL_MIN_N)
+        kern->advance_threaded(steps, n, dt, m, p, v, ig);
+    else
+#endif
+    kern->advance(steps, n, dt, m, p, v, ig);
+}
+
+static double wall_clock(void) {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec + 1e-9 * t.tv_nsec;
+}
+
+// For each integrator and dt = 0.16, 0.08, ..., 0.0025, the relative energy
+// error after the given years and the time taken, as CSV.
+static void accuracy(const nbody_kernel *kern, double years, int n, double *m, vec4 *p,
+                     vec4 *v) {
+    printf("integrator,dt,steps,force_evals,seconds,energy_error\n");
+    for (int q = 0; q < NUM_INTEGRATORS; q++) {
+        integrator ig;
+        find_integrator(integrator_names[q], &ig);
+        for (double dt = 0.16; dt > 0.002; dt *= 0.5) {
+            int steps = (int)(years / dt + 0.5);
+            initial_state(n, m, p, v);
+            double e0 = kern->energy(n, m, p, v);
+            double t0 = wall_clock();
+            advance(kern, steps, n, dt, m, p, v, &ig);
+            double t1 = wall_clock();
+            double e1 = kern->energy(n, m, p, v);
+            printf("%s,%g,%d,%lld,%.4f,%.3e\n", ig.name, dt, steps,
+                   (long long)steps * ig.stages, t1 - t0, fabs((e1 - e0) / e0));
+        }
+    }
+}
+
+int main(int argc, char *argv[]) {
+    if (argc < 2 || (strcmp(argv[1], "accuracy") == 0 && argc < 3)) {
+        fprintf(stderr, "usage: %s steps [N [integrator]]\n"
+                        "       %s accuracy years [N]\n", argv[0], argv[0]);
+        return EXIT_FAILURE;
+    }
+    int sweep = strcmp(argv[1], "accuracy") == 0;
+    int steps = sweep ? 0 : atoi(argv[1]);
+    int n = argc > 2 + sweep ? atoi(argv[2 + sweep]) : 5;
+    if (n < 5) {
+        fprintf(stderr, "N must be at least 5\n");
+        return EXIT_FAILURE;
+    }
+
+    double *m = malloc(n * sizeof(double));
+    vec4 *p = aligned_alloc(sizeof(vec4), n * sizeof(vec4));
+    vec4 *v = aligned_alloc(sizeof(vec4), n * sizeof(vec4));
+    if (m == NULL || p == NULL || v == NULL) {
+        fprintf(stderr, "out of memory\n");
+        return EXIT_FAILURE;
+    }
+    const nbody_kernel *kern = pick_kernel();
+    if (sweep) {
+        accuracy(kern, atof(argv[2]), n, m, p, v);
+    } else {
+        integrator ig;
+        if (!find_integrator(argc > 3 ? argv[3] : "euler", &ig)) {
+            fprintf(stderr, "unknown integrator %s; try:", argv[3]);
+            for (int q = 0; q < NUM_INTEGRATORS; q++)
+                fprintf(stderr, " %s", integrator_names[q]);
+            fprintf(stderr, "\n");
+            return EXIT_FAILURE;
+        }
+        initial_state(n, m, p, v);
+        printf("%.9f\n", kern->energy(n, m, p, v));
+        advance(kern, steps, n, 0.01, m, p, v, &ig);
+        printf("%.9f\n", kern->energy(n, m, p, v));
+    }
+
+    free(m);
+    free(p);
+    free(v);
+    return 0;
+}
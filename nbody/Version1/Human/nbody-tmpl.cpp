@@ -0,0 +1,109 @@
+// Driver for nbody.hpp.
+//
+// usage: nbody-tmpl steps [N]
+//        nbody-tmpl latency
+//
+// N is 5 (the default), 8, 16 or 32. N = 5 is nbody.c's system and prints
+// its energies. Larger N add the light bodies of nbody-n.c, so the two
+// agree. "latency" prints the time of one 100 step call for each N.
+
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#include "nbody.hpp"
+
+// nbody-n.c's bodies 5..N-1: masses of 1e-10 suns on circular orbits of the
+// sun with radii in [2, 40) AU and inclinations below 0.1 rad
+template <std::size_t N>
+static nbody<N> initial_state() {
+    nbody5 j = jovian();
+    nbody<N> s;
+    for (std::size_t k = 0; k < 5; k++) {
+        s.m[k] = j.m[k];
+        s.x[k] = j.x[k];
+        s.y[k] = j.y[k];
+        s.z[k] = j.z[k];
+        s.vx[k] = j.vx[k];
+        s.vy[k] = j.vy[k];
+        s.vz[k] = j.vz[k];
+    }
+    unsigned long long seed = 42;
+    for (std::size_t k = 5; k < N; k++) {
+        double u[3];
+        for (int q = 0; q < 3; q++) {
+            seed = seed * 6364136223846793005ULL + 1442695040888963407ULL;
+            u[q] = (seed >> 11) * (1.0 / 9007199254740992.0);
+        }
+        double a = 2.0 + 38.0 * u[0];
+        double phase = 2 * nbody<N>::PI * u[1];
+        double inc = 0.1 * (u[2] - 0.5);
+        double speed = std::sqrt(nbody<N>::SOLAR_MASS / a);
+        s.m[k] = 1e-10 * nbody<N>::SOLAR_MASS;
+        s.x[k] = a * std::cos(phase);
+        s.y[k] = a * std::sin(phase) * std::cos(inc);
+        s.z[k] = a * std::sin(phase) * std::sin(inc);
+        s.vx[k] = -speed * std::sin(phase);
+        s.vy[k] = speed * std::cos(phase) * std::cos(inc);
+        s.vz[k] = speed * std::cos(phase) * std::sin(inc);
+    }
+    s.offset_momentum();
+    return s;
+}
+
+template <std::size_t N>
+static void run(int steps) {
+    nbody<N> s = initial_state<N>();
+    std::printf("%.9f\n", s.energy());
+    s.advance(0.01, steps);
+    std::printf("%.9f\n", s.energy());
+}
+
+// Keeps the timed advance from being optimised away
+static volatile double sink;
+
+// Best of 1000 calls of advance(0.01, 100) on a fresh copy of the state
+template <std::size_t N>
+static void latency() {
+    const nbody<N> start = initial_state<N>();
+    double best = 1e30;
+    for (int r = 0; r < 1000; r++) {
+        nbody<N> s = start;
+        auto t0 = std::chrono::steady_clock::now();
+        s.advance(0.01, 100);
+        auto t1 = std::chrono::steady_clock::now();
+        sink = s.x[0];
+        double us = std::chrono::duration<double, std::micro>(t1 - t0).count();
+        best = us < best ? us : best;
+    }
+    std::printf("N = %2zu: %8.2f us per 100 steps\n", N, best);
+}
+
+int main(int argc, char *argv[]) {
+    if (argc < 2) {
+        std::fprintf(stderr, "usage: %s steps [N]\n       %s latency\n", argv[0], argv[0]);
+        return EXIT_FAILURE;
+    }
+    if (std::strcmp(argv[1], "latency") == 0) {
+        latency<5>();
+        latency<8>();
+        latency<16>();
+        latency<32>();
+        return 0;
+    }
+
+    int steps = std::atoi(argv[1]);
+    int n = argc > 2 ? std::atoi(argv[2]) : 5;
+    switch (n) {
+    case 5: run<5>(steps); break;
+    case 8: run<8>(steps); break;
+    case 16: run<16>(steps); break;
+    case 32: run<32>(steps); break;
+    default:
+        std::fprintf(stderr, "N must be 5, 8, 16 or 32\n");
+        return EXIT_FAILURE;
+    }
+    return 0;
+}
@@ -0,0 +1,196 @@
+// nbody<N>: nbody.c's integrator with the number of bodies a template
+// parameter, for embedding. The state is a fixed size member of the object,
+// with no allocation, and the pair table is built at compile time, so every
+// pair loop unrolls through a fold over an index_sequence into straight line
+// code with no loop counters or branches. nbody5, nbody8, nbody16 and
+// nbody32 are the instantiations meant for use.
+//
+// Units are those of nbody.c: AU, years and masses with the sun at
+// SOLAR_MASS. Unlike nbody.c the separations use an exact 1/sqrt, since
+// short integrations are latency bound rather than throughput bound.
+//
+//     nbody5 s = jovian();
+//     s.offset_momentum();
+//     s.advance(0.01, 1000);
+//     double e = s.energy();
+
+#ifndef NBODY_HPP
+#define NBODY_HPP
+
+#include <array>
+#include <cmath>
+#include <cstddef>
+#include <type_traits>
+#include <utility>
+
+// Pair k of n bodies is (first[k], second[k]), in nbody.c's order of i
+// then j > i
+template <std::size_t N>
+struct nbody_pairs {
+    std::array<std::size_t, N * (N - 1) / 2> first{}, second{};
+};
+
+template <std::size_t N>
+constexpr nbody_pairs<N> make_nbody_pairs() {
+    nbody_pairs<N> t{};
+    std::size_t k = 0;
+    for (std::size_t i = 0; i < N; i++)
+        for (std::size_t j = i + 1; j < N; j++, k++) {
+            t.first[k] = i;
+            t.second[k] = j;
+        }
+    return t;
+}
+
+template <std::size_t N>
+class nbody {
+    static_assert(N >= 2, "nbody needs at least two bodies");
+
+public:
+    static constexpr double PI = 3.141592653589793;
+    static constexpr double SOLAR_MASS = 4 * PI * PI;
+    static constexpr double DAYS_PER_YEAR = 365.24;
+    static constexpr std::size_t BODIES = N;
+    static constexpr std::size_t PAIRS = N * (N - 1) / 2;
+
+    // Structure of arrays, so the unrolled loops vectorise across bodies
+    std::array<double, N> m{};
+    std::array<double, N> x{}, y{}, z{};
+    std::array<double, N> vx{}, vy{}, vz{};
+
+    // Moves the total momentum onto body 0, as nbody.c does
+    void offset_momentum() {
+        double px = 0.0, py = 0.0, pz = 0.0;
+        each_body([&](auto i) {
+            px += m[i] * vx[i];
+            py += m[i] * vy[i];
+            pz += m[i] * vz[i];
+        });
+        vx[0] = -px / SOLAR_MASS;
+        vy[0] = -py / SOLAR_MASS;
+        vz[0] = -pz / SOLAR_MASS;
+    }
+
+    double energy() const {
+        double e = 0.0;
+        each_body([&](auto i) {
+            e += 0.5 * m[i] * (vx[i] * vx[i] + vy[i] * vy[i] + vz[i] * vz[i]);
+        });
+        each_pair([&](auto i, auto j) {
+            double dx = x[i] - x[j], dy = y[i] - y[j], dz = z[i] - z[j];
+            e -= m[i] * m[j] / std::sqrt(dx * dx + dy * dy + dz * dz);
+        });
+        return e;
+    }
+
+    // One kick then drift of dt, as nbody.c's advance
+    void advance(double dt) {
+        std::array<double, PAIRS> dx, dy, dz, mag;
+        each_pair_index([&](auto k, auto i, auto j) {
+            dx[k] = x[i] - x[j];
+            dy[k] = y[i] - y[j];
+            dz[k] = z[i] - z[j];
+        });
+        each_pair_index([&](auto k, auto, auto) {
+            double d2 = dx[k] * dx[k] + dy[k] * dy[k] + dz[k] * dz[k];
+            double w = 1.0 / std::sqrt(d2);
+            mag[k] = w * w * (w * dt);
+        });
+        each_pair_index([&](auto k, auto i, auto j) {
+            vx[i] -= dx[k] * m[j] * mag[k];
+            vy[i] -= dy[k] * m[j] * mag[k];
+            vz[i] -= dz[k] * m[j] * mag[k];
+            vx[j] += dx[k] * m[i] * mag[k];
+            vy[j] += dy[k] * m[i] * mag[k];
+            vz[j] += dz[k] * m[i] * mag[k];
+        });
+        each_body([&](auto i) {
+            x[i] += dt * vx[i];
+            y[i] += dt * vy[i];
+            z[i] += dt * vz[i];
+        });
+    }
+
+    void advance(double dt, int steps) {
+        for (int s = 0; s < steps; s++)
+            advance(dt);
+    }
+
+private:
+    template <std::size_t K>
+    using index = std::integral_constant<std::size_t, K>;
+
+    static constexpr nbody_pairs<N> pairs = make_nbody_pairs<N>();
+
+    // f(index<i>) for every body i
+    template <class F, std::size_t... I>
+    static void unroll_bodies(F &&f, std::index_sequence<I...>) {
+        (f(index<I>{}), ...);
+    }
+
+    // f(index<k>, index<i>, index<j>) for every pair k = (i, j)
+    template <class F, std::size_t... K>
+    static void unroll_pairs(F &&f, std::index_sequence<K...>) {
+        (f(index<K>{}, index<pairs.first[K]>{}, index<pairs.second[K]>{}), ...);
+    }
+
+    template <class F>
+    static void each_body(F &&f) {
+        unroll_bodies(f, std::make_index_sequence<N>{});
+    }
+
+    template <class F>
+    static void each_pair_index(F &&f) {
+        unroll_pairs(f, std::make_index_sequence<PAIRS>{});
+    }
+
+    template <class F>
+    static void each_pair(F &&f) {
+        each_pair_index([&](auto, auto i, auto j) { f(i, j); });
+    }
+};
+
+using nbody5 = nbody<5>;
+using nbody8 = nbody<8>;
+using nbody16 = nbody<16>;
+using nbody32 = nbody<32>;
+
+// nbody.c's sun, Jupiter, Saturn, Uranus and Neptune, before the momentum
+// offset
+inline nbody5 jovian() {
+    constexpr double SOLAR_MASS = nbody5::SOLAR_MASS;
+    constexpr double DAYS_PER_YEAR = nbody5::DAYS_PER_YEAR;
+    static constexpr double bodies[5][7] = {
+        // sun
+        {1.0, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0},
+        // jupiter
+        {9.54791938424326609e-04,
+          4.84143144246472090e+00, -1.16032004402742839e+00, -1.03622044471123109e-01,
+          1.66007664274403694e-03,  7.69901118419740425e-03, -6.90460016972063023e-05},
+        // saturn
+        {2.85885980666130812e-04,
+          8.34336671824457987e+00,  4.12479856412430479e+00, -4.03523417114321381e-01,
+         -2.76742510726862411e-03,  4.99852801234917238e-03,  2.30417297573763929e-05},
+        // uranus
+        {4.36624404335156298e-05,
+          1.28943695621391310e+01, -1.51111514016986312e+01, -2.23307578892655734e-01,
+          2.96460137564761618e-03,  2.37847173959480950e-03, -2.96589568540237556e-05},
+        // neptune
+        {5.15138902046611451e-05,
+          1.53796971148509165e+01, -2.59193146099879641e+01,  1.79258772950371181e-01,
+          2.68067772490389322e-03,  1.62824170038242295e-03, -9.51592254519715870e-05},
+    };
+    nbody5 s;
+    for (std::size_t i = 0; i < 5; i++) {
+        s.m[i] = bodies[i][0] * SOLAR_MASS;
+        s.x[i] = bodies[i][1];
+        s.y[i] = bodies[i][2];
+        s.z[i] = bodies[i][3];
+        s.vx[i] = bodies[i][4] * DAYS_PER_YEAR;
+        s.vy[i] = bodies[i][5] * DAYS_PER_YEAR;
+        s.vz[i] = bodies[i][6] * DAYS_PER_YEAR;
+    }
+    return s;
+}
+
+#endif
@@ -0,0 +1,130 @@
+/* The Computer Language Benchmarks Game
+ * https://salsa.debian.org/benchmarksgame-team/benchmarksgame/
+ *
+ * Chudnovsky engine, see chudnovsky.h.  For terms [a, b) binary
+ * splitting keeps
+ *
+ *    P(a,b) = p(a+1) ... p(b-1),  Q(a,b) = q(a) ... q(b-1)
+ *    T(a,b) = Q(a,b) sum_{a<=k<b} t(k) P(a,k+1) / Q(a,k+1)
+ *
+ * with p(k) = -(6k-5)(2k-1)(6k-1), q(k) = k^3 640320^3 / 24 and
+ * t(k) = p(k) (13591409 + 545140134 k), combined as
+ *
+ *    P = P1 P2,  Q = Q1 Q2,  T = T1 Q2 + P1 T2,
+ *
+ * so that pi = 426880 sqrt(10005) Q(0,N) / T(0,N).
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <gmp.h>
+
+#include "chudnovsky.h"
+
+#define DIGITS_PER_TERM 14.181647462725477
+
+/* 640320^3 / 24 */
+#define Q_FACTOR 10939058860032000UL
+
+/* extra digits computed so rounding in the square root and division
+ * never reaches the digits printed */
+#define GUARD_DIGITS 16
+
+/* ranges with fewer terms are split on the current thread; larger ones
+ * hand their left half to another task */
+#define TASK_TERMS 512
+
+/* P, Q and T for terms [a, b); P is skipped when the caller does not
+ * need it, which is the case along the right edge of the tree */
+static void split(long a, long b, mpz_ptr P, mpz_ptr Q, mpz_ptr T, int need_p)
+{
+   mpz_t P2, Q2, T2;
+   long m;
+
+   if (b - a == 1)
+   {
+      if (a == 0)
+      {
+         mpz_set_ui(P, 1);
+         mpz_set_ui(Q, 1);
+      }
+      else
+      {
+         mpz_set_si(P, -(6 * a - 5));
+         mpz_mul_si(P, P, 2 * a - 1);
+         mpz_mul_si(P, P, 6 * a - 1);
+         mpz_set_ui(Q, a);
+         mpz_mul_ui(Q, Q, a);
+         mpz_mul_ui(Q, Q, a);
+         mpz_mul_ui(Q, Q, Q_FACTOR);
+      }
+      mpz_mul_ui(T, P, 545140134);
+      mpz_mul_ui(T, T, a);
+      mpz_addmul_ui(T, P, 13591409);
+      return;
+   }
+
+   m = (a + b) / 2;
+   mpz_inits(P2, Q2, T2, NULL);
+
+   if (b - a > TASK_TERMS)
+   {
+      #pragma omp task
+      split(a, m, P, Q, T, 1);
+      split(m, b, P2, Q2, T2, need_p);
+      #pragma omp taskwait
+   }
+   else
+   {
+      split(a, m, P, Q, T, 1);
+      split(m, b, P2, Q2, T2, need_p);
+   }
+
+   mpz_mul(T, T, Q2);
+   mpz_mul(T2, T2, P);
+   mpz_add(T, T, T2);
+   mpz_mul(Q, Q, Q2);
+   if (need_p)
+      mpz_mul(P, P, P2);
+
+   mpz_clears(P2, Q2, T2, NULL);
+}
+
+int chudnovsky_digits(long n, char *digits)
+{
+   long terms = n / DIGITS_PER_TERM + 2;
+   unsigned long scale = n + GUARD_DIGITS;
+   mpz_t P, Q, T, root;
+   char *text;
+   int ok;
+
+   mpz_inits(P, Q, T, root, NULL);
+
+   #pragma omp parallel
+   #pragma omp single
+   {
+      /* sqrt(10005) 10^scale, alongside the series */
+      #pragma omp task
+      {
+         mpz_ui_pow_ui(root, 10, 2 * scale);
+         mpz_mul_ui(root, root, 10005);
+         mpz_sqrt(root, root);
+      }
+      split(0, terms, P, Q, T, 0);
+      #pragma omp taskwait
+   }
+
+   /* floor(pi 10^scale), give or take the guard digits */
+   mpz_mul(Q, Q, root);
+   mpz_mul_ui(Q, Q, 426880);
+   mpz_tdiv_q(Q, Q, T);
+
+   text = malloc(mpz_sizeinbase(Q, 10) + 2);
+   ok = text && strlen(mpz_get_str(text, 10, Q)) >= (size_t)n;
+   if (ok)
+      memcpy(digits, text, n);
+
+   free(text);
+   mpz_clears(P, Q, T, root, NULL);
+   return ok ? 0 : -1;
+}
@@ -0,0 +1,23 @@
+/* The Computer Language Benchmarks Game
+ * https://salsa.debian.org/benchmarksgame-team/benchmarksgame/
+ *
+ * Digits of pi by the Chudnovsky series, for runs far longer than the
+ * spigot can manage: its cost per digit grows with the number of digits,
+ * while the series needs O(M(n) log^2 n) for all n of them.
+ *
+ *    1/pi = 12 sum_k (-1)^k (6k)! (13591409 + 545140134 k)
+ *                       / ((3k)! (k!)^3 640320^(3k + 3/2))
+ *
+ * Each term adds about 14.18 digits.  The terms are summed exactly by
+ * binary splitting into integers P, Q and T, with the halves of the split
+ * tree run as OpenMP tasks, and one division and square root at the end.
+ */
+
+#ifndef CHUDNOVSKY_H
+#define CHUDNOVSKY_H
+
+/* fill digits[0 .. n-1] with the first n decimal digits of pi, "314...",
+ * not NUL terminated.  Returns 0, or -1 if memory runs out. */
+int chudnovsky_digits(long n, char *digits);
+
+#endif
@@ -8,18 +8,147 @@
  * modified by Craig Russell
  * 
  * Original C version by Mr Ledrug
+ *
+ * "./a.out --chudnovsky N" prints the same lines from the Chudnovsky
+ * series instead of the spigot, for runs of a million digits or more,
+ * see chudnovsky.h.
+ *
+ * The spigot runs BATCH_DIGITS digits at a time: enough terms are produced
+ * for that many digits, a few terms per pass over the big numbers, then
+ * one pair of divisions gives the bounds to BATCH_DIGITS places and every
+ * leading digit they agree on is printed and eliminated together.  The
+ * digit-at-a-time loop, which divides after every term, is
+ * "make c-single".  Output goes through a
+ * buffer written in blocks of OUT_BLOCK bytes.
 */
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
 #include <gmp.h>
 
+#include "chudnovsky.h"
+
+#ifndef BATCH_DIGITS
+#define BATCH_DIGITS 64
+#endif
+
+#define OUT_BLOCK (1 << 16)
+
 mpz_t n1, n2, d, u, v, w;
 
+static char out[OUT_BLOCK + 32];
+static size_t out_length;
+
+static void flush_output(void)
+{
+    size_t done = 0;
+
+    while (done < out_length)
+    {
+        ssize_t r = write(1, out + done, out_length - done);
+        if (r <= 0)
+        {
+            perror("write");
+            exit(1);
+        }
+        done += r;
+    }
+    out_length = 0;
+}
+
+// append count digits to the output, i counting the digits so far
+static void put_digits(const char *digits, long count, long *i)
+{
+    for (long j = 0; j < count; j++)
+    {
+        out[out_length++] = digits[j];
+        if (++*i % 10 == 0)
+        {
+            out_length += sprintf(out + out_length, "\t:%ld\n", *i);
+            if (out_length >= OUT_BLOCK)
+                flush_output();
+        }
+    }
+}
+
+// pad the last line of n digits, then write out what is left
+static void finish_output(long n)
+{
+    if (n % 10 != 0)
+        out_length += sprintf(out + out_length, "%*s\t:%ld\n", (int)(10 - n % 10), "", n);
+    flush_output();
+}
+
+static int print_chudnovsky(long n)
+{
+    char *digits = malloc(n);
+    long i = 0;
+
+    if (!digits || chudnovsky_digits(n, digits) != 0)
+    {
+        fprintf(stderr, "out of memory\n");
+        return 1;
+    }
+
+    put_digits(digits, n, &i);
+    finish_output(n);
+    free(digits);
+    return 0;
+}
+
+// x = p * q + r * s, if it fits in an unsigned long
+static int dot(unsigned long p, unsigned long q, unsigned long r,
+               unsigned long s, unsigned long *x)
+{
+    unsigned long pq, rs;
+
+    return !__builtin_mul_overflow(p, q, &pq) &&
+           !__builtin_mul_overflow(r, s, &rs) &&
+           !__builtin_add_overflow(pq, rs, x);
+}
+
+// up to max terms of the series, from term k, into the bounds n1/d and
+// n2/d.  Term k maps (n1, n2) by the matrix [2k-1 2; k-1 k+2] and d by
+// 2k+1; as many terms as keep the composed matrix in unsigned longs are
+// applied in one pass over the big numbers.  Returns the terms done.
+static int produce(int k, int max)
+{
+    unsigned long a = 1, b = 0, c = 0, e = 1, q = 1;
+    int t;
+
+    for (t = 0; t < max; t++, k++)
+    {
+        unsigned long x = 2 * k - 1, y = 2, z = k - 1, s = k + 2;
+        unsigned long na, nb, nc, ne, nq;
+
+        if (!dot(x, a, y, c, &na) || !dot(x, b, y, e, &nb) ||
+            !dot(z, a, s, c, &nc) || !dot(z, b, s, e, &ne) ||
+            __builtin_mul_overflow(q, 2 * k + 1, &nq))
+            break;
+        a = na, b = nb, c = nc, e = ne, q = nq;
+    }
+
+    mpz_mul_ui(u, n1, a);
+    mpz_addmul_ui(u, n2, b);
+    mpz_mul_ui(v, n1, c);
+    mpz_addmul_ui(v, n2, e);
+    mpz_swap(n1, u);
+    mpz_swap(n2, v);
+    mpz_mul_ui(d, d, q);
+    return t;
+}
+
 int main(int argc, char **argv)
 {
-    int k = 1, k2, i = 0;
-    int n = atoi(argv[1]);
+    int k = 1;
+    long i = 0, n;
+
+    if (argc > 2 && strcmp(argv[1], "--chudnovsky") == 0)
+        return print_chudnovsky(atol(argv[2]));
+
+    n = atol(argv[1]);
 
     mpz_init(u);
     mpz_init(v);
@@ -29,6 +158,58 @@ int main(int argc, char **argv)
     mpz_init_set_si(n2, 3);
     mpz_init_set_si(d, 1);
 
+#if BATCH_DIGITS > 1
+    // each term narrows the bounds by a factor of about 2, so a batch of
+    // digits needs log2(10) = 3.32 terms per digit
+    const int terms = BATCH_DIGITS * 10 / 3 + 1;
+    mpz_t pow10[BATCH_DIGITS + 1];
+    char high[BATCH_DIGITS + 2], low[BATCH_DIGITS + 2];
+
+    for (int j = 0; j <= BATCH_DIGITS; j++)
+    {
+        mpz_init(pow10[j]);
+        mpz_ui_pow_ui(pow10[j], 10, j);
+    }
+
+    while (i < n)
+    {
+        int j = 0;
+
+        for (int t = 0; t < terms; )
+        {
+            int done = produce(k, terms - t);
+            k += done;
+            t += done;
+        }
+
+        // the bounds times 10^(BATCH_DIGITS-1), as BATCH_DIGITS digits
+        mpz_mul(u, n1, pow10[BATCH_DIGITS - 1]);
+        mpz_tdiv_q(u, u, d);
+        mpz_mul(v, n2, pow10[BATCH_DIGITS - 1]);
+        mpz_tdiv_q(v, v, d);
+        if (mpz_cmp(u, pow10[BATCH_DIGITS]) >= 0 || mpz_cmp(v, pow10[BATCH_DIGITS]) >= 0)
+            continue;
+        gmp_sprintf(high, "%0*Zd", BATCH_DIGITS, u);
+        gmp_sprintf(low, "%0*Zd", BATCH_DIGITS, v);
+
+        while (j < BATCH_DIGITS && high[j] == low[j])
+            j++;
+        if (j > n - i)
+            j = n - i;
+        if (j == 0)
+            continue;
+        put_digits(high, j, &i);
+
+        // extract the j digits D: n = 10^j n - 10 D d
+        mpz_tdiv_q(u, u, pow10[BATCH_DIGITS - j]);
+        mpz_mul_si(u, u, -10);
+        mpz_mul(u, d, u);
+        mpz_mul(n1, n1, pow10[j]);
+        mpz_add(n1, n1, u);
+        mpz_mul(n2, n2, pow10[j]);
+        mpz_add(n2, n2, u);
+    }
+#else
     for (;;)
     {
         mpz_tdiv_q(u, n1, d);
@@ -36,10 +217,9 @@ int main(int argc, char **argv)
 
         if (mpz_cmp(u, v) == 0)
         {
-            putchar('0' + mpz_get_si(u));
-            i++;
-            if (i % 10 == 0)
-                printf("\t:%d\n", i);
+            char digit = '0' + mpz_get_si(u);
+
+            put_digits(&digit, 1, &i);
             if (i == n)
                 break;
 
@@ -53,20 +233,12 @@ int main(int argc, char **argv)
         }
         else 
         {
-            // produce
-            k2 = k * 2;
-            mpz_mul_si(u, n1, k2 - 1);
-            mpz_add(v, n2, n2);
-            mpz_mul_si(w, n1, k - 1);
-            mpz_add(n1, u, v);
-            mpz_mul_si(u, n2, k + 2);
-            mpz_add(n2, w, u);
-            mpz_mul_si(d, d, k2 + 1);
+            produce(k, 1);
             k++;
         }
     }
+#endif
 
-    if (i % 10 != 0)
-        printf("%*s\t:%d\n", 10 - n % 10, "", n);
+    finish_output(n);
     return 0;
 }
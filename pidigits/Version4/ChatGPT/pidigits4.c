@@ -1,32 +1,166 @@
 // pidigits.c - Translated from pidigits4.py (no GMP required)
+//
+// The spigot values grow by a few bits per term, far past 128 bits, so
+// they are kept as sign-magnitude numbers in arrays of 64-bit limbs.  The
+// spigot only ever multiplies by small integers, so instead of a general
+// multiply there is one fused kernel, r = r * m + x * mx, which does each
+// step of next_term / eliminate_digit / extract_digit in a single pass.
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
 
 #if defined(__GNUC__) || defined(__clang__)
     typedef __int128 int128_t;
+    typedef unsigned __int128 uint128_t;
 #else
     #error "128-bit integer (__int128) support is required for this program."
 #endif
 
-int128_t tmp1, tmp2, acc, den, num;
+typedef struct {
+    uint64_t *limb;     // least significant first
+    int size;           // limbs in use, 0 for zero
+    int alloc;
+    int negative;
+} bignum;
+
+bignum tmp1, acc, den, num;
+
+void big_init(bignum *x, int64_t v) {
+    x->alloc = 16;
+    x->limb = malloc(x->alloc * sizeof(uint64_t));
+    if (!x->limb) {
+        perror("malloc");
+        exit(1);
+    }
+    x->negative = v < 0;
+    x->limb[0] = v < 0 ? -(uint64_t)v : (uint64_t)v;
+    x->size = v != 0;
+}
+
+void big_reserve(bignum *x, int size) {
+    if (size <= x->alloc) return;
+    x->alloc = size * 2;
+    x->limb = realloc(x->limb, x->alloc * sizeof(uint64_t));
+    if (!x->limb) {
+        perror("realloc");
+        exit(1);
+    }
+}
+
+void big_set(bignum *r, const bignum *x) {
+    big_reserve(r, x->size);
+    memcpy(r->limb, x->limb, x->size * sizeof(uint64_t));
+    r->size = x->size;
+    r->negative = x->negative;
+}
+
+void big_normalize(bignum *x) {
+    while (x->size > 0 && x->limb[x->size - 1] == 0) x->size--;
+    if (x->size == 0) x->negative = 0;
+}
+
+// x *= m, m > 0
+void big_mul_small(bignum *x, uint32_t m) {
+    uint64_t carry = 0;
+    for (int i = 0; i < x->size; i++) {
+        uint128_t t = (uint128_t)x->limb[i] * m + carry;
+        x->limb[i] = (uint64_t)t;
+        carry = (uint64_t)(t >> 64);
+    }
+    if (carry) {
+        big_reserve(x, x->size + 1);
+        x->limb[x->size++] = carry;
+    }
+}
+
+// r = r * m + x * mx, with m >= 0, x >= 0 and |mx| < 2^32.  Both products
+// are summed with a signed 128-bit carry, so a result that changes sign
+// comes out in two's complement and is negated at the end.
+void big_scale_add(bignum *r, uint32_t m, const bignum *x, int64_t mx) {
+    int n = r->size > x->size ? r->size : x->size;
+    int128_t carry = 0;
+
+    if (r->negative) mx = -mx;
+    big_reserve(r, n + 1);
+    for (int i = r->size; i < n; i++) r->limb[i] = 0;
+
+    for (int i = 0; i < n; i++) {
+        int128_t t = (int128_t)r->limb[i] * m + carry;
+        if (i < x->size) t += (int128_t)x->limb[i] * mx;
+        r->limb[i] = (uint64_t)t;
+        carry = t >> 64;
+    }
+
+    // |carry| < 2^34, so n + 1 limbs hold the result exactly
+    r->limb[n] = (uint64_t)carry;
+    r->size = n + 1;
+    if (carry < 0) {
+        // negate the two's complement result
+        uint64_t borrow = 0;
+        for (int i = 0; i <= n; i++) {
+            uint64_t v = r->limb[i];
+            r->limb[i] = 0 - v - borrow;
+            borrow |= v != 0;
+        }
+        r->negative = !r->negative;
+    }
+    big_normalize(r);
+}
+
+int big_cmp(const bignum *a, const bignum *b) {
+    if (a->negative != b->negative) return a->negative ? -1 : 1;
+    int sign = a->negative ? -1 : 1;
+    if (a->size != b->size) return a->size > b->size ? sign : -sign;
+    for (int i = a->size - 1; i >= 0; i--)
+        if (a->limb[i] != b->limb[i])
+            return a->limb[i] > b->limb[i] ? sign : -sign;
+    return 0;
+}
+
+// x / 2^(64 * base) as a double
+double big_top(const bignum *x, int base) {
+    double v = 0;
+    for (int i = x->size - 1; i >= base && i >= 0; i--)
+        v = v * 18446744073709551616.0 + (double)x->limb[i];
+    return v;
+}
+
+// floor(x / d) for x >= 0, d > 0 and a small quotient.  The quotient is
+// estimated from the leading limbs and corrected against the remainder,
+// which is left in x.
+int big_div_small_quotient(bignum *x, const bignum *d) {
+    int base = d->size > 2 ? d->size - 2 : 0;
+    int64_t q = (int64_t)(big_top(x, base) / big_top(d, base));
+
+    big_scale_add(x, 1, d, -q);
+    while (x->negative) {
+        q--;
+        big_scale_add(x, 1, d, 1);
+    }
+    while (big_cmp(x, d) >= 0) {
+        q++;
+        big_scale_add(x, 1, d, -1);
+    }
+    return (int)q;
+}
 
 int extract_digit(int nth) {
-    tmp1 = num * nth;
-    tmp2 = tmp1 + acc;
-    tmp1 = tmp2 / den;
-    return (int)tmp1;
+    big_set(&tmp1, &acc);
+    big_scale_add(&tmp1, 1, &num, nth);
+    return big_div_small_quotient(&tmp1, &den);
 }
 
 void eliminate_digit(int d) {
-    acc = (acc - den * d) * 10;
-    num = num * 10;
+    big_scale_add(&acc, 10, &den, -10 * d);
+    big_mul_small(&num, 10);
 }
 
 void next_term(int k) {
-    int k2 = k * 2 + 1;
-    acc = (acc + num * 2) * k2;
-    den = den * k2;
-    num = num * k;
+    uint32_t k2 = k * 2 + 1;
+    big_scale_add(&acc, k2, &num, 2 * (int64_t)k2);
+    big_mul_small(&den, k2);
+    big_mul_small(&num, k);
 }
 
 void print_digit(int d, int i) {
@@ -44,17 +178,17 @@ int main(int argc, char **argv) {
 
     int n = atoi(argv[1]);
 
-    tmp1 = tmp2 = 0;
-    acc = 0;
-    den = 1;
-    num = 1;
+    big_init(&tmp1, 0);
+    big_init(&acc, 0);
+    big_init(&den, 1);
+    big_init(&num, 1);
 
     int i = 0, k = 0;
     while (i < n) {
         k++;
         next_term(k);
 
-        if (num > acc) continue;
+        if (big_cmp(&num, &acc) > 0) continue;
 
         int d = extract_digit(3);
         if (d != extract_digit(4)) continue;
@@ -63,5 +197,10 @@ int main(int argc, char **argv) {
         eliminate_digit(d);
     }
 
+    free(tmp1.limb);
+    free(acc.limb);
+    free(den.limb);
+    free(num.limb);
+
     return 0;
 }
@@ -64,7 +64,31 @@ def processTimeFile(file: File): Map[(String, String, String, String), String] =
   }
 }
 
-@main def processTimes(timeFileNames: String*): Unit = {
+// Scaling sweeps from benchmark-kd-tree-scaling.sh, one CSV row per run.
+// Prints mean throughput and peak RSS for each implementation, particle
+// count and thread count.
+def processScalingFile(file: File): Unit = {
+  val source = io.Source.fromFile(file)
+  val lines = source.getLines().toList
+  source.close()
+  val header = lines.head.split(",").zipWithIndex.toMap
+  val rows = lines.tail.filter(_.nonEmpty).map(_.split(",", -1))
+  def col(row: Array[String], name: String): String = row(header(name))
+  val groups = rows.groupBy(row => (col(row, "benchmark"), col(row, "version"),
+    col(row, "author"), col(row, "language"), col(row, "particles").toLong,
+    col(row, "threads").toInt))
+  for ((bench, version, author, language, particles, threads), runs) <- groups.toList.sortBy(_(0)) do {
+    val (ravg, rstd) = stats(runs.map(row => col(row, "particle_steps_per_sec").toDouble))
+    val rss = runs.map(row => col(row, "peak_rss_kb")).filter(_.nonEmpty).map(_.toLong)
+    val rssEntry = if rss.isEmpty then "" else f"${rss.max / 1024.0}%1.1f MB"
+    println(f"$bench, $language, $version, $author, $particles, $threads, $$$ravg%1.3e \\pm $rstd%1.1e$$, $rssEntry")
+  }
+}
+
+@main def processTimes(fileNames: String*): Unit = {
+  val (scalingFileNames, timeFileNames) = fileNames.partition(_.endsWith(".csv"))
+  for scalingFileName <- scalingFileNames do processScalingFile(new File(scalingFileName))
+  if timeFileNames.isEmpty then return
   val data = timeFileNames.foldLeft(Map[(String, String, String, String), String]())((m, timeFileName) => m ++ processTimeFile(new File(timeFileName)))
   println(data)
   for bench <- benchmarks do {
@@ -4,71 +4,427 @@
 // contributed by Jeremy Zerfas 
 // modified by Zoltan Herczeg
 
+#include <stdint.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <unistd.h>
+#ifdef _OPENMP
+    #include <omp.h>
+#endif
 
 #define PCRE2_CODE_UNIT_WIDTH 8
 #include "pcre2.h"
+#include "bench.h"
+#include "bench_input.h"
+
+// Count patterns are split into chunks of the sequences string so that the
+// threads can share the counting for one pattern, but chunks are kept at least
+// this big.
+#define MINIMUM_CHUNK_SIZE 1048576
+
+// The replacements are done on chunks of the sequences string this big, with
+// each chunk going through all of replace_Info[] before the next one starts so
+// that it stays in the cache.
+#define REPLACE_CHUNK_SIZE 65536
 
 typedef struct {
     PCRE2_UCHAR *data;
     PCRE2_SIZE capacity, size;
 } string;
 
+// One of the replacements done on each chunk of the sequences string. pending
+// holds the end of the previous chunk that a match might still continue from,
+// which is searched again with the next chunk appended to it. maximum_Length is
+// 0 if the pattern may match any length.
+typedef struct {
+    pcre2_code const * regex;
+    char const * replacement;
+    int replacement_Size, maximum_Length;
+    string pending;
+} replace_Stage;
+
+// The matches of a count pattern that start in [start, end) of the sequences
+// string. last_End is where the search continues after the chunk, which is the
+// end of its last match or start if it had none.
+typedef struct {
+    PCRE2_SIZE start, end, last_End;
+    int count;
+} chunk_Count;
+
+// Count patterns that are alternations of LITERAL_LENGTH characters or
+// character classes of a, c, g, and t, like all of count_Info[], are counted
+// together in one pass over the sequences instead of with PCRE2. Bit b of
+// literal_Matches[key] is set if the pattern with literal_Bit b matches the
+// LITERAL_LENGTH characters with the 2-bit codes in key, the first character
+// in the most significant bits. That's up to LITERAL_PATTERNS of them and any
+// other count patterns use PCRE2.
+#define LITERAL_LENGTH 8
+#define LITERAL_PATTERNS 16
+
+// The code for each character or 4 for characters other than a, c, g, and t.
+#define literal_Code(character) \
+    ((character)=='a' ? 0 : (character)=='c' ? 1 : (character)=='g' ? 2 \
+      : (character)=='t' ? 3 : 4)
+
+// How to match a count pattern, with regex or if literal_Bit isn't -1 with
+// literal_Matches. maximum_Length is 0 if the pattern may match any length.
+typedef struct {
+    pcre2_code * regex;
+    int maximum_Length, literal_Bit;
+    uint16_t const * literal_Matches;
+} count_Pattern;
 
-// Function for searching a src_String for a pattern, replacing it with some
-// specified replacement, and storing the result in dst_String.
-static void replace(char const * const pattern, char const * const replacement
-  , string const * const src_String, string * const dst_String
-  , pcre2_match_context * const mcontext, pcre2_match_data * mdata){
+
+// Function for compiling and studying a pattern. All the patterns are compiled
+// once by main() before any matching starts, so each replacement and each count
+// only has to match.
+static pcre2_code * compile_Pattern(char const * const pattern){
 
     int errorcode;
-    PCRE2_SIZE erroroffset, pos=0;
-    int const replacement_Size=strlen(replacement);
+    PCRE2_SIZE erroroffset;
+    pcre2_code * const regex=pcre2_compile((PCRE2_SPTR)pattern
+      , PCRE2_ZERO_TERMINATED, 0, &errorcode, &erroroffset, NULL);
+    if(!regex){
+        PCRE2_UCHAR message[256];
+        pcre2_get_error_message(errorcode, message, sizeof(message));
+        fprintf(stderr, "%s: %s at offset %d\n", pattern, (char *)message
+          , (int)erroroffset);
+        exit(EXIT_FAILURE);
+    }
+    pcre2_jit_compile(regex, PCRE2_JIT_COMPLETE);
+    return regex;
+}
+
+
+// Function for finding the longest match a pattern can have, if it is an
+// alternation of characters and character classes like all of count_Info[].
+// Returns 0 for any other pattern, which may match any length.
+static int maximum_Match_Length(char const * pattern){
+
+    int maximum=0, length=0;
+    for(; *pattern; pattern++, length++)
+        if(*pattern=='|'){
+            maximum=length>maximum ? length : maximum;
+            length=-1;
+        }else if(*pattern=='['){
+            while(*++pattern!=']')
+                if(!*pattern)
+                    return 0;
+        }else if(*pattern=='\\'){
+            if(!*++pattern)
+                return 0;
+        }else if(strchr("*+?{}()^$", *pattern))
+            return 0;
+
+    return length>maximum ? length : maximum;
+}
+
+
+// Function for adding pattern to literal_Matches with literal_Bit if it can
+// be counted with them. The character sets at each position of each
+// alternative are found first so that nothing is added to literal_Matches when
+// the pattern turns out not to be suitable. Returns 0 if it isn't.
+static int add_Literal_Pattern(char const * pattern
+  , uint16_t * const literal_Matches, int const literal_Bit){
+
+    // Up to LITERAL_LENGTH alternatives, with a bit for each code allowed at
+    // each position.
+    enum {MAXIMUM_ALTERNATIVES=LITERAL_LENGTH};
+    uint8_t sets[MAXIMUM_ALTERNATIVES][LITERAL_LENGTH];
+    int alternatives=0, length=0;
+    for(;; pattern++){
+        if(*pattern=='|' || !*pattern){
+            if(length!=LITERAL_LENGTH)
+                return 0;
+            alternatives++;
+            length=0;
+            if(!*pattern)
+                break;
+            continue;
+        }
+        if(alternatives==MAXIMUM_ALTERNATIVES || length==LITERAL_LENGTH)
+            return 0;
+
+        uint8_t set=0;
+        if(*pattern=='['){
+            while(*++pattern!=']'){
+                if(literal_Code(*pattern)>3)
+                    return 0;
+                set|=1<<literal_Code(*pattern);
+            }
+        }else if(literal_Code(*pattern)>3)
+            return 0;
+        else
+            set=1<<literal_Code(*pattern);
+        sets[alternatives][length++]=set;
+    }
+
+    // Set literal_Bit for every key that an alternative matches.
+    for(int a=0; a<alternatives; a++)
+        for(uint32_t key=0; key<1<<2*LITERAL_LENGTH; key++){
+            int position=0;
+            while(position<LITERAL_LENGTH && sets[a][position]
+              >>(key>>2*(LITERAL_LENGTH-1-position) & 3) & 1)
+                position++;
+            if(position==LITERAL_LENGTH)
+                literal_Matches[key]|=1<<literal_Bit;
+        }
+
+    return 1;
+}
+
+
+// Function for finding the next match of a count pattern in sequences that
+// starts at or after pos and before end, only looking at sequences up to
+// limit. Returns the start of the match and stores its end in match_End, or
+// returns end if there is no such match.
+static PCRE2_SIZE next_Match(count_Pattern const * const pattern
+  , string const * const sequences, PCRE2_SIZE const pos, PCRE2_SIZE const end
+  , PCRE2_SIZE const limit, PCRE2_SIZE * const match_End
+  , pcre2_match_context * const mcontext, pcre2_match_data * mdata){
+
+    if(pattern->literal_Bit>=0){
+        uint32_t key=0;
+        for(PCRE2_SIZE i=pos, valid=0; i<limit; i++){
+            int const code=literal_Code(sequences->data[i]);
+            if(code>3){
+                valid=0;
+                continue;
+            }
+            key=(key<<2 | code) & ((1<<2*LITERAL_LENGTH)-1);
+            if(++valid<LITERAL_LENGTH)
+                continue;
+            PCRE2_SIZE const start=i+1-LITERAL_LENGTH;
+            if(start>=end)
+                break;
+            if(pattern->literal_Matches[key]>>pattern->literal_Bit & 1){
+                *match_End=i+1;
+                return start;
+            }
+        }
+        return end;
+    }
+
     PCRE2_SIZE *match=pcre2_get_ovector_pointer(mdata);
+    if(pos>=end || pcre2_jit_match(pattern->regex, sequences->data, limit, pos
+      , 0, mdata, mcontext)<0 || match[0]>=end)
+        return end;
+    *match_End=match[1];
+    return match[0];
+}
+
+
+// Function for counting the matches of a count pattern that start in a chunk
+// of sequences, searching from the start of the chunk. A match can run up to
+// maximum_Length-1 characters past the end of the chunk, so only that much of
+// sequences after the chunk is searched.
+static void count_Chunk(count_Pattern const * const pattern
+  , string const * const sequences, chunk_Count * const chunk
+  , pcre2_match_context * const mcontext, pcre2_match_data * mdata){
+
+    int const maximum_Length=pattern->maximum_Length;
+    PCRE2_SIZE const limit=maximum_Length
+      && chunk->end+maximum_Length-1<sequences->size
+      ? chunk->end+maximum_Length-1 : sequences->size;
+
+    chunk->count=0;
+    chunk->last_End=chunk->start;
+    PCRE2_SIZE match_End=0;
+    while(next_Match(pattern, sequences, chunk->last_End, chunk->end, limit
+      , &match_End, mcontext, mdata)<chunk->end){
+        chunk->count++;
+        chunk->last_End=match_End;
+    }
+}
+
+
+// Function for correcting the count for a chunk when the search should have
+// continued from previous_End, after the start of the chunk, because the last
+// match of the previous chunk ran into it. The matches found searching from
+// there and those found searching from the start of the chunk are followed
+// together until they reach the same match, after which they're all the same,
+// and the count is corrected for the difference before that.
+static void resync_Chunk(count_Pattern const * const pattern
+  , string const * const sequences, chunk_Count * const chunk
+  , PCRE2_SIZE const previous_End, pcre2_match_context * const mcontext
+  , pcre2_match_data * mdata){
+
+    int const maximum_Length=pattern->maximum_Length;
+    PCRE2_SIZE const limit=chunk->end+maximum_Length-1<sequences->size
+      ? chunk->end+maximum_Length-1 : sequences->size;
+
+    PCRE2_SIZE old_End=0, new_End=0, new_Last_End=previous_End;
+    PCRE2_SIZE old_Match=next_Match(pattern, sequences, chunk->start, chunk->end
+      , limit, &old_End, mcontext, mdata);
+    PCRE2_SIZE new_Match=next_Match(pattern, sequences, previous_End
+      , chunk->end, limit, &new_End, mcontext, mdata);
+    while(old_Match!=new_Match)
+        if(old_Match<new_Match){
+            chunk->count--;
+            old_Match=next_Match(pattern, sequences, old_End, chunk->end, limit
+              , &old_End, mcontext, mdata);
+        }else{
+            chunk->count++;
+            new_Last_End=new_End;
+            new_Match=next_Match(pattern, sequences, new_End, chunk->end, limit
+              , &new_End, mcontext, mdata);
+        }
+
+    // If the two never met then none of the chunk's own matches were right.
+    if(new_Match==chunk->end)
+        chunk->last_End=new_Last_End;
+}
 
-    // Compile and study pattern.
-    pcre2_code * regex=pcre2_compile((PCRE2_SPTR)pattern, PCRE2_ZERO_TERMINATED
-      , 0, &errorcode, &erroroffset, NULL);
-    pcre2_jit_compile(regex, PCRE2_JIT_COMPLETE);
 
-    // Find each match of the pattern in src_String and append the characters
-    // preceding each match and the replacement text to dst_String.
-    while(pcre2_jit_match(regex, src_String->data, src_String->size, pos, 0
-      , mdata, mcontext)>=0){
-
-        // Allocate more memory for dst_String if there is not enough space for
-        // the characters preceding the match and the replacement text.
-        while(dst_String->size+match[0]-pos+replacement_Size
-          >dst_String->capacity)
-            dst_String->data=realloc(dst_String->data, dst_String->capacity*=2);
-
-        // Append the characters preceding the match and the replacement text to
-        // dst_String and update the size of dst_String.
-        memcpy(dst_String->data+dst_String->size, src_String->data+pos
-          , match[0]-pos);
-        memcpy(dst_String->data+dst_String->size+match[0]-pos, replacement
-          , replacement_Size);
-        dst_String->size+=match[0]-pos+replacement_Size;
-
-        // Update pos to continue searching after the current match.
-        pos=match[1];
+// Function for counting the matches of all the count patterns that use
+// literal_Matches in a chunk of sequences, in one pass over it. Each pattern
+// still has its own search position so that its matches don't overlap, just
+// like when it is searched for on its own. counts[p] is for the pattern with
+// literal_Bit p.
+static void count_Literal_Chunk(uint16_t const * const literal_Matches
+  , int const literal_Patterns, string const * const sequences
+  , chunk_Count * const * const counts, PCRE2_SIZE const start
+  , PCRE2_SIZE const end){
+
+    for(int p=0; p<literal_Patterns; p++){
+        counts[p]->start=start;
+        counts[p]->end=end;
+        counts[p]->last_End=start;
+        counts[p]->count=0;
     }
 
-    pcre2_code_free(regex);
+    PCRE2_SIZE const limit=end+LITERAL_LENGTH-1<sequences->size
+      ? end+LITERAL_LENGTH-1 : sequences->size;
+    uint32_t key=0;
+    for(PCRE2_SIZE i=start, valid=0; i<limit; i++){
+        int const code=literal_Code(sequences->data[i]);
+        if(code>3){
+            valid=0;
+            continue;
+        }
+        key=(key<<2 | code) & ((1<<2*LITERAL_LENGTH)-1);
+        if(++valid<LITERAL_LENGTH || !literal_Matches[key])
+            continue;
+
+        // Count a match for each pattern that matches here, unless it would
+        // overlap its previous match.
+        PCRE2_SIZE const match_Start=i+1-LITERAL_LENGTH;
+        for(uint32_t bits=literal_Matches[key]; bits; bits&=bits-1){
+            chunk_Count * const count=counts[__builtin_ctz(bits)];
+            if(match_Start>=count->last_End){
+                count->count++;
+                count->last_End=i+1;
+            }
+        }
+    }
+}
+
+
+// Function for removing all the sequence descriptions and new lines from input,
+// the same as replacing matches of ">.*\n|\n" with empty strings, and storing
+// the result in sequences. sequences is allocated with the size of input, which
+// it can't grow past, and memchr() finds each new line and '>'. If input is
+// mapped its pages are released once they've been copied, so that the two
+// aren't both held in memory in full.
+static void extract_Sequences(bench_input * const input
+  , string * const sequences){
+
+    PCRE2_UCHAR const * const data=(PCRE2_UCHAR const *)input->data;
+    PCRE2_SIZE const size=input->size-input->pos;
+    *sequences=(string){malloc(size ? size : 1), size};
+
+    PCRE2_UCHAR const * pos=data+input->pos, * const end=data+input->size;
+    while(pos<end){
+        bench_input_release(input, pos-data);
+
+        PCRE2_UCHAR const * const new_Line=memchr(pos, '\n', end-pos);
+
+        // Without a new line the rest of input is kept whole, since ">.*\n"
+        // needs one to match.
+        if(!new_Line){
+            memcpy(sequences->data+sequences->size, pos, end-pos);
+            sequences->size+=end-pos;
+            break;
+        }
+
+        // Keep the line up to any '>', which starts a sequence description
+        // that runs to the new line.
+        PCRE2_UCHAR const * const description=memchr(pos, '>', new_Line-pos);
+        PCRE2_SIZE const kept=(description ? description : new_Line)-pos;
+        memcpy(sequences->data+sequences->size, pos, kept);
+        sequences->size+=kept;
+        pos=new_Line+1;
+    }
+}
+
+
+// Function for appending size characters from data to dst_String, allocating
+// more memory for it if needed.
+static void append_String(string * const dst_String, PCRE2_UCHAR const * data
+  , PCRE2_SIZE const size){
 
-    // Allocate more memory for dst_String if there is not enough space for
-    // the characters following the last match (or the entire src_String if
-    // there was no match).
-    while(dst_String->size+src_String->size-pos>dst_String->capacity)
+    while(dst_String->size+size>dst_String->capacity)
         dst_String->data=realloc(dst_String->data, dst_String->capacity*=2);
+    memcpy(dst_String->data+dst_String->size, data, size);
+    dst_String->size+=size;
+}
+
+
+// Function for doing the replacement of a replace_Stage on the next size
+// characters of the sequences string after the replacements of the previous
+// stages, appending the result to dst_String. Unless this is the final chunk,
+// the characters that a match might still start at once the next chunk is
+// appended are left in pending. For patterns with a maximum_Length that's the
+// last maximum_Length-1 characters, which are just not searched, and for others
+// it's from the start of a partial match, which PCRE2 can find but searches
+// for more slowly.
+static void replace_Chunk(replace_Stage * const stage
+  , PCRE2_UCHAR const * data, PCRE2_SIZE size, int const final
+  , string * const dst_String, pcre2_match_context * const mcontext
+  , pcre2_match_data * mdata){
+
+    // Search data directly unless there is something left from the previous
+    // chunk that it has to be appended to.
+    if(stage->pending.size){
+        append_String(&stage->pending, data, size);
+        data=stage->pending.data;
+        size=stage->pending.size;
+    }
+
+    PCRE2_SIZE const limit=final || !stage->maximum_Length ? size
+      : size>=(PCRE2_SIZE)stage->maximum_Length-1
+      ? size-(stage->maximum_Length-1) : 0;
+    int const options=final || stage->maximum_Length ? 0 : PCRE2_PARTIAL_HARD;
+    PCRE2_SIZE pos=0, keep;
+    PCRE2_SIZE *match=pcre2_get_ovector_pointer(mdata);
+    for(;;){
+        int const result=pcre2_jit_match(stage->regex, data, size, pos, options
+          , mdata, mcontext);
+
+        if(result>=0 && match[0]<limit){
+            append_String(dst_String, data+pos, match[0]-pos);
+            append_String(dst_String, (PCRE2_UCHAR const *)stage->replacement
+              , stage->replacement_Size);
+            pos=match[1];
+            continue;
+        }
+
+        // Everything before a partial match or limit is done with.
+        keep=result==PCRE2_ERROR_PARTIAL ? match[0] : limit>pos ? limit : pos;
+        append_String(dst_String, data+pos, keep-pos);
+        break;
+    }
 
-    // Append the characters following the last match (or the entire src_String
-    // if there was no match) to dst_String and update the size of dst_String.
-    memcpy(dst_String->data+dst_String->size, src_String->data+pos
-      , src_String->size-pos);
-    dst_String->size+=src_String->size-pos;
+    // Move the characters of the partial match, if any, to the start of
+    // pending.
+    if(data==stage->pending.data){
+        memmove(stage->pending.data, data+keep, size-keep);
+        stage->pending.size=size-keep;
+    }else{
+        stage->pending.size=0;
+        append_String(&stage->pending, data+keep, size-keep);
+    }
 }
 
 
@@ -91,21 +447,54 @@ int main(void){
         {"\\|[^|][^|]*\\|", "-"}
       };
 
-    string input={malloc(16384), 16384}, sequences={malloc(16384), 16384};
-    int postreplace_Size;
+    int const count_Patterns=sizeof(count_Info)/sizeof(char *);
+    int const replace_Patterns=sizeof(replace_Info)/sizeof(char * [2]);
+
+    // Compile every pattern once up front.
+    BENCH_PHASE("compile");
+    pcre2_code * replace_Regexes[replace_Patterns];
+    count_Pattern count_Matchers[count_Patterns];
+    uint16_t * const literal_Matches=calloc(1<<2*LITERAL_LENGTH
+      , sizeof(uint16_t));
+    int literal_Patterns=0, literal_Leader=-1;
+    for(int i=0; i<count_Patterns; i++){
+        count_Matchers[i]=(count_Pattern){compile_Pattern(count_Info[i])
+          , maximum_Match_Length(count_Info[i]), -1, literal_Matches};
+        if(literal_Patterns<LITERAL_PATTERNS && add_Literal_Pattern(
+          count_Info[i], literal_Matches, literal_Patterns)){
+            count_Matchers[i].literal_Bit=literal_Patterns++;
+            if(literal_Leader<0)
+                literal_Leader=i;
+        }
+    }
+    for(int i=0; i<replace_Patterns; i++){
+        replace_Regexes[i]=compile_Pattern(replace_Info[i][0]);
+        if(!maximum_Match_Length(replace_Info[i][0]))
+            pcre2_jit_compile(replace_Regexes[i], PCRE2_JIT_PARTIAL_HARD);
+    }
+
+    bench_input input;
+    string sequences;
+    int input_Size, postreplace_Size, chunks;
+    chunk_Count * chunk_Counts;
 
 
-    // Read in input from stdin until we reach the end or encounter an error.
-    for(int bytes_Read;
-      (bytes_Read=fread(input.data+input.size, 1, input.capacity-input.size
-      , stdin))>0;)
-        // Update the size of input to reflect the newly read input and if
-        // we've reached the full capacity of the input string then also double
-        // its size.
-        if((input.size+=bytes_Read)==input.capacity)
-            input.data=realloc(input.data, input.capacity*=2);
+    // Read in input from stdin, mapped if it is a file, and find all sequence
+    // descriptions and new lines in it, remove them, and store the result in
+    // the sequences string. Only the size of input is needed after that.
+    BENCH_PHASE("read");
+    if(bench_input_read_all(&input, STDIN_FILENO)){
+        perror("read");
+        return EXIT_FAILURE;
+    }
+    input_Size=input.size-input.pos;
+    extract_Sequences(&input, &sequences);
+    bench_input_close(&input);
+
 
+    BENCH_PHASE("match");
 
+    // Each thread has its own match context, JIT stack, and match data.
     #pragma omp parallel
     {
         pcre2_match_context * mcontext=pcre2_match_context_create(NULL);
@@ -114,90 +503,122 @@ int main(void){
 
         pcre2_match_data * mdata=pcre2_match_data_create(16, NULL);
 
-        // Find all sequence descriptions and new lines in input, replace them
-        // with empty strings, and store the result in the sequences string.
         #pragma omp single
         {
-            replace(">.*\\n|\\n", "", &input, &sequences, mcontext, mdata);
-
-            free(input.data);
+            // Split each count pattern into one chunk for each thread, unless
+            // that would make the chunks too small.
+            chunks=1;
+#ifdef _OPENMP
+            chunks=omp_get_num_threads();
+#endif
+            if(chunks>sequences.size/MINIMUM_CHUNK_SIZE)
+                chunks=sequences.size/MINIMUM_CHUNK_SIZE>1
+                  ? sequences.size/MINIMUM_CHUNK_SIZE : 1;
+            chunk_Counts=malloc(count_Patterns*chunks*sizeof(chunk_Count));
         }
 
+        // Where count_Literal_Chunk() puts the counts for each pattern that
+        // uses literal_Matches, for this thread's chunk.
+        chunk_Count * chunk_Literal_Counts[LITERAL_PATTERNS];
+
 
         // Have one thread start working on performing all the replacements
-        // serially.
+        // serially, passing each chunk of the sequences string through all the
+        // replace stages in turn. Only the size of the final result is needed
+        // so the output of the last stage is just counted.
         #pragma omp single nowait
         {
-            // We'll use two strings when doing all the replacements, searching
-            // for patterns in prereplace_String and using postreplace_String to
-            // store the string after the replacements have been made. After
-            // each iteration these two then get swapped. Start out with both
-            // strings having the same capacity as the sequences string and also
-            // copy the sequences string into prereplace_String for the initial
-            // iteration.
-            string prereplace_String={
-                malloc(sequences.capacity), sequences.capacity, sequences.size
-              }, postreplace_String={
-                malloc(sequences.capacity), sequences.capacity
-              };
-            memcpy(prereplace_String.data, sequences.data, sequences.size);
-
-            // Iterate through all the replacement patterns and their
-            // replacements in replace_Info[].
-            for(int i=0; i<sizeof(replace_Info)/sizeof(char * [2]); i++){
-
-                replace(replace_Info[i][0], replace_Info[i][1]
-                  , &prereplace_String, &postreplace_String, mcontext, mdata);
-
-                // Swap prereplace_String and postreplace_String in preparation
-                // for the next iteration.
-                string const temp=prereplace_String;
-                prereplace_String=postreplace_String;
-                postreplace_String=temp;
-
-                postreplace_String.size=0;
+            replace_Stage stages[replace_Patterns];
+            string stage_Outputs[2];
+            for(int i=0; i<replace_Patterns; i++)
+                stages[i]=(replace_Stage){replace_Regexes[i], replace_Info[i][1]
+                  , strlen(replace_Info[i][1]), maximum_Match_Length(
+                  replace_Info[i][0]), {malloc(16384), 16384}};
+            for(int i=0; i<2; i++)
+                stage_Outputs[i]=(string){
+                    malloc(2*REPLACE_CHUNK_SIZE), 2*REPLACE_CHUNK_SIZE
+                  };
+
+            postreplace_Size=0;
+            for(PCRE2_SIZE offset=0;; offset+=REPLACE_CHUNK_SIZE){
+                int const final=offset+REPLACE_CHUNK_SIZE>=sequences.size;
+                PCRE2_UCHAR const * data=sequences.data+offset;
+                PCRE2_SIZE size=final ? sequences.size-offset
+                  : REPLACE_CHUNK_SIZE;
+
+                // The output of each stage is the input of the next, so
+                // alternate between the two stage_Outputs.
+                for(int i=0; i<replace_Patterns; i++){
+                    string * const output=&stage_Outputs[i%2];
+                    output->size=0;
+                    replace_Chunk(&stages[i], data, size, final, output
+                      , mcontext, mdata);
+                    data=output->data;
+                    size=output->size;
+                }
+                postreplace_Size+=size;
+
+                if(final)
+                    break;
             }
 
-            // If any replacements were made, they'll be in prereplace_String
-            // instead of postreplace_String because of the swap done after each
-            // iteration. Copy its size to postreplace_Size.
-            postreplace_Size=prereplace_String.size;
-
-            free(prereplace_String.data);
-            free(postreplace_String.data);
+            for(int i=0; i<replace_Patterns; i++)
+                free(stages[i].pending.data);
+            for(int i=0; i<2; i++)
+                free(stage_Outputs[i].data);
         }
 
 
-        // Iterate through all the count patterns in count_Info[] and perform
-        // the counting for each one on a different thread if available.
-        #pragma omp for schedule(dynamic) ordered
-        for(int i=0; i<sizeof(count_Info)/sizeof(char *); i++){
-
-            int errorcode, count=0;
-            PCRE2_SIZE erroroffset, pos=0;
-            PCRE2_SIZE *match=pcre2_get_ovector_pointer(mdata);
-
-            // Compile and study pattern.
-            pcre2_code * regex=pcre2_compile((PCRE2_SPTR)count_Info[i]
-              , PCRE2_ZERO_TERMINATED, 0, &errorcode, &erroroffset, NULL);
-            pcre2_jit_compile(regex, PCRE2_JIT_COMPLETE);
-
-            // Find each match of the pattern in the sequences string and
-            // increment count for each match.
-            while(pcre2_jit_match(regex, sequences.data, sequences.size
-              , pos, 0, mdata, mcontext)>=0){
+        // Iterate through all the chunks of all the count patterns in
+        // count_Info[] and count each one on a different thread if available.
+        // Patterns that may match any length only get one chunk. The chunks of
+        // the first pattern that uses literal_Matches count all of them.
+        #pragma omp for schedule(dynamic) nowait
+        for(int i=0; i<count_Patterns*chunks; i++){
+
+            int const pattern=i/chunks, chunk=i%chunks;
+            count_Pattern const * const matcher=&count_Matchers[pattern];
+            if(!matcher->maximum_Length && chunk)
+                continue;
+
+            PCRE2_SIZE const start=sequences.size*chunk/chunks;
+            PCRE2_SIZE const end=matcher->maximum_Length
+              ? sequences.size*(chunk+1)/chunks : sequences.size;
+            if(pattern==literal_Leader){
+                for(int p=0; p<count_Patterns; p++)
+                    if(count_Matchers[p].literal_Bit>=0)
+                        chunk_Literal_Counts[count_Matchers[p].literal_Bit]
+                          =&chunk_Counts[p*chunks+chunk];
+                count_Literal_Chunk(literal_Matches, literal_Patterns
+                  , &sequences, chunk_Literal_Counts, start, end);
+            }else if(matcher->literal_Bit<0){
+                chunk_Count * const chunk_Count=&chunk_Counts[i];
+                chunk_Count->start=start;
+                chunk_Count->end=end;
+                count_Chunk(matcher, &sequences, chunk_Count, mcontext, mdata);
+            }
+        }
 
-                count++;
+        #pragma omp barrier
 
-                // Update pos to continue searching after the current match.
-                pos=match[1];
+        // Add up the chunks for each pattern, correcting the chunks that the
+        // last match of the previous chunk ran into, and print the counts in
+        // the correct order.
+        #pragma omp single
+        for(int pattern=0; pattern<count_Patterns; pattern++){
+
+            chunk_Count * const counts=&chunk_Counts[pattern*chunks];
+            int count=counts[0].count;
+            for(int chunk=1; count_Matchers[pattern].maximum_Length
+              && chunk<chunks; chunk++){
+                if(counts[chunk-1].last_End>counts[chunk].start)
+                    resync_Chunk(&count_Matchers[pattern], &sequences
+                      , &counts[chunk], counts[chunk-1].last_End, mcontext
+                      , mdata);
+                count+=counts[chunk].count;
             }
 
-            pcre2_code_free(regex);
-
-            // Print the count for each pattern in the correct order.
-            #pragma omp ordered
-            printf("%s %d\n", count_Info[i], count);
+            printf("%s %d\n", count_Info[pattern], count);
         }
 
 
@@ -208,11 +629,18 @@ int main(void){
 
 
     free(sequences.data);
+    free(chunk_Counts);
+
+    for(int i=0; i<count_Patterns; i++)
+        pcre2_code_free(count_Matchers[i].regex);
+    free(literal_Matches);
+    for(int i=0; i<replace_Patterns; i++)
+        pcre2_code_free(replace_Regexes[i]);
 
     // Print the size of the original input, the size of the input without the
     // sequence descriptions & new lines, and the size after having made all the
     // replacements.
-    printf("\n%d\n%d\n%d\n", (int)input.size, (int)sequences.size
+    printf("\n%d\n%d\n%d\n", input_Size, (int)sequences.size
       , postreplace_Size);
     return 0;
 }
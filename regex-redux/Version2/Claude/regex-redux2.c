@@ -16,18 +16,66 @@
 #include <pcre2.h>
 #include <sys/sysinfo.h>
 
+// Smallest chunk of the sequences that one thread counts a pattern in
+#define MIN_CHUNK_SIZE 1048576
+
+// Size of the chunks of the sequences that each go through every replacement
+// in turn, small enough to stay in cache between replacements
+#define REPLACE_CHUNK_SIZE 65536
+
+// How much of a mapped input is copied between releasing its pages
+#define INPUT_RELEASE_SIZE 4194304
+
 // Structure for storing pattern and match count
 typedef struct {
     const char *pattern;
     int count;
+    pcre2_code *regex;      // Compiled once by compile_patterns
+    int max_length;         // Longest possible match, or 0 if unbounded
 } CountInfo;
 
+// The matches of a count pattern that start in [start, end) of the sequences.
+// last_end is where searching continues after the chunk: the end of its last
+// match, or start if it had none.
+typedef struct {
+    size_t start;
+    size_t end;
+    size_t last_end;
+    int count;
+} ChunkCount;
+
 // Structure for storing pattern and replacement
 typedef struct {
     const char *pattern;
     const char *replacement;
+    pcre2_code *regex;      // Compiled once by compile_patterns
+    int max_length;         // Longest possible match, or 0 if unbounded
 } ReplaceInfo;
 
+// A growable byte buffer
+typedef struct {
+    char *data;
+    size_t length;
+    size_t capacity;
+} Buffer;
+
+// One replacement of the pipeline. pending holds the end of the previous chunk
+// that a match may still start in, which is searched again with the next chunk
+// appended.
+typedef struct {
+    const ReplaceInfo *info;
+    size_t replacement_length;
+    Buffer pending;
+} ReplaceStage;
+
+// Matching state that each thread creates for itself, so that no match data
+// or JIT stack is shared between threads or created per match call
+typedef struct {
+    pcre2_match_data *match_data;
+    pcre2_match_context *match_context;
+    pcre2_jit_stack *jit_stack;
+} MatchState;
+
 // Structure for worker thread arguments
 typedef struct {
     int thread_id;
@@ -37,103 +85,279 @@ typedef struct {
     size_t sequences_length;
     CountInfo *count_info;
     int count_info_size;
+    ChunkCount *chunk_counts;   // chunks_per_pattern for each count pattern
+    int chunks_per_pattern;
     ReplaceInfo *replace_info;
     int replace_info_size;
     size_t *result_length; // For replacement task
 } WorkerArgs;
 
-// Function to perform regex replacement
-char* replace(const char *pattern, const char *replacement,
-             const char *src, size_t src_length,
-             size_t *dst_length) {
-    
+// Compile and JIT compile a pattern, exiting if it is invalid
+pcre2_code* compile_pattern(const char *pattern) {
     int error_code;
     PCRE2_SIZE error_offset;
-    pcre2_code *regex;
-
-    // Compile the pattern
-    regex = pcre2_compile((PCRE2_SPTR)pattern, PCRE2_ZERO_TERMINATED,
-                          0, &error_code, &error_offset, NULL);
+    pcre2_code *regex = pcre2_compile((PCRE2_SPTR)pattern, PCRE2_ZERO_TERMINATED,
+                                      0, &error_code, &error_offset, NULL);
     
     if (regex == NULL) {
         PCRE2_UCHAR error_buffer[256];
         pcre2_get_error_message(error_code, error_buffer, sizeof(error_buffer));
         fprintf(stderr, "PCRE2 compilation failed at offset %zu: %s\n", error_offset, error_buffer);
-        return NULL;
+        exit(1);
     }
-
+    
     // Enable JIT compilation to make matching faster
     pcre2_jit_compile(regex, PCRE2_JIT_COMPLETE);
+    return regex;
+}
+
+// Longest match of a pattern that is an alternation of characters and
+// character classes, like all the count patterns, or 0 for any other pattern
+int max_match_length(const char *pattern) {
+    int max_length = 0, length = 0;
+    for (; *pattern; pattern++, length++) {
+        if (*pattern == '|') {
+            if (length > max_length) max_length = length;
+            length = -1;
+        } else if (*pattern == '[') {
+            while (*++pattern != ']') {
+                if (!*pattern) return 0;
+            }
+        } else if (*pattern == '\\') {
+            if (!*++pattern) return 0;
+        } else if (strchr("*+?{}()^$", *pattern)) {
+            return 0;
+        }
+    }
+    return length > max_length ? length : max_length;
+}
+
+// Compile every count and replace pattern once, before any thread starts
+void compile_patterns(CountInfo *count_info, int count_info_size,
+                      ReplaceInfo *replace_info, int replace_info_size) {
+    for (int i = 0; i < count_info_size; i++) {
+        count_info[i].regex = compile_pattern(count_info[i].pattern);
+        count_info[i].max_length = max_match_length(count_info[i].pattern);
+    }
+    for (int i = 0; i < replace_info_size; i++) {
+        replace_info[i].regex = compile_pattern(replace_info[i].pattern);
+        replace_info[i].max_length = max_match_length(replace_info[i].pattern);
+        // Unbounded patterns find chunk boundaries with partial matching
+        if (!replace_info[i].max_length) {
+            pcre2_jit_compile(replace_info[i].regex, PCRE2_JIT_PARTIAL_HARD);
+        }
+    }
+}
+
+void free_patterns(CountInfo *count_info, int count_info_size,
+                   ReplaceInfo *replace_info, int replace_info_size) {
+    for (int i = 0; i < count_info_size; i++) {
+        pcre2_code_free(count_info[i].regex);
+    }
+    for (int i = 0; i < replace_info_size; i++) {
+        pcre2_code_free(replace_info[i].regex);
+    }
+}
 
-    // Allocate a buffer for the result - make it larger to accommodate growth
-    size_t dst_capacity = src_length * 1.1;
-    char *dst = malloc(dst_capacity);
-    if (!dst) {
+// Create a thread's match data, match context and JIT stack
+MatchState create_match_state(void) {
+    MatchState state;
+    state.match_data = pcre2_match_data_create(16, NULL);
+    state.match_context = pcre2_match_context_create(NULL);
+    state.jit_stack = pcre2_jit_stack_create(16384, 16384, NULL);
+    if (!state.match_data || !state.match_context || !state.jit_stack) {
         fprintf(stderr, "Memory allocation failed\n");
-        pcre2_code_free(regex);
-        return NULL;
+        exit(1);
     }
+    pcre2_jit_stack_assign(state.match_context, NULL, state.jit_stack);
+    return state;
+}
 
-    // Perform the substitution
-    PCRE2_SIZE dst_size = dst_capacity;
-    int rc = pcre2_substitute(regex, (PCRE2_SPTR)src, src_length,
-                            0, PCRE2_SUBSTITUTE_GLOBAL, NULL, NULL,
-                            (PCRE2_SPTR)replacement, PCRE2_ZERO_TERMINATED,
-                            (PCRE2_UCHAR*)dst, &dst_size);
+void free_match_state(MatchState *state) {
+    pcre2_match_data_free(state->match_data);
+    pcre2_match_context_free(state->match_context);
+    pcre2_jit_stack_free(state->jit_stack);
+}
 
-    if (rc < 0) {
-        // If the buffer is too small, try again with a larger buffer
-        if (rc == PCRE2_ERROR_NOMEMORY) {
-            free(dst);
-            dst_capacity = src_length * 2;
-            dst = malloc(dst_capacity);
-            if (!dst) {
-                fprintf(stderr, "Memory allocation failed\n");
-                pcre2_code_free(regex);
-                return NULL;
-            }
-            dst_size = dst_capacity;
-            rc = pcre2_substitute(regex, (PCRE2_SPTR)src, src_length,
-                                 0, PCRE2_SUBSTITUTE_GLOBAL, NULL, NULL,
-                                 (PCRE2_SPTR)replacement, PCRE2_ZERO_TERMINATED,
-                                 (PCRE2_UCHAR*)dst, &dst_size);
-        }
-        
-        if (rc < 0) {
-            fprintf(stderr, "Substitution failed with code %d\n", rc);
-            free(dst);
-            pcre2_code_free(regex);
-            return NULL;
+// Append length bytes to a buffer, growing it as needed
+static void buffer_append(Buffer *buffer, const char *data, size_t length) {
+    if (buffer->length + length > buffer->capacity) {
+        size_t capacity = buffer->capacity ? buffer->capacity : 16384;
+        while (buffer->length + length > capacity) capacity *= 2;
+        buffer->data = realloc(buffer->data, capacity);
+        if (!buffer->data) {
+            fprintf(stderr, "Memory allocation failed\n");
+            exit(1);
         }
+        buffer->capacity = capacity;
     }
+    memcpy(buffer->data + buffer->length, data, length);
+    buffer->length += length;
+}
 
-    pcre2_code_free(regex);
-    *dst_length = dst_size;
-    return dst;
+// Read all of stdin. A regular file is mapped rather than copied, and
+// *mapped is set so the caller unmaps it instead of freeing it.
+char* read_input(size_t *input_length, int *mapped) {
+    struct stat st;
+    if (fstat(STDIN_FILENO, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+        char *data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, STDIN_FILENO, 0);
+        if (data != MAP_FAILED) {
+            madvise(data, st.st_size, MADV_SEQUENTIAL);
+            *input_length = st.st_size;
+            *mapped = 1;
+            return data;
+        }
+    }
+    
+    Buffer input = {NULL, 0, 0};
+    char buffer[65536];
+    size_t bytes_read;
+    while ((bytes_read = fread(buffer, 1, sizeof(buffer), stdin)) > 0) {
+        buffer_append(&input, buffer, bytes_read);
+    }
+    *input_length = input.length;
+    *mapped = 0;
+    return input.data;
 }
 
-// Function to count matches
-int count_matches(const char *pattern, const char *src, size_t src_length) {
-    int error_code;
-    PCRE2_SIZE error_offset;
-    pcre2_code *regex;
+// Remove the headers and newlines, the same as replacing ">.*\n|\n" with "",
+// into a buffer the size of the input. Pages of a mapped input are released
+// once they have been copied, so the input and the sequences are never both
+// held in full.
+char* extract_sequences(const char *input, size_t input_length, int mapped,
+                        size_t *sequences_length) {
+    char *sequences = malloc(input_length ? input_length : 1);
+    if (!sequences) {
+        fprintf(stderr, "Memory allocation failed\n");
+        exit(1);
+    }
+    
+    size_t length = 0, released = 0;
+    size_t page_size = sysconf(_SC_PAGESIZE);
+    const char *pos = input, *end = input + input_length;
+    while (pos < end) {
+        if (mapped && (size_t)(pos - input) >= released + INPUT_RELEASE_SIZE) {
+            size_t done = (pos - input) & ~(page_size - 1);
+            madvise((char*)input + released, done - released, MADV_DONTNEED);
+            released = done;
+        }
+        
+        const char *newline = memchr(pos, '\n', end - pos);
+        if (!newline) {
+            // ">.*\n" needs a newline, so the rest is kept as is
+            memcpy(sequences + length, pos, end - pos);
+            length += end - pos;
+            break;
+        }
+        
+        // A header runs from '>' to the newline
+        const char *header = memchr(pos, '>', newline - pos);
+        size_t kept = (header ? header : newline) - pos;
+        memcpy(sequences + length, pos, kept);
+        length += kept;
+        pos = newline + 1;
+    }
+    
+    *sequences_length = length;
+    return sequences;
+}
 
-    // Compile the pattern
-    regex = pcre2_compile((PCRE2_SPTR)pattern, PCRE2_ZERO_TERMINATED,
-                          0, &error_code, &error_offset, NULL);
+// Apply a stage's replacement to the next chunk of its input, appending the
+// result to out. Unless this is the last chunk, the characters that a match
+// could still start at once more input arrives stay in pending: the last
+// max_length - 1 characters for bounded patterns, which are just not searched,
+// or everything from the start of a partial match for unbounded ones.
+static void replace_chunk(ReplaceStage *stage, const char *src, size_t src_length,
+                          int last, Buffer *out, MatchState *state) {
+    if (stage->pending.length) {
+        buffer_append(&stage->pending, src, src_length);
+        src = stage->pending.data;
+        src_length = stage->pending.length;
+    }
     
-    if (regex == NULL) {
-        PCRE2_UCHAR error_buffer[256];
-        pcre2_get_error_message(error_code, error_buffer, sizeof(error_buffer));
-        fprintf(stderr, "PCRE2 compilation failed at offset %zu: %s\n", error_offset, error_buffer);
-        return -1;
+    int max_length = stage->info->max_length;
+    size_t limit = src_length;
+    if (!last && max_length) {
+        limit = src_length >= (size_t)max_length - 1 ? src_length - (max_length - 1) : 0;
     }
+    uint32_t options = last || max_length ? 0 : PCRE2_PARTIAL_HARD;
+    
+    PCRE2_SIZE *ovector = pcre2_get_ovector_pointer(state->match_data);
+    size_t pos = 0, keep;
+    while (1) {
+        int rc = pcre2_jit_match(stage->info->regex, (PCRE2_SPTR)src, src_length,
+                                 pos, options, state->match_data, state->match_context);
+        if (rc >= 0 && ovector[0] < limit) {
+            buffer_append(out, src + pos, ovector[0] - pos);
+            buffer_append(out, stage->info->replacement, stage->replacement_length);
+            pos = ovector[1];
+            continue;
+        }
+        
+        keep = rc == PCRE2_ERROR_PARTIAL ? ovector[0] : (limit > pos ? limit : pos);
+        buffer_append(out, src + pos, keep - pos);
+        break;
+    }
+    
+    // Keep the unsearched tail for the next chunk
+    if (src == stage->pending.data) {
+        memmove(stage->pending.data, src + keep, src_length - keep);
+        stage->pending.length = src_length - keep;
+    } else {
+        stage->pending.length = 0;
+        buffer_append(&stage->pending, src + keep, src_length - keep);
+    }
+}
 
-    // Enable JIT compilation to make matching faster
-    pcre2_jit_compile(regex, PCRE2_JIT_COMPLETE);
+// Apply every replacement in order and return the length of the result. The
+// sequences go through all the replacements one chunk at a time, so only the
+// length of the final output is ever needed rather than whole intermediate
+// copies of the sequences.
+size_t replace_pipeline(const ReplaceInfo *replace_info, int replace_info_size,
+                        const char *src, size_t src_length, MatchState *state) {
+    ReplaceStage *stages = calloc(replace_info_size, sizeof(ReplaceStage));
+    if (!stages) {
+        fprintf(stderr, "Memory allocation failed\n");
+        exit(1);
+    }
+    for (int i = 0; i < replace_info_size; i++) {
+        stages[i].info = &replace_info[i];
+        stages[i].replacement_length = strlen(replace_info[i].replacement);
+    }
+    
+    // Each stage's output is the next stage's input
+    Buffer outputs[2] = {{NULL, 0, 0}, {NULL, 0, 0}};
+    size_t result_length = 0;
+    for (size_t offset = 0;; offset += REPLACE_CHUNK_SIZE) {
+        int last = offset + REPLACE_CHUNK_SIZE >= src_length;
+        const char *chunk = src + offset;
+        size_t chunk_length = last ? src_length - offset : REPLACE_CHUNK_SIZE;
+        
+        for (int i = 0; i < replace_info_size; i++) {
+            Buffer *out = &outputs[i % 2];
+            out->length = 0;
+            replace_chunk(&stages[i], chunk, chunk_length, last, out, state);
+            chunk = out->data;
+            chunk_length = out->length;
+        }
+        result_length += chunk_length;
+        
+        if (last) break;
+    }
+    
+    for (int i = 0; i < replace_info_size; i++) {
+        free(stages[i].pending.data);
+    }
+    free(stages);
+    free(outputs[0].data);
+    free(outputs[1].data);
+    return result_length;
+}
 
-    // Create match data
-    pcre2_match_data *match_data = pcre2_match_data_create_from_pattern(regex, NULL);
+// Function to count matches of a compiled pattern
+int count_matches(const pcre2_code *regex, const char *src, size_t src_length,
+                  MatchState *state) {
+    pcre2_match_data *match_data = state->match_data;
     
     PCRE2_SIZE start_offset = 0;
     int match_count = 0;
@@ -141,7 +365,7 @@ int count_matches(const char *pattern, const char *src, size_t src_length) {
     // Count all matches
     while (1) {
         int rc = pcre2_jit_match(regex, (PCRE2_SPTR)src, src_length,
-                               start_offset, 0, match_data, NULL);
+                               start_offset, 0, match_data, state->match_context);
         if (rc < 0) {
             if (rc != PCRE2_ERROR_NOMATCH) {
                 fprintf(stderr, "Matching error %d\n", rc);
@@ -161,115 +385,141 @@ int count_matches(const char *pattern, const char *src, size_t src_length) {
         }
     }
     
-    pcre2_match_data_free(match_data);
-    pcre2_code_free(regex);
-    
     return match_count;
 }
 
+// Find the next match starting in [pos, end), looking no further than limit.
+// Returns the match start and sets *match_end, or returns end if none.
+static size_t next_match(const pcre2_code *regex, const char *src, size_t pos,
+                         size_t end, size_t limit, size_t *match_end,
+                         MatchState *state) {
+    if (pos >= end ||
+        pcre2_jit_match(regex, (PCRE2_SPTR)src, limit, pos, 0,
+                        state->match_data, state->match_context) < 0) {
+        return end;
+    }
+    
+    PCRE2_SIZE *ovector = pcre2_get_ovector_pointer(state->match_data);
+    if (ovector[0] >= end) return end;
+    *match_end = ovector[1];
+    return ovector[0];
+}
+
+// Where searching a chunk may look up to: a match starting in the chunk can
+// run max_length - 1 characters past its end
+static size_t chunk_limit(const ChunkCount *chunk, int max_length, size_t src_length) {
+    size_t limit = chunk->end + max_length - 1;
+    return limit < src_length ? limit : src_length;
+}
+
+// Count the matches of a bounded-length pattern that start in a chunk,
+// searching from the start of the chunk
+void count_chunk(const CountInfo *info, const char *src, size_t src_length,
+                 ChunkCount *chunk, MatchState *state) {
+    size_t limit = chunk_limit(chunk, info->max_length, src_length);
+    size_t match_end = 0;
+    
+    chunk->count = 0;
+    chunk->last_end = chunk->start;
+    while (next_match(info->regex, src, chunk->last_end, chunk->end, limit,
+                      &match_end, state) < chunk->end) {
+        chunk->count++;
+        chunk->last_end = match_end;
+    }
+}
+
+// Correct a chunk's count when the previous chunk's last match ran into it, so
+// that searching really continues from previous_end. The matches found from
+// there and from the chunk start are followed together until they reach the
+// same match, after which both searches find the same matches.
+void resync_chunk(const CountInfo *info, const char *src, size_t src_length,
+                  ChunkCount *chunk, size_t previous_end, MatchState *state) {
+    size_t limit = chunk_limit(chunk, info->max_length, src_length);
+    size_t old_end = 0, new_end = 0, new_last_end = previous_end;
+    size_t old_match = next_match(info->regex, src, chunk->start, chunk->end,
+                                  limit, &old_end, state);
+    size_t new_match = next_match(info->regex, src, previous_end, chunk->end,
+                                  limit, &new_end, state);
+    
+    while (old_match != new_match) {
+        if (old_match < new_match) {
+            chunk->count--;
+            old_match = next_match(info->regex, src, old_end, chunk->end,
+                                   limit, &old_end, state);
+        } else {
+            chunk->count++;
+            new_last_end = new_end;
+            new_match = next_match(info->regex, src, new_end, chunk->end,
+                                   limit, &new_end, state);
+        }
+    }
+    
+    // If they never met, none of the chunk's own matches were right
+    if (new_match == chunk->end) {
+        chunk->last_end = new_last_end;
+    }
+}
+
+// Add up a pattern's chunk counts, correcting each chunk that the previous
+// chunk's last match ran into
+int merge_chunks(const CountInfo *info, const char *src, size_t src_length,
+                 ChunkCount *chunks, int num_chunks, MatchState *state) {
+    int count = chunks[0].count;
+    for (int i = 1; info->max_length && i < num_chunks; i++) {
+        if (chunks[i - 1].last_end > chunks[i].start) {
+            resync_chunk(info, src, src_length, &chunks[i], chunks[i - 1].last_end, state);
+        }
+        count += chunks[i].count;
+    }
+    return count;
+}
+
 // Worker thread function
 void* worker_thread(void *arg) {
     WorkerArgs *args = (WorkerArgs*)arg;
+    MatchState state = create_match_state();
     
     // Process based on task type
     if (args->task_type == 0) { // Count task
-        // Each thread processes a subset of patterns
-        for (int i = args->thread_id; i < args->count_info_size; i += args->num_threads) {
-            args->count_info[i].count = count_matches(
-                args->count_info[i].pattern, 
-                args->sequences, 
-                args->sequences_length
-            );
-        }
-    } else { // Replace task
-        // Only one thread should do the replacements
-        if (args->thread_id == 0) {
-            const char *current_src = args->sequences;
-            size_t current_length = args->sequences_length;
-            char *result = NULL;
+        // Each thread processes a subset of the chunks of every pattern.
+        // Patterns that may match any length are counted whole by chunk 0.
+        int chunks = args->chunks_per_pattern;
+        for (int i = args->thread_id; i < args->count_info_size * chunks; i += args->num_threads) {
+            CountInfo *info = &args->count_info[i / chunks];
+            ChunkCount *chunk = &args->chunk_counts[i];
             
-            for (int i = 0; i < args->replace_info_size; i++) {
-                size_t new_length;
-                char *new_result = replace(
-                    args->replace_info[i].pattern,
-                    args->replace_info[i].replacement,
-                    current_src,
-                    current_length,
-                    &new_length
-                );
-                
-                if (new_result) {
-                    // If we have a previous result, free it
-                    if (result) {
-                        free((void*)current_src);
-                    }
-                    
-                    // Update the current source for the next iteration
-                    current_src = new_result;
-                    current_length = new_length;
-                    result = new_result;
-                } else {
-                    fprintf(stderr, "Replacement failed for pattern %s\n", 
-                            args->replace_info[i].pattern);
-                    break;
+            if (!info->max_length) {
+                if (i % chunks == 0) {
+                    chunk->count = count_matches(info->regex, args->sequences,
+                                                 args->sequences_length, &state);
                 }
+                continue;
             }
             
-            // Save the final length
-            *args->result_length = current_length;
-            
-            // Free the last result if it's not the original sequence
-            if (result && result != args->sequences) {
-                free(result);
-            }
+            chunk->start = args->sequences_length * (i % chunks) / chunks;
+            chunk->end = args->sequences_length * (i % chunks + 1) / chunks;
+            count_chunk(info, args->sequences, args->sequences_length, chunk, &state);
         }
+    } else { // Replace task
+        *args->result_length = replace_pipeline(args->replace_info, args->replace_info_size,
+                                                args->sequences, args->sequences_length,
+                                                &state);
     }
     
+    free_match_state(&state);
     return NULL;
 }
 
 int main() {
-    // Read the entire input from stdin
-    char *input = NULL;
-    size_t input_capacity = 0;
-    size_t input_length = 0;
-    char buffer[8192];
-    size_t bytes_read;
-    
-    while ((bytes_read = fread(buffer, 1, sizeof(buffer), stdin)) > 0) {
-        // Ensure we have enough capacity
-        if (input_length + bytes_read > input_capacity) {
-            input_capacity = input_capacity ? input_capacity * 2 : 16384;
-            input = realloc(input, input_capacity);
-            if (!input) {
-                fprintf(stderr, "Memory allocation failed\n");
-                return 1;
-            }
-        }
-        
-        // Copy the data
-        memcpy(input + input_length, buffer, bytes_read);
-        input_length += bytes_read;
-    }
-    
-    // Ensure null termination
-    if (input_length >= input_capacity) {
-        input = realloc(input, input_length + 1);
-        if (!input) {
-            fprintf(stderr, "Memory allocation failed\n");
-            return 1;
-        }
-    }
-    input[input_length] = '\0';
-    
-    // Remove sequence descriptions and newlines
-    size_t sequences_length;
-    char *sequences = replace(">.*\\n|\\n", "", input, input_length, &sequences_length);
-    
-    if (!sequences) {
-        fprintf(stderr, "Failed to remove headers and newlines\n");
-        free(input);
-        return 1;
+    // Read the input and strip the headers and newlines from it
+    size_t input_length, sequences_length;
+    int input_mapped;
+    char *input = read_input(&input_length, &input_mapped);
+    char *sequences = extract_sequences(input, input_length, input_mapped,
+                                        &sequences_length);
+    if (input_mapped) {
+        munmap(input, input_length);
+    } else {
     }
     
     // Define patterns to count
@@ -296,17 +546,33 @@ int main() {
     };
     int replace_info_size = sizeof(replace_info) / sizeof(replace_info[0]);
     
+    compile_patterns(count_info, count_info_size, replace_info, replace_info_size);
+    
     // Get the number of available processors
     int num_threads = get_nprocs();
     if (num_threads < 1) num_threads = 1;
     
+    // Split each count pattern into a chunk per thread, so that the threads
+    // share the counting of each pattern, unless the chunks would be too small
+    int chunks_per_pattern = num_threads;
+    if ((size_t)chunks_per_pattern > sequences_length / MIN_CHUNK_SIZE) {
+        chunks_per_pattern = sequences_length / MIN_CHUNK_SIZE > 1 ? sequences_length / MIN_CHUNK_SIZE : 1;
+    }
+    ChunkCount *chunk_counts = malloc(count_info_size * chunks_per_pattern * sizeof(ChunkCount));
+    if (!chunk_counts) {
+        fprintf(stderr, "Memory allocation failed\n");
+        return 1;
+    }
+    
     // Create and initialize worker thread arguments
     WorkerArgs count_args = {
         .task_type = 0, // Count task
         .sequences = sequences,
         .sequences_length = sequences_length,
         .count_info = count_info,
-        .count_info_size = count_info_size
+        .count_info_size = count_info_size,
+        .chunk_counts = chunk_counts,
+        .chunks_per_pattern = chunks_per_pattern
     };
     
     // Result length for replacement task
@@ -321,13 +587,24 @@ int main() {
         .result_length = &result_length
     };
     
-    // Create worker threads for counting
-    pthread_t *threads = malloc(num_threads * sizeof(pthread_t));
+    // Create worker threads for counting, plus one for the replacements
+    pthread_t *threads = malloc((num_threads + 1) * sizeof(pthread_t));
     WorkerArgs *thread_args = malloc(num_threads * sizeof(WorkerArgs));
     
     if (!threads || !thread_args) {
         fprintf(stderr, "Memory allocation failed\n");
-        free(input);
+        free(sequences);
+        free(threads);
+        free(thread_args);
+        return 1;
+    }
+    
+    // Start the replacement thread, which runs while the patterns are counted
+    replace_args.thread_id = 0;
+    replace_args.num_threads = 1;
+    
+    if (pthread_create(&threads[num_threads], NULL, worker_thread, &replace_args) != 0) {
+        fprintf(stderr, "Failed to create replacement thread\n");
         free(sequences);
         free(threads);
         free(thread_args);
@@ -342,8 +619,7 @@ int main() {
         
         if (pthread_create(&threads[i], NULL, worker_thread, &thread_args[i]) != 0) {
             fprintf(stderr, "Failed to create thread %d\n", i);
-            free(input);
-            free(sequences);
+                free(sequences);
             free(threads);
             free(thread_args);
             return 1;
@@ -355,21 +631,18 @@ int main() {
         pthread_join(threads[i], NULL);
     }
     
-    // Start replacement thread (just use the first thread)
-    replace_args.thread_id = 0;
-    replace_args.num_threads = 1;
-    
-    if (pthread_create(&threads[0], NULL, worker_thread, &replace_args) != 0) {
-        fprintf(stderr, "Failed to create replacement thread\n");
-        free(input);
-        free(sequences);
-        free(threads);
-        free(thread_args);
-        return 1;
+    // Combine the chunks of each pattern
+    MatchState merge_state = create_match_state();
+    for (int i = 0; i < count_info_size; i++) {
+        count_info[i].count = merge_chunks(&count_info[i], sequences, sequences_length,
+                                           &chunk_counts[i * chunks_per_pattern],
+                                           chunks_per_pattern, &merge_state);
     }
+    free_match_state(&merge_state);
+    free(chunk_counts);
     
     // Wait for the replacement thread to finish
-    pthread_join(threads[0], NULL);
+    pthread_join(threads[num_threads], NULL);
     
     // Print the results
     for (int i = 0; i < count_info_size; i++) {
@@ -382,7 +655,7 @@ int main() {
     printf("%zu\n", result_length);
     
     // Clean up
-    free(input);
+    free_patterns(count_info, count_info_size, replace_info, replace_info_size);
     free(sequences);
     free(threads);
     free(thread_args);
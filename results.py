@@ -0,0 +1,323 @@
+#!/usr/bin/env python3
+"""Structured benchmark results and a regression gate.
+
+One CSV row per run, with the columns in FIELDS:
+
+    benchmark, version, author, language  which implementation ran
+    threads     OMP_NUM_THREADS or the thread count, empty for the default
+    input       the run's arguments, e.g. "10000" or "0 < ../../revcomp-input.txt"
+    repetition  1, 2, ... within one benchmark/version/author/language/input
+    wall, user, sys   seconds
+    max_rss_kb  peak resident set, empty if it was not measured
+    host        machine the run was on
+
+Commands:
+
+    results.py convert times-c.txt [...]   times-*.txt from the benchmark-*.sh
+                                           scripts to CSV on stdout
+    results.py jsonl runs.jsonl [...]      harness JSON lines (harness/bench.h)
+                                           to CSV; BENCH_LABEL must be
+                                           "benchmark version author language
+                                           [threads]"
+    results.py compare base.csv new.csv    exit status 1 if any implementation
+                                           got significantly slower
+    results.py roofline runs.jsonl [...]   achieved bandwidth and FLOP rate of
+                                           the work programs register with
+                                           BENCH_WORK, against the host's roofs
+
+compare groups rows by implementation, threads and input. For each group
+in both files it runs a one-sided Mann-Whitney U test on the wall times,
+which is exact for the 7 repetitions the scripts take and does not assume
+normal timings. A slowdown counts if p < --alpha and the median moved by
+more than --min-change, so tiny but consistent shifts on a quiet machine
+are not reported.
+
+roofline takes the median time of each phase with registered work, and of
+the whole run, over the repetitions of an implementation and divides the
+work by it. The roofs come from harness/calibrate, a STREAM triad and
+peak multiply-add rate run once per host and kept in
+harness/calibration-<host>.json (--calibration names another file). For
+a run on t threads the roofs are the one-thread figures times t, capped
+at the all-thread ones. A phase whose flops per byte are below the ridge
+point, peak GFLOP/s over GB/s, is memory-bound and "% roof" is its share
+of the bandwidth; above it, it is compute-bound and "% roof" is its share
+of the peak rate. The bytes are the least traffic the loops need, so the
+flops per byte are an upper bound and a phase found memory-bound is.
+"""
+
+import argparse
+import csv
+import itertools
+import json
+import math
+import os
+import re
+import socket
+import statistics
+import subprocess
+import sys
+
+FIELDS = ["benchmark", "version", "author", "language", "threads", "input",
+          "repetition", "wall", "user", "sys", "max_rss_kb", "host"]
+
+KEY = ["benchmark", "version", "author", "language", "threads", "input"]
+
+# "benchmark version author language"; the version is left out by scripts
+# for benchmarks without version directories, which count as Version1
+HEADER = re.compile(r"^([A-Za-z0-9.\-]+)\s+(?:(Version[0-9]+)\s+)?([A-Za-z0-9._]+)\s+([A-Za-z0-9._]+)$")
+TIME = re.compile(r"^(real|user|sys)\s+(\d+)m(\d+\.\d+)s$")
+
+# directories whose name differs from the benchmark name in the times files
+DIRECTORIES = {"photometry": "Photometry"}
+
+ROOT = os.path.dirname(os.path.abspath(__file__))
+HARNESS = os.path.join(ROOT, "harness")
+
+
+def run_arguments(benchmark, version, author, language):
+    """The arguments of the Makefile's run-<language> command, or ""."""
+    directory = os.path.join(ROOT, DIRECTORIES.get(benchmark, benchmark))
+    for path in [os.path.join(directory, version, author, "Makefile"),
+                 os.path.join(directory, author, "Makefile")]:
+        try:
+            lines = open(path).read().split("\n")
+        except OSError:
+            continue
+        for i, line in enumerate(lines[:-1]):
+            if line.strip() == "run-%s:" % language:
+                command = lines[i + 1].split(None, 1)
+                if command and command[0] in ("python3", "python"):
+                    command = command[1].split(None, 1)
+                return command[1].strip() if len(command) > 1 else ""
+    return ""
+
+
+def convert(paths, host):
+    """Rows from the "time" output the benchmark scripts append."""
+    rows = []
+    for path in paths:
+        row = names = None
+        for line in open(path):
+            line = line.strip()
+            header = HEADER.match(line)
+            time = TIME.match(line)
+            if header:
+                fields = header.groups()
+                fields = (fields[0], fields[1] or "Version1") + fields[2:]
+                names = dict(zip(KEY[:4], fields))
+                names["input"] = run_arguments(*fields)
+                repetition = 0
+            elif time and names:
+                kind, minutes, seconds = time.groups()
+                if kind == "real":
+                    repetition += 1
+                    row = dict(names, threads="", repetition=repetition,
+                               max_rss_kb="", host=host)
+                    rows.append(row)
+                if row is not None:
+                    row["wall" if kind == "real" else kind] = \
+                        "%.3f" % (60 * int(minutes) + float(seconds))
+    return rows
+
+
+def from_jsonl(paths, host):
+    """Rows from harness result lines."""
+    rows, counts = [], {}
+    for path in paths:
+        for line in open(path):
+            if not line.strip():
+                continue
+            result = json.loads(line)
+            label = result.get("label", "").split()
+            if len(label) < 4:
+                print("%s: label %r is not \"benchmark version author language\""
+                      % (path, result.get("label")), file=sys.stderr)
+                continue
+            names = dict(zip(KEY[:4], label))
+            names["threads"] = label[4] if len(label) > 4 else ""
+            names["input"] = result["command"].split(None, 1)[1] \
+                if " " in result["command"] else ""
+            key = tuple(names[k] for k in KEY)
+            counts[key] = counts.get(key, 0) + 1
+            rows.append(dict(names, repetition=counts[key],
+                             wall="%.6f" % result["wall"],
+                             user="%.6f" % result["user"],
+                             sys="%.6f" % result["sys"],
+                             max_rss_kb=result["max_rss_kb"], host=host))
+    return rows
+
+
+def write_rows(rows):
+    out = csv.DictWriter(sys.stdout, FIELDS, extrasaction="ignore")
+    out.writeheader()
+    out.writerows(rows)
+
+
+def read_groups(path):
+    """Wall times grouped by KEY."""
+    groups = {}
+    with open(path, newline="") as f:
+        for row in csv.DictReader(f):
+            if row.get("wall"):
+                groups.setdefault(tuple(row[k] for k in KEY), []) \
+                      .append(float(row["wall"]))
+    return groups
+
+
+def mann_whitney_greater(base, new):
+    """One-sided p-value that new tends to be larger than base.
+
+    Exact over all splits of the pooled midranks when there are at most
+    200000 of them, the normal approximation otherwise."""
+    pooled = sorted(base + new)
+    rank = {}
+    for value, ties in itertools.groupby(pooled):
+        count = len(list(ties))
+        first = len([v for v in pooled if v < value]) + 1
+        rank[value] = first + (count - 1) / 2
+    ranks = [rank[v] for v in base + new]
+    n, m = len(new), len(base)
+    observed = sum(rank[v] for v in new)
+
+    if math.comb(n + m, n) <= 200000:
+        at_least = total = 0
+        for chosen in itertools.combinations(ranks, n):
+            total += 1
+            at_least += sum(chosen) >= observed - 1e-9
+        return at_least / total
+
+    mean = n * (n + m + 1) / 2
+    sd = math.sqrt(n * m * (n + m + 1) / 12)
+    return 0.5 * math.erfc((observed - mean) / sd / math.sqrt(2)) if sd else 1.0
+
+
+def compare(base_path, new_path, alpha, min_change):
+    base, new = read_groups(base_path), read_groups(new_path)
+    regressions = 0
+    for key in sorted(set(base) & set(new)):
+        old_median = statistics.median(base[key])
+        new_median = statistics.median(new[key])
+        change = new_median / old_median - 1 if old_median > 0 else 0.0
+        slower = mann_whitney_greater(base[key], new[key])
+        faster = mann_whitney_greater(new[key], base[key])
+        if slower < alpha and change > min_change:
+            verdict = "SLOWER"
+            regressions += 1
+        elif faster < alpha and change < -min_change:
+            verdict = "faster"
+        else:
+            verdict = ""
+        name = " ".join(k for k in key if k)
+        print("%-60s %9.3f %9.3f %+7.1f%%  p=%.4f %s"
+              % (name, old_median, new_median, 100 * change,
+                 min(slower, faster), verdict))
+    for key in sorted(set(base) ^ set(new)):
+        print("%-60s only in %s" % (" ".join(k for k in key if k),
+                                    base_path if key in base else new_path))
+    print("%d significant slowdown%s" % (regressions, "" if regressions == 1 else "s"))
+    return 1 if regressions else 0
+
+
+def calibration(path=None):
+    """The host's roofs, running harness/calibrate the first time."""
+    path = path or os.path.join(HARNESS, "calibration-%s.json" % socket.gethostname())
+    try:
+        with open(path) as f:
+            return json.load(f)
+    except (OSError, ValueError):
+        pass
+    print("calibrating %s, once" % socket.gethostname(), file=sys.stderr)
+    subprocess.run(["make", "-s", "c"], cwd=HARNESS, stdout=subprocess.DEVNULL,
+                   check=True)
+    line = subprocess.run([os.path.join(HARNESS, "calibrate")], capture_output=True,
+                          text=True, check=True).stdout
+    roofs = json.loads(line)
+    with open(path, "w") as f:
+        f.write(line)
+    return roofs
+
+
+def roofline_table(results, roofs):
+    """Lines of the roofline report for harness result lines."""
+    groups = {}
+    for result in results:
+        if not result.get("work"):
+            continue
+        label = result.get("label") or result["command"]
+        work = result["work"]
+        phases = [("total", result["wall"], work)] + \
+            [(name, result["phases"].get(name, 0.0), phase)
+             for name, phase in work["phases"].items()]
+        for name, seconds, phase in phases:
+            group = groups.setdefault((label, name), [[], phase])
+            group[0].append(seconds)
+    if not groups:
+        return []
+
+    lines = ["roofs of %s: %.1f GB/s and %.1f GFLOP/s a thread, %.1f GB/s and "
+             "%.1f GFLOP/s on %d" % (roofs["host"], roofs["bandwidth_1"],
+                                     roofs["gflops_1"], roofs["bandwidth"],
+                                     roofs["gflops"], roofs["threads"]),
+             "%-50s %-10s %9s %8s %8s %7s %-8s %6s"
+             % ("implementation", "phase", "seconds", "GB/s", "GFLOP/s",
+                "flop/B", "bound", "% roof")]
+    for (label, name), (times, work) in sorted(groups.items()):
+        seconds = statistics.median(times)
+        words = label.split()
+        threads = int(words[4]) if len(words) > 4 and words[4].isdigit() else 1
+        bandwidth = min(roofs["bandwidth_1"] * threads, roofs["bandwidth"])
+        gflops = min(roofs["gflops_1"] * threads, roofs["gflops"])
+        achieved_bandwidth = work["bytes"] / seconds * 1e-9 if seconds > 0 else 0.0
+        achieved_gflops = work["flops"] / seconds * 1e-9 if seconds > 0 else 0.0
+        intensity = work["flops"] / work["bytes"] if work["bytes"] > 0 else math.inf
+        if intensity < gflops / bandwidth:
+            bound, share = "memory", achieved_bandwidth / bandwidth
+        else:
+            bound, share = "compute", achieved_gflops / gflops
+        lines.append("%-50s %-10s %9.3f %8.2f %8.2f %7.2f %-8s %5.1f%%"
+                     % (label, name, seconds, achieved_bandwidth, achieved_gflops,
+                        intensity, bound, 100 * share))
+    return lines
+
+
+def read_jsonl(paths):
+    results = []
+    for path in paths:
+        with open(path) as f:
+            results.extend(json.loads(line) for line in f if line.strip())
+    return results
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.split("\n")[0])
+    commands = parser.add_subparsers(dest="command", required=True)
+    for name in ("convert", "jsonl"):
+        command = commands.add_parser(name)
+        command.add_argument("files", nargs="+")
+        command.add_argument("--host", default=socket.gethostname())
+    command = commands.add_parser("compare")
+    command.add_argument("base")
+    command.add_argument("new")
+    command.add_argument("--alpha", type=float, default=0.01)
+    command.add_argument("--min-change", type=float, default=0.03,
+                         help="smallest relative change of the median reported")
+    command = commands.add_parser("roofline")
+    command.add_argument("files", nargs="+")
+    command.add_argument("--calibration",
+                         help="roofs file (default: harness/calibration-<host>.json)")
+    args = parser.parse_args()
+
+    if args.command == "convert":
+        write_rows(convert(args.files, args.host))
+    elif args.command == "jsonl":
+        write_rows(from_jsonl(args.files, args.host))
+    elif args.command == "roofline":
+        lines = roofline_table(read_jsonl(args.files), calibration(args.calibration))
+        print("\n".join(lines) if lines else "no run registered any work")
+    else:
+        return compare(args.base, args.new, args.alpha, args.min_change)
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
@@ -14,10 +14,30 @@
 // initial sequence_Capacity.
 #define READ_SIZE 16384
 
+// Sequences with at least two chunks of about this many characters are split
+// into chunks which are reversed and complemented by different threads.
+#define CHUNK_SIZE 1048576
+
+// This controls how many pieces of output are collected before they are
+// written out with one writev() or vmsplice().
+#define OUTPUT_VECTORS 64
+
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include "bench.h"
+#include "bench_input.h"
+#ifdef __AVX2__
+   #include <immintrin.h>
+#endif
 
 // intptr_t should be the native integer type on most sane systems.
 typedef intptr_t intnative_t;
@@ -25,47 +45,469 @@ typedef intptr_t intnative_t;
 
 static intnative_t next_Sequence_Number_To_Output=1;
 
-static void process_Sequence(char * sequence, const intnative_t sequence_Size
-  , const intnative_t sequence_Number){
-   // Free up any memory we didn't need.
-   sequence=realloc(sequence, sequence_Size);
-
-   // Set up pointers to the front_Pos and bac_Pos, advance front_Pos to the
-   // first character on the next line, and then make sure front_Pos and
-   // back_Pos start out pointing to non-line feed characters (unless all the
-   // characters happen to be line feeds in which case front_Pos will go past
-   // back_Pos causing the reversing and complementing loop to do nothing.
-   char * front_Pos=sequence, * back_Pos=sequence+sequence_Size-1;
-   while(*front_Pos++!='\n');
-   while(*front_Pos=='\n' && front_Pos<=back_Pos) front_Pos++;
-   while(*back_Pos=='\n' && front_Pos<=back_Pos) back_Pos--;
-
-   // Reverse and complement the sequence.
-   while(front_Pos<=back_Pos){
+
+// The memory for sequences is mapped directly rather than allocated with
+// malloc() so that it is never reused after being handed to vmsplice(). Once a
+// sequence has been output it is unmapped and the pipe keeps the only
+// reference to its pages.
+static char * map_Sequence(const intnative_t capacity){
+   return mmap(NULL, capacity, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS
+     , -1, 0);
+}
+
+static char * remap_Sequence(char * const sequence
+  , const intnative_t old_Capacity, const intnative_t new_Capacity){
+   return mremap(sequence, old_Capacity, new_Capacity, MREMAP_MAYMOVE);
+}
+
+
+// Pieces of output waiting to be written and the sequences to unmap once they
+// have been. If stdout is a pipe the pieces are spliced into it with
+// vmsplice() instead of being copied by write().
+static struct iovec output_Vectors[OUTPUT_VECTORS];
+static int output_Vector_Count;
+static struct iovec sequences_To_Unmap[OUTPUT_VECTORS];
+static int sequences_To_Unmap_Count;
+static int output_Is_Pipe;
+
+
+// Write out the pieces of output collected by add_Output() and then unmap the
+// sequences which have been output completely.
+static void flush_Output(){
+   struct iovec * vectors=output_Vectors;
+   for(int count=output_Vector_Count; count; ){
+      const ssize_t bytes_Written=output_Is_Pipe
+        ? vmsplice(STDOUT_FILENO, vectors, count, 0)
+        : writev(STDOUT_FILENO, vectors, count);
+      if(bytes_Written<0){
+         if(errno==EINTR) continue;
+         perror("writing output");
+         exit(1);
+      }
+
+      // Skip past what was written, which may end partway through a piece.
+      for(size_t bytes_Left=bytes_Written; count && bytes_Left; ){
+         const size_t length=bytes_Left<vectors->iov_len
+           ? bytes_Left : vectors->iov_len;
+         vectors->iov_base=(char *)vectors->iov_base+length;
+         vectors->iov_len-=length;
+         bytes_Left-=length;
+         if(!vectors->iov_len){
+            vectors++;
+            count--;
+         }
+      }
+   }
+   output_Vector_Count=0;
+
+   for(int i=0; i<sequences_To_Unmap_Count; i++)
+      munmap(sequences_To_Unmap[i].iov_base, sequences_To_Unmap[i].iov_len);
+   sequences_To_Unmap_Count=0;
+}
+
+
+// Add length characters starting at characters to the output, joining them to
+// the last piece if they follow on from it.
+static void add_Output(const char * const characters
+  , const intnative_t length){
+   if(!length) return;
+   if(output_Vector_Count
+     && (const char *)output_Vectors[output_Vector_Count-1].iov_base
+     +output_Vectors[output_Vector_Count-1].iov_len==characters)
+      output_Vectors[output_Vector_Count-1].iov_len+=length;
+   else{
+      if(output_Vector_Count==OUTPUT_VECTORS) flush_Output();
+      output_Vectors[output_Vector_Count++]
+        =(struct iovec){(char *)characters, length};
+   }
+}
+
+
+// Remove the line feeds from the lines of a sequence starting at body and
+// ending at end, moving the characters together at body. This is only done if
+// every line has line_Length characters other than the last, which may be
+// shorter, and every line ends with a line feed, the usual layout, so that the
+// line feeds can be put back by insert_Line_Feeds(). Returns the number of
+// characters or -1 if the lines aren't laid out like that, in which case the
+// sequence is left unchanged.
+static intnative_t remove_Line_Feeds(char * const body, char * const end
+  , intnative_t * const line_Length){
+   intnative_t characters=0;
+   *line_Length=0;
+   for(char * line=body; line<end; ){
+      char * const line_End=memchr(line, '\n', end-line);
+      const intnative_t length=line_End ? line_End-line : 0;
+      if(!*line_Length) *line_Length=length;
+
+      // If this line doesn't fit the layout, undo the moves so far.
+      if(!length || length>*line_Length
+        || (length<*line_Length && line_End+1!=end)){
+         if(*line_Length){
+            for(intnative_t i=characters/ *line_Length; i--; ){
+               memmove(body+i*(*line_Length+1), body+i* *line_Length
+                 , *line_Length);
+               body[i*(*line_Length+1)+*line_Length]='\n';
+            }
+         }
+         return -1;
+      }
+
+      memmove(body+characters, line, length);
+      characters+=length;
+      line=line_End+1;
+   }
+   return characters;
+}
+
+
+// Put the line feeds removed by remove_Line_Feeds() back in after every
+// line_Length characters and after the last character, working back from the
+// end so that each line is moved to where it goes before being overwritten.
+static void insert_Line_Feeds(char * const body, const intnative_t characters
+  , const intnative_t line_Length){
+   for(intnative_t i=(characters+line_Length-1)/line_Length; i--; ){
+      const intnative_t length=characters-i*line_Length<line_Length
+        ? characters-i*line_Length : line_Length;
+      memmove(body+i*(line_Length+1), body+i*line_Length, length);
+      body[i*(line_Length+1)+length]='\n';
+   }
+}
+
+
+#ifdef __AVX2__
+// Complement 32 characters at once. COMPLEMENT_LOOKUP only converts letters
+// (characters 64 to 127) and is the same for upper and lower case so the
+// lowest five bits of a letter are looked up with two shuffles, one for each
+// value of bit 4. Other characters become spaces, as they do in
+// COMPLEMENT_LOOKUP.
+static __m256i complement_Block(const __m256i characters){
+   const __m256i low_Half=_mm256_broadcastsi128_si256(_mm_loadu_si128(
+     (const __m128i *)&COMPLEMENT_LOOKUP[64]));
+   const __m256i high_Half=_mm256_broadcastsi128_si256(_mm_loadu_si128(
+     (const __m128i *)&COMPLEMENT_LOOKUP[80]));
+
+   const __m256i index=_mm256_and_si256(characters, _mm256_set1_epi8(15));
+   const __m256i complements=_mm256_blendv_epi8(
+     _mm256_shuffle_epi8(low_Half, index)
+     , _mm256_shuffle_epi8(high_Half, index)
+     , _mm256_slli_epi16(characters, 3));
+   const __m256i is_Letter=_mm256_cmpeq_epi8(_mm256_and_si256(characters
+     , _mm256_set1_epi8((char)0xC0)), _mm256_set1_epi8(0x40));
+   return _mm256_blendv_epi8(_mm256_set1_epi8(' '), complements, is_Letter);
+}
+
+
+// Reverse the order of 32 characters.
+static __m256i reverse_Block(const __m256i characters){
+   const __m256i reversed_Lanes=_mm256_shuffle_epi8(characters
+     , _mm256_setr_epi8(15, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1, 0
+     , 15, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1, 0));
+   return _mm256_permute4x64_epi64(reversed_Lanes, 0x4E);
+}
+#endif
+
+
+// Reverse and complement characters characters starting at front_Pos, which
+// has no line feeds in it, 32 characters from each end at a time if AVX2 is
+// available.
+static void reverse_Complement(char * front_Pos, const intnative_t characters){
+   char * back_Pos=front_Pos+characters-1;
+
+#ifdef __AVX2__
+   for(; back_Pos-front_Pos+1>=64; front_Pos+=32, back_Pos-=32){
+      const __m256i front=_mm256_loadu_si256((__m256i *)front_Pos);
+      const __m256i back=_mm256_loadu_si256((__m256i *)(back_Pos-31));
+      _mm256_storeu_si256((__m256i *)front_Pos
+        , complement_Block(reverse_Block(back)));
+      _mm256_storeu_si256((__m256i *)(back_Pos-31)
+        , complement_Block(reverse_Block(front)));
+   }
+#endif
+
+   for(; front_Pos<=back_Pos; front_Pos++, back_Pos--){
       const char temp=COMPLEMENT_LOOKUP[(unsigned char)*front_Pos];
       *front_Pos=COMPLEMENT_LOOKUP[(unsigned char)*back_Pos];
       *back_Pos=temp;
+   }
+}
+
+// Check that the lines of a sequence starting at body and ending at end are
+// laid out the way remove_Line_Feeds() requires but without moving anything.
+// Returns the number of characters or -1 if the lines aren't laid out like that.
+static intnative_t count_Characters(const char * const body
+  , const char * const end, intnative_t * const line_Length){
+   const char * const first_Line_End=memchr(body, '\n', end-body);
+   if(!first_Line_End || first_Line_End==body) return -1;
+   *line_Length=first_Line_End-body;
+
+   intnative_t characters=0;
+   for(const char * line=body; line<end; ){
+      const char * const line_End=memchr(line, '\n'
+        , end-line<*line_Length+1 ? end-line : *line_Length+1);
+      if(!line_End || line_End==line
+        || (line_End-line<*line_Length && line_End+1!=end))
+         return -1;
+      characters+=line_End-line;
+      line=line_End+1;
+   }
+   return characters;
+}
+
+
+// Copy the characters numbered first to last of a sequence with lines of
+// line_Length characters starting at body to or from buffer, skipping over the
+// line feeds in the sequence.
+static void copy_Characters(char * const body, const intnative_t line_Length
+  , intnative_t first, const intnative_t last, char * buffer
+  , const int to_Buffer){
+   while(first<last){
+      const intnative_t length=line_Length-first%line_Length<last-first
+        ? line_Length-first%line_Length : last-first;
+      char * const characters=body+first+first/line_Length;
+      if(to_Buffer)
+         memcpy(buffer, characters, length);
+      else
+         memcpy(characters, buffer, length);
+      buffer+=length;
+      first+=length;
+   }
+}
+
+
+// Reverse and complement the sequence starting at front_Pos and ending at end
+// one line at a time. If the lines all have the same length, remove the line
+// feeds, reverse and complement the characters in one block, and then put the
+// line feeds back in the same places.
+static void reverse_Complement_Lines(char * front_Pos, char * const end){
+   char * back_Pos=end-1;
+
+   intnative_t line_Length;
+   const intnative_t characters=remove_Line_Feeds(front_Pos, end
+     , &line_Length);
+   if(characters>0){
+      reverse_Complement(front_Pos, characters);
+      insert_Line_Feeds(front_Pos, characters, line_Length);
+   }else if(characters<0){
+      // Otherwise make sure front_Pos and back_Pos start out pointing to
+      // non-line feed characters (unless all the characters happen to be line
+      // feeds in which case front_Pos will go past back_Pos causing the
+      // reversing and complementing loop to do nothing.
+      while(*front_Pos=='\n' && front_Pos<=back_Pos) front_Pos++;
+      while(*back_Pos=='\n' && front_Pos<=back_Pos) back_Pos--;
+
+      // Reverse and complement the sequence.
+      while(front_Pos<=back_Pos){
+         const char temp=COMPLEMENT_LOOKUP[(unsigned char)*front_Pos];
+         *front_Pos=COMPLEMENT_LOOKUP[(unsigned char)*back_Pos];
+         *back_Pos=temp;
+
+         // Skip over line feeds.
+         while(*++front_Pos=='\n');
+         while(*--back_Pos=='\n');
+      }
+   }
+}
+
+
+// A sequence which has been read in and is waiting to be reversed,
+// complemented, and output. Long sequences whose lines have been checked by
+// count_Characters() are split into chunks. Chunk i, other than the last,
+// covers characters i*chunk_Size to (i+1)*chunk_Size at the front of the
+// sequence and the mirrored characters at the back, and the last chunk covers
+// the characters left in the middle. Other sequences are one chunk done by
+// reverse_Complement_Lines() and have a line_Length of 0.
+typedef struct{
+   char * sequence, * body;
+   intnative_t sequence_Size, characters, line_Length, chunk_Size, chunk_Count;
+
+   // 0 while a chunk is waiting, 1 while a thread is working on it, and 2
+   // once it is done.
+   int * chunk_States;
+
+   // The sequence is output in pieces, the header and front parts of the
+   // chunks, the middle, and then the back parts of the chunks, as the chunks
+   // get done.
+   intnative_t next_Piece_To_Output;
+   const char * output_Pos;
+} pending_Sequence;
+
+// The sequences which have been read in, indexed by sequence number-1. Only
+// the thread reading the input uses these.
+static pending_Sequence ** pending_Sequences;
+static intnative_t pending_Sequences_Capacity;
+
+
+// Reverse and complement chunk number chunk of a pending_Sequence unless
+// another thread has already started on it. The characters of the front and
+// back parts of the chunk are copied together so reversing and complementing
+// them as one block puts each one in the place of its mirror.
+// The harness is told of the chunk's part of the sequence being read and
+// written back, line feeds included, and nothing else, since the buffer
+// stays in cache.
+static void process_Chunk(pending_Sequence * const sequence
+  , const intnative_t chunk){
+   int state;
+   #pragma omp atomic capture
+   { state=sequence->chunk_States[chunk]; sequence->chunk_States[chunk]=1; }
+   if(state){
+      // Put back the state of a chunk which is already done.
+      if(state==2){
+         #pragma omp atomic write
+         sequence->chunk_States[chunk]=2;
+      }
+      return;
+   }
+
+   if(!sequence->line_Length){
+      reverse_Complement_Lines(sequence->body
+        , sequence->sequence+sequence->sequence_Size);
+      BENCH_WORK(2.0*(sequence->sequence+sequence->sequence_Size
+        -sequence->body), 0);
+   }else{
+      const intnative_t front_Start=chunk*sequence->chunk_Size;
+      const intnative_t front_End=chunk<sequence->chunk_Count-1
+        ? front_Start+sequence->chunk_Size : sequence->characters-front_Start;
+      const intnative_t back_Start=sequence->characters-front_End
+        , back_End=chunk<sequence->chunk_Count-1
+        ? sequence->characters-front_Start : back_Start;
+      const intnative_t front_Length=front_End-front_Start;
+
+      char * const buffer=malloc(front_Length+back_End-back_Start);
+      copy_Characters(sequence->body, sequence->line_Length, front_Start
+        , front_End, buffer, 1);
+      copy_Characters(sequence->body, sequence->line_Length, back_Start
+        , back_End, buffer+front_Length, 1);
+      reverse_Complement(buffer, front_Length+back_End-back_Start);
+      copy_Characters(sequence->body, sequence->line_Length, front_Start
+        , front_End, buffer, 0);
+      copy_Characters(sequence->body, sequence->line_Length, back_Start
+        , back_End, buffer+front_Length, 0);
+      free(buffer);
+      BENCH_WORK(2.0*(front_Length+back_End-back_Start)
+        *(sequence->line_Length+1)/sequence->line_Length, 0);
+   }
+
+   #pragma omp flush
+   #pragma omp atomic write
+   sequence->chunk_States[chunk]=2;
+}
+
+
+// Returns whether chunk number chunk of a pending_Sequence is done. If wait is
+// set, the chunk is done in this thread if no other thread has started on it
+// yet and otherwise waited for.
+static int finish_Chunk(pending_Sequence * const sequence
+  , const intnative_t chunk, const int wait){
+   if(wait) process_Chunk(sequence, chunk);
+   int state;
+   do{
+      #pragma omp atomic read
+      state=sequence->chunk_States[chunk];
+   }while(wait && state!=2);
+   #pragma omp flush
+   return state==2;
+}
+
+
+// Free up any memory the sequence numbered sequence_Number didn't need, split
+// it into chunks, and have other threads reverse and complement the chunks if
+// OpenMP is enabled and there is more than one CPU core.
+static void queue_Sequence(char * sequence
+  , const intnative_t sequence_Capacity, const intnative_t sequence_Size
+  , const intnative_t sequence_Number){
+   sequence=remap_Sequence(sequence, sequence_Capacity, sequence_Size);
 
-      // Skip over line feeds.
-      while(*++front_Pos=='\n');
-      while(*--back_Pos=='\n');
+   // Advance body to the first character on the next line.
+   char * body=sequence;
+   while(*body++!='\n');
+
+   pending_Sequence * const pending=malloc(sizeof(pending_Sequence));
+   *pending=(pending_Sequence){sequence, body, sequence_Size, 0, 0, 0, 1};
+   pending->output_Pos=sequence;
+
+   // Sequences long enough to be split into at least two chunk pairs are done
+   // by several threads.
+   if(sequence+sequence_Size-body>=2*CHUNK_SIZE){
+      pending->characters=count_Characters(body, sequence+sequence_Size
+        , &pending->line_Length);
+      if(pending->characters>=2*CHUNK_SIZE){
+         pending->chunk_Size=(CHUNK_SIZE+pending->line_Length-1)
+           /pending->line_Length*pending->line_Length;
+         pending->chunk_Count=pending->characters/(2*pending->chunk_Size)+1;
+      }else
+         pending->line_Length=0;
+   }
+   pending->chunk_States=calloc(pending->chunk_Count, sizeof(int));
+
+   if(sequence_Number>pending_Sequences_Capacity){
+      pending_Sequences_Capacity=2*sequence_Number;
+      pending_Sequences=realloc(pending_Sequences
+        , pending_Sequences_Capacity*sizeof(pending_Sequence *));
    }
+   pending_Sequences[sequence_Number-1]=pending;
 
-   // Wait for our turn to output the altered sequence and then output it.
-   #pragma omp flush(next_Sequence_Number_To_Output)
-   while(sequence_Number!=next_Sequence_Number_To_Output){
-      #pragma omp flush(next_Sequence_Number_To_Output)
+   for(intnative_t chunk=0; chunk<pending->chunk_Count; chunk++){
+      #pragma omp task firstprivate(pending, chunk)
+      process_Chunk(pending, chunk);
    }
-   fwrite(sequence, 1, sequence_Size, stdout);
-   next_Sequence_Number_To_Output++;
-   #pragma omp flush(next_Sequence_Number_To_Output)
+}
+
 
-   // Free the memory for the altered sequence.
-   free(sequence);
+// Output the pieces of the sequences up to last_Sequence_Number in order,
+// starting with next_Sequence_Number_To_Output, and unmap each sequence after
+// it is output. If wait is set, this waits for (or does) the chunks which
+// aren't done yet, otherwise it stops at the first piece whose chunk isn't
+// done. Whatever is ready is written out before waiting or stopping.
+static void output_Sequences(const intnative_t last_Sequence_Number
+  , const int wait){
+   for(; next_Sequence_Number_To_Output<=last_Sequence_Number
+     ; next_Sequence_Number_To_Output++){
+      pending_Sequence * const sequence
+        =pending_Sequences[next_Sequence_Number_To_Output-1];
+      const intnative_t piece_Count=2*sequence->chunk_Count-1;
+
+      for(; sequence->next_Piece_To_Output<piece_Count
+        ; sequence->next_Piece_To_Output++){
+         const intnative_t piece=sequence->next_Piece_To_Output;
+         const intnative_t chunk=piece<sequence->chunk_Count
+           ? piece : piece_Count-1-piece;
+         if(!finish_Chunk(sequence, chunk, 0)){
+            flush_Output();
+            if(!wait) return;
+            finish_Chunk(sequence, chunk, 1);
+         }
+
+         // Each piece ends where the characters of the next one start.
+         const intnative_t piece_End=piece<sequence->chunk_Count-1
+           ? (chunk+1)*sequence->chunk_Size
+           : sequence->characters-chunk*sequence->chunk_Size;
+         const char * const piece_End_Pos=piece==piece_Count-1
+           ? sequence->sequence+sequence->sequence_Size
+           : sequence->body+piece_End+piece_End/sequence->line_Length;
+         add_Output(sequence->output_Pos, piece_End_Pos-sequence->output_Pos);
+         sequence->output_Pos=piece_End_Pos;
+      }
+
+      // Unmap the memory for the altered sequence once it has been written.
+      // The pending_Sequence itself is kept until the tasks for its chunks are
+      // finished.
+      if(sequences_To_Unmap_Count==OUTPUT_VECTORS) flush_Output();
+      sequences_To_Unmap[sequences_To_Unmap_Count++]
+        =(struct iovec){sequence->sequence, sequence->sequence_Size};
+   }
+   flush_Output();
 }
 
 
 int main(){
+   // Splice the output into stdout if it is a pipe, with the pipe made as big
+   // as we are allowed so that fewer calls are needed.
+   struct stat output_Stat;
+   if(!fstat(STDOUT_FILENO, &output_Stat) && S_ISFIFO(output_Stat.st_mode)){
+      output_Is_Pipe=1;
+      fcntl(STDOUT_FILENO, F_SETPIPE_SZ, 1048576);
+   }
+
    #pragma omp parallel
    {
       #pragma omp single
@@ -73,12 +515,17 @@ int main(){
          // Allocate memory for the initial sequence (assuming there is one).
          intnative_t sequence_Capacity=READ_SIZE, sequence_Size=0
            , sequence_Number=1;
-         char * sequence=malloc(sequence_Capacity);
+         char * sequence=map_Sequence(sequence_Capacity);
 
          // Read in sequence data until we reach the end of the file or
-         // encounter an error.
-         for(intnative_t bytes_Read; (bytes_Read
-           =fread(&sequence[sequence_Size], 1, READ_SIZE, stdin)); ){
+         // encounter an error, copying straight out of stdin's pages when it
+         // is a file. Sequences are processed and written while later ones
+         // are still being read.
+         BENCH_PHASE("read");
+         bench_input input;
+         bench_input_open(&input, STDIN_FILENO);
+         for(intnative_t bytes_Read; (bytes_Read=bench_input_read(&input
+           , &sequence[sequence_Size], READ_SIZE))>0; ){
 
 
             // Search the read in chunk of data for a '>' to see if any
@@ -99,19 +546,15 @@ int main(){
 
                   // Allocate memory for a new sequence and copy the '>'
                   // & any data following it to the new sequence.
-                  char * const new_Sequence=malloc(READ_SIZE);
+                  char * const new_Sequence=map_Sequence(READ_SIZE);
                   memcpy(new_Sequence, sequence_Start
                     , bytes_Read-number_Of_Preceding_Bytes);
 
-                  // Process the current sequence and have another thread
-                  // do the work if OpenMP is enabled and there is more
-                  // than one CPU core.
-                  #pragma omp task\
-                    firstprivate(sequence, sequence_Size, sequence_Number)
-                  {
-                     process_Sequence(sequence, sequence_Size
-                       , sequence_Number);
-                  }
+                  // Process the current sequence and output any sequences
+                  // that are already done.
+                  queue_Sequence(sequence, sequence_Capacity, sequence_Size
+                    , sequence_Number);
+                  output_Sequences(sequence_Number, 0);
 
                   // Update variables to reflect the new sequence.
                   sequence=new_Sequence;
@@ -133,17 +576,38 @@ int main(){
 
             // If there potentially isn't enough free space for all the data
             // from the next read, then double the capacity of the sequence.
-            if(sequence_Size>sequence_Capacity-READ_SIZE)
-               sequence=realloc(sequence, sequence_Capacity*=2);
+            if(sequence_Size>sequence_Capacity-READ_SIZE){
+               sequence=remap_Sequence(sequence, sequence_Capacity
+                 , 2*sequence_Capacity);
+               sequence_Capacity*=2;
+            }
          }
 
 
          // If there is any data for a last sequence, process it, otherwise
-         // just free the sequence memory.
+         // just unmap the sequence memory.
          if(sequence_Size)
-            process_Sequence(sequence, sequence_Size, sequence_Number);
-         else
-            free(sequence);
+            queue_Sequence(sequence, sequence_Capacity, sequence_Size
+              , sequence_Number);
+         else{
+            munmap(sequence, sequence_Capacity);
+            sequence_Number--;
+         }
+         bench_input_close(&input);
+
+         // Output the rest of the sequences, helping with any chunks which
+         // no other thread has started on yet.
+         BENCH_PHASE("finish");
+         output_Sequences(sequence_Number, 1);
+
+         // Free the pending sequences once the tasks for their chunks have
+         // finished.
+         #pragma omp taskwait
+         for(intnative_t i=0; i<sequence_Number; i++){
+            free(pending_Sequences[i]->chunk_States);
+            free(pending_Sequences[i]);
+         }
+         free(pending_Sequences);
       }
    }
 
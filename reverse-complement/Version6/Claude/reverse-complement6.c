@@ -3,37 +3,88 @@
 //
 // Converted from Python to C by Claude
 
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <stdbool.h>
 #include <pthread.h>
 #include <unistd.h>
+#include <limits.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
 
-#define BUFFER_SIZE 8192
+#define READ_SIZE 65536
 #define LINE_LENGTH 60
-#define MAX_SEQUENCES 1024
+
+// Bytes of sequence data in one block of work
+#define BLOCK_SIZE (256 * 1024)
+
+// Number of slots in the ring between the reader, the workers and the writer.
+// At most this many blocks are in flight at once.
+#define RING_SLOTS 32
 
 // Translation table for complementing DNA
 unsigned char reverse_translation[256];
 
-// Structure for a sequence
+// A piece of work: either a header line or one block of a sequence body.
+// Blocks of a sequence are queued from the last to the first, so their
+// output comes out in order.
+typedef struct {
+    bool is_header;
+    char *data;             // header line, or the block's bytes for pipes
+    off_t offset;           // where the block starts in a regular file
+    size_t bytes;
+    size_t output_start;    // position of the block's first output letter
+    bool final_newline;     // block ends a sequence whose last line is short
+} Job;
+
+// Slot states in the ring
+enum { SLOT_EMPTY, SLOT_QUEUED, SLOT_WORKING, SLOT_DONE };
+
+typedef struct {
+    Job job;
+    int state;
+    char *output;
+    size_t output_len;
+    size_t output_capacity;
+} Slot;
+
+// A block of a sequence as found by the reader
 typedef struct {
-    char *header;
-    size_t header_len;
-    char *sequence;
-    size_t seq_len;
-    size_t seq_capacity;
-} Sequence;
-
-// Array to store sequences
-Sequence *sequences;
-int num_sequences = 0;
-
-// Thread synchronization
-pthread_mutex_t output_mutex = PTHREAD_MUTEX_INITIALIZER;
-pthread_cond_t sequence_processed_cond = PTHREAD_COND_INITIALIZER;
-int next_sequence_to_output = 0;
+    char *data;
+    off_t offset;
+    size_t bytes;
+    size_t letters;
+} Block;
+
+// Ring shared by the pipeline stages
+Slot ring[RING_SLOTS];
+long next_to_queue = 0;      // written by the reader
+long next_to_work = 0;       // claimed by the workers
+long next_to_write = 0;      // written by the writer
+bool reader_done = false;
+
+pthread_mutex_t ring_mutex = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t slot_free_cond = PTHREAD_COND_INITIALIZER;
+pthread_cond_t job_queued_cond = PTHREAD_COND_INITIALIZER;
+pthread_cond_t job_done_cond = PTHREAD_COND_INITIALIZER;
+
+// Input: regular files are read twice, once by the reader to find the
+// sequences and once by the workers with pread, so nothing but the blocks in
+// flight is kept in memory. Pipes can't be read twice, so the reader keeps
+// the blocks of the current sequence.
+int input_fd = STDIN_FILENO;
+bool input_seekable = false;
+
+// Output: when stdout is a pipe, block outputs are spliced into it with
+// vmsplice instead of being copied by writev. The pipe then refers to the
+// output pages themselves, so each block gets freshly mapped memory that is
+// unmapped, never reused, once it has been spliced.
+bool output_is_pipe = false;
 
 // Initialize the reverse translation table
 void init_reverse_translation() {
@@ -41,7 +92,7 @@ void init_reverse_translation() {
     for (int i = 0; i < 256; i++) {
         reverse_translation[i] = i;
     }
-    
+
     // Define the complementary bases
     reverse_translation[(int)'A'] = 'T';
     reverse_translation[(int)'B'] = 'V';
@@ -59,280 +110,458 @@ void init_reverse_translation() {
     reverse_translation[(int)'V'] = 'B';
     reverse_translation[(int)'W'] = 'W';
     reverse_translation[(int)'Y'] = 'R';
-    
-    reverse_translation[(int)'a'] = 't';
-    reverse_translation[(int)'b'] = 'v';
-    reverse_translation[(int)'c'] = 'g';
-    reverse_translation[(int)'d'] = 'h';
-    reverse_translation[(int)'g'] = 'c';
-    reverse_translation[(int)'h'] = 'd';
-    reverse_translation[(int)'k'] = 'm';
-    reverse_translation[(int)'m'] = 'k';
-    reverse_translation[(int)'n'] = 'n';
-    reverse_translation[(int)'r'] = 'y';
-    reverse_translation[(int)'s'] = 's';
-    reverse_translation[(int)'t'] = 'a';
-    reverse_translation[(int)'u'] = 'a';
-    reverse_translation[(int)'v'] = 'b';
-    reverse_translation[(int)'w'] = 'w';
-    reverse_translation[(int)'y'] = 'r';
+
+    reverse_translation[(int)'a'] = 'T';
+    reverse_translation[(int)'b'] = 'V';
+    reverse_translation[(int)'c'] = 'G';
+    reverse_translation[(int)'d'] = 'H';
+    reverse_translation[(int)'g'] = 'C';
+    reverse_translation[(int)'h'] = 'D';
+    reverse_translation[(int)'k'] = 'M';
+    reverse_translation[(int)'m'] = 'K';
+    reverse_translation[(int)'n'] = 'N';
+    reverse_translation[(int)'r'] = 'Y';
+    reverse_translation[(int)'s'] = 'S';
+    reverse_translation[(int)'t'] = 'A';
+    reverse_translation[(int)'u'] = 'A';
+    reverse_translation[(int)'v'] = 'B';
+    reverse_translation[(int)'w'] = 'W';
+    reverse_translation[(int)'y'] = 'R';
+}
+
+// Characters that the Python version deletes from a sequence
+static inline bool is_skipped(unsigned char c) {
+    return c == '\n' || c == '\r' || c == ' ';
 }
 
-// Process a sequence: reverse complement and prepare for output
-char* reverse_complement(Sequence *seq, size_t *result_len) {
-    // Create a buffer for the translated sequence (without newlines)
-    char *translated = malloc(seq->seq_len);
-    if (!translated) {
-        perror("Failed to allocate memory for translated sequence");
+// Count the letters in a piece of a sequence body
+size_t count_letters(const char *data, size_t bytes) {
+    size_t skipped = 0;
+    for (size_t i = 0; i < bytes; i++) {
+        skipped += is_skipped((unsigned char)data[i]);
+    }
+    return bytes - skipped;
+}
+
+void *checked_malloc(size_t size) {
+    void *p = malloc(size);
+    if (!p) {
+        perror("Failed to allocate memory");
         exit(EXIT_FAILURE);
     }
-    
-    // Copy and translate the sequence, skipping newlines and spaces
-    size_t translated_len = 0;
-    for (size_t i = 0; i < seq->seq_len; i++) {
-        char c = seq->sequence[i];
-        if (c != '\n' && c != '\r' && c != ' ') {
-            translated[translated_len++] = reverse_translation[(unsigned char)c];
-        }
+    return p;
+}
+
+// Hand a job to the workers, waiting for a free slot in the ring
+void queue_job(const Job *job) {
+    pthread_mutex_lock(&ring_mutex);
+    while (next_to_queue - next_to_write >= RING_SLOTS) {
+        pthread_cond_wait(&slot_free_cond, &ring_mutex);
     }
-    
-    // Create the result buffer with added newlines
-    // We need at most translated_len + translated_len/LINE_LENGTH + 2 bytes
-    char *result = malloc(translated_len + translated_len / LINE_LENGTH + 2);
-    if (!result) {
-        perror("Failed to allocate memory for result");
-        free(translated);
-        exit(EXIT_FAILURE);
+    Slot *slot = &ring[next_to_queue % RING_SLOTS];
+    slot->job = *job;
+    slot->state = SLOT_QUEUED;
+    next_to_queue++;
+    pthread_cond_signal(&job_queued_cond);
+    pthread_mutex_unlock(&ring_mutex);
+}
+
+// Reverse complement one block into slot->output. Letters are written from
+// the end of the block to the start, with a line feed after every
+// LINE_LENGTH letters of the whole sequence's output.
+void process_block(Slot *slot, char *input) {
+    const Job *job = &slot->job;
+    const char *data = job->data;
+
+    if (!data) {
+        size_t done = 0;
+        while (done < job->bytes) {
+            ssize_t n = pread(input_fd, input + done, job->bytes - done,
+                              job->offset + done);
+            if (n <= 0) {
+                perror("Failed to read input");
+                exit(EXIT_FAILURE);
+            }
+            done += n;
+        }
+        data = input;
     }
-    
-    *result_len = 0;
-    
-    // Add initial newline
-    result[(*result_len)++] = '\n';
-    
-    // Add the trailing part (the part that doesn't make a full line)
-    size_t trailing_length = translated_len % LINE_LENGTH;
-    if (trailing_length > 0) {
-        for (int i = translated_len - trailing_length; i < translated_len; i++) {
-            result[(*result_len)++] = translated[i];
+
+    size_t needed = job->bytes + job->bytes / LINE_LENGTH + 2;
+    if (output_is_pipe) {
+        slot->output = mmap(NULL, needed, PROT_READ | PROT_WRITE,
+                            MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (slot->output == MAP_FAILED) {
+            perror("Failed to map memory for output");
+            exit(EXIT_FAILURE);
         }
-        result[(*result_len)++] = '\n';
+        slot->output_capacity = needed;
+    } else if (slot->output_capacity < needed) {
+        free(slot->output);
+        slot->output = checked_malloc(needed);
+        slot->output_capacity = needed;
     }
-    
-    // Add full lines in reverse order
-    for (size_t i = translated_len - trailing_length; i > 0; i -= LINE_LENGTH) {
-        size_t start = i - LINE_LENGTH;
-        for (size_t j = 0; j < LINE_LENGTH; j++) {
-            result[(*result_len)++] = translated[start + j];
+
+    char *out = slot->output;
+    size_t column = job->output_start % LINE_LENGTH;
+    for (size_t i = job->bytes; i-- > 0; ) {
+        unsigned char c = data[i];
+        if (is_skipped(c)) {
+            continue;
         }
-        result[(*result_len)++] = '\n';
+        *out++ = reverse_translation[c];
+        if (++column == LINE_LENGTH) {
+            *out++ = '\n';
+            column = 0;
+        }
+    }
+    if (job->final_newline) {
+        *out++ = '\n';
+    }
+    slot->output_len = out - slot->output;
+
+    if (job->data) {
+        free(job->data);
+        slot->job.data = NULL;
     }
-    
-    free(translated);
-    return result;
 }
 
-// Thread function to process sequences
-void* process_sequence_thread(void *arg) {
-    int thread_id = *(int*)arg;
-    free(arg);
-    
-    // Process sequences in a round-robin fashion
-    for (int i = thread_id; i < num_sequences; i += sysconf(_SC_NPROCESSORS_ONLN)) {
-        // Get the sequence
-        Sequence *seq = &sequences[i];
-        
-        // Process the sequence
-        size_t result_len;
-        char *result = reverse_complement(seq, &result_len);
-        
-        // Wait for our turn to output
-        pthread_mutex_lock(&output_mutex);
-        while (next_sequence_to_output != i) {
-            pthread_cond_wait(&sequence_processed_cond, &output_mutex);
+// Worker thread: take queued jobs in order and process them
+void *worker_thread(void *arg) {
+    (void)arg;
+    char *input = input_seekable ? checked_malloc(BLOCK_SIZE) : NULL;
+
+    pthread_mutex_lock(&ring_mutex);
+    for (;;) {
+        while (next_to_work == next_to_queue && !reader_done) {
+            pthread_cond_wait(&job_queued_cond, &ring_mutex);
+        }
+        if (next_to_work == next_to_queue) {
+            break;
         }
-        
-        // Output the sequence
-        fwrite(seq->header, 1, seq->header_len, stdout);
-        fwrite(result, 1, result_len, stdout);
-        
-        // Free the result buffer
-        free(result);
-        
-        // Update the next sequence to output and signal other threads
-        next_sequence_to_output++;
-        pthread_cond_broadcast(&sequence_processed_cond);
-        pthread_mutex_unlock(&output_mutex);
+        Slot *slot = &ring[next_to_work % RING_SLOTS];
+        next_to_work++;
+        slot->state = SLOT_WORKING;
+        pthread_mutex_unlock(&ring_mutex);
+
+        if (slot->job.is_header) {
+            slot->output_len = 0;
+        } else {
+            process_block(slot, input);
+        }
+
+        pthread_mutex_lock(&ring_mutex);
+        slot->state = SLOT_DONE;
+        pthread_cond_signal(&job_done_cond);
     }
-    
+    pthread_mutex_unlock(&ring_mutex);
+
+    free(input);
     return NULL;
 }
 
-// Read sequences from stdin
-void read_sequences() {
-    char buffer[BUFFER_SIZE];
-    size_t bytes_read;
-    bool in_header = false;
-    Sequence current_seq = {0};
-    
-    // Allocate space for sequences
-    sequences = malloc(MAX_SEQUENCES * sizeof(Sequence));
-    if (!sequences) {
-        perror("Failed to allocate memory for sequences");
-        exit(EXIT_FAILURE);
+// Queue the header and then the blocks of a finished sequence, last block
+// first.
+void queue_sequence(char *header, size_t header_len, Block *blocks,
+                    size_t num_blocks) {
+    Job job = {0};
+    job.is_header = true;
+    job.data = header;
+    job.bytes = header_len;
+    queue_job(&job);
+
+    size_t letters = 0;
+    for (size_t i = 0; i < num_blocks; i++) {
+        letters += blocks[i].letters;
     }
-    
-    // Read input one character at a time
-    int c;
-    while ((c = getc(stdin)) != EOF) {
-        // Check for sequence header
-        if (c == '>') {
-            // If we already have a sequence, add it to the array
-            if (current_seq.header != NULL) {
-                sequences[num_sequences++] = current_seq;
-                
-                // Reallocate if needed
-                if (num_sequences >= MAX_SEQUENCES) {
-                    sequences = realloc(sequences, (num_sequences + MAX_SEQUENCES) * sizeof(Sequence));
-                    if (!sequences) {
-                        perror("Failed to reallocate memory for sequences");
+
+    // Blocks are walked from the end of the sequence, which is where the
+    // output starts.
+    size_t output_start = 0;
+    for (size_t i = num_blocks; i-- > 0; ) {
+        Job block_job = {0};
+        block_job.data = blocks[i].data;
+        block_job.offset = blocks[i].offset;
+        block_job.bytes = blocks[i].bytes;
+        block_job.output_start = output_start;
+        block_job.final_newline = i == 0 && letters % LINE_LENGTH != 0;
+        queue_job(&block_job);
+        output_start += blocks[i].letters;
+    }
+}
+
+// Append a finished block to the blocks of the current sequence
+void add_block(Block **blocks, size_t *num_blocks, size_t *capacity,
+               Block block) {
+    if (*num_blocks == *capacity) {
+        *capacity = *capacity ? 2 * *capacity : 64;
+        *blocks = realloc(*blocks, *capacity * sizeof(Block));
+        if (!*blocks) {
+            perror("Failed to reallocate memory for blocks");
+            exit(EXIT_FAILURE);
+        }
+    }
+    (*blocks)[(*num_blocks)++] = block;
+}
+
+// Reader thread: scan the input for sequences, split each body into blocks
+// and queue them once the sequence ends.
+void *reader_thread(void *arg) {
+    (void)arg;
+    char *buffer = checked_malloc(READ_SIZE);
+    off_t buffer_offset = 0;
+
+    bool in_header = false, in_sequence = false, at_line_start = true;
+    char *header = NULL;
+    size_t header_len = 0, header_capacity = 0;
+
+    Block *blocks = NULL;
+    size_t num_blocks = 0, blocks_capacity = 0;
+    Block current = {0};
+
+    ssize_t bytes_read;
+    while ((bytes_read = read(input_fd, buffer, READ_SIZE)) != 0) {
+        if (bytes_read < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("Failed to read input");
+            exit(EXIT_FAILURE);
+        }
+
+        char *p = buffer, *end = buffer + bytes_read;
+        while (p < end) {
+            if (in_header) {
+                // Copy the header up to and including its line feed
+                char *newline = memchr(p, '\n', end - p);
+                size_t n = (newline ? newline + 1 : end) - p;
+                if (header_len + n > header_capacity) {
+                    header_capacity = 2 * (header_len + n);
+                    header = realloc(header, header_capacity);
+                    if (!header) {
+                        perror("Failed to reallocate memory for header");
                         exit(EXIT_FAILURE);
                     }
                 }
-                
-                // Initialize new sequence
-                current_seq.header = NULL;
-                current_seq.header_len = 0;
-                current_seq.sequence = NULL;
-                current_seq.seq_len = 0;
-                current_seq.seq_capacity = 0;
-            }
-            
-            // Start new header
-            in_header = true;
-            
-            // Allocate memory for the header
-            current_seq.header = malloc(BUFFER_SIZE);
-            if (!current_seq.header) {
-                perror("Failed to allocate memory for header");
-                exit(EXIT_FAILURE);
+                memcpy(header + header_len, p, n);
+                header_len += n;
+                p += n;
+                if (newline) {
+                    in_header = false;
+                    in_sequence = true;
+                    at_line_start = true;
+                    current.offset = buffer_offset + (p - buffer);
+                }
+                continue;
             }
-            
-            // Add the '>' character
-            current_seq.header[0] = '>';
-            current_seq.header_len = 1;
-        }
-        
-        // Process the character
-        if (in_header) {
-            // Add character to header
-            if (current_seq.header_len >= BUFFER_SIZE - 1) {
-                current_seq.header = realloc(current_seq.header, current_seq.header_len + BUFFER_SIZE);
-                if (!current_seq.header) {
-                    perror("Failed to reallocate memory for header");
-                    exit(EXIT_FAILURE);
+
+            // Find the next '>' that starts a line
+            char *next_header = NULL;
+            for (char *q = p; (q = memchr(q, '>', end - q)); q++) {
+                if (q == p ? at_line_start : q[-1] == '\n') {
+                    next_header = q;
+                    break;
                 }
             }
-            
-            current_seq.header[current_seq.header_len++] = c;
-            
-            // Check for end of header
-            if (c == '\n') {
-                in_header = false;
-                
-                // Allocate memory for the sequence
-                current_seq.sequence = malloc(BUFFER_SIZE);
-                if (!current_seq.sequence) {
-                    perror("Failed to allocate memory for sequence");
-                    exit(EXIT_FAILURE);
+            char *body_end = next_header ? next_header : end;
+            char *segment_start = p;
+
+            // Add the body bytes to blocks of at most BLOCK_SIZE
+            while (in_sequence && p < body_end) {
+                size_t n = body_end - p;
+                if (n > BLOCK_SIZE - current.bytes) {
+                    n = BLOCK_SIZE - current.bytes;
+                }
+                if (!input_seekable) {
+                    if (!current.data) {
+                        current.data = checked_malloc(BLOCK_SIZE);
+                    }
+                    memcpy(current.data + current.bytes, p, n);
+                }
+                current.letters += count_letters(p, n);
+                current.bytes += n;
+                p += n;
+
+                if (current.bytes == BLOCK_SIZE) {
+                    add_block(&blocks, &num_blocks, &blocks_capacity, current);
+                    current = (Block){0};
+                    current.offset = buffer_offset + (p - buffer);
                 }
-                current_seq.seq_capacity = BUFFER_SIZE;
             }
-        } else {
-            // Add character to sequence
-            if (current_seq.seq_len >= current_seq.seq_capacity - 1) {
-                current_seq.seq_capacity += BUFFER_SIZE;
-                current_seq.sequence = realloc(current_seq.sequence, current_seq.seq_capacity);
-                if (!current_seq.sequence) {
-                    perror("Failed to reallocate memory for sequence");
-                    exit(EXIT_FAILURE);
+            if (body_end > segment_start) {
+                at_line_start = body_end[-1] == '\n';
+            }
+            p = body_end;
+
+            if (next_header) {
+                if (in_sequence) {
+                    if (current.bytes) {
+                        add_block(&blocks, &num_blocks, &blocks_capacity, current);
+                    } else {
+                        free(current.data);
+                    }
+                    queue_sequence(header, header_len, blocks, num_blocks);
+                    num_blocks = 0;
+                    current = (Block){0};
+                    header = NULL;
+                    header_len = header_capacity = 0;
                 }
+                in_header = true;
+                in_sequence = false;
             }
-            
-            current_seq.sequence[current_seq.seq_len++] = c;
         }
+        buffer_offset += bytes_read;
     }
-    
-    // Add the last sequence
-    if (current_seq.header != NULL) {
-        sequences[num_sequences++] = current_seq;
+
+    // Queue the last sequence
+    if (in_header || in_sequence) {
+        if (current.bytes) {
+            add_block(&blocks, &num_blocks, &blocks_capacity, current);
+        } else {
+            free(current.data);
+        }
+        queue_sequence(header, header_len, blocks, num_blocks);
     }
+
+    free(blocks);
+    free(buffer);
+
+    pthread_mutex_lock(&ring_mutex);
+    reader_done = true;
+    pthread_cond_broadcast(&job_queued_cond);
+    pthread_cond_signal(&job_done_cond);
+    pthread_mutex_unlock(&ring_mutex);
+    return NULL;
 }
 
-// Process sequences sequentially
-void process_sequences_sequential() {
-    for (int i = 0; i < num_sequences; i++) {
-        Sequence *seq = &sequences[i];
-        
-        size_t result_len;
-        char *result = reverse_complement(seq, &result_len);
-        
-        fwrite(seq->header, 1, seq->header_len, stdout);
-        fwrite(result, 1, result_len, stdout);
-        
-        free(result);
+// Write all of iov to stdout, retrying after short writes. With splice set
+// the pages are handed to the pipe with vmsplice rather than copied.
+void write_all(struct iovec *iov, int count, bool splice) {
+    while (count > 0) {
+        ssize_t n = splice ? vmsplice(STDOUT_FILENO, iov, count, 0)
+                           : writev(STDOUT_FILENO, iov, count);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("Failed to write output");
+            exit(EXIT_FAILURE);
+        }
+        while (count > 0 && (size_t)n >= iov->iov_len) {
+            n -= iov->iov_len;
+            iov++;
+            count--;
+        }
+        if (count > 0) {
+            iov->iov_base = (char *)iov->iov_base + n;
+            iov->iov_len -= n;
+        }
     }
 }
 
-// Free all allocated memory
-void cleanup() {
-    for (int i = 0; i < num_sequences; i++) {
-        free(sequences[i].header);
-        free(sequences[i].sequence);
+// Writer: output finished slots in order, as many as are ready per writev
+// (or per vmsplice for a run of blocks when stdout is a pipe)
+void run_writer() {
+    struct iovec iov[RING_SLOTS < IOV_MAX ? RING_SLOTS : IOV_MAX];
+    bool is_header[RING_SLOTS < IOV_MAX ? RING_SLOTS : IOV_MAX];
+    const int max_iov = sizeof(iov) / sizeof(iov[0]);
+
+    pthread_mutex_lock(&ring_mutex);
+    for (;;) {
+        while (!(next_to_write < next_to_queue &&
+                 ring[next_to_write % RING_SLOTS].state == SLOT_DONE) &&
+               !(reader_done && next_to_write == next_to_queue)) {
+            pthread_cond_wait(&job_done_cond, &ring_mutex);
+        }
+        if (next_to_write == next_to_queue) {
+            break;
+        }
+
+        int count = 0;
+        while (count < max_iov && next_to_write + count < next_to_queue) {
+            Slot *slot = &ring[(next_to_write + count) % RING_SLOTS];
+            if (slot->state != SLOT_DONE) {
+                break;
+            }
+            is_header[count] = slot->job.is_header;
+            if (slot->job.is_header) {
+                iov[count].iov_base = slot->job.data;
+                iov[count].iov_len = slot->job.bytes;
+            } else {
+                iov[count].iov_base = slot->output;
+                iov[count].iov_len = slot->output_len;
+            }
+            count++;
+        }
+        pthread_mutex_unlock(&ring_mutex);
+
+        if (!output_is_pipe) {
+            write_all(iov, count, false);
+        } else {
+            // Headers live in malloc'd memory which will be reused, so only
+            // the runs of blocks between them are spliced.
+            for (int start = 0, end; start < count; start = end) {
+                for (end = start + 1;
+                     end < count && is_header[end] == is_header[start]; end++) {
+                }
+                write_all(iov + start, end - start, !is_header[start]);
+            }
+        }
+
+        pthread_mutex_lock(&ring_mutex);
+        for (int i = 0; i < count; i++) {
+            Slot *slot = &ring[next_to_write % RING_SLOTS];
+            if (slot->job.is_header) {
+                free(slot->job.data);
+            } else if (output_is_pipe) {
+                munmap(slot->output, slot->output_capacity);
+                slot->output = NULL;
+                slot->output_capacity = 0;
+            }
+            slot->state = SLOT_EMPTY;
+            next_to_write++;
+        }
+        pthread_cond_signal(&slot_free_cond);
     }
-    free(sequences);
+    pthread_mutex_unlock(&ring_mutex);
 }
 
 int main() {
     // Initialize the translation table
     init_reverse_translation();
-    
-    // Read all sequences
-    read_sequences();
-    
-    // Determine whether to use parallel processing
-    int num_cores = sysconf(_SC_NPROCESSORS_ONLN);
-    bool use_parallel = (num_cores > 1) && (num_sequences > 0) && 
-                        (sequences[0].seq_len >= 1000000);
-    
-    if (use_parallel) {
-        // Create threads
-        pthread_t *threads = malloc(num_cores * sizeof(pthread_t));
-        if (!threads) {
-            perror("Failed to allocate memory for threads");
-            exit(EXIT_FAILURE);
-        }
-        
-        // Start threads
-        for (int i = 0; i < num_cores; i++) {
-            int *thread_id = malloc(sizeof(int));
-            *thread_id = i;
-            pthread_create(&threads[i], NULL, process_sequence_thread, thread_id);
-        }
-        
-        // Wait for threads to finish
-        for (int i = 0; i < num_cores; i++) {
-            pthread_join(threads[i], NULL);
-        }
-        
-        free(threads);
-    } else {
-        // Process sequences sequentially
-        process_sequences_sequential();
+
+    struct stat st;
+    input_seekable = fstat(input_fd, &st) == 0 && S_ISREG(st.st_mode);
+    output_is_pipe = fstat(STDOUT_FILENO, &st) == 0 && S_ISFIFO(st.st_mode);
+    if (output_is_pipe) {
+        // A bigger pipe means fewer vmsplice calls; this may be refused
+        fcntl(STDOUT_FILENO, F_SETPIPE_SZ, 1024 * 1024);
+    }
+
+    // One reader, one worker per core, and the writer on the main thread
+    int num_workers = sysconf(_SC_NPROCESSORS_ONLN);
+    if (num_workers < 1) {
+        num_workers = 1;
+    }
+
+    pthread_t reader;
+    pthread_t *workers = checked_malloc(num_workers * sizeof(pthread_t));
+    pthread_create(&reader, NULL, reader_thread, NULL);
+    for (int i = 0; i < num_workers; i++) {
+        pthread_create(&workers[i], NULL, worker_thread, NULL);
     }
-    
-    // Clean up
-    cleanup();
-    
+
+    run_writer();
+
+    pthread_join(reader, NULL);
+    for (int i = 0; i < num_workers; i++) {
+        pthread_join(workers[i], NULL);
+    }
+    free(workers);
+
+    for (int i = 0; i < RING_SLOTS; i++) {
+        free(ring[i].output);
+    }
+
     return 0;
-}
\ No newline at end of file
+}
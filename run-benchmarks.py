@@ -0,0 +1,313 @@
+#!/usr/bin/env python3
+"""Pinned, interleaved benchmark runner.
+
+A replacement for the serial loops in benchmark-c.sh and friends. For each
+implementation it runs "make <language>" once. It then runs the command of
+the run-<language> target directly, without make, so make's startup is
+not timed. Every run is timed with wait4() and pinned with taskset to
+cores taken from --cpus. Boot with isolcpus= or use
+a cpuset cgroup and pass its cores to keep other work off them.
+
+The first --warmup runs of each implementation are thrown away. The
+--repetitions measured runs go round by round, with every implementation
+once per round in a shuffled order, so slow drift in the machine (heat,
+other tenants) is spread over all of them instead of landing on whoever
+ran last.
+
+With --jobs N, up to N single-threaded implementations run at once, each
+on its own core. Multithreaded ones (OpenMP, pthreads, rayon, ...) always
+run alone on all of --cpus with OMP_NUM_THREADS set to match. Rows go to
+--output in the results.py CSV schema. Peak RSS comes from the harness
+(harness/bench.h), which is preloaded into every run; --jsonl keeps its
+JSON lines too, with the phases of programs that mark them. When programs
+register their work with BENCH_WORK, the results.py roofline table of it
+follows the wall times.
+
+    ./run-benchmarks.py --languages c --cpus 2-15 --jobs 14
+    ./run-benchmarks.py --benchmarks pidigits nbody --repetitions 11
+"""
+
+import argparse
+import csv
+import glob
+import json
+import os
+import random
+import re
+import socket
+import subprocess
+import sys
+import tempfile
+import time
+
+import results
+
+BENCHMARKS = ["k-nuclcotide", "spectral-norm", "binary-trees", "mandelbrot",
+              "fannkuch-redux", "nbody", "regex-redux", "fasta", "pidigits",
+              "reverse-complement", "kd-tree", "photometry"]
+AUTHORS = ["ChatGPT", "Claude", "Gemini2.5", "Human"]
+
+ROOT = os.path.dirname(os.path.abspath(__file__))
+HARNESS = os.path.join(ROOT, "harness", "libbench.so")
+
+# what marks a build or its source as using more than one thread
+PARALLEL_FLAGS = re.compile(r"-fopenmp|-pthread|-lpthread")
+PARALLEL_SOURCE = re.compile(r"#pragma omp|pthread_create|rayon|thread::spawn|"
+                             r"std::thread|multiprocessing|ThreadPool|ProcessPool")
+SOURCE_SUFFIXES = (".c", ".h", ".rs", ".py")
+
+
+class Implementation:
+    def __init__(self, benchmark, version, author, language, directory):
+        self.benchmark = benchmark
+        self.version = version
+        self.author = author
+        self.language = language
+        self.directory = directory
+        self.command = None
+        self.parallel = False
+        self.repetitions = 0
+
+    def name(self):
+        return " ".join([self.benchmark, self.version, self.author, self.language])
+
+
+def parse_cpus(text):
+    cpus = []
+    for part in text.split(","):
+        first, _, last = part.partition("-")
+        cpus.extend(range(int(first), int(last or first) + 1))
+    return cpus
+
+
+def has_target(makefile, target):
+    """The same test as the shell scripts: an uncommented "target:" line."""
+    try:
+        lines = open(makefile).read().split("\n")
+    except OSError:
+        return False
+    return any(line.startswith(target + ":") for line in lines)
+
+
+def find_implementations(args):
+    found = []
+    for benchmark in args.benchmarks:
+        directory = os.path.join(ROOT, results.DIRECTORIES.get(benchmark, benchmark))
+        versions = sorted(glob.glob(os.path.join(directory, args.versions)))
+        if not versions:
+            # Photometry has no version directories
+            versions = [directory]
+        for version_directory in versions:
+            version = os.path.basename(version_directory) \
+                if version_directory != directory else "Version1"
+            for author in args.authors:
+                path = os.path.join(version_directory, author)
+                for language in args.languages:
+                    if has_target(os.path.join(path, "Makefile"), language) and \
+                       has_target(os.path.join(path, "Makefile"), "run-" + language):
+                        found.append(Implementation(benchmark, version, author,
+                                                    language, path))
+    return found
+
+
+def is_parallel(impl):
+    """Whether the build or source uses more than one thread."""
+    makefile = open(os.path.join(impl.directory, "Makefile")).read()
+    target = re.search(r"^%s:\n((?:\t.*\n?)*)" % re.escape(impl.language),
+                       makefile, re.M)
+    if target and PARALLEL_FLAGS.search(target.group(1)):
+        return True
+    for base, dirs, files in os.walk(impl.directory):
+        dirs[:] = [d for d in dirs if d != "target"]
+        for name in files:
+            if name.endswith(SOURCE_SUFFIXES):
+                try:
+                    if PARALLEL_SOURCE.search(open(os.path.join(base, name),
+                                                   errors="replace").read()):
+                        return True
+                except OSError:
+                    pass
+    return False
+
+
+def prepare(impl):
+    """Builds impl and finds its run command; False if either fails."""
+    build = subprocess.run(["make", impl.language], cwd=impl.directory,
+                           stdout=subprocess.DEVNULL, stderr=subprocess.DEVNULL)
+    if build.returncode != 0:
+        print("%s: build failed" % impl.name(), file=sys.stderr)
+        return False
+    dry = subprocess.run(["make", "-s", "-n", "run-" + impl.language],
+                         cwd=impl.directory, capture_output=True, text=True)
+    commands = [line for line in dry.stdout.split("\n") if line.strip()]
+    if dry.returncode != 0 or not commands:
+        print("%s: no run-%s command" % (impl.name(), impl.language), file=sys.stderr)
+        return False
+    impl.command = commands[-1]
+    impl.parallel = is_parallel(impl)
+    return True
+
+
+def governors(cpus):
+    found = set()
+    for cpu in cpus:
+        try:
+            path = "/sys/devices/system/cpu/cpu%d/cpufreq/scaling_governor" % cpu
+            found.add(open(path).read().strip())
+        except OSError:
+            pass
+    return found
+
+
+class Runner:
+    def __init__(self, args):
+        self.cpus = args.cpus
+        self.jobs = args.jobs
+        self.jsonl = args.jsonl
+        self.host = socket.gethostname()
+        self.free = list(self.cpus)
+        self.running = {}   # pid -> (impl, measured, cores, start)
+        self.rows = []
+        self.lines = []     # harness lines of the measured runs
+
+    def launch(self, impl, measured, cores):
+        env = dict(os.environ)
+        env["OMP_NUM_THREADS"] = str(len(cores))
+        output = None
+        if os.path.exists(HARNESS):
+            fd, output = tempfile.mkstemp(prefix="bench-", suffix=".jsonl")
+            os.close(fd)
+            env["LD_PRELOAD"] = HARNESS
+            env["BENCH_OUTPUT"] = output
+            env["BENCH_LABEL"] = "%s %d" % (impl.name(), len(cores))
+        # The program is forked by sh rather than exec'ed: a process started
+        # straight from this one inherits its peak RSS at exec, so only the
+        # program's own harness line has a true max_rss_kb.
+        process = subprocess.Popen(
+            ["taskset", "-c", ",".join(map(str, cores)), "sh", "-c", impl.command],
+            cwd=impl.directory, env=env, stdout=subprocess.DEVNULL)
+        process.returncode = 0  # reaped with wait4 below, not by Popen
+        self.running[process.pid] = (impl, measured, cores, output, time.monotonic())
+
+    def harness_line(self, output):
+        """The program's line from the harness, skipping the one from sh."""
+        if not output:
+            return None
+        try:
+            with open(output) as f:
+                lines = [json.loads(line) for line in f if line.strip()]
+        except (OSError, ValueError):
+            lines = []
+        os.unlink(output)
+        for line in lines:
+            if not line["command"].startswith("sh -c"):
+                return line
+        return None
+
+    def reap(self):
+        pid, status, usage = os.wait4(-1, 0)
+        end = time.monotonic()
+        if pid not in self.running:
+            return
+        impl, measured, cores, output, start = self.running.pop(pid)
+        self.free.extend(cores)
+        line = self.harness_line(output)
+        if os.waitstatus_to_exitcode(status) != 0:
+            print("%s: exit status %d" % (impl.name(), os.waitstatus_to_exitcode(status)),
+                  file=sys.stderr)
+            return
+        if measured:
+            impl.repetitions += 1
+            self.rows.append({
+                "benchmark": impl.benchmark, "version": impl.version,
+                "author": impl.author, "language": impl.language,
+                "threads": len(cores), "input": impl.command.split(None, 1)[1]
+                if " " in impl.command else "",
+                "repetition": impl.repetitions, "wall": "%.6f" % (end - start),
+                "user": "%.6f" % usage.ru_utime, "sys": "%.6f" % usage.ru_stime,
+                "max_rss_kb": line["max_rss_kb"] if line else "", "host": self.host})
+            if line:
+                self.lines.append(line)
+            if line and self.jsonl:
+                with open(self.jsonl, "a") as f:
+                    f.write(json.dumps(line) + "\n")
+            print("%-50s %2d cores %9.3f s" % (impl.name(), len(cores), end - start))
+
+    def run(self, impl, measured):
+        """Starts impl as soon as it has its cores: one of its own if it is
+        single-threaded, all of them otherwise."""
+        if impl.parallel or self.jobs == 1:
+            while self.running:
+                self.reap()
+            self.free = []
+            self.launch(impl, measured, list(self.cpus) if impl.parallel else self.cpus[:1])
+            while self.running:
+                self.reap()
+            self.free = list(self.cpus)
+            return
+        while len(self.running) >= self.jobs or not self.free:
+            self.reap()
+        self.launch(impl, measured, [self.free.pop(0)])
+
+    def finish(self):
+        while self.running:
+            self.reap()
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.split("\n")[0])
+    parser.add_argument("--benchmarks", nargs="+", default=BENCHMARKS)
+    parser.add_argument("--authors", nargs="+", default=AUTHORS)
+    parser.add_argument("--languages", nargs="+", default=["c"])
+    parser.add_argument("--versions", default="Version*")
+    parser.add_argument("--repetitions", type=int, default=7)
+    parser.add_argument("--warmup", type=int, default=1)
+    parser.add_argument("--cpus", type=parse_cpus,
+                        default=sorted(os.sched_getaffinity(0)),
+                        help="cores to run on, e.g. 2-15 or 1,3,5 (default: all allowed)")
+    parser.add_argument("--jobs", type=int, default=1,
+                        help="single-threaded runs at once, each on its own core")
+    parser.add_argument("--seed", type=int, default=0)
+    parser.add_argument("--output", default="results-run.csv")
+    parser.add_argument("--jsonl", help="also collect harness JSON lines here")
+    args = parser.parse_args()
+    args.jobs = max(1, min(args.jobs, len(args.cpus)))
+
+    slow = governors(args.cpus) - {"performance"}
+    if slow:
+        print("warning: cpufreq governor %s; timings will vary with frequency"
+              % ", ".join(sorted(slow)), file=sys.stderr)
+
+    subprocess.run(["make", "-s", "c"], cwd=os.path.dirname(HARNESS),
+                   stdout=subprocess.DEVNULL)
+    implementations = [impl for impl in find_implementations(args) if prepare(impl)]
+    if not implementations:
+        print("nothing to run", file=sys.stderr)
+        return 1
+
+    runner = Runner(args)
+    shuffle = random.Random(args.seed)
+    for impl in implementations:
+        for _ in range(args.warmup):
+            runner.run(impl, False)
+    runner.finish()
+    for _ in range(args.repetitions):
+        order = list(implementations)
+        shuffle.shuffle(order)
+        for impl in order:
+            runner.run(impl, True)
+    runner.finish()
+
+    with open(args.output, "w", newline="") as f:
+        out = csv.DictWriter(f, results.FIELDS)
+        out.writeheader()
+        out.writerows(sorted(runner.rows, key=lambda row: [
+            str(row[k]) for k in results.KEY] + [row["repetition"]]))
+    print("%d runs written to %s" % (len(runner.rows), args.output))
+    if any(line.get("work") for line in runner.lines):
+        print("\n".join(results.roofline_table(runner.lines, results.calibration())))
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
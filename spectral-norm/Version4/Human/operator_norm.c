@@ -0,0 +1,237 @@
+/* The Computer Language Benchmarks Game
+ * https://salsa.debian.org/benchmarksgame-team/benchmarksgame/
+ *
+ * General operator norms, see operator_norm.h.  The product follows
+ * mult_AtAv in spectral-norm.c: one parallel region for the whole
+ * iteration, each thread accumulating A^t (A x) into its own vector, and
+ * the vectors summed by static slices of the result.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <malloc.h>
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <omp.h>
+
+#include "operator_norm.h"
+
+#define HEADER_SIZE 32
+
+/* a file of size bytes holds the arrays the header describes */
+static int check_layout(opnorm_matrix *m, const char *magic, size_t size) {
+   const char *base = m->map;
+   size_t need;
+
+   if (m->rows <= 0 || m->cols <= 0 || m->nnz < 0) return -1;
+
+   if (strcmp(magic, "SNDENSE") == 0) {
+      m->kind = OPNORM_DENSE;
+      if ((size_t)m->cols > (SIZE_MAX - HEADER_SIZE) / sizeof(double) / m->rows)
+         return -1;
+      need = HEADER_SIZE + (size_t)m->rows * m->cols * sizeof(double);
+      m->values = (const double *)(base + HEADER_SIZE);
+      m->nnz = m->rows * m->cols;
+      return size == need ? 0 : -1;
+   }
+
+   if (strcmp(magic, "SNCSR") == 0) {
+      long i, k;
+      m->kind = OPNORM_CSR;
+      need = HEADER_SIZE + (m->rows + 1 + 2 * (size_t)m->nnz) * 8;
+      if (size != need) return -1;
+      m->row_start = (const int64_t *)(base + HEADER_SIZE);
+      m->column = m->row_start + m->rows + 1;
+      m->values = (const double *)(m->column + m->nnz);
+      if (m->row_start[0] != 0 || m->row_start[m->rows] != m->nnz) return -1;
+      for (i = 0; i < m->rows; i++)
+         if (m->row_start[i + 1] < m->row_start[i]) return -1;
+      for (k = 0; k < m->nnz; k++)
+         if (m->column[k] < 0 || m->column[k] >= m->cols) return -1;
+      return 0;
+   }
+
+   return -1;
+}
+
+int opnorm_map(const char *path, opnorm_matrix *m) {
+   struct stat st;
+   char magic[9] = {0};
+   int64_t dims[3];
+   int fd;
+
+   memset(m, 0, sizeof(*m));
+   fd = open(path, O_RDONLY);
+   if (fd < 0) return -1;
+   if (fstat(fd, &st) != 0) {
+      close(fd);
+      return -1;
+   }
+   if (st.st_size < HEADER_SIZE) {
+      close(fd);
+      errno = EINVAL;
+      return -1;
+   }
+
+   m->map_size = st.st_size;
+   m->map = mmap(NULL, m->map_size, PROT_READ, MAP_SHARED, fd, 0);
+   close(fd);
+   if (m->map == MAP_FAILED) {
+      m->map = NULL;
+      return -1;
+   }
+
+   memcpy(magic, m->map, 8);
+   memcpy(dims, (char *)m->map + 8, sizeof(dims));
+   m->rows = dims[0];
+   m->cols = dims[1];
+   m->nnz = dims[2];
+   if (check_layout(m, magic, m->map_size) != 0) {
+      opnorm_unmap(m);
+      errno = EINVAL;
+      return -1;
+   }
+
+   madvise(m->map, m->map_size, MADV_SEQUENTIAL);
+   return 0;
+}
+
+void opnorm_unmap(opnorm_matrix *m) {
+   if (m->map) munmap(m->map, m->map_size);
+   memset(m, 0, sizeof(*m));
+}
+
+void opnorm_callback(opnorm_matrix *m, long rows, long cols,
+                     void (*row)(void *context, long i, double *a),
+                     void *context) {
+   memset(m, 0, sizeof(*m));
+   m->kind = OPNORM_CALLBACK;
+   m->rows = rows;
+   m->cols = cols;
+   m->nnz = rows * cols;
+   m->row = row;
+   m->context = context;
+}
+
+/* acc += A(i,:) * (A(i,:) . x) for a dense row a */
+static void dense_row(const double *a, const double *x, double *acc, long cols) {
+   double s = 0;
+   long j;
+#pragma omp simd reduction(+:s)
+   for (j = 0; j < cols; j++) s += a[j] * x[j];
+#pragma omp simd
+   for (j = 0; j < cols; j++) acc[j] += a[j] * s;
+}
+
+/* out = A^t A x; called by every thread of the team.  buffers[t] holds
+ * thread t's accumulator and, for callbacks, its row. */
+static void product(const opnorm_matrix *m, const double *x, double *out,
+                    double *const *buffers) {
+   const int threads = omp_get_num_threads();
+   double *acc = buffers[omp_get_thread_num()];
+   double *a = acc + m->cols;
+   long i, j;
+
+   memset(acc, 0, m->cols * sizeof(double));
+
+#pragma omp for schedule(dynamic, 64)
+   for (i = 0; i < m->rows; i++) {
+      if (m->kind == OPNORM_CSR) {
+         const int64_t k0 = m->row_start[i], k1 = m->row_start[i + 1];
+         double s = 0;
+         int64_t k;
+         for (k = k0; k < k1; k++) s += m->values[k] * x[m->column[k]];
+         for (k = k0; k < k1; k++) acc[m->column[k]] += m->values[k] * s;
+      } else if (m->kind == OPNORM_DENSE) {
+         dense_row(m->values + (size_t)i * m->cols, x, acc, m->cols);
+      } else {
+         m->row(m->context, i, a);
+         dense_row(a, x, acc, m->cols);
+      }
+   }
+
+#pragma omp for schedule(static)
+   for (j = 0; j < m->cols; j++) {
+      double total = 0;
+      int t;
+      for (t = 0; t < threads; t++) total += buffers[t][j];
+      out[j] = total;
+   }
+}
+
+int opnorm_solve(const opnorm_matrix *m, double tolerance, int max_iterations,
+                 opnorm_result *result) {
+   const int max_threads = omp_get_max_threads();
+   double **buffers = calloc(max_threads, sizeof(double *));
+   double *x = memalign(64, m->cols * sizeof(double));
+   double *y = memalign(64, m->cols * sizeof(double));
+   double estimate = 0, previous = 0, scale = 0, start;
+   int failed = 0, done = 0, iterations = 0;
+
+   if (!buffers || !x || !y) {
+      free(buffers);
+      free(x);
+      free(y);
+      return -1;
+   }
+
+   start = omp_get_wtime();
+#pragma omp parallel
+   {
+      const size_t size = (m->kind == OPNORM_CALLBACK ? 2 : 1) * m->cols;
+      long j;
+
+      buffers[omp_get_thread_num()] = memalign(64, size * sizeof(double));
+      if (!buffers[omp_get_thread_num()]) {
+#pragma omp atomic write
+         failed = 1;
+      }
+      /* the barrier ending the next loop makes failed visible to all */
+
+      /* unit start vector, first touched by the slices that write it */
+#pragma omp for schedule(static)
+      for (j = 0; j < m->cols; j++) x[j] = 1 / sqrt(m->cols);
+
+      while (!failed && !done) {
+         product(m, x, y, buffers);
+
+         /* x is a unit vector, so x . A^t A x estimates ||A||^2; the
+          * next x is y scaled to unit length */
+#pragma omp single
+         {
+            double xy = 0, yy = 0;
+            for (j = 0; j < m->cols; j++) {
+               xy += x[j] * y[j];
+               yy += y[j] * y[j];
+            }
+            previous = estimate;
+            estimate = xy;
+            scale = yy > 0 ? 1 / sqrt(yy) : 0;
+            iterations++;
+            done = yy == 0 || iterations >= max_iterations ||
+               (iterations > 1 && fabs(estimate - previous) <= tolerance * estimate);
+         }
+
+#pragma omp for schedule(static)
+         for (j = 0; j < m->cols; j++) x[j] = y[j] * scale;
+      }
+
+      free(buffers[omp_get_thread_num()]);
+   }
+
+   result->seconds = omp_get_wtime() - start;
+   result->norm = sqrt(estimate);
+   result->iterations = iterations;
+   result->converged = iterations > 1 &&
+      fabs(estimate - previous) <= tolerance * estimate;
+   result->gflops = 4.0 * m->nnz * iterations / result->seconds / 1e9;
+
+   free(buffers);
+   free(x);
+   free(y);
+   return failed ? -1 : 0;
+}
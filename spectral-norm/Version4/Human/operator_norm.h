@@ -0,0 +1,71 @@
+/* The Computer Language Benchmarks Game
+ * https://salsa.debian.org/benchmarksgame-team/benchmarksgame/
+ *
+ * Operator norm ||A||_2 of a general rows x cols matrix by the power
+ * iteration of spectral-norm: x <- A^t A x, with A x and A^t (A x) fused
+ * per row so every element of A is read once per product.  Unlike the
+ * benchmark it stops when the estimate settles instead of after a fixed
+ * number of rounds.
+ *
+ * A matrix is a dense or CSR file mapped with opnorm_map, or a callback
+ * that fills one row at a time.  The file is native-endian:
+ *
+ *    char    magic[8]      "SNDENSE" or "SNCSR", NUL padded
+ *    int64   rows, cols, nnz                      (nnz is 0 for dense)
+ *    dense:  double values[rows * cols]           row-major
+ *    CSR:    int64  row_start[rows + 1]
+ *            int64  column[nnz]
+ *            double values[nnz]
+ */
+
+#ifndef OPERATOR_NORM_H
+#define OPERATOR_NORM_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+typedef enum {
+   OPNORM_DENSE,
+   OPNORM_CSR,
+   OPNORM_CALLBACK
+} opnorm_kind;
+
+typedef struct {
+   opnorm_kind kind;
+   long rows, cols, nnz;
+   const double *values;        /* dense and CSR */
+   const int64_t *row_start;    /* CSR */
+   const int64_t *column;       /* CSR */
+   /* callback: fill a[0 .. cols-1] with row i */
+   void (*row)(void *context, long i, double *a);
+   void *context;
+   void *map;                   /* set by opnorm_map */
+   size_t map_size;
+} opnorm_matrix;
+
+typedef struct {
+   double norm;
+   int iterations;              /* products of A^t A done */
+   int converged;
+   double seconds;
+   double gflops;               /* 4 flops per element of A per product */
+} opnorm_result;
+
+/* map a matrix file read-only.  Returns 0, or -1 with errno set (EINVAL
+ * if the file is not a valid matrix). */
+int opnorm_map(const char *path, opnorm_matrix *m);
+
+void opnorm_unmap(opnorm_matrix *m);
+
+/* a rows x cols matrix given by its rows */
+void opnorm_callback(opnorm_matrix *m, long rows, long cols,
+                     void (*row)(void *context, long i, double *a),
+                     void *context);
+
+/* iterate until successive estimates of ||A||^2 differ by at most
+ * tolerance relative to the estimate, or max_iterations products.
+ * Returns 0, or -1 if memory runs out. */
+int opnorm_solve(const opnorm_matrix *m, double tolerance, int max_iterations,
+                 opnorm_result *result);
+
+#endif
@@ -3,17 +3,75 @@
  *
  * contributed by Ledrug
  * algorithm is a straight copy from Steve Decker et al's Fortran code
- * with GCC SSE2 intrinsics
+ * with GCC vector extensions
+ *
+ * A v and A^t (A v) share one blocked pass, see mult_AtAv in
+ * spectral_kernel.h.  It is compiled once per instruction set, with
+ * vectors of that set's width, and the best one the CPU supports is
+ * picked at startup through harness/cpu_dispatch.h, so the binary needs
+ * no -march (CPU_KERNEL=avx2 or sse2 forces a narrower one).
+ *
+ * Built with -DUSE_MPI (make mpi) each rank takes a block of rows of A;
+ * the partial products are reduce-scattered and the slices of the new
+ * vector allgathered.  "./a.out N scaling" times 1, 2, 4 .. all ranks and
+ * prints the strong-scaling speedup.
+ *
+ * "./a.out --matrix FILE [tolerance [max_iterations]]" prints the norm of
+ * a matrix file instead, see operator_norm.h.
  */
 
 #include <stdio.h>
 #include <stdlib.h>
 #include <math.h>
 #include <malloc.h>
-#include <emmintrin.h>
+#include <string.h>
+#include <omp.h>
+#ifdef USE_MPI
+#include <mpi.h>
+#else
+#include "operator_norm.h"
+#endif
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+
+#include "bench.h"
+#include "cpu_dispatch.h"
+
+/* doubles in the widest kernel's vectors */
+#define MAX_LANES 8
+
+/* rows per block; their reciprocals are kept for the A^t pass */
+#define BLOCK_ROWS 8
+/* columns per tile, so the tile of v stays in L1 across the block */
+#define TILE_COLS 1024
+
+/* 1/A by the AVX-512 reciprocal estimate instead of a divide in the
+ * AVX-512 kernel; -DRECIP_APPROX=0 turns it off.  power_method guards
+ * the printed result. */
+#ifndef RECIP_APPROX
+#define RECIP_APPROX 1
+#endif
 
-inline double A(int i, int j) {
-   return ((i+j) * (i+j+1) / 2 + i + 1);
+/* the ranks sharing the work; 1 without MPI */
+static int ranks = 1, rank = 0;
+#ifdef USE_MPI
+static MPI_Comm comm;
+#endif
+
+/* vectors are allocated padded to a multiple of MAX_LANES, and of the
+ * number of ranks so each gets an equal slice */
+static int padded(int n) {
+   return (n + MAX_LANES * ranks - 1) / (MAX_LANES * ranks) * (MAX_LANES * ranks);
+}
+
+/* this rank's rows [*row0, *row1), whole blocks of BLOCK_ROWS */
+static void rank_rows(int n, int *row0, int *row1) {
+   const long blocks = (n + BLOCK_ROWS - 1) / BLOCK_ROWS;
+   *row0 = blocks * rank / ranks * BLOCK_ROWS;
+   *row1 = blocks * (rank + 1) / ranks * BLOCK_ROWS;
+   if (*row0 > n) *row0 = n;
+   if (*row1 > n) *row1 = n;
 }
 
 double dot(double * v, double * u, int n) {
@@ -24,44 +82,151 @@ double dot(double * v, double * u, int n) {
    return sum;
 }
 
-void mult_Av(double * v, double * out, const int n) {
-   int i;
+/* per-thread scratch of mult_AtAv, first touched by its own thread so it
+ * sits on that thread's NUMA node */
+typedef struct {
+   double *recip;   /* 1/A for a block of rows */
+   double *acc;     /* this thread's share of A^t A v */
+} scratch;
+static scratch *scratches;
+#ifdef USE_MPI
+static double *slice;   /* this rank's part of the reduced product */
+#endif
+
+/* the kernels, best first; the last is the compiler's own target */
+#if defined(__x86_64__) || defined(__i386__)
+#define ISA avx512
+#define LANES 8
+#define TARGET CPU_TARGET_AVX512
+#define APPROX RECIP_APPROX
+#include "spectral_kernel.h"
+
+#define ISA avx2
+#define LANES 4
+#define TARGET CPU_TARGET_AVX2
+#define APPROX 0
+#include "spectral_kernel.h"
 
-#pragma omp parallel for
-   for (i = 0; i < n; i++) {
-      __m128d sum = _mm_setzero_pd();
+#define BASE_LEVEL CPU_SSE2
+#elif defined(__aarch64__)
+#define BASE_LEVEL CPU_NEON
+#else
+#define BASE_LEVEL CPU_SCALAR
+#endif
 
-      int j;
-      for (j = 0; j < n; j += 2) {
-         __m128d b = _mm_set_pd(v[j],v[j+1]);
-         __m128d a = _mm_set_pd(A(i,j), A(i,j+1));
-         sum = _mm_add_pd(sum, _mm_div_pd(b, a));
+#define ISA base
+#define LANES 2
+#define TARGET
+#define APPROX 0
+#include "spectral_kernel.h"
+
+typedef struct {
+   cpu_level level;
+   void (*mult_AtAv)(const double *v, double *out, const int n, const int exact);
+   int approx;   /* whether it approximates 1/A unless exact */
+} spectral_kernel;
+
+static const spectral_kernel kernels[] = {
+#if defined(__x86_64__) || defined(__i386__)
+   {CPU_AVX512, mult_AtAv_avx512, RECIP_APPROX},
+   {CPU_AVX2, mult_AtAv_avx2, 0},
+#endif
+   {BASE_LEVEL, mult_AtAv_base, 0},
+};
+static const spectral_kernel *kernel;
+
+/* the printed result for n.  With approximate reciprocals this is the
+ * accuracy guard: the last product is redone with exact division and 0
+ * is returned if that prints differently.
+ *
+ * One parallel region covers the whole power iteration, with threads
+ * spread over the machine (set OMP_PLACES=cores to pin them).  u and v
+ * are first touched in the same static slices the reductions write, so
+ * each NUMA node holds its threads' part of them. */
+static int power_method(const int n, const int exact, char *result) {
+   const int np = padded(n);
+   double *u, *v;
+   u = memalign(64, np * sizeof(double));
+   v = memalign(64, np * sizeof(double));
+   scratches = calloc(omp_get_max_threads(), sizeof(scratch));
+#ifdef USE_MPI
+   slice = malloc(np / ranks * sizeof(double));
+#endif
+
+   int ok = 1;
+#pragma omp parallel proc_bind(spread)
+   {
+      scratch *mine = &scratches[omp_get_thread_num()];
+      int i;
+
+      mine->recip = memalign(64, BLOCK_ROWS * np * sizeof(double));
+      mine->acc = memalign(64, np * sizeof(double));
+      memset(mine->recip, 0, BLOCK_ROWS * np * sizeof(double));
+
+#pragma omp for schedule(static)
+      for (i = 0; i < np; i++) {
+         u[i] = i < n ? 1 : 0;
+         v[i] = 0;
       }
-      out[i] = sum[0] + sum[1];
-   }
-}
 
-void mult_Atv(double * v, double * out, const int n) {
-   int i;
+      for (i = 0; i < 10; i++) {
+         kernel->mult_AtAv(u, v, n, exact);
+         kernel->mult_AtAv(v, u, n, exact);
+      }
 
-#pragma omp parallel for
-   for (i = 0; i < n; i++) {
-      __m128d sum = _mm_setzero_pd();
+#pragma omp single
+      sprintf(result, "%.9f", sqrt(dot(u,v, n) / dot(v,v,n)));
 
-      int j;
-      for (j = 0; j < n; j += 2) {
-         __m128d b = _mm_set_pd(v[j], v[j+1]);
-         __m128d a = _mm_set_pd(A(j,i), A(j+1,i));
-         sum = _mm_add_pd(sum, _mm_div_pd(b, a));
+      if (!exact) {
+         kernel->mult_AtAv(v, u, n, 1);
+#pragma omp single
+         {
+            char check[32];
+            sprintf(check, "%.9f", sqrt(dot(u,v, n) / dot(v,v,n)));
+            ok = strcmp(result, check) == 0;
+         }
       }
-      out[i] = sum[0] + sum[1];
+
+      free(mine->recip);
+      free(mine->acc);
    }
+
+   free(scratches);
+#ifdef USE_MPI
+   free(slice);
+#endif
+   free(u);
+   free(v);
+   return ok;
 }
 
-double *tmp;
-void mult_AtAv(double *v, double *out, const int n) {
-   mult_Av(v, tmp, n);
-   mult_Atv(tmp, out, n);
+/* the printed result for n, falling back to exact division if the
+ * guard fails */
+static void spectral_norm(const int n, char *result) {
+   if (kernel == NULL) kernel = CPU_PICK(kernels, NULL);
+   if (!power_method(n, !kernel->approx, result))
+      power_method(n, 1, result);
+}
+
+#ifdef USE_MPI
+/* seconds for n on the first p ranks of MPI_COMM_WORLD; the others wait */
+static double timed_run(const int n, const int p, char *result) {
+   int world_rank;
+   double seconds = 0;
+
+   MPI_Comm_rank(MPI_COMM_WORLD, &world_rank);
+   MPI_Comm_split(MPI_COMM_WORLD, world_rank < p, world_rank, &comm);
+   MPI_Comm_size(comm, &ranks);
+   MPI_Comm_rank(comm, &rank);
+   if (world_rank < p) {
+      MPI_Barrier(comm);
+      seconds = MPI_Wtime();
+      spectral_norm(n, result);
+      seconds = MPI_Wtime() - seconds;
+   }
+   MPI_Comm_free(&comm);
+   MPI_Barrier(MPI_COMM_WORLD);
+   return seconds;
 }
 
 int main(int argc, char**argv) {
@@ -69,19 +234,76 @@ int main(int argc, char**argv) {
    if (n <= 0) n = 2000;
    if (n & 1) n++;   // make it multiple of two
 
-   double *u, *v;
-   u = memalign(16, n * sizeof(double));
-   v = memalign(16, n * sizeof(double));
-   tmp = memalign(16, n * sizeof(double));
+   int provided, world_rank, world_size;
+   MPI_Init_thread(&argc, &argv, MPI_THREAD_FUNNELED, &provided);
+   MPI_Comm_rank(MPI_COMM_WORLD, &world_rank);
+   MPI_Comm_size(MPI_COMM_WORLD, &world_size);
 
-   int i;
-   for (i = 0; i < n; i++) u[i] = 1;
-   for (i = 0; i < 10; i++) {
-      mult_AtAv(u, v, n);
-      mult_AtAv(v, u, n);
+   char result[32];
+   if (argc > 2 && strcmp(argv[2], "scaling") == 0) {
+      double base = 0;
+      int p = 1;
+      for (;;) {
+         double seconds = timed_run(n, p, result);
+         if (p == 1) base = seconds;
+         if (world_rank == 0)
+            printf("%s ranks %d seconds %.3f speedup %.2f efficiency %.2f\n",
+                   result, p, seconds, base / seconds, base / seconds / p);
+         if (p == world_size) break;
+         p = 2 * p < world_size ? 2 * p : world_size;
+      }
+   } else {
+      double seconds = timed_run(n, world_size, result);
+      if (world_rank == 0) {
+         printf("%s\n", result);
+         fprintf(stderr, "%d ranks x %d threads: %.3f s\n",
+                 world_size, omp_get_max_threads(), seconds);
+      }
+   }
+
+   MPI_Finalize();
+   return 0;
+}
+#else
+/* norm of a matrix file to the given tolerance, with the iterations and
+ * rate on the second line */
+static int matrix_norm(int argc, char**argv) {
+   double tolerance = argc > 3 ? atof(argv[3]) : 1e-12;
+   int max_iterations = argc > 4 ? atoi(argv[4]) : 1000;
+   opnorm_matrix m;
+   opnorm_result r;
+
+   if (argc < 3 || opnorm_map(argv[2], &m) != 0) {
+      perror(argc < 3 ? "usage: a.out --matrix FILE" : argv[2]);
+      return 1;
+   }
+   if (opnorm_solve(&m, tolerance, max_iterations, &r) != 0) {
+      perror("opnorm_solve");
+      opnorm_unmap(&m);
+      return 1;
    }
 
-   printf("%.9f\n", sqrt(dot(u,v, n) / dot(v,v,n)));
+   printf("%.9f\n", r.norm);
+   printf("iterations %d %s seconds %.3f GFLOP/s %.2f\n", r.iterations,
+          r.converged ? "converged" : "not-converged", r.seconds, r.gflops);
+
+   opnorm_unmap(&m);
+   return 0;
+}
+
+int main(int argc, char**argv) {
+   if (argc > 1 && strcmp(argv[1], "--matrix") == 0)
+      return matrix_norm(argc, argv);
+
+   int n = atoi(argv[1]);
+   if (n <= 0) n = 2000;
+   if (n & 1) n++;   // make it multiple of two
+
+   char result[32];
+   spectral_norm(n, result);
+
+   printf("%s\n", result);
 
    return 0;
 }
+#endif
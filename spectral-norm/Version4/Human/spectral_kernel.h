@@ -0,0 +1,140 @@
+/* One kernel of spectral-norm.c: reciprocal, A_row and mult_AtAv on
+ * vectors of LANES doubles, compiled for TARGET.  spectral-norm.c
+ * includes this once per instruction set with ISA, LANES, TARGET and
+ * APPROX defined, and each copy's names get _ISA appended. */
+
+#define KERNEL_NAME(name) KERNEL_NAME_(name, ISA)
+#define KERNEL_NAME_(name, isa) KERNEL_NAME__(name, isa)
+#define KERNEL_NAME__(name, isa) name##_##isa
+#define vdouble KERNEL_NAME(vdouble)
+#define reciprocal KERNEL_NAME(reciprocal)
+#define A_row KERNEL_NAME(A_row)
+#define mult_AtAv KERNEL_NAME(mult_AtAv)
+
+typedef double vdouble __attribute__((vector_size(LANES * sizeof(double))));
+
+/* 1/A, by the AVX-512 reciprocal estimate and Newton-Raphson steps
+ * instead of a divide when APPROX and not exact */
+TARGET static inline vdouble reciprocal(vdouble a, int exact) {
+#if APPROX
+   if (!exact) {
+      /* 14 bits, then 28, 56 */
+      vdouble r = (vdouble)_mm512_rcp14_pd((__m512d)a);
+      r += r * (1.0 - a * r);
+      r += r * (1.0 - a * r);
+      return r;
+   }
+#endif
+   return 1.0 / a;
+}
+
+/* A(i,j) = (i+j)(i+j+1)/2 + i + 1 for lanes j .. j+LANES-1, and the step
+ * to the next LANES columns, which itself grows by LANES*LANES */
+TARGET static inline void A_row(int i, int j, vdouble *a, vdouble *step) {
+   int l;
+   for (l = 0; l < LANES; l++) {
+      long k = i + j + l;
+      (*a)[l] = k * (k + 1) / 2 + i + 1;
+      (*step)[l] = LANES * k + LANES * (LANES + 1) / 2;
+   }
+}
+
+/* out = A^t A v in one pass over A: a block of rows computes its part of
+ * A v, keeping each 1/A(i,j), and then adds its A^t contribution from the
+ * same reciprocals, so every A(i,j) is divided once instead of twice.
+ * Each thread accumulates A^t into its own vector, and the vectors are
+ * summed by static slices of out, matching the first touch of u and v.
+ * exact selects true division over the reciprocal approximation.
+ *
+ * Called by every thread of the team inside power_method's parallel
+ * region; the work-sharing loops end in barriers.  With MPI only this
+ * rank's rows are done and the master thread combines the ranks.
+ *
+ * Work registered with the harness: 7 flops per A(i,j), two adds that
+ * step A along the row, the reciprocal and a multiply-add for each of
+ * A v and A^t (A v), and the adds of the reduction.  A is never stored,
+ * so the only traffic is v in, out out and every thread's acc out and
+ * back in; the reciprocals of a block stay in cache. */
+TARGET static void mult_AtAv(const double *v, double *out, const int n, const int exact) {
+   const int np = padded(n);
+   const int threads = omp_get_num_threads();
+   vdouble *recip = (vdouble *)scratches[omp_get_thread_num()].recip;
+   vdouble *acc = (vdouble *)scratches[omp_get_thread_num()].acc;
+   const vdouble *vv = (const vdouble *)v;
+   int row0, row1, ib, j;
+
+   rank_rows(n, &row0, &row1);
+   for (j = 0; j < np / LANES; j++) acc[j] = (vdouble){0};
+
+#pragma omp for schedule(dynamic)
+   for (ib = row0; ib < row1; ib += BLOCK_ROWS) {
+      const int rows = row1 - ib < BLOCK_ROWS ? row1 - ib : BLOCK_ROWS;
+      vdouble sum[BLOCK_ROWS] = {{0}};
+      double Av[BLOCK_ROWS];
+      int i, jt;
+
+      /* A v for the rows of the block, tile by tile along j */
+      for (jt = 0; jt < np; jt += TILE_COLS) {
+         const int jend = jt + TILE_COLS < np ? jt + TILE_COLS : np;
+         for (i = 0; i < rows; i++) {
+            vdouble *r = recip + (size_t)i * (np / LANES);
+            vdouble a, step;
+            A_row(ib + i, jt, &a, &step);
+            for (j = jt; j < jend; j += LANES) {
+               r[j / LANES] = reciprocal(a, exact);
+               sum[i] += r[j / LANES] * vv[j / LANES];
+               a += step;
+               step += LANES * LANES;
+            }
+         }
+      }
+      for (i = 0; i < rows; i++) {
+         Av[i] = 0;
+         for (j = 0; j < LANES; j++) Av[i] += sum[i][j];
+      }
+
+      /* A^t contribution of the same rows */
+      for (j = 0; j < np / LANES; j++) {
+         vdouble t = acc[j];
+         for (i = 0; i < rows; i++)
+            t += recip[(size_t)i * (np / LANES) + j] * Av[i];
+         acc[j] = t;
+      }
+   }
+
+#pragma omp for schedule(static)
+   for (j = 0; j < np; j++) {
+      double total = 0;
+      int t;
+      for (t = 0; t < threads; t++) total += scratches[t].acc[j];
+      out[j] = j < n ? total : 0;
+   }
+
+#pragma omp master
+   {
+      const double elements = (double)(row1 - row0) * np;
+      BENCH_WORK((2.0 + 2 * threads) * np * sizeof(double),
+                 7 * elements + (double)threads * np);
+   }
+
+#ifdef USE_MPI
+#pragma omp master
+   {
+      MPI_Reduce_scatter_block(out, slice, np / ranks, MPI_DOUBLE, MPI_SUM, comm);
+      MPI_Allgather(slice, np / ranks, MPI_DOUBLE, out, np / ranks, MPI_DOUBLE, comm);
+   }
+#pragma omp barrier
+#endif
+}
+
+#undef vdouble
+#undef reciprocal
+#undef A_row
+#undef mult_AtAv
+#undef KERNEL_NAME
+#undef KERNEL_NAME_
+#undef KERNEL_NAME__
+#undef ISA
+#undef LANES
+#undef TARGET
+#undef APPROX